@@ -0,0 +1,177 @@
+#include "stdlib/cstdlib.hpp"
+
+#include "acpi.hpp"
+
+#include "page_table.hpp"
+
+namespace acpi {
+
+struct [[gnu::packed]] madt_header {
+    sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+};
+
+inline static constexpr uint32_t MADT_PCAT_COMPAT = 1;
+inline static constexpr uint32_t LAPIC_ENABLED = 1;
+inline static constexpr uint32_t LAPIC_ONLINE_CAPABLE = 2;
+
+struct [[gnu::packed]] mcfg_entry {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+};
+
+static const sdt_header* s_tables[MAX_TABLES];
+static std::size_t s_num_tables = 0;
+static madt_info s_madt;
+static ecam_region s_ecam[MAX_ECAM];
+static std::size_t s_num_ecam = 0;
+
+static bool checksum_ok(const void* p, std::size_t len) {
+    const uint8_t* b = (const uint8_t*)p;
+    uint8_t sum = 0;
+    for (std::size_t i = 0; i < len; i++)
+        sum += b[i];
+    return sum == 0;
+}
+
+template<typename T> static T read_unaligned(const uint8_t* p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+static void add_table(uintptr_t phys) {
+    if (phys == 0 || s_num_tables == MAX_TABLES)
+        return;
+    const sdt_header* t = (const sdt_header*)mem::phys_to_virt(phys);
+    if (t->length < sizeof(sdt_header) || !checksum_ok(t, t->length))
+        return;
+    s_tables[s_num_tables++] = t;
+}
+
+static void add_processor(uint32_t lapic_id, uint32_t flags) {
+    if ((flags & (LAPIC_ENABLED | LAPIC_ONLINE_CAPABLE)) == 0)
+        return;
+    if (s_madt.num_processors < MAX_PROCESSORS)
+        s_madt.lapic_ids[s_madt.num_processors++] = lapic_id;
+}
+
+static void parse_madt(const sdt_header* t) {
+    const madt_header* m = (const madt_header*)t;
+    s_madt.lapic_address = m->lapic_address;
+    s_madt.legacy_pics = (m->flags & MADT_PCAT_COMPAT) != 0;
+
+    const uint8_t* p = (const uint8_t*)(m + 1);
+    const uint8_t* end = (const uint8_t*)t + t->length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+        case MADT_LAPIC:
+            if (p[1] >= 8)
+                add_processor(p[3], read_unaligned<uint32_t>(p + 4));
+            break;
+        case MADT_X2APIC:
+            if (p[1] >= 16)
+                add_processor(read_unaligned<uint32_t>(p + 4),
+                              read_unaligned<uint32_t>(p + 8));
+            break;
+        case MADT_IOAPIC:
+            if (p[1] >= 12 && s_madt.num_ioapics < MAX_IOAPICS) {
+                s_madt.ioapics[s_madt.num_ioapics++] = {
+                    p[2], read_unaligned<uint32_t>(p + 4),
+                    read_unaligned<uint32_t>(p + 8)
+                };
+            }
+            break;
+        case MADT_OVERRIDE:
+            if (p[1] >= 10 && s_madt.num_overrides < MAX_OVERRIDES) {
+                s_madt.overrides[s_madt.num_overrides++] = {
+                    p[3], read_unaligned<uint32_t>(p + 4),
+                    read_unaligned<uint16_t>(p + 8)
+                };
+            }
+            break;
+        case MADT_LAPIC_ADDR:
+            if (p[1] >= 12)
+                s_madt.lapic_address = read_unaligned<uint64_t>(p + 4);
+            break;
+        }
+        p += p[1];
+    }
+}
+
+static void parse_mcfg(const sdt_header* t) {
+    // 8 reserved bytes follow the header
+    const uint8_t* p = (const uint8_t*)t + sizeof(sdt_header) + 8;
+    const uint8_t* end = (const uint8_t*)t + t->length;
+    for (; p + sizeof(mcfg_entry) <= end && s_num_ecam < MAX_ECAM;
+         p += sizeof(mcfg_entry))
+    {
+        mcfg_entry e = read_unaligned<mcfg_entry>(p);
+        if (e.base == 0 || e.end_bus < e.start_bus)
+            continue;
+        s_ecam[s_num_ecam++] = { e.base, e.segment, e.start_bus, e.end_bus };
+    }
+}
+
+bool init(const void* rsdp_virt) {
+    const rsdp* r = (const rsdp*)rsdp_virt;
+    if (r == nullptr || memcmp(r->signature, "RSD PTR ", 8) != 0 ||
+        !checksum_ok(r, 20))
+        return false;
+
+    // the XSDT holds 64-bit pointers and supersedes the RSDT when both
+    // exist
+    bool xsdt = r->revision >= 2 && r->xsdt_address != 0 &&
+                checksum_ok(r, r->length);
+    uintptr_t root_phys = xsdt ? r->xsdt_address : r->rsdt_address;
+    if (root_phys == 0)
+        return false;
+    const sdt_header* root = (const sdt_header*)mem::phys_to_virt(root_phys);
+    if (memcmp(root->signature, xsdt ? "XSDT" : "RSDT", 4) != 0 ||
+        root->length < sizeof(sdt_header) ||
+        !checksum_ok(root, root->length))
+        return false;
+
+    std::size_t entry_size = xsdt ? 8 : 4;
+    std::size_t entries = (root->length - sizeof(sdt_header)) / entry_size;
+    const uint8_t* p = (const uint8_t*)(root + 1);
+    for (std::size_t i = 0; i < entries; i++) {
+        add_table(xsdt ? read_unaligned<uint64_t>(p + i * 8)
+                       : read_unaligned<uint32_t>(p + i * 4));
+    }
+
+    const sdt_header* madt = find_table("APIC");
+    if (madt != nullptr && madt->length >= sizeof(madt_header))
+        parse_madt(madt);
+    const sdt_header* mcfg = find_table("MCFG");
+    if (mcfg != nullptr)
+        parse_mcfg(mcfg);
+    return true;
+}
+
+const sdt_header* find_table(const char* signature, std::size_t index) {
+    for (std::size_t i = 0; i < s_num_tables; i++) {
+        if (memcmp(s_tables[i]->signature, signature, 4) == 0 &&
+            index-- == 0)
+            return s_tables[i];
+    }
+    return nullptr;
+}
+
+const madt_info& madt() {
+    return s_madt;
+}
+
+std::size_t ecam_count() {
+    return s_num_ecam;
+}
+
+const ecam_region& get_ecam(std::size_t i) {
+    return s_ecam[i];
+}
+
+} // namespace acpi
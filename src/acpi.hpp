@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace acpi {
+
+#ifdef K_ACPI_MAX_TABLES
+    inline static constexpr std::size_t MAX_TABLES = K_ACPI_MAX_TABLES;
+#else
+    inline static constexpr std::size_t MAX_TABLES = 64;
+#endif
+
+inline static constexpr std::size_t MAX_IOAPICS = 8;
+inline static constexpr std::size_t MAX_OVERRIDES = 16;
+inline static constexpr std::size_t MAX_ECAM = 8;
+inline static constexpr std::size_t MAX_PROCESSORS = 256;
+
+struct [[gnu::packed]] rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    // revision 2 and up
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+};
+
+struct [[gnu::packed]] sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
+static_assert(sizeof(sdt_header) == 36);
+
+// MADT entries that matter here
+inline static constexpr uint8_t MADT_LAPIC        = 0;
+inline static constexpr uint8_t MADT_IOAPIC       = 1;
+inline static constexpr uint8_t MADT_OVERRIDE     = 2;
+inline static constexpr uint8_t MADT_LAPIC_ADDR   = 5;
+inline static constexpr uint8_t MADT_X2APIC       = 9;
+
+struct ioapic {
+    uint8_t id;
+    uint32_t address;
+    uint32_t gsi_base;
+};
+
+// an ISA IRQ that isn't wired to the GSI of the same number
+struct irq_override {
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+};
+
+struct madt_info {
+    uint64_t lapic_address;
+    bool legacy_pics;       // 8259s present, to be masked
+    uint32_t lapic_ids[MAX_PROCESSORS];
+    std::size_t num_processors;     // enabled or online-capable ones
+    ioapic ioapics[MAX_IOAPICS];
+    std::size_t num_ioapics;
+    irq_override overrides[MAX_OVERRIDES];
+    std::size_t num_overrides;
+};
+
+// one MCFG allocation: the ECAM window for a segment's bus range, bus
+// start_bus at base
+struct ecam_region {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+};
+
+// walks the XSDT (or the RSDT before ACPI 2.0) from the RSDP Limine found,
+// keeping every table whose checksum holds, then decodes the MADT and
+// MCFG. the tables are read through the HHDM, which covers ACPI memory.
+// false if there is no usable root table
+bool init(const void* rsdp_virt);
+
+// the index-th table with this signature, null if there are fewer
+const sdt_header* find_table(const char* signature, std::size_t index = 0);
+
+// empty if there was no MADT
+const madt_info& madt();
+
+std::size_t ecam_count();
+const ecam_region& get_ecam(std::size_t i);
+
+} // namespace acpi
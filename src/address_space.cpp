@@ -0,0 +1,609 @@
+#include "stdlib/cstdlib.hpp"
+
+#include "address_space.hpp"
+
+#include "asm_wrappers.hpp"
+#include "ipi.hpp"
+#include "vm.hpp"
+#include "vdso.hpp"
+#include "zero_pool.hpp"
+
+namespace mem {
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+inline static constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+inline static constexpr uint64_t CR4_PCIDE = 1ull << 17;
+inline static constexpr uint64_t CR3_NOFLUSH = 1ull << 63;
+
+// flags for intermediate entries; the leaves decide permissions
+inline static constexpr uint64_t TABLE_FLAGS = 
+	PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+
+static bool s_pcid_enabled = false;
+static address_space* s_current[cpu::MAX_CPUS];
+static uintptr_t s_kernel_cr3[cpu::MAX_CPUS];
+
+// PCID 0 belongs to the kernel's own tables
+static uint64_t s_pcid_map[MAX_PCIDS / 64] = { 1 };
+static kstd::ticket_lock s_pcid_lock;
+
+// extra mappings of each frame beyond the first, so a frame shared by
+// two address spaces counts 1. frames outside the table are never
+// shared; clone() copies them outright instead
+static uint16_t s_frame_shares[MAX_PAGES];
+
+// pin()s outstanding on each frame, counted in s_frame_shares as well.
+// clone() can't make such a frame copy-on-write: the parent's next
+// write would move it off the frame the device is using
+static uint16_t s_frame_pins[MAX_PAGES];
+
+static uint16_t alloc_pcid() {
+	kstd::lock_guard guard(s_pcid_lock);
+	for (std::size_t w = 0; w < MAX_PCIDS / 64; w++) {
+		if (s_pcid_map[w] == ~0ull)
+			continue;
+		unsigned bit = __builtin_ctzll(~s_pcid_map[w]);
+		s_pcid_map[w] |= 1ull << bit;
+		return w * 64 + bit;
+	}
+	return 0; // out of tags: this address space flushes on every switch
+}
+
+static void free_pcid(uint16_t pcid) {
+	if (pcid == 0)
+		return;
+	kstd::lock_guard guard(s_pcid_lock);
+	s_pcid_map[pcid / 64] &= ~(1ull << (pcid % 64));
+}
+
+static bool can_share(uintptr_t frame) {
+	return frame / PAGE_SIZE < MAX_PAGES;
+}
+
+// frames mapped into many address spaces without counting, which no
+// address space ever frees: the shared zero page, the vDSO and anything
+// mapped PTE_PINNED by its owner
+static bool is_pinned(uint64_t entry) {
+	uintptr_t frame = entry & PTE_ADDR_MASK;
+	return (entry & PTE_PINNED) || frame == pt->zero_page() || 
+	       frame == vdso::data_frame();
+}
+
+static void share_frame(uintptr_t frame) {
+	__atomic_fetch_add(&s_frame_shares[frame / PAGE_SIZE], 1, __ATOMIC_RELAXED);
+}
+
+// drops the mapping in a leaf entry, freeing its frame with the last
+static void release_frame(uint64_t entry) {
+	if (is_pinned(entry))
+		return;
+
+	uintptr_t frame = entry & PTE_ADDR_MASK;
+	if (!can_share(frame)) {
+		pt->free_frame(frame);
+		return;
+	}
+
+	uint16_t* shares = &s_frame_shares[frame / PAGE_SIZE];
+	uint16_t n = __atomic_load_n(shares, __ATOMIC_ACQUIRE);
+	for (;;) {
+		if (n == 0) {
+			pt->free_frame(frame);
+			return;
+		}
+		if (__atomic_compare_exchange_n(shares, &n, n - 1, true,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return;
+	}
+}
+
+static uint64_t* table_virt(uint64_t entry) {
+	return (uint64_t*)phys_to_virt(entry & PTE_ADDR_MASK);
+}
+
+void address_space::init_cpu() {
+	s_kernel_cr3[cpu::id()] = (uintptr_t)rcr3();
+
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if ((ecx & (1u << 17)) == 0)
+		return;
+
+	// CR3's PCID field must be 0 when PCIDE is turned on, which it is
+	// for the tables Limine left us on
+	lcr4(rcr4() | CR4_PCIDE);
+	s_pcid_enabled = true;
+}
+
+address_space* address_space::create() {
+	address_space* as = create_empty();
+	if (as == nullptr)
+		return nullptr;
+
+	if (!IS_NULL(vdso::data_frame()) &&
+	    !as->map(vdso::VDSO_BASE, vdso::data_frame(), PTE_NX)) {
+		as->destroy();
+		return nullptr;
+	}
+	return as;
+}
+
+address_space* address_space::create_empty() {
+	address_space* as = new address_space();
+	if (as == nullptr)
+		return nullptr;
+
+	page_table::physical_address frame = alloc_zeroed_frame();
+	if (IS_NULL(frame)) {
+		delete as;
+		return nullptr;
+	}
+	as->m_pml4_phys = frame;
+	as->m_pml4 = (uint64_t*)phys_to_virt(frame);
+
+	// the kernel half is shared by reference: same PDPTs, so kernel
+	// mappings made later show up everywhere without copying
+	const uint64_t* kernel = pt->pml4t();
+	for (std::size_t i = 256; i < 512; i++)
+		as->m_pml4[i] = kernel[i];
+
+	as->m_pcid = s_pcid_enabled ? alloc_pcid() : 0;
+	return as;
+}
+
+uint64_t* address_space::leaf(uintptr_t virt_addr, bool create) {
+	uint64_t* table = m_pml4;
+	for (unsigned l = (unsigned)pt_level::pml4t; l > (unsigned)pt_level::pt; l--) {
+		uint64_t& e = table[pt_index(virt_addr, (pt_level)l)];
+		if ((e & PTE_PRESENT) == 0) {
+			if (!create)
+				return nullptr;
+			page_table::physical_address frame = alloc_zeroed_frame();
+			if (IS_NULL(frame))
+				return nullptr;
+			e = frame | TABLE_FLAGS;
+		} else if (e & PTE_HUGE) {
+			return nullptr;
+		}
+		table = table_virt(e);
+	}
+	return &table[pt_index(virt_addr, pt_level::pt)];
+}
+
+uint64_t* address_space::huge_leaf(uintptr_t virt_addr, bool create) {
+	uint64_t* table = m_pml4;
+	for (unsigned l = (unsigned)pt_level::pml4t; l > (unsigned)pt_level::pdt; l--) {
+		uint64_t& e = table[pt_index(virt_addr, (pt_level)l)];
+		if ((e & PTE_PRESENT) == 0) {
+			if (!create)
+				return nullptr;
+			page_table::physical_address frame = alloc_zeroed_frame();
+			if (IS_NULL(frame))
+				return nullptr;
+			e = frame | TABLE_FLAGS;
+		} else if (e & PTE_HUGE) {
+			return nullptr;
+		}
+		table = table_virt(e);
+	}
+	return &table[pt_index(virt_addr, pt_level::pdt)];
+}
+
+bool address_space::map(uintptr_t virt_addr, 
+                        page_table::physical_address phys_addr, uint64_t flags)
+{
+	if ((virt_addr & (PAGE_SIZE - 1)) || (phys_addr & (PAGE_SIZE - 1)))
+		return false;
+	if (virt_addr >= USER_SPACE_END)
+		return false;
+
+	kstd::mcs_guard guard(m_lock);
+	uint64_t* e = leaf(virt_addr, true);
+	if (e == nullptr || (*e & PTE_PRESENT))
+		return false;
+	*e = phys_addr | PTE_PRESENT | PTE_USER | flags;
+	return true;
+}
+
+struct flush_args {
+	address_space* as;
+	uintptr_t virt;
+	std::size_t pages;
+};
+
+void address_space::flush_here(void* p) {
+	const flush_args& a = *(const flush_args*)p;
+	std::size_t self = cpu::id();
+
+	// invlpg only reaches the PCID that's loaded. a CPU running something
+	// else forgets it ever ran this instead, so its next activate()
+	// flushes the whole PCID
+	if (s_current[self] != a.as) {
+		a.as->m_tlb_cpus.clear(self);
+		return;
+	}
+	if (a.pages > ipi::SHOOTDOWN_FULL_FLUSH) {
+		// without CR3_NOFLUSH this drops everything under the PCID
+		lcr3((void*)(a.as->m_pml4_phys | (s_pcid_enabled ? a.as->m_pcid : 0)));
+		return;
+	}
+	for (std::size_t i = 0; i < a.pages; i++)
+		invlpg((const void*)(a.virt + i * PAGE_SIZE));
+}
+
+void address_space::shootdown(uintptr_t virt_addr, std::size_t pages) {
+	// this CPU included: it may have run this address space before
+	flush_args args = { this, virt_addr, pages };
+	ipi::call_many(m_tlb_cpus, &flush_here, &args);
+}
+
+bool address_space::unmap(uintptr_t virt_addr) {
+	if (virt_addr >= USER_SPACE_END)
+		return false;
+
+	uint64_t entry;
+	{
+		kstd::mcs_guard guard(m_lock);
+		uint64_t* e = leaf(virt_addr, false);
+		if (e == nullptr || (*e & PTE_PRESENT) == 0)
+			return false;
+		entry = *e;
+		*e = 0;
+	}
+	shootdown(virt_addr);
+	release_frame(entry);
+	return true;
+}
+
+bool address_space::map_huge(uintptr_t virt_addr,
+                             page_table::physical_address phys_addr,
+                             uint64_t flags)
+{
+	if ((virt_addr & (HUGE_PAGE_SIZE - 1)) || (phys_addr & (HUGE_PAGE_SIZE - 1)))
+		return false;
+	if (virt_addr >= USER_SPACE_END)
+		return false;
+
+	kstd::mcs_guard guard(m_lock);
+	uint64_t* e = huge_leaf(virt_addr, true);
+	// a page table there counts as mapped, even an empty one
+	if (e == nullptr || (*e & PTE_PRESENT))
+		return false;
+	*e = phys_addr | PTE_PRESENT | PTE_USER | PTE_HUGE | PTE_PINNED | flags;
+	return true;
+}
+
+bool address_space::unmap_huge(uintptr_t virt_addr) {
+	if ((virt_addr & (HUGE_PAGE_SIZE - 1)) || virt_addr >= USER_SPACE_END)
+		return false;
+
+	{
+		kstd::mcs_guard guard(m_lock);
+		uint64_t* e = huge_leaf(virt_addr, false);
+		if (e == nullptr || (*e & (PTE_PRESENT | PTE_HUGE)) !=
+		                    (PTE_PRESENT | PTE_HUGE))
+			return false;
+		*e = 0;
+	}
+	// one invlpg anywhere in it drops the whole 2MB entry; the frames
+	// are pinned, so there's nothing to release
+	shootdown(virt_addr);
+	return true;
+}
+
+bool address_space::pin(uintptr_t virt_addr, bool for_write,
+                        page_table::physical_address* frame)
+{
+	if (virt_addr >= USER_SPACE_END)
+		return false;
+
+	uintptr_t page = virt_addr & ~(PAGE_SIZE - 1);
+	// a second round only follows a copy-on-write break, after which the
+	// page is ours
+	for (int round = 0; round < 2; round++) {
+		{
+			kstd::mcs_guard guard(m_lock);
+			// nothing in an address space is mapped lazily, so there's
+			// nothing to fault in
+			uint64_t* e = leaf(page, false);
+			if (e == nullptr || (*e & PTE_PRESENT) == 0)
+				return false;
+			uintptr_t f = *e & PTE_ADDR_MASK;
+			// untouched bss and stack; unpin() leaves it alone too
+			if (!for_write && f == pt->zero_page()) {
+				*frame = f;
+				return true;
+			}
+			bool cow = (*e & PTE_COW) != 0;
+			if (!cow || (!for_write && !is_pinned(*e))) {
+				if (is_pinned(*e) || !can_share(f) ||
+				    (for_write && (*e & PTE_WRITABLE) == 0))
+					return false;
+				// counts as one more mapping, so unmap() leaves the
+				// frame alone
+				share_frame(f);
+				__atomic_fetch_add(&s_frame_pins[f / PAGE_SIZE], 1,
+				                   __ATOMIC_RELAXED);
+				*frame = f;
+				return true;
+			}
+		}
+		// the device is to write it, or the frame is someone else's:
+		// take a copy of our own, as a write from user mode would
+		if (!handle_cow_fault(page, PF_PRESENT | PF_WRITE))
+			return false;
+	}
+	return false;
+}
+
+void address_space::unpin(page_table::physical_address frame) {
+	if (frame == pt->zero_page())
+		return;
+	__atomic_fetch_sub(&s_frame_pins[frame / PAGE_SIZE], 1, __ATOMIC_RELAXED);
+	release_frame(frame);
+}
+
+bool address_space::clone_table(const uint64_t* src, uint64_t* dst, pt_level l) {
+	// only the user half of the PML4 is copied; the rest is the kernel's
+	std::size_t end = l == pt_level::pml4t ? 256 : 512;
+	for (std::size_t i = 0; i < end; i++) {
+		uint64_t e = src[i];
+		if ((e & PTE_PRESENT) == 0)
+			continue;
+
+		if (l != pt_level::pt && (e & PTE_HUGE) == 0) {
+			page_table::physical_address table = alloc_zeroed_frame();
+			if (IS_NULL(table))
+				return false;
+			dst[i] = table | (e & ~PTE_ADDR_MASK);
+			if (!clone_table(table_virt(e), table_virt(dst[i]), 
+			                 (pt_level)((unsigned)l - 1)))
+				return false;
+			continue;
+		}
+		// huge pages in user space are always pinned, so they're
+		// shared as they are
+		uintptr_t frame = e & PTE_ADDR_MASK;
+		if (is_pinned(e)) {
+			dst[i] = e;
+			continue;
+		}
+		if (l != pt_level::pt)
+			continue;
+		if (!can_share(frame)) {
+			page_table::physical_address copy = pt->alloc_frame();
+			if (IS_NULL(copy))
+				return false;
+			memcpy(phys_to_virt(copy), phys_to_virt(frame), PAGE_SIZE);
+			dst[i] = copy | (e & ~PTE_ADDR_MASK);
+			continue;
+		}
+
+		// a device has the frame: the parent keeps it as it is, and the
+		// child gets its contents as they are now
+		if ((e & PTE_WRITABLE) &&
+		    __atomic_load_n(&s_frame_pins[frame / PAGE_SIZE],
+		                    __ATOMIC_RELAXED) != 0) {
+			page_table::physical_address copy = pt->alloc_frame();
+			if (IS_NULL(copy))
+				return false;
+			memcpy(phys_to_virt(copy), phys_to_virt(frame), PAGE_SIZE);
+			dst[i] = copy | (e & ~PTE_ADDR_MASK);
+			continue;
+		}
+
+		// both sides lose write access until one of them writes
+		if (e & PTE_WRITABLE) {
+			e = (e & ~PTE_WRITABLE) | PTE_COW;
+			const_cast<uint64_t*>(src)[i] = e;
+		}
+		share_frame(frame);
+		dst[i] = e;
+	}
+	return true;
+}
+
+void address_space::clear_range(uintptr_t start, std::size_t length) {
+	kstd::mcs_guard guard(m_lock);
+	uintptr_t end = start + length;
+	for (uintptr_t v = start; v < end; ) {
+		uint64_t* h = huge_leaf(v, false);
+		if (h != nullptr && (*h & (PTE_PRESENT | PTE_HUGE)) ==
+		                    (PTE_PRESENT | PTE_HUGE)) {
+			*h = 0;
+			v = (v & ~(HUGE_PAGE_SIZE - 1)) + HUGE_PAGE_SIZE;
+			continue;
+		}
+		uint64_t* e = leaf(v, false);
+		if (e != nullptr && (*e & PTE_PRESENT)) {
+			release_frame(*e);
+			*e = 0;
+		}
+		v += PAGE_SIZE;
+	}
+}
+
+void address_space::add_mapping(mapping* m) {
+	kstd::lock_guard guard(m_mappings_lock);
+	m->next = m_mappings;
+	m_mappings = m;
+}
+
+bool address_space::remove_mapping(mapping* m) {
+	kstd::lock_guard guard(m_mappings_lock);
+	for (mapping** at = &m_mappings; *at != nullptr; at = &(*at)->next) {
+		if (*at == m) {
+			*at = m->next;
+			return true;
+		}
+	}
+	return false;
+}
+
+mapping* address_space::find_mapping(uintptr_t start, const mapping_ops* ops) {
+	kstd::lock_guard guard(m_mappings_lock);
+	for (mapping* m = m_mappings; m != nullptr; m = m->next) {
+		if (m->start == start && m->ops == ops)
+			return m;
+	}
+	return nullptr;
+}
+
+address_space* address_space::clone() {
+	// the vDSO comes across with the rest of the user half
+	address_space* child = create_empty();
+	if (child == nullptr)
+		return nullptr;
+
+	bool ok;
+	{
+		kstd::mcs_guard guard(m_lock);
+		ok = clone_table(m_pml4, child->m_pml4, pt_level::pml4t);
+	}
+
+	// owned ranges came across as pinned pages, which count for nothing;
+	// their owners decide what the child gets
+	if (ok) {
+		kstd::lock_guard guard(m_mappings_lock);
+		for (mapping* m = m_mappings; m != nullptr && ok; m = m->next) {
+			if (!m->ops->inherit) {
+				child->clear_range(m->start, m->length);
+				continue;
+			}
+			mapping* copy = m->ops->clone(m, child);
+			if (copy != nullptr)
+				child->add_mapping(copy);
+			else
+				ok = false;
+		}
+	}
+
+	// our writable pages just went read-only: flush them everywhere we
+	// may be cached
+	shootdown(0, ipi::SHOOTDOWN_FULL_FLUSH + 1);
+
+	if (!ok) {
+		child->destroy();
+		return nullptr;
+	}
+	return child;
+}
+
+bool address_space::handle_cow_fault(uintptr_t addr, uint64_t error_code) {
+	// write to a present page only
+	if ((error_code & 0x3) != 0x3 || addr >= USER_SPACE_END)
+		return false;
+
+	uintptr_t page = addr & ~(PAGE_SIZE - 1);
+	uint64_t old_entry = 0;
+	{
+		kstd::mcs_guard guard(m_lock);
+		uint64_t* e = leaf(page, false);
+		if (e == nullptr || (*e & PTE_PRESENT) == 0)
+			return false;
+		if (*e & PTE_WRITABLE) {
+			// another thread resolved it; our TLB entry is just stale
+			invlpg((const void*)page);
+			return true;
+		}
+		if ((*e & PTE_COW) == 0)
+			return false;
+
+		uintptr_t frame = *e & PTE_ADDR_MASK;
+		// the copy is ours, whoever owned the original
+		uint64_t flags = (*e & ~PTE_ADDR_MASK & ~PTE_COW & ~PTE_PINNED) | 
+		                 PTE_WRITABLE;
+
+		// last one holding it: take it over without copying
+		if (!is_pinned(*e) && can_share(frame) &&
+		    __atomic_load_n(&s_frame_shares[frame / PAGE_SIZE], 
+		                    __ATOMIC_ACQUIRE) == 0) {
+			*e = frame | flags;
+			invlpg((const void*)page);
+			return true;
+		}
+
+		page_table::physical_address copy = pt->alloc_frame();
+		if (IS_NULL(copy))
+			return false;
+		memcpy(phys_to_virt(copy), phys_to_virt(frame), PAGE_SIZE);
+		old_entry = *e;
+		*e = copy | flags;
+	}
+
+	// other threads may still read the old frame through their TLBs;
+	// it can only be released once they can't
+	shootdown(page);
+	release_frame(old_entry);
+	return true;
+}
+
+void address_space::free_table(uint64_t* table, pt_level l) {
+	std::size_t end = l == pt_level::pml4t ? 256 : 512;
+	for (std::size_t i = 0; i < end; i++) {
+		uint64_t e = table[i];
+		if ((e & PTE_PRESENT) == 0)
+			continue;
+		if (l == pt_level::pt || (e & PTE_HUGE))
+			release_frame(e);
+		else
+			free_table(table_virt(e), (pt_level)((unsigned)l - 1));
+	}
+	if (l != pt_level::pml4t)
+		pt->free_frame((uintptr_t)table - hhdm_offset);
+}
+
+void address_space::destroy() {
+	// owners first, while their pages are still mapped
+	mapping* m;
+	{
+		kstd::lock_guard guard(m_mappings_lock);
+		m = m_mappings;
+		m_mappings = nullptr;
+	}
+	while (m != nullptr) {
+		mapping* next = m->next;
+		m->ops->release(m, this);
+		m = next;
+	}
+
+	// CPUs that ran it may still hold translations under its PCID, but
+	// nothing loads that PCID again before activate() has flushed it
+	free_table(m_pml4, pt_level::pml4t);
+	pt->free_frame(m_pml4_phys);
+	free_pcid(m_pcid);
+	delete this;
+}
+
+void address_space::activate() {
+	// a shootdown IPI between the test and the load could clear our bit
+	// after it's been read
+	kstd::irq_guard irqs;
+	std::size_t self = cpu::id();
+	uint64_t cr3 = m_pml4_phys;
+
+	if (s_pcid_enabled && m_pcid != 0) {
+		cr3 |= m_pcid;
+		// this CPU may still have entries under our PCID from an earlier
+		// owner of it; only skip the flush once we've flushed them here
+		if (m_tlb_cpus.test(self))
+			cr3 |= CR3_NOFLUSH;
+	}
+
+	m_tlb_cpus.set(self);
+	s_current[self] = this;
+	lcr3((void*)cr3);
+}
+
+address_space* address_space::current() {
+	return s_current[cpu::id()];
+}
+
+void address_space::activate_kernel() {
+	kstd::irq_guard irqs;
+	std::size_t self = cpu::id();
+	s_current[self] = nullptr;
+	lcr3((void*)s_kernel_cr3[self]);
+}
+
+} // namespace mem
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/sync.hpp"
+
+#include "cpu.hpp"
+#include "page_table.hpp"
+
+namespace mem {
+
+// user half of the canonical address space; the kernel half above it is
+// shared by every address space
+inline static constexpr uintptr_t USER_SPACE_END = 0x0000800000000000;
+
+// number of PCIDs handed out before falling back to untagged switches
+inline static constexpr uint16_t MAX_PCIDS = 4096;
+
+class address_space;
+struct mapping;
+
+// what the owner of a mapping does when its address space is cloned or
+// destroyed
+struct mapping_ops {
+	// whether a clone() child gets the pages too; if not, the range is
+	// left empty in it
+	bool inherit;
+	// for inherit: the child's record, holding whatever keeps the pages
+	// alive for it; null if that can't be had, which fails the clone()
+	mapping* (*clone)(mapping* m, address_space* child);
+	// as is being destroyed with m's pages still mapped: unmaps them if
+	// it likes and drops everything m holds, m itself included
+	void (*release)(mapping* m, address_space* as);
+};
+
+// pages mapped PTE_PINNED by an owner that keeps their frames alive -
+// a file, an I/O ring - rather than by the address space. the address
+// space has no idea how to keep such frames alive for a clone or when
+// to let them go, so it keeps a list of these and asks
+struct mapping {
+	const mapping_ops* ops;
+	uintptr_t start;
+	std::size_t length;
+	mapping* next;
+};
+
+// a process's page tables. unlike page_table there are no static arrays:
+// the PML4 is a single frame whose upper half points at the kernel's
+// tables, and everything below USER_SPACE_END is built as it's mapped,
+// so an empty address space costs one page
+class address_space {
+public:
+	// sets up CR4.PCIDE on this CPU if it has PCIDs; each CPU, before
+	// activating any address space
+	static void init_cpu();
+
+	// a new address space with nothing but the vDSO page mapped; null if
+	// out of memory
+	static address_space* create();
+
+	// copy-on-write duplicate: user tables are copied, while the frames
+	// they map are shared read-only by both until one side writes
+	address_space* clone();
+
+	// releases the mappings, unmaps everything, drops frame references
+	// and frees the tables
+	void destroy();
+
+	// records m, whose pages the caller has mapped
+	void add_mapping(mapping* m);
+
+	// forgets m, leaving its pages to the caller; false if it isn't
+	// recorded here, which includes destroy() having taken it already
+	bool remove_mapping(mapping* m);
+
+	// the mapping starting at start that belongs to ops's owner, if any
+	mapping* find_mapping(uintptr_t start, const mapping_ops* ops);
+
+	// maps a 4K page in the user half with the given PTE_* flags
+	// (PTE_PRESENT and PTE_USER implied); fails if already mapped. the
+	// address space owns the frame from then on unless PTE_PINNED is set
+	bool map(uintptr_t virt_addr, page_table::physical_address phys_addr,
+	         uint64_t flags);
+
+	// unmaps a page, releasing its frame once no other address space
+	// shares it
+	bool unmap(uintptr_t virt_addr);
+
+	// maps a 2MB page of memory owned elsewhere, such as the page cache:
+	// PTE_PINNED is implied, so nothing here ever frees it. fails if
+	// anything in the range is mapped already
+	bool map_huge(uintptr_t virt_addr, page_table::physical_address phys_addr,
+	              uint64_t flags);
+
+	// unmaps a 2MB page; false if virt_addr isn't the start of one
+	bool unmap_huge(uintptr_t virt_addr);
+
+	// holds on to the frame behind a mapped user page, for I/O straight
+	// to or from it: the frame stays allocated even if the page is
+	// unmapped, until unpin(). for_write means the device will write to
+	// it, so a copy-on-write page gets its copy first; so does one whose
+	// frame its owner keeps, such as the zero page, even for reading.
+	// false if the page isn't mapped, isn't writable, is pinned by its
+	// owner, or there's no memory for the copy. while a writable page
+	// is pinned, clone() copies it for the child rather than making it
+	// copy-on-write, so the frame stays the parent's
+	bool pin(uintptr_t virt_addr, bool for_write,
+	         page_table::physical_address* frame);
+
+	// drops a pin(), freeing the frame if nothing else has it
+	static void unpin(page_table::physical_address frame);
+
+	// resolves a write fault on a copy-on-write page; false if the fault
+	// isn't one
+	bool handle_cow_fault(uintptr_t addr, uint64_t error_code);
+
+	// loads this address space on the current CPU
+	void activate();
+
+	// the address space loaded on this CPU, null while only the kernel's
+	// tables are
+	static address_space* current();
+
+	// goes back to the tables this CPU ran on before its first activate()
+	static void activate_kernel();
+
+	inline page_table::physical_address pml4_phys() const {
+		return m_pml4_phys;
+	}
+
+	inline uint16_t pcid() const {
+		return m_pcid;
+	}
+
+private:
+	address_space() = default;
+
+	// PML4 and PCID only, not even the vDSO
+	static address_space* create_empty();
+
+	// the level-1 entry for virt_addr, allocating missing tables if
+	// create is set
+	uint64_t* leaf(uintptr_t virt_addr, bool create);
+
+	// the level-2 entry for virt_addr, the same way
+	uint64_t* huge_leaf(uintptr_t virt_addr, bool create);
+
+	bool clone_table(const uint64_t* src, uint64_t* dst, pt_level l);
+	// empties [start, start + length) in an address space nothing runs
+	// yet, such as a fresh clone
+	void clear_range(uintptr_t start, std::size_t length);
+	void free_table(uint64_t* table, pt_level l);
+	// flushes the pages from every CPU that may have them cached, this
+	// one included
+	void shootdown(uintptr_t virt_addr, std::size_t pages = 1);
+	// the IPI side of shootdown(), on each of those CPUs
+	static void flush_here(void* args);
+
+	uint64_t* m_pml4 = nullptr; // through the HHDM
+	page_table::physical_address m_pml4_phys;
+	uint16_t m_pcid = 0;
+	kstd::mcs_lock m_lock;
+	// CPUs that may hold TLB entries for this address space. with PCIDs
+	// that outlives activation, so shootdowns go to all of them; one not
+	// running it when a shootdown comes drops out until it next does
+	cpu::cpu_mask m_tlb_cpus;
+
+	kstd::ticket_lock m_mappings_lock;
+	mapping* m_mappings = nullptr;
+};
+
+} // namespace mem
@@ -0,0 +1,519 @@
+#include "stdlib/cstdlib.hpp"
+
+#include "ahci.hpp"
+
+#include "apic.hpp"
+#include "asm_wrappers.hpp"
+#include "cpu.hpp"
+#include "mmio.hpp"
+#include "zero_pool.hpp"
+
+namespace ahci {
+
+// generic host control, in dwords
+inline static constexpr std::size_t HBA_CAP = 0x00 / 4;
+inline static constexpr std::size_t HBA_GHC = 0x04 / 4;
+inline static constexpr std::size_t HBA_IS  = 0x08 / 4;
+inline static constexpr std::size_t HBA_PI  = 0x0C / 4;
+
+inline static constexpr uint32_t CAP_S64A = 1u << 31;
+inline static constexpr uint32_t CAP_SNCQ = 1u << 30;
+inline static constexpr uint32_t GHC_HR = 1u << 0;
+inline static constexpr uint32_t GHC_IE = 1u << 1;
+inline static constexpr uint32_t GHC_AE = 1u << 31;
+
+// per-port registers, in dwords from the port's base
+inline static constexpr std::size_t PORT_BASE = 0x100;
+inline static constexpr std::size_t PORT_SIZE = 0x80;
+inline static constexpr std::size_t PX_CLB  = 0x00 / 4;
+inline static constexpr std::size_t PX_CLBU = 0x04 / 4;
+inline static constexpr std::size_t PX_FB   = 0x08 / 4;
+inline static constexpr std::size_t PX_FBU  = 0x0C / 4;
+inline static constexpr std::size_t PX_IS   = 0x10 / 4;
+inline static constexpr std::size_t PX_IE   = 0x14 / 4;
+inline static constexpr std::size_t PX_CMD  = 0x18 / 4;
+inline static constexpr std::size_t PX_TFD  = 0x20 / 4;
+inline static constexpr std::size_t PX_SIG  = 0x24 / 4;
+inline static constexpr std::size_t PX_SSTS = 0x28 / 4;
+inline static constexpr std::size_t PX_SERR = 0x30 / 4;
+inline static constexpr std::size_t PX_SACT = 0x34 / 4;
+inline static constexpr std::size_t PX_CI   = 0x38 / 4;
+
+inline static constexpr uint32_t CMD_ST  = 1u << 0;
+inline static constexpr uint32_t CMD_FRE = 1u << 4;
+inline static constexpr uint32_t CMD_FR  = 1u << 14;
+inline static constexpr uint32_t CMD_CR  = 1u << 15;
+
+inline static constexpr uint32_t IS_DHRS = 1u << 0;
+inline static constexpr uint32_t IS_PSS  = 1u << 1;
+inline static constexpr uint32_t IS_SDBS = 1u << 3;
+inline static constexpr uint32_t IS_DPS  = 1u << 5;
+inline static constexpr uint32_t IS_IFS  = 1u << 27;
+inline static constexpr uint32_t IS_HBDS = 1u << 28;
+inline static constexpr uint32_t IS_HBFS = 1u << 29;
+inline static constexpr uint32_t IS_TFES = 1u << 30;
+inline static constexpr uint32_t IS_ERRORS = IS_IFS | IS_HBDS | IS_HBFS | IS_TFES;
+
+inline static constexpr uint32_t TFD_ERR = 1u << 0;
+inline static constexpr uint32_t TFD_DRQ = 1u << 3;
+inline static constexpr uint32_t TFD_BSY = 1u << 7;
+
+inline static constexpr uint32_t SIG_ATA = 0x00000101;
+
+inline static constexpr uint8_t FIS_REG_H2D       = 0x27;
+inline static constexpr uint8_t ATA_IDENTIFY      = 0xEC;
+inline static constexpr uint8_t ATA_READ_DMA_EXT  = 0x25;
+inline static constexpr uint8_t ATA_WRITE_DMA_EXT = 0x35;
+inline static constexpr uint8_t ATA_READ_FPDMA    = 0x60;
+inline static constexpr uint8_t ATA_WRITE_FPDMA   = 0x61;
+inline static constexpr uint8_t ATA_READ_LOG_EXT  = 0x2F;
+inline static constexpr uint8_t LOG_NCQ_ERROR     = 0x10;
+inline static constexpr uint8_t LOG_NCQ_NQ        = 1 << 7;   // not a queued command
+inline static constexpr uint8_t ATA_DEVICE_LBA    = 1 << 6;
+
+// a PRDT entry covers at most 4M
+inline static constexpr std::size_t PRD_MAX = 0x400000;
+
+// register spins give up after this many rounds (a few hundred ms)
+inline static constexpr unsigned SPIN_LIMIT = 10000000;
+
+struct prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;       // bytes - 1; bit 31 interrupts on completion
+};
+
+static_assert(sizeof(prd) == 16);
+
+static volatile uint32_t* s_hba = nullptr;
+static port* s_ports[MAX_PORTS];
+static std::size_t s_num_ports = 0;
+
+static bool spin_until_clear(volatile uint32_t* reg, uint32_t mask) {
+    for (unsigned i = 0; i < SPIN_LIMIT; i++) {
+        if ((*reg & mask) == 0)
+            return true;
+        cpu_relax();
+    }
+    return false;
+}
+
+bool port::stop_engine() {
+    m_regs[PX_CMD] = m_regs[PX_CMD] & ~CMD_ST;
+    if (!spin_until_clear(&m_regs[PX_CMD], CMD_CR))
+        return false;
+    m_regs[PX_CMD] = m_regs[PX_CMD] & ~CMD_FRE;
+    return spin_until_clear(&m_regs[PX_CMD], CMD_FR);
+}
+
+void port::start_engine() {
+    spin_until_clear(&m_regs[PX_CMD], CMD_CR);
+    m_regs[PX_CMD] = m_regs[PX_CMD] | CMD_FRE;
+    m_regs[PX_CMD] = m_regs[PX_CMD] | CMD_ST;
+}
+
+void port::build_command(unsigned slot, uint8_t command, uint64_t lba,
+                         uint32_t sectors, bool write, std::size_t prdt_len)
+{
+    uint8_t* fis = m_tables[slot];
+    memset(fis, 0, 64);
+    fis[0] = FIS_REG_H2D;
+    fis[1] = 0x80; // command, not control
+    fis[2] = command;
+    fis[4] = (uint8_t)lba;
+    fis[5] = (uint8_t)(lba >> 8);
+    fis[6] = (uint8_t)(lba >> 16);
+    fis[7] = ATA_DEVICE_LBA;
+    fis[8] = (uint8_t)(lba >> 24);
+    fis[9] = (uint8_t)(lba >> 32);
+    fis[10] = (uint8_t)(lba >> 40);
+    if (command == ATA_READ_FPDMA || command == ATA_WRITE_FPDMA) {
+        // queued commands move the count to the features field and put
+        // the tag where the count was
+        fis[3] = (uint8_t)sectors;
+        fis[11] = (uint8_t)(sectors >> 8);
+        fis[12] = (uint8_t)(slot << 3);
+    } else {
+        fis[12] = (uint8_t)sectors;
+        fis[13] = (uint8_t)(sectors >> 8);
+    }
+
+    uint32_t* header = &m_cmd_list[slot * 8];
+    header[0] = 5 | (write ? 1u << 6 : 0) | ((uint32_t)prdt_len << 16);
+    header[1] = 0;
+    header[2] = (uint32_t)m_tables_phys[slot];
+    header[3] = (uint32_t)(m_tables_phys[slot] >> 32);
+}
+
+bool port::identify() {
+    mem::page_table::physical_address buf = mem::alloc_zeroed_frame();
+    if (IS_NULL(buf))
+        return false;
+
+    prd* prdt = (prd*)(m_tables[0] + 128);
+    prdt[0] = { (uint32_t)(uintptr_t)buf, (uint32_t)((uintptr_t)buf >> 32),
+                0, SECTOR_SIZE - 1 };
+    build_command(0, ATA_IDENTIFY, 0, 0, false, 1);
+
+    m_regs[PX_CI] = 1;
+    bool ok = spin_until_clear(&m_regs[PX_CI], 1) &&
+              (m_regs[PX_IS] & IS_TFES) == 0;
+    m_regs[PX_IS] = m_regs[PX_IS];
+
+    const uint16_t* id = (const uint16_t*)mem::phys_to_virt(buf);
+    // LBA48 only, 512-byte logical sectors only
+    if (ok && (id[83] & (1 << 10)) &&
+        ((id[106] & 0xC000) != 0x4000 || (id[106] & (1 << 12)) == 0))
+    {
+        m_sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                    ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+        if (id[76] & (1 << 8)) {
+            unsigned depth = (id[75] & 0x1F) + 1;
+            if (depth < m_slots)
+                m_slots = depth;
+            m_ncq = true;
+        }
+    } else {
+        ok = false;
+    }
+    pt->free_frame(buf);
+    return ok && m_sectors != 0;
+}
+
+bool port::start(volatile uint32_t* regs, bool addr64) {
+    m_regs = regs;
+    m_addr64 = addr64;
+
+    uint32_t ssts = m_regs[PX_SSTS];
+    // device present and the link up
+    if ((ssts & 0xF) != 3 || ((ssts >> 8) & 0xF) != 1)
+        return false;
+    if (m_regs[PX_SIG] != SIG_ATA)
+        return false;
+    if (!stop_engine())
+        return false;
+
+    // command list at 0, received FISes at 1K, both in one frame
+    mem::page_table::physical_address base = mem::alloc_zeroed_frame();
+    if (IS_NULL(base))
+        return false;
+    m_cmd_list = (uint32_t*)mem::phys_to_virt(base);
+    for (unsigned i = 0; i < m_slots; i++) {
+        mem::page_table::physical_address table = mem::alloc_zeroed_frame();
+        if (IS_NULL(table))
+            return false;
+        m_tables_phys[i] = table;
+        m_tables[i] = (uint8_t*)mem::phys_to_virt(table);
+        if (!m_addr64 && (m_tables_phys[i] >> 32) != 0)
+            return false;
+    }
+    if (!m_addr64 && ((uintptr_t)base >> 32) != 0)
+        return false;
+
+    m_regs[PX_CLB] = (uint32_t)(uintptr_t)base;
+    m_regs[PX_CLBU] = (uint32_t)((uintptr_t)base >> 32);
+    m_regs[PX_FB] = (uint32_t)((uintptr_t)base + 1024);
+    m_regs[PX_FBU] = (uint32_t)(((uintptr_t)base + 1024) >> 32);
+    m_regs[PX_SERR] = ~0u;
+    m_regs[PX_IS] = ~0u;
+    start_engine();
+    if (!spin_until_clear(&m_regs[PX_TFD], TFD_BSY | TFD_DRQ))
+        return false;
+
+    if (!identify())
+        return false;
+
+    // the NCQ error log's command table at 0, the log itself at 2K
+    if (m_ncq) {
+        mem::page_table::physical_address log = mem::alloc_zeroed_frame();
+        if (IS_NULL(log))
+            return false;
+        m_log_phys = log;
+        if (!m_addr64 && (m_log_phys >> 32) != 0)
+            return false;
+        m_log = (uint8_t*)mem::phys_to_virt(m_log_phys);
+    }
+
+    m_free = m_slots == 32 ? ~0u : (1u << m_slots) - 1;
+    m_regs[PX_IE] = IS_DHRS | IS_PSS | IS_SDBS | IS_DPS | IS_ERRORS;
+    return true;
+}
+
+bool port::submit(request* req) {
+    std::size_t len = (std::size_t)req->sectors * SECTOR_SIZE;
+    if (req->sectors == 0 || req->sectors > MAX_SECTORS ||
+        ((uintptr_t)req->buffer & 1) ||
+        req->lba + req->sectors > m_sectors)
+        return false;
+
+    kstd::irq_lock_guard guard(m_lock);
+    if (m_free == 0)
+        return false;
+    unsigned slot = __builtin_ctz(m_free);
+
+    // one walk of the page tables for the whole buffer
+    std::size_t n = blk::request_ranges(req, m_ranges, MAX_PRDT);
+    prd* prdt = (prd*)(m_tables[slot] + 128);
+    std::size_t prdt_len = 0, covered = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        uintptr_t base = m_ranges[i].base;
+        std::size_t left = m_ranges[i].length;
+        if ((base & 1) || (!m_addr64 && ((base + left - 1) >> 32) != 0))
+            return false;
+        while (left != 0) {
+            if (prdt_len == MAX_PRDT)
+                return false;
+            std::size_t chunk = left < PRD_MAX ? left : PRD_MAX;
+            prdt[prdt_len++] = { (uint32_t)base, (uint32_t)(base >> 32), 0,
+                                 (uint32_t)(chunk - 1) };
+            base += chunk;
+            left -= chunk;
+            covered += chunk;
+        }
+    }
+    if (covered != len)
+        return false;
+
+    uint8_t command = m_ncq
+        ? (req->write ? ATA_WRITE_FPDMA : ATA_READ_FPDMA)
+        : (req->write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT);
+    build_command(slot, command, req->lba, req->sectors, req->write, prdt_len);
+
+    uint32_t bit = 1u << slot;
+    m_requests[slot] = req;
+    m_free &= ~bit;
+    m_active |= bit;
+    // the command table and header are plain stores, which x86 keeps
+    // ahead of the uncached doorbell writes
+    if (m_ncq)
+        m_regs[PX_SACT] = bit;
+    m_regs[PX_CI] = bit;
+    return true;
+}
+
+// READ LOG EXT of the NCQ error log, polled through slot 0 with its own
+// command table while the engine is otherwise idle; reading the log is
+// what takes the drive out of its error state. the failed command's
+// tag, or -1 if that can't be had
+int port::read_ncq_log() {
+    uint32_t* header = &m_cmd_list[0];
+    uint32_t saved[4] = { header[0], header[1], header[2], header[3] };
+
+    uint8_t* fis = m_log;
+    memset(fis, 0, 64);
+    fis[0] = FIS_REG_H2D;
+    fis[1] = 0x80;
+    fis[2] = ATA_READ_LOG_EXT;
+    fis[4] = LOG_NCQ_ERROR;
+    fis[7] = ATA_DEVICE_LBA;
+    fis[12] = 1;
+    uintptr_t buf = m_log_phys + 2048;
+    prd* prdt = (prd*)(m_log + 128);
+    prdt[0] = { (uint32_t)buf, (uint32_t)(buf >> 32), 0, SECTOR_SIZE - 1 };
+    header[0] = 5 | (1u << 16);
+    header[1] = 0;
+    header[2] = (uint32_t)m_log_phys;
+    header[3] = (uint32_t)(m_log_phys >> 32);
+
+    m_regs[PX_CI] = 1;
+    bool ok = spin_until_clear(&m_regs[PX_CI], 1) &&
+              (m_regs[PX_IS] & IS_TFES) == 0;
+    m_regs[PX_IS] = m_regs[PX_IS];
+    for (unsigned i = 0; i < 4; i++)
+        header[i] = saved[i];
+
+    uint8_t status = m_log[2048];
+    if (!ok || (status & LOG_NCQ_NQ) != 0)
+        return -1;
+    return status & 0x1F;
+}
+
+// a task file error stops the port and everything outstanding on it.
+// an NCQ drive's error log names the one command that failed, and the
+// others go out again; without it they all fail. returns the slots of
+// pending that failed
+uint32_t port::recover(uint32_t pending) {
+    stop_engine();
+    m_regs[PX_SERR] = ~0u;
+    m_regs[PX_IS] = ~0u;
+    start_engine();
+    if (!m_ncq || pending == 0 ||
+        !spin_until_clear(&m_regs[PX_TFD], TFD_BSY | TFD_DRQ))
+        return pending;
+
+    int tag = read_ncq_log();
+    if (tag < 0 || (pending & (1u << tag)) == 0)
+        return pending;
+
+    uint32_t retry = pending & ~(1u << tag);
+    for (uint32_t s = retry; s != 0; s &= s - 1)
+        m_cmd_list[__builtin_ctz(s) * 8 + 1] = 0;   // bytes transferred
+    if (retry != 0) {
+        m_regs[PX_SACT] = retry;
+        m_regs[PX_CI] = retry;
+    }
+    return 1u << tag;
+}
+
+void port::poll() {
+    request* done[MAX_SLOTS];
+    std::size_t num_done = 0;
+
+    {
+        kstd::irq_lock_guard guard(m_lock);
+        uint32_t is = m_regs[PX_IS];
+        m_regs[PX_IS] = is;
+
+        // what finished before any error did so cleanly
+        uint32_t finished = m_active & ~(m_regs[PX_SACT] | m_regs[PX_CI]);
+        uint32_t failed = 0;
+        if ((is & IS_ERRORS) != 0 || (m_regs[PX_TFD] & TFD_ERR) != 0) {
+            failed = recover(m_active & ~finished);
+            finished |= failed;
+        }
+
+        while (finished != 0) {
+            unsigned slot = __builtin_ctz(finished);
+            finished &= finished - 1;
+            request* req = m_requests[slot];
+            m_requests[slot] = nullptr;
+            m_active &= ~(1u << slot);
+            m_free |= 1u << slot;
+            req->ok = (failed & (1u << slot)) == 0;
+            done[num_done++] = req;
+        }
+    }
+
+    // unlocked, so completions can submit more
+    for (std::size_t i = 0; i < num_done; i++)
+        done[i]->done(done[i]);
+}
+
+static void poll_all() {
+    for (std::size_t i = 0; i < s_num_ports; i++)
+        s_ports[i]->poll();
+}
+
+static void irq_handler(void*) {
+    uint32_t is = s_hba[HBA_IS];
+    for (std::size_t i = 0; i < s_num_ports; i++)
+        s_ports[i]->poll();
+    s_hba[HBA_IS] = is;
+}
+
+// without MSI, completions are noticed by idle CPUs
+static bool idle_poll() {
+    for (std::size_t i = 0; i < s_num_ports; i++) {
+        if (s_ports[i]->busy()) {
+            poll_all();
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool disk_submit(void* driver, std::size_t, request* req) {
+    return ((port*)driver)->submit(req);
+}
+
+static void disk_poll(void* driver) {
+    ((port*)driver)->poll();
+}
+
+static bool disk_busy(void* driver, std::size_t) {
+    return ((port*)driver)->busy();
+}
+
+static const blk::disk_ops s_disk_ops = { &disk_submit, &disk_poll, &disk_busy };
+
+bool init() {
+    pci::address dev;
+    // mass storage, SATA, AHCI 1.0
+    if (!pci::find_class(0x01, 0x06, 0x01, 0, &dev))
+        return false;
+
+    uint64_t abar = pci::bar(dev, 5);
+    if (abar == 0)
+        return false;
+    pci::enable(dev);
+    s_hba = (volatile uint32_t*)mem::map_mmio(abar, 0x1100);
+    if (s_hba == nullptr)
+        return false;
+
+    s_hba[HBA_GHC] = s_hba[HBA_GHC] | GHC_AE;
+    s_hba[HBA_GHC] = s_hba[HBA_GHC] | GHC_HR;
+    if (!spin_until_clear(&s_hba[HBA_GHC], GHC_HR))
+        return false;
+    s_hba[HBA_GHC] = s_hba[HBA_GHC] | GHC_AE;
+
+    uint32_t cap = s_hba[HBA_CAP];
+    unsigned slots = ((cap >> 8) & 0x1F) + 1;
+    bool ncq = (cap & CAP_SNCQ) != 0;
+    uint32_t implemented = s_hba[HBA_PI];
+
+    for (unsigned i = 0; i < MAX_PORTS; i++) {
+        if ((implemented & (1u << i)) == 0)
+            continue;
+        port* p = new port();
+        if (p == nullptr)
+            break;
+        p->m_slots = slots;
+        volatile uint32_t* regs = s_hba + (PORT_BASE + i * PORT_SIZE) / 4;
+        if (!p->start(regs, (cap & CAP_S64A) != 0)) {
+            // whatever frames it got are lost; this only happens at boot
+            delete p;
+            continue;
+        }
+        p->m_ncq = p->m_ncq && ncq;
+        char name[] = "sda";
+        name[2] = (char)('a' + s_num_ports);
+        blk::register_disk(name, p, &s_disk_ops, p->sectors(), 1, MAX_PRDT,
+                           MAX_SECTORS);
+        s_ports[s_num_ports++] = p;
+    }
+
+    // the HBA has the one message; it goes wherever there's least else
+    std::size_t target = pci::ANY_CPU;
+    uint8_t vector = 0;
+    if (apic::x2apic())
+        vector = pci::alloc_irq(&irq_handler, nullptr, &target);
+    if (vector != 0 && pci::enable_msi(dev, vector, cpu::get(target).lapic_id))
+        s_hba[HBA_GHC] = s_hba[HBA_GHC] | GHC_IE;
+    else
+        cpu::register_idle_work(&idle_poll);
+    return s_num_ports != 0;
+}
+
+std::size_t port_count() {
+    return s_num_ports;
+}
+
+port* get_port(std::size_t i) {
+    return s_ports[i];
+}
+
+static void sync_done(request* req) {
+    __atomic_store_n((bool*)req->ctx, true, __ATOMIC_RELEASE);
+}
+
+bool transfer(port* p, uint64_t lba, uint32_t sectors, void* buffer,
+              bool write)
+{
+    bool finished = false;
+    request req = { lba, sectors, write, buffer, nullptr, 0, &sync_done,
+                    &finished, false };
+    while (!p->submit(&req)) {
+        // refused by an idle port: the request itself is bad
+        if (!p->busy())
+            return false;
+        p->poll();
+    }
+    while (!__atomic_load_n(&finished, __ATOMIC_ACQUIRE)) {
+        p->poll();
+        cpu_relax();
+    }
+    return req.ok;
+}
+
+} // namespace ahci
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/sync.hpp"
+
+#include "block.hpp"
+#include "page_table.hpp"
+#include "pci.hpp"
+
+namespace ahci {
+
+inline static constexpr std::size_t SECTOR_SIZE = blk::SECTOR_SIZE;
+inline static constexpr unsigned MAX_SLOTS = 32;
+inline static constexpr unsigned MAX_PORTS = 32;
+
+// scatter-gather entries per command: as many as fit in the one frame a
+// command table gets after its 128-byte header
+inline static constexpr std::size_t MAX_PRDT = (4096 - 128) / 16;
+
+// NCQ carries the count in 16 bits, and 0 doesn't mean 65536 everywhere
+inline static constexpr uint32_t MAX_SECTORS = 0xFFFF;
+
+// buffers and extents must be 2-byte aligned
+using request = blk::request;
+using completion_fn = blk::completion_fn;
+
+// one SATA disk behind an AHCI port. commands go out as soon as they're
+// submitted, up to one per command slot, NCQ-tagged if the drive can
+// reorder them
+class port {
+public:
+    // false if every slot is busy or the buffer needs more than MAX_PRDT
+    // extents; the request is untouched then
+    bool submit(request* req);
+
+    // checks for completions; what the interrupt handler runs, and what
+    // to call when there is no MSI
+    void poll();
+
+    inline uint64_t sectors() const {
+        return m_sectors;
+    }
+
+    // commands that can be outstanding at once
+    inline unsigned queue_depth() const {
+        return m_slots;
+    }
+
+    inline bool ncq() const {
+        return m_ncq;
+    }
+
+    // commands outstanding; a racy snapshot
+    inline bool busy() const {
+        return __atomic_load_n(&m_active, __ATOMIC_RELAXED) != 0;
+    }
+
+private:
+    friend bool init();
+
+    bool start(volatile uint32_t* regs, bool addr64);
+    bool stop_engine();
+    void start_engine();
+    bool identify();
+    void build_command(unsigned slot, uint8_t command, uint64_t lba,
+                       uint32_t sectors, bool write, std::size_t prdt_len);
+    uint32_t recover(uint32_t pending);
+    int read_ncq_log();
+
+    volatile uint32_t* m_regs = nullptr;
+    uint32_t* m_cmd_list = nullptr;     // through the HHDM
+    uint8_t* m_tables[MAX_SLOTS] = { };
+    uintptr_t m_tables_phys[MAX_SLOTS] = { };
+    uint64_t m_sectors = 0;
+    unsigned m_slots = 0;
+    bool m_ncq = false;
+    bool m_addr64 = false;
+    uint8_t* m_log = nullptr;           // for read_ncq_log(), NCQ only
+    uintptr_t m_log_phys = 0;
+
+    kstd::ticket_lock m_lock;
+    uint32_t m_free = 0;                // slots not in use
+    uint32_t m_active = 0;              // slots issued to the HBA
+    request* m_requests[MAX_SLOTS] = { };
+    mem::phys_range m_ranges[MAX_PRDT]; // scratch for submit()
+};
+
+// finds the first AHCI controller and brings up every port with a disk
+// behind it, registering each as sda, sdb, ...; after SMP bring-up
+bool init();
+
+std::size_t port_count();
+port* get_port(std::size_t i);
+
+// submits and waits, polling; interrupts may be on or off
+bool transfer(port* p, uint64_t lba, uint32_t sectors, void* buffer,
+              bool write);
+
+} // namespace ahci
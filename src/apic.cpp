@@ -0,0 +1,43 @@
+#include "apic.hpp"
+
+#include "asm_wrappers.hpp"
+
+namespace apic {
+
+static bool s_x2apic = false;
+
+static bool has_x2apic() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1u << 21)) != 0;
+}
+
+void init_local() {
+    if (!has_x2apic())
+        return;
+
+    // Limine has normally done this already when asked for x2APIC
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    if ((base & (APIC_BASE_ENABLE | APIC_BASE_X2APIC)) != 
+        (APIC_BASE_ENABLE | APIC_BASE_X2APIC))
+        wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+
+    // bit 8 software-enables the APIC
+    wrmsr(MSR_X2APIC_SVR, (1 << 8) | SPURIOUS_VECTOR);
+    s_x2apic = true;
+}
+
+bool x2apic() {
+    return s_x2apic;
+}
+
+void eoi() {
+    wrmsr(MSR_X2APIC_EOI, 0);
+}
+
+void send_ipi(uint32_t lapic_id, uint8_t vector) {
+    // a single ICR write in x2APIC mode: no delivery status to poll
+    wrmsr(MSR_X2APIC_ICR, ((uint64_t)lapic_id << 32) | vector);
+}
+
+} // namespace apic
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+namespace apic {
+
+inline static constexpr uint32_t MSR_APIC_BASE = 0x1B;
+inline static constexpr uint64_t APIC_BASE_ENABLE = 1 << 11;
+inline static constexpr uint64_t APIC_BASE_X2APIC = 1 << 10;
+
+// x2APIC registers are MSRs at 0x800 + (xAPIC MMIO offset >> 4)
+inline static constexpr uint32_t MSR_X2APIC_ID  = 0x802;
+inline static constexpr uint32_t MSR_X2APIC_EOI = 0x80B;
+inline static constexpr uint32_t MSR_X2APIC_SVR = 0x80F;
+inline static constexpr uint32_t MSR_X2APIC_ICR = 0x830;
+
+inline static constexpr uint8_t SPURIOUS_VECTOR = 0xFF;
+
+// switches this CPU's local APIC to x2APIC mode and software-enables it.
+// does nothing (and x2apic() stays false) on CPUs without x2APIC
+void init_local();
+
+// true once the BSP's APIC is in x2APIC mode
+bool x2apic();
+
+void eoi();
+
+// fixed delivery, physical destination
+void send_ipi(uint32_t lapic_id, uint8_t vector);
+
+} // namespace apic
@@ -2,6 +2,8 @@
 // apologies for the AT&T syntax
 // GCC inline asm doesn't play nice with the correct syntax
 
+#pragma once
+
 #include <cstdint>
 
 #if defined __x86_64__ || defined __i386__
@@ -66,12 +68,26 @@ extern "C" inline void outd(uint16_t port, uint32_t data) {
            );
 }
 
+// memory clobbers keep the compiler from moving accesses across the
+// edges of an interrupts-off section
 extern "C" inline void sti() {
-    __asm__("sti\n\t");
+    __asm__ volatile("sti\n\t" ::: "memory");
 }
 
 extern "C" inline void cli() {
-    __asm__("cli\n\t");
+    __asm__ volatile("cli\n\t" ::: "memory");
+}
+
+extern "C" inline uint64_t read_rflags() {
+    uint64_t flags;
+    __asm__ volatile(
+            "pushfq\n\t"
+            "popq %0\n\t"
+            :"=r"(flags)
+            :
+            :"memory"
+           );
+    return flags;
 }
 
 extern "C" inline void hlt() {
@@ -86,6 +102,165 @@ extern "C" inline void lcr3(void* page_table) {
            );
 }
 
+extern "C" inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile(
+            "rdmsr\n\t"
+            :"=a"(lo), "=d"(hi)
+            :"c"(msr)
+            :
+           );
+    return ((uint64_t)hi << 32) | lo;
+}
+
+extern "C" inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile(
+            "wrmsr\n\t"
+            :
+            :"c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32))
+            :"memory"
+           );
+}
+
+extern "C" inline void* rcr2() {
+    void* fault_addr;
+    __asm__ volatile(
+            "mov %%cr2, %0\n\t"
+            :"=r"(fault_addr)
+            :
+            :
+           );
+    return fault_addr;
+}
+
+extern "C" inline void* rcr3() {
+    void* page_table;
+    __asm__ volatile(
+            "mov %%cr3, %0\n\t"
+            :"=r"(page_table)
+            :
+            :
+           );
+    return page_table;
+}
+
+extern "C" inline uint64_t rcr4() {
+    uint64_t val;
+    __asm__ volatile(
+            "movq %%cr4, %0\n\t"
+            :"=r"(val)
+            :
+            :
+           );
+    return val;
+}
+
+extern "C" inline void lcr4(uint64_t val) {
+    __asm__ volatile(
+            "movq %0, %%cr4\n\t"
+            :
+            :"r"(val)
+            :"memory"
+           );
+}
+
+// drops every TLB entry, global ones included: toggling CR4.PGE flushes
+// everything, while a CR3 reload would leave global pages behind
+extern "C" inline void flush_tlb_all() {
+    uint64_t cr4 = rcr4();
+    if (cr4 & (1 << 7)) {
+        lcr4(cr4 & ~(1ull << 7));
+        lcr4(cr4);
+    } else {
+        lcr3(rcr3());
+    }
+}
+
+extern "C" inline void invlpg(const void* virt_addr) {
+    __asm__ volatile(
+            "invlpg (%0)\n\t"
+            :
+            :"r"(virt_addr)
+            :"memory"
+           );
+}
+
+extern "C" inline void sfence() {
+    __asm__ volatile("sfence\n\t" ::: "memory");
+}
+
+// arms the monitor on the cache line holding addr; a following mwait
+// sleeps until that line is written (or an interrupt arrives)
+extern "C" inline void monitor(const volatile void* addr) {
+    __asm__ volatile(
+            "monitor\n\t"
+            :
+            :"a"(addr), "c"(0), "d"(0)
+            :
+           );
+}
+
+extern "C" inline void mwait() {
+    __asm__ volatile(
+            "mwait\n\t"
+            :
+            :"a"(0), "c"(0)
+            :"memory"
+           );
+}
+
+extern "C" inline void cpu_relax() {
+    __asm__ volatile("pause\n\t" ::: "memory");
+}
+
+// not serializing - callers that need ordering against surrounding
+// loads/stores should fence around it
+extern "C" inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile(
+            "rdtsc\n\t"
+            :"=a"(lo), "=d"(hi)
+            :
+            :
+           );
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// rdtsc that also returns IA32_TSC_AUX, which we load with the CPU id
+extern "C" inline uint64_t rdtscp(uint32_t* aux) {
+    uint32_t lo, hi;
+    __asm__ volatile(
+            "rdtscp\n\t"
+            :"=a"(lo), "=d"(hi), "=c"(*aux)
+            :
+            :
+           );
+    return ((uint64_t)hi << 32) | lo;
+}
+
+extern "C" inline uint64_t rdpid() {
+    uint64_t aux;
+    __asm__ volatile(
+            "rdpid %0\n\t"
+            :"=r"(aux)
+            :
+            :
+           );
+    return aux;
+}
+
+extern "C" inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t* eax, uint32_t* ebx,
+                             uint32_t* ecx, uint32_t* edx)
+{
+    __asm__ volatile(
+            "cpuid\n\t"
+            :"=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+            :"a"(leaf), "c"(subleaf)
+            :
+           );
+}
+
 //extern "C" rflags_t	get_flags();
 
 #endif
@@ -0,0 +1,449 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/mpsc_queue.hpp"
+#include "stdlib/new.hpp"
+#include "stdlib/sync.hpp"
+
+#include "block.hpp"
+
+#include "asm_wrappers.hpp"
+#include "softirq.hpp"
+
+namespace blk {
+
+// a request as the block layer keeps it: the driver's view, the bios
+// merged into it in sector order, and the extents they add up to
+struct queued_request : kstd::mpsc_node {
+    request req;
+    disk* target;
+    std::size_t cpu;            // where it was queued and completes
+    bio* bios;
+    bio* bios_tail;
+    queued_request* next;       // software queue or free list
+    bio_vec segs[MAX_SEGMENTS];
+};
+
+// drivers complete requests on whatever CPU their interrupt went to; the
+// bios end on the CPU that queued them
+struct alignas(cpu::CACHE_LINE_SIZE) cpu_state {
+    kstd::mpsc_queue<queued_request> done;
+    queued_request* free = nullptr;
+    plug* current = nullptr;
+};
+
+static cpu_state s_cpus[cpu::MAX_CPUS];
+static bool s_pools_ready = false;
+
+static disk* s_disks[MAX_DISKS];
+static std::size_t s_num_disks = 0;
+
+// software queues, on any CPU, that are stalled
+static uint32_t s_stalled = 0;
+
+std::size_t request_ranges(const request* req, mem::phys_range* out,
+                           std::size_t max)
+{
+    if (req->buffer != nullptr) {
+        return pt->to_phys_ranges(req->buffer,
+                                  (std::size_t)req->sectors * SECTOR_SIZE,
+                                  out, max);
+    }
+    std::size_t n = req->num_segments < max ? req->num_segments : max;
+    for (std::size_t i = 0; i < n; i++) {
+        out[i].base = req->segments[i].phys;
+        out[i].length = req->segments[i].len;
+    }
+    return n;
+}
+
+static void request_done(request* req) {
+    queued_request* rq = (queued_request*)req->ctx;
+    s_cpus[rq->cpu].done.push(rq);
+    if (rq->cpu == cpu::id())
+        softirq::raise(softirq::SOFTIRQ_BLOCK);
+    else
+        softirq::raise_on(rq->cpu, softirq::SOFTIRQ_BLOCK);
+}
+
+static void end_bio(bio* b, bool ok) {
+    b->ok = ok;
+    b->end_io(b);
+}
+
+static void poll_all() {
+    std::size_t n = __atomic_load_n(&s_num_disks, __ATOMIC_ACQUIRE);
+    for (std::size_t i = 0; i < n; i++)
+        s_disks[i]->poll();
+}
+
+// a free request of this CPU's; with none left, reaps completions until
+// one comes back
+static queued_request* alloc_request() {
+    cpu_state& c = s_cpus[cpu::id()];
+    for (;;) {
+        {
+            kstd::irq_guard guard;
+            queued_request* rq = c.free;
+            if (rq != nullptr) {
+                c.free = rq->next;
+                return rq;
+            }
+        }
+        poll_all();
+        cpu_relax();
+    }
+}
+
+// appends v, growing the last extent instead if v carries straight on
+// from it
+static bool append_segment(queued_request* rq, const bio_vec& v,
+                           std::size_t max)
+{
+    std::size_t n = rq->req.num_segments;
+    if (n != 0) {
+        bio_vec& last = rq->segs[n - 1];
+        if (last.phys + last.len == v.phys &&
+            (uint64_t)last.len + v.len <= 0xFFFFFFFF)
+        {
+            last.len += v.len;
+            return true;
+        }
+    }
+    if (n == max)
+        return false;
+    rq->segs[n] = v;
+    rq->req.num_segments = n + 1;
+    return true;
+}
+
+void disk::complete_requests() {
+    cpu_state& c = s_cpus[cpu::id()];
+    bool freed = false;
+    for (;;) {
+        queued_request* rq;
+        {
+            // the poll loops call this too, and the softirq mustn't pop
+            // alongside them
+            kstd::irq_guard guard;
+            rq = c.done.pop();
+            if (rq == nullptr)
+                break;
+        }
+
+        bool ok = rq->req.ok;
+        bio* b = rq->bios;
+        {
+            // back on the free list first, so the bios' end_io can
+            // submit more
+            kstd::irq_guard guard;
+            rq->next = c.free;
+            c.free = rq;
+        }
+        freed = true;
+        while (b != nullptr) {
+            bio* next = b->next;
+            end_bio(b, ok);
+            b = next;
+        }
+    }
+
+    std::size_t n = __atomic_load_n(&s_num_disks, __ATOMIC_ACQUIRE);
+    for (std::size_t i = 0; i < n; i++)
+        s_disks[i]->dispatch();
+    // the room may be on a hardware queue another CPU is waiting for
+    if (freed && __atomic_load_n(&s_stalled, __ATOMIC_ACQUIRE) != 0)
+        cpu::kick_idle();
+}
+
+bool disk::redispatch() {
+    if (__atomic_load_n(&s_stalled, __ATOMIC_ACQUIRE) == 0)
+        return false;
+    std::size_t id = cpu::id();
+    std::size_t n = __atomic_load_n(&s_num_disks, __ATOMIC_ACQUIRE);
+    for (std::size_t i = 0; i < n; i++) {
+        if (s_disks[i]->m_sw[id].stalled)
+            s_disks[i]->dispatch();
+    }
+    // still stalled ones wait for the next kick
+    return false;
+}
+
+bool disk::prepare(bio* b) {
+    uint64_t bytes = 0;
+    for (std::size_t i = 0; i < b->num_vecs; i++)
+        bytes += b->vecs[i].len;
+    uint64_t sectors = bytes / SECTOR_SIZE;
+
+    bool fits = bytes != 0 && bytes % SECTOR_SIZE == 0 &&
+                b->num_vecs <= m_max_segments && sectors <= 0xFFFFFFFF &&
+                (m_max_sectors == 0 || sectors <= m_max_sectors) &&
+                b->lba < m_sectors && sectors <= m_sectors - b->lba;
+    if (!fits) {
+        end_bio(b, false);
+        return false;
+    }
+    b->target = this;
+    b->sectors = (uint32_t)sectors;
+    b->next = nullptr;
+    return true;
+}
+
+// b goes onto rq's front or back if it continues it exactly, the
+// direction matches and the result stays within the driver's limits
+bool disk::try_merge(queued_request* rq, bio* b) {
+    request& r = rq->req;
+    if (r.write != b->write)
+        return false;
+    uint64_t sectors = (uint64_t)r.sectors + b->sectors;
+    if (sectors > 0xFFFFFFFF ||
+        (m_max_sectors != 0 && sectors > m_max_sectors))
+        return false;
+    // before coalescing, so both ways round have room
+    if (r.num_segments + b->num_vecs > m_max_segments)
+        return false;
+
+    if (r.lba + r.sectors == b->lba) {
+        for (std::size_t i = 0; i < b->num_vecs; i++)
+            append_segment(rq, b->vecs[i], m_max_segments);
+        rq->bios_tail->next = b;
+        rq->bios_tail = b;
+    } else if (b->lba + b->sectors == r.lba) {
+        std::size_t n = b->num_vecs;
+        for (std::size_t i = r.num_segments; i-- > 0; )
+            rq->segs[i + n] = rq->segs[i];
+        for (std::size_t i = 0; i < n; i++)
+            rq->segs[i] = b->vecs[i];
+        r.num_segments += n;
+        r.lba = b->lba;
+        b->next = rq->bios;
+        rq->bios = b;
+    } else {
+        return false;
+    }
+    r.sectors = (uint32_t)sectors;
+    return true;
+}
+
+// merges b into something already waiting on this CPU or queues a new
+// request for it; dispatch() sends it on
+void disk::enqueue(bio* b) {
+    sw_queue& q = m_sw[cpu::id()];
+    {
+        kstd::irq_guard guard;
+        for (queued_request* rq = q.head; rq != nullptr; rq = rq->next) {
+            if (try_merge(rq, b))
+                return;
+        }
+    }
+
+    queued_request* rq = alloc_request();
+    rq->target = this;
+    rq->cpu = cpu::id();
+    rq->bios = b;
+    rq->bios_tail = b;
+    rq->next = nullptr;
+    rq->req = { b->lba, b->sectors, b->write, nullptr, rq->segs, 0,
+                &request_done, rq, false };
+    for (std::size_t i = 0; i < b->num_vecs; i++)
+        append_segment(rq, b->vecs[i], m_max_segments);
+
+    kstd::irq_guard guard;
+    if (q.tail != nullptr)
+        q.tail->next = rq;
+    else
+        q.head = rq;
+    q.tail = rq;
+}
+
+// hands this CPU's waiting requests to its hardware queue until that
+// one is full
+void disk::dispatch() {
+    std::size_t id = cpu::id();
+    std::size_t hwq = id % m_hw_queues;
+    sw_queue& q = m_sw[id];
+
+    kstd::irq_guard guard;
+    bool stalled = false;
+    while (q.head != nullptr) {
+        queued_request* rq = q.head;
+        bool taken = m_ops->submit(m_driver, hwq, &rq->req);
+        if (!taken && m_ops->busy(m_driver, hwq)) {
+            stalled = true;
+            break;
+        }
+        q.head = rq->next;
+        if (q.head == nullptr)
+            q.tail = nullptr;
+        if (!taken) {
+            rq->req.ok = false;
+            request_done(&rq->req);
+        }
+    }
+    if (stalled != q.stalled) {
+        q.stalled = stalled;
+        if (stalled)
+            __atomic_add_fetch(&s_stalled, 1, __ATOMIC_RELEASE);
+        else
+            __atomic_sub_fetch(&s_stalled, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void disk::submit(bio* b) {
+    if (!prepare(b))
+        return;
+
+    cpu::cpu_local& c = cpu::current();
+    plug* p = s_cpus[c.id].current;
+    if (p != nullptr && c.irq_depth == 0 && !c.in_softirq) {
+        if (p->m_tail != nullptr)
+            p->m_tail->next = b;
+        else
+            p->m_head = b;
+        p->m_tail = b;
+        if (++p->m_count == PLUG_MAX)
+            p->flush();
+        return;
+    }
+
+    enqueue(b);
+    dispatch();
+}
+
+static void wait_done(bio* b) {
+    __atomic_store_n((bool*)b->ctx, true, __ATOMIC_RELEASE);
+}
+
+bool disk::submit_wait(bio* b) {
+    bool finished = false;
+    b->end_io = &wait_done;
+    b->ctx = &finished;
+    if (!prepare(b))
+        return false;
+
+    enqueue(b);
+    dispatch();
+    while (!__atomic_load_n(&finished, __ATOMIC_ACQUIRE)) {
+        poll();
+        cpu_relax();
+    }
+    return b->ok;
+}
+
+void disk::poll() {
+    m_ops->poll(m_driver);
+    complete_requests();
+}
+
+plug::plug() {
+    cpu_state& c = s_cpus[cpu::id()];
+    if (c.current == nullptr) {
+        c.current = this;
+        m_active = true;
+    }
+}
+
+plug::~plug() {
+    if (!m_active)
+        return;
+    flush();
+    s_cpus[cpu::id()].current = nullptr;
+}
+
+void plug::flush() {
+    bio* list = m_head;
+    m_head = nullptr;
+    m_tail = nullptr;
+    m_count = 0;
+
+    // by disk, then sector. stable, so equal keys keep their order; the
+    // list is never longer than PLUG_MAX
+    bio* sorted = nullptr;
+    while (list != nullptr) {
+        bio* b = list;
+        list = list->next;
+        bio** at = &sorted;
+        while (*at != nullptr &&
+               ((*at)->target < b->target ||
+                ((*at)->target == b->target && (*at)->lba <= b->lba)))
+            at = &(*at)->next;
+        b->next = *at;
+        *at = b;
+    }
+
+    disk* last = nullptr;
+    while (sorted != nullptr) {
+        bio* b = sorted;
+        sorted = b->next;
+        b->next = nullptr;
+        if (last != nullptr && last != b->target)
+            last->dispatch();
+        b->target->enqueue(b);
+        last = b->target;
+    }
+    if (last != nullptr)
+        last->dispatch();
+}
+
+void init() {
+    softirq::register_handler(softirq::SOFTIRQ_BLOCK, &disk::complete_requests);
+    cpu::register_idle_work(&disk::redispatch);
+}
+
+static bool alloc_pools() {
+    if (s_pools_ready)
+        return true;
+    for (std::size_t i = 0; i < cpu::count(); i++) {
+        queued_request* pool = new queued_request[REQUESTS_PER_CPU];
+        if (pool == nullptr)
+            return false;
+        for (std::size_t j = 0; j < REQUESTS_PER_CPU; j++) {
+            pool[j].next = s_cpus[i].free;
+            s_cpus[i].free = &pool[j];
+        }
+    }
+    s_pools_ready = true;
+    return true;
+}
+
+disk* register_disk(kstd::string_view name, void* driver, const disk_ops* ops,
+                    uint64_t sectors, std::size_t hw_queues,
+                    std::size_t max_segments, uint32_t max_sectors)
+{
+    if (s_num_disks == MAX_DISKS || !alloc_pools())
+        return nullptr;
+    disk* d = new disk();
+    if (d == nullptr)
+        return nullptr;
+
+    std::size_t len = name.size() < sizeof(d->m_name) - 1
+                    ? name.size() : sizeof(d->m_name) - 1;
+    memcpy(d->m_name, name.data(), len);
+    d->m_driver = driver;
+    d->m_ops = ops;
+    d->m_sectors = sectors;
+    d->m_hw_queues = hw_queues != 0 ? hw_queues : 1;
+    d->m_max_segments = max_segments < MAX_SEGMENTS ? max_segments
+                                                    : MAX_SEGMENTS;
+    d->m_max_sectors = max_sectors;
+
+    s_disks[s_num_disks] = d;
+    __atomic_store_n(&s_num_disks, s_num_disks + 1, __ATOMIC_RELEASE);
+    return d;
+}
+
+std::size_t disk_count() {
+    return __atomic_load_n(&s_num_disks, __ATOMIC_ACQUIRE);
+}
+
+disk* get_disk(std::size_t i) {
+    return s_disks[i];
+}
+
+disk* find_disk(kstd::string_view name) {
+    for (std::size_t i = 0; i < disk_count(); i++) {
+        if (s_disks[i]->name() == name)
+            return s_disks[i];
+    }
+    return nullptr;
+}
+
+} // namespace blk
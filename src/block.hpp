@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/string_view.hpp"
+
+#include "cpu.hpp"
+#include "page_table.hpp"
+
+namespace blk {
+
+inline static constexpr std::size_t SECTOR_SIZE = 512;
+
+// extents one queued request can carry after merging; bios that would
+// take it past this (or past the driver's own limits) start a new one
+#ifdef K_BLK_MAX_SEGMENTS
+    inline static constexpr std::size_t MAX_SEGMENTS = K_BLK_MAX_SEGMENTS;
+#else
+    inline static constexpr std::size_t MAX_SEGMENTS = 32;
+#endif
+
+// requests each CPU can have queued or in flight across every disk
+#ifdef K_BLK_REQUESTS_PER_CPU
+    inline static constexpr std::size_t REQUESTS_PER_CPU = K_BLK_REQUESTS_PER_CPU;
+#else
+    inline static constexpr std::size_t REQUESTS_PER_CPU = 64;
+#endif
+
+// bios a plug holds before it flushes on its own
+#ifdef K_BLK_PLUG_MAX
+    inline static constexpr std::size_t PLUG_MAX = K_BLK_PLUG_MAX;
+#else
+    inline static constexpr std::size_t PLUG_MAX = 32;
+#endif
+
+inline static constexpr std::size_t MAX_DISKS = 16;
+
+// a piece of a transfer: physical memory, usually (part of) a page
+// someone else owns. nothing is copied on its way to the device
+struct bio_vec {
+    uintptr_t phys;
+    uint32_t len;
+};
+
+struct request;
+using completion_fn = void (*)(request* req);
+
+// what a driver is handed. the data is either a kernel virtual buffer,
+// split up with to_phys_ranges(), or, when buffer is null, a list of
+// physical extents
+struct request {
+    uint64_t lba;
+    uint32_t sectors;
+    bool write;
+    void* buffer;
+    const bio_vec* segments;
+    std::size_t num_segments;
+    // runs from the interrupt handler with ok set; may submit again
+    completion_fn done;
+    void* ctx;
+    bool ok;
+};
+
+// the request's data as at most max physical extents; drivers check that
+// they add up to the whole transfer
+std::size_t request_ranges(const request* req, mem::phys_range* out,
+                           std::size_t max);
+
+class disk;
+struct bio;
+using bio_end_fn = void (*)(bio* b);
+
+// one contiguous run of sectors, read into or written from the pages its
+// vectors point at. owned by the submitter until end_io runs, which
+// happens in softirq context on the CPU that submitted it
+struct bio {
+    uint64_t lba;
+    bool write;
+    const bio_vec* vecs;    // lengths add up to a whole number of sectors
+    std::size_t num_vecs;
+    bio_end_fn end_io;
+    void* ctx;
+    bool ok;
+
+    // the block layer's
+    disk* target;
+    uint32_t sectors;
+    bio* next;
+};
+
+// a driver's entry points. driver is whatever it registered the disk with
+struct disk_ops {
+    // starts req on hardware queue hwq; false if that queue is full
+    bool (*submit)(void* driver, std::size_t hwq, request* req);
+    // reaps completions, for when the caller can't wait for an interrupt
+    void (*poll)(void* driver);
+    // whether hwq has anything outstanding: a refusal from an idle queue
+    // means the request itself is bad
+    bool (*busy)(void* driver, std::size_t hwq);
+};
+
+struct queued_request;
+
+// requests waiting on one CPU for a hardware queue to take them, oldest
+// first. only that CPU touches it, with interrupts off
+struct sw_queue {
+    queued_request* head = nullptr;
+    queued_request* tail = nullptr;
+    // the hardware queue turned the head away for being full
+    bool stalled = false;
+};
+
+// a registered block device. every CPU has a software queue on it, and
+// CPU n feeds hardware queue n % hw_queues()
+class disk {
+public:
+    inline kstd::string_view name() const {
+        return kstd::string_view(m_name);
+    }
+
+    inline uint64_t sectors() const {
+        return m_sectors;
+    }
+
+    inline std::size_t hw_queues() const {
+        return m_hw_queues;
+    }
+
+    // queues b (into the current plug if there is one) and gets what it
+    // can going. a bio that's malformed, out of range or too big for one
+    // request ends with ok false before this returns
+    void submit(bio* b);
+
+    // submit() past any plug, then poll until it's done; returns ok.
+    // takes over b's end_io and ctx
+    bool submit_wait(bio* b);
+
+    // reaps the driver's completions and runs this CPU's
+    void poll();
+
+private:
+    friend disk* register_disk(kstd::string_view, void*, const disk_ops*,
+                               uint64_t, std::size_t, std::size_t, uint32_t);
+    friend class plug;
+    friend void init();
+
+    bool prepare(bio* b);
+    void enqueue(bio* b);
+    void dispatch();
+    bool try_merge(queued_request* rq, bio* b);
+
+    // this CPU's finished requests: ends their bios, recycles them and
+    // retries whatever was waiting for the room
+    static void complete_requests();
+
+    // idle work: retries this CPU's stalled queues. a hardware queue
+    // other CPUs share frees up with no sign of it here, so whoever
+    // frees a slot kicks the idle CPUs
+    static bool redispatch();
+
+    char m_name[16] = { };
+    void* m_driver = nullptr;
+    const disk_ops* m_ops = nullptr;
+    uint64_t m_sectors = 0;
+    std::size_t m_hw_queues = 1;
+    std::size_t m_max_segments = MAX_SEGMENTS;
+    uint32_t m_max_sectors = 0;     // 0: no limit
+    sw_queue m_sw[cpu::MAX_CPUS];
+};
+
+// batches submissions from this CPU while it's alive: bios collect here
+// instead of going out one at a time, and are sorted and merged on the
+// way out. nests; only the outermost one does anything. bios submitted
+// from interrupt or softirq context go around it. nothing orders
+// overlapping bios that are in flight together, here or in the hardware
+class plug {
+public:
+    plug();
+    ~plug();
+
+    plug(const plug&) = delete;
+    plug& operator=(const plug&) = delete;
+
+    // hands everything held so far down to the disks
+    void flush();
+
+private:
+    friend class disk;
+
+    bool m_active = false;
+    bio* m_head = nullptr;
+    bio* m_tail = nullptr;
+    std::size_t m_count = 0;
+};
+
+// registers the completion softirq and the idle retry; before SMP
+void init();
+
+// makes a driver's device available; after SMP bring-up, since the
+// request pools are per CPU. max_segments and max_sectors are what one
+// request may carry (max_sectors 0 for no limit). null if the table is
+// full or memory runs out
+disk* register_disk(kstd::string_view name, void* driver, const disk_ops* ops,
+                    uint64_t sectors, std::size_t hw_queues,
+                    std::size_t max_segments, uint32_t max_sectors);
+
+std::size_t disk_count();
+disk* get_disk(std::size_t i);
+disk* find_disk(kstd::string_view name);
+
+} // namespace blk
@@ -0,0 +1,73 @@
+#include "boot_modules.hpp"
+
+#include "limine.h"
+
+#include "page_table.hpp"
+
+namespace boot {
+
+static module s_modules[MAX_MODULES];
+static std::size_t s_num_modules = 0;
+static module s_kernel_file;
+static bool s_have_kernel_file = false;
+
+static kstd::string_view as_view(const char* s) {
+    return s != nullptr ? kstd::string_view(s) : kstd::string_view();
+}
+
+static module from_file(const limine_file* f) {
+    module m;
+    m.path = as_view(f->path);
+    m.cmdline = as_view(f->cmdline);
+    m.data = (const uint8_t*)f->address;
+    m.phys = (uintptr_t)f->address - mem::hhdm_offset;
+    m.size = f->size;
+    return m;
+}
+
+void init_modules(const limine_module_response* modules,
+                  const limine_kernel_file_response* kernel)
+{
+    s_num_modules = 0;
+    if (modules != nullptr) {
+        for (uint64_t i = 0; i < modules->module_count; i++) {
+            if (s_num_modules == MAX_MODULES)
+                break;
+            s_modules[s_num_modules++] = from_file(modules->modules[i]);
+        }
+    }
+
+    s_have_kernel_file = kernel != nullptr && kernel->kernel_file != nullptr;
+    if (s_have_kernel_file)
+        s_kernel_file = from_file(kernel->kernel_file);
+}
+
+std::size_t module_count() {
+    return s_num_modules;
+}
+
+const module& get_module(std::size_t i) {
+    return s_modules[i];
+}
+
+const module* find_module(kstd::string_view name) {
+    for (std::size_t i = 0; i < s_num_modules; i++) {
+        if (s_modules[i].cmdline == name)
+            return &s_modules[i];
+    }
+    for (std::size_t i = 0; i < s_num_modules; i++) {
+        kstd::string_view path = s_modules[i].path;
+        std::size_t slash = path.rfind('/');
+        if (slash != kstd::string_view::npos)
+            path = path.substr(slash + 1);
+        if (path == name)
+            return &s_modules[i];
+    }
+    return nullptr;
+}
+
+const module* kernel_file() {
+    return s_have_kernel_file ? &s_kernel_file : nullptr;
+}
+
+} // namespace boot
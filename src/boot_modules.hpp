@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/string_view.hpp"
+
+struct limine_module_response;
+struct limine_kernel_file_response;
+
+namespace boot {
+
+#ifdef K_MAX_BOOT_MODULES
+    inline static constexpr std::size_t MAX_MODULES = K_MAX_BOOT_MODULES;
+#else
+    inline static constexpr std::size_t MAX_MODULES = 16;
+#endif
+
+// a file Limine loaded next to the kernel. the memory is never given to
+// the frame allocator, so it stays put for as long as the kernel runs
+// and its frames can be mapped straight into user space
+struct module {
+    kstd::string_view path;
+    kstd::string_view cmdline;
+    const uint8_t* data;        // through the HHDM
+    uintptr_t phys;
+    std::size_t size;
+};
+
+// copies out what the responses describe; after the HHDM offset is known
+void init_modules(const limine_module_response* modules,
+                  const limine_kernel_file_response* kernel);
+
+std::size_t module_count();
+const module& get_module(std::size_t i);
+
+// by cmdline, or failing that by the last component of the path; null if
+// there's no such module
+const module* find_module(kstd::string_view name);
+
+// the kernel's own ELF file, null if the bootloader didn't provide it
+const module* kernel_file();
+
+} // namespace boot
@@ -0,0 +1,197 @@
+#include "boot_profile.hpp"
+
+#include "stdlib/charconv.hpp"
+
+#include "asm_wrappers.hpp"
+#include "console.hpp"
+#include "serial.hpp"
+
+namespace prof {
+
+static boot_phase s_phases[MAX_BOOT_PHASES];
+static std::size_t s_num_phases = 0;
+static uint8_t s_depth = 0;
+static uint64_t s_entry_tsc = 0;
+static uint64_t s_finish_tsc = 0;
+static int64_t s_boot_time = 0;
+
+void boot_profile_start(uint64_t entry_tsc) {
+    s_entry_tsc = entry_tsc;
+    s_num_phases = 0;
+    s_depth = 0;
+}
+
+void set_boot_time(int64_t boot_time) {
+    s_boot_time = boot_time;
+}
+
+int64_t boot_time() {
+    return s_boot_time;
+}
+
+uint64_t entry_tsc() {
+    return s_entry_tsc;
+}
+
+std::size_t phase_begin(kstd::string_view name) {
+    if(s_num_phases == MAX_BOOT_PHASES)
+        return INVALID_PHASE;
+
+    std::size_t i = s_num_phases++;
+    s_phases[i].name = name;
+    s_phases[i].depth = s_depth++;
+    s_phases[i].end_tsc = 0;
+    s_phases[i].start_tsc = rdtsc();
+    return i;
+}
+
+void phase_end(std::size_t phase) {
+    uint64_t now = rdtsc();
+    if(phase >= s_num_phases)
+        return;
+    s_phases[phase].end_tsc = now;
+    s_depth = s_phases[phase].depth;
+}
+
+void boot_profile_finish() {
+    s_finish_tsc = rdtsc();
+}
+
+uint64_t tsc_frequency() {
+    static uint64_t freq = 0;
+    static bool probed = false;
+    if(probed)
+        return freq;
+    probed = true;
+
+    uint32_t max_leaf, ebx, ecx, edx;
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+
+    if(max_leaf >= 0x15) {
+        uint32_t denominator, numerator, crystal_hz;
+        cpuid(0x15, 0, &denominator, &numerator, &crystal_hz, &edx);
+        if(denominator != 0 && numerator != 0 && crystal_hz != 0) {
+            freq = (uint64_t)crystal_hz * numerator / denominator;
+            return freq;
+        }
+    }
+
+    if(max_leaf >= 0x16) {
+        uint32_t base_mhz;
+        cpuid(0x16, 0, &base_mhz, &ebx, &ecx, &edx);
+        freq = (uint64_t)(base_mhz & 0xFFFF) * 1000000;
+    }
+    return freq;
+}
+
+static uint64_t cycles_to_us(uint64_t cycles) {
+    uint64_t freq = tsc_frequency();
+    if(freq < 1000000)
+        return 0;
+    return cycles / (freq / 1000000);
+}
+
+static uint64_t phase_cycles(const boot_phase& p) {
+    return p.end_tsc > p.start_tsc ? p.end_tsc - p.start_tsc : 0;
+}
+
+static kstd::string_view format(char* buf, std::size_t len, uint64_t value) {
+    auto r = kstd::to_chars(buf, buf + len, value);
+    return kstd::string_view(buf, r.ptr - buf);
+}
+
+static void print_row(kstd::string_view name, uint8_t depth, 
+                      uint64_t cycles, uint64_t total) 
+{
+    char buf[24];
+    for(uint8_t i = 0; i < depth; i++)
+        console::print("  ");
+    console::print_padded(name, -(28 - 2 * (int)depth));
+    console::print_padded(format(buf, sizeof(buf), cycles), 16);
+    if(tsc_frequency() != 0)
+        console::print_padded(format(buf, sizeof(buf), cycles_to_us(cycles)), 12);
+    if(total != 0) {
+        uint64_t permille = cycles * 1000 / total;
+        console::print_padded(format(buf, sizeof(buf), permille / 10), 6);
+        console::print(".");
+        console::print(format(buf, sizeof(buf), permille % 10));
+    }
+    console::print("\n");
+}
+
+#ifdef K_BOOT_PROFILE_JSON
+static void json_number(kstd::string_view key, uint64_t value, bool comma = true) {
+    char buf[24];
+    serial::write("\"");
+    serial::write(key);
+    serial::write("\":");
+    serial::write(format(buf, sizeof(buf), value));
+    if(comma)
+        serial::write(",");
+}
+
+static void dump_json() {
+    if(!serial::is_initialized() && !serial::init())
+        return;
+
+    serial::write("{\"boot_profile\":{");
+    json_number("tsc_hz", tsc_frequency());
+    json_number("boot_time", (uint64_t)s_boot_time);
+    json_number("entry_tsc", s_entry_tsc);
+    json_number("kernel_cycles", s_finish_tsc - s_entry_tsc);
+    serial::write("\"phases\":[");
+    for(std::size_t i = 0; i < s_num_phases; i++) {
+        const boot_phase& p = s_phases[i];
+        serial::write(i == 0 ? "{\"name\":\"" : ",{\"name\":\"");
+        serial::write(p.name);
+        serial::write("\",");
+        json_number("depth", p.depth);
+        json_number("start", p.start_tsc - s_entry_tsc);
+        json_number("cycles", phase_cycles(p));
+        json_number("us", cycles_to_us(phase_cycles(p)), false);
+        serial::write("}");
+    }
+    serial::write("]}}\n");
+}
+#endif
+
+void report_boot_profile() {
+    if(s_finish_tsc == 0)
+        boot_profile_finish();
+
+    uint64_t total = s_finish_tsc - s_entry_tsc;
+
+    console::print("\nBoot profile");
+    if(tsc_frequency() != 0) {
+        console::print(" (TSC ");
+        console::print_udec(tsc_frequency() / 1000000);
+        console::print(" MHz)");
+    }
+    if(s_boot_time > 0) {
+        console::print(", boot time ");
+        console::print_dec(s_boot_time);
+    }
+    console::print("\n");
+
+    console::print_padded("phase", -28);
+    console::print_padded("cycles", 16);
+    if(tsc_frequency() != 0)
+        console::print_padded("us", 12);
+    console::print_padded("%", 8);
+    console::print("\n");
+
+    // the TSC counts from reset, so the entry stamp is everything the
+    // firmware and bootloader spent before handing over to us
+    print_row("firmware+bootloader", 0, s_entry_tsc, 0);
+    for(std::size_t i = 0; i < s_num_phases; i++) {
+        const boot_phase& p = s_phases[i];
+        print_row(p.name, p.depth, phase_cycles(p), total);
+    }
+    print_row("kernel total", 0, total, total);
+
+#ifdef K_BOOT_PROFILE_JSON
+    dump_json();
+#endif
+}
+
+} // namespace prof
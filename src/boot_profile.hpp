@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/string_view.hpp"
+
+namespace prof {
+
+#ifdef K_BOOT_PROFILE_MAX_PHASES
+    inline static constexpr std::size_t MAX_BOOT_PHASES = K_BOOT_PROFILE_MAX_PHASES;
+#else
+    inline static constexpr std::size_t MAX_BOOT_PHASES = 32;
+#endif
+
+inline static constexpr std::size_t INVALID_PHASE = MAX_BOOT_PHASES;
+
+struct boot_phase {
+    kstd::string_view name;
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    uint8_t  depth;
+};
+
+// entry_tsc should be sampled as early as possible in _start - everything
+// before it is attributed to firmware and bootloader
+void boot_profile_start(uint64_t entry_tsc);
+
+// unix time reported by Limine, used to label the report and as the
+// realtime clock's starting point
+void set_boot_time(int64_t boot_time);
+int64_t boot_time();
+
+// the TSC passed to boot_profile_start()
+uint64_t entry_tsc();
+
+// phases nest; names must outlive the profile and must not need JSON
+// escaping (string literals, in practice)
+std::size_t phase_begin(kstd::string_view name);
+void phase_end(std::size_t phase);
+
+void boot_profile_finish();
+
+// TSC ticks per second from CPUID leaves 0x15/0x16, 0 if the CPU does not
+// enumerate it (in which case the report only shows cycles)
+uint64_t tsc_frequency();
+
+// table on the console; with K_BOOT_PROFILE_JSON also a single JSON line
+// on COM1 so it can be scraped from `qemu -serial stdio`
+void report_boot_profile();
+
+class scoped_boot_phase {
+public:
+    inline explicit scoped_boot_phase(kstd::string_view name)
+        : m_phase(phase_begin(name))
+    {
+
+    }
+
+    inline ~scoped_boot_phase() {
+        phase_end(m_phase);
+    }
+
+    scoped_boot_phase(const scoped_boot_phase&) = delete;
+    scoped_boot_phase& operator=(const scoped_boot_phase&) = delete;
+
+private:
+    std::size_t m_phase;
+};
+
+} // namespace prof
@@ -0,0 +1,59 @@
+#include "console.hpp"
+
+#include "stdlib/charconv.hpp"
+
+namespace console {
+
+static limine_terminal* s_terminal = nullptr;
+static limine_terminal_write s_write = nullptr;
+
+void init(limine_terminal* terminal, limine_terminal_write write) {
+    s_terminal = terminal;
+    s_write = write;
+}
+
+void print(kstd::string_view s) {
+    if(s_terminal == nullptr || s_write == nullptr)
+        return;
+    s_write(s_terminal, s.data(), s.length());
+}
+
+void print_dec(int64_t value) {
+    char buf[21];
+    auto r = kstd::to_chars(buf, buf + sizeof(buf), value);
+    print(kstd::string_view(buf, r.ptr - buf));
+}
+
+void print_udec(uint64_t value) {
+    char buf[20];
+    auto r = kstd::to_chars(buf, buf + sizeof(buf), value);
+    print(kstd::string_view(buf, r.ptr - buf));
+}
+
+void print_hex(uint64_t value) {
+    char buf[18] = { '0', 'x' };
+    auto r = kstd::to_chars(buf + 2, buf + sizeof(buf), value, 16);
+    print(kstd::string_view(buf, r.ptr - buf));
+}
+
+void print_padded(kstd::string_view s, int width) {
+    bool left = width < 0;
+    std::size_t w = left ? -width : width;
+    std::size_t pad = s.length() < w ? w - s.length() : 0;
+
+    // every terminal write is a trip through the bootloader, so emit the
+    // padding in as few chunks as possible
+    static constexpr kstd::string_view spaces = "                                ";
+
+    if(left)
+        print(s);
+    while(pad > 0) {
+        std::size_t n = pad < spaces.length() ? pad : spaces.length();
+        print(spaces.substr(0, n));
+        pad -= n;
+    }
+    if(!left)
+        print(s);
+}
+
+} // namespace console
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+#include "stdlib/string_view.hpp"
+
+#include "limine.h"
+
+namespace console {
+
+// the Limine terminal is only usable while the bootloader's page tables
+// are active and only from the BSP; anything printed before init() or
+// without a terminal is silently dropped
+void init(limine_terminal* terminal, limine_terminal_write write);
+
+void print(kstd::string_view s);
+void print_dec(int64_t value);
+void print_udec(uint64_t value);
+void print_hex(uint64_t value);
+
+// right-aligns (or left-aligns, for negative widths) s in a field of
+// |width| characters; used for tabular boot reports
+void print_padded(kstd::string_view s, int width);
+
+} // namespace console
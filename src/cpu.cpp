@@ -0,0 +1,155 @@
+#include "stdlib/atomic.hpp"
+
+#include "cpu.hpp"
+
+#include "limine.h"
+
+#include "asm_wrappers.hpp"
+#include "address_space.hpp"
+#include "apic.hpp"
+#include "gdt.hpp"
+#include "idt.hpp"
+#include "rcu.hpp"
+#include "syscall.hpp"
+#include "vdso.hpp"
+
+volatile limine_smp_request smp_request = {
+    .id = LIMINE_SMP_REQUEST,
+    .revision = 0,
+    .response = nullptr,
+    .flags = LIMINE_SMP_X2APIC
+};
+
+namespace cpu {
+
+static cpu_local s_cpus[MAX_CPUS];
+static std::size_t s_num_cpus = 1;
+static cpu_mask s_online_mask;
+static kstd::atomic<std::size_t> s_num_online = 0;
+
+static idle_work s_idle_work[MAX_IDLE_WORK];
+static std::size_t s_num_idle_work = 0;
+// idle CPUs monitor this line, so keep it to itself
+alignas(CACHE_LINE_SIZE) static kstd::atomic<uint64_t> s_idle_generation = 0;
+
+static void set_local(cpu_local& c) {
+    c.self = &c;
+    wrmsr(MSR_GS_BASE, (uint64_t)&c);
+}
+
+void init_bsp() {
+    s_cpus[0].id = 0;
+    s_cpus[0].lapic_id = 0;
+    s_cpus[0].online = true;
+    set_local(s_cpus[0]);
+    s_online_mask.set(0);
+    s_num_online.store(1, kstd::memory_order_relaxed);
+}
+
+static void ap_entry(limine_smp_info* info) {
+    cpu_local& c = *(cpu_local*)info->extra_argument;
+    set_local(c);
+    gdt::init_cpu();
+    idt::load();
+    sys::init_cpu();
+    vdso::init_cpu();
+    apic::init_local();
+    mem::address_space::init_cpu();
+    c.online = true;
+    s_online_mask.set(c.id);
+    s_num_online.fetch_add(1, kstd::memory_order_release);
+    idle_loop();
+}
+
+std::size_t init_smp() {
+    limine_smp_response* r = smp_request.response;
+    if (r == nullptr)
+        return 1;
+
+    // hand out dense ids, BSP first so it keeps id 0
+    std::size_t next = 1;
+    for (uint64_t i = 0; i < r->cpu_count; i++) {
+        limine_smp_info* info = r->cpus[i];
+        if (info->lapic_id == r->bsp_lapic_id) {
+            s_cpus[0].lapic_id = info->lapic_id;
+            continue;
+        }
+        if (next == MAX_CPUS)
+            break;
+
+        cpu_local& c = s_cpus[next];
+        c.id = next++;
+        c.lapic_id = info->lapic_id;
+        info->extra_argument = (uint64_t)&c;
+        // the write to goto_address is what releases the AP
+        __atomic_store_n(&info->goto_address, &ap_entry, __ATOMIC_RELEASE);
+    }
+    s_num_cpus = next;
+
+    while (s_num_online.load(kstd::memory_order_acquire) != s_num_cpus)
+        cpu_relax();
+    return s_num_cpus;
+}
+
+std::size_t count() {
+    return s_num_cpus;
+}
+
+cpu_local& get(std::size_t id) {
+    return s_cpus[id];
+}
+
+const cpu_mask& online_mask() {
+    return s_online_mask;
+}
+
+bool register_idle_work(idle_work work) {
+    if (s_num_idle_work == MAX_IDLE_WORK)
+        return false;
+    s_idle_work[s_num_idle_work++] = work;
+    return true;
+}
+
+void kick_idle() {
+    s_idle_generation.fetch_add(1, kstd::memory_order_release);
+}
+
+static bool has_mwait() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1u << 3)) != 0;
+}
+
+NO_RETURN void idle_loop() {
+    const bool mwait_ok = has_mwait();
+
+    for (;;) {
+        // sample before running the work, so a kick that lands while it
+        // runs isn't slept through
+        uint64_t gen = s_idle_generation.load(kstd::memory_order_acquire);
+
+        bool busy = false;
+        for (std::size_t i = 0; i < s_num_idle_work; i++)
+            busy |= s_idle_work[i]();
+        if (busy)
+            continue;
+
+        // sleep with interrupts on so IPIs get through; sti only takes
+        // effect after the next instruction, so nothing can slip in
+        // between the check and mwait
+        rcu::idle_enter();
+        if (mwait_ok) {
+            monitor(&s_idle_generation);
+            if (s_idle_generation.load(kstd::memory_order_acquire) == gen)
+                __asm__ volatile("sti\n\tmwait\n\t" :: "a"(0), "c"(0) : "memory");
+        } else {
+            sti();
+            while (s_idle_generation.load(kstd::memory_order_acquire) == gen)
+                cpu_relax();
+        }
+        cli();
+        rcu::idle_exit();
+    }
+}
+
+} // namespace cpu
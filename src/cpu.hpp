@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/new.hpp"
+
+#ifndef NO_RETURN
+#   define NO_RETURN [[noreturn]]
+#endif
+
+namespace cpu {
+
+#ifdef K_MAX_CPUS
+    inline static constexpr std::size_t MAX_CPUS = K_MAX_CPUS;
+#else
+    inline static constexpr std::size_t MAX_CPUS = 64;
+#endif
+
+inline static constexpr std::size_t CACHE_LINE_SIZE = 
+    kstd::hardware_destructive_interference_size;
+
+inline static constexpr uint32_t MSR_GS_BASE        = 0xC0000101;
+inline static constexpr uint32_t MSR_KERNEL_GS_BASE = 0xC0000102;
+
+// offsets of the cpu_local fields the assembly entry paths use, as plain
+// macros so they can be pasted into asm strings
+#define CPU_LOCAL_KERNEL_RSP 32
+#define CPU_LOCAL_USER_RSP   40
+#define CPU_LOCAL_EXIT_RSP   48
+
+// per-CPU data, reached through the GS base so that finding it costs a
+// single segment-relative load instead of an APIC id lookup
+struct alignas(CACHE_LINE_SIZE) cpu_local {
+    cpu_local* self;     // must stay first - current() reads %gs:0
+    uint32_t   id;       // dense, 0 is the BSP
+    uint32_t   lapic_id;
+    bool       online;
+
+    // interrupt/softirq bookkeeping, see softirq.hpp. pending is set by
+    // other CPUs too, so it's only touched through __atomic builtins
+    uint32_t   softirq_pending;
+    uint32_t   irq_depth;
+    bool       in_softirq;
+
+    // user mode entry/exit, see syscall.cpp
+    uint64_t   kernel_rsp; // stack SYSCALL switches to
+    uint64_t   user_rsp;   // scratch while switching
+    uint64_t   exit_rsp;   // enter_user()'s frame, for SYS_EXIT
+};
+
+static_assert(offsetof(cpu_local, kernel_rsp) == CPU_LOCAL_KERNEL_RSP);
+static_assert(offsetof(cpu_local, user_rsp) == CPU_LOCAL_USER_RSP);
+static_assert(offsetof(cpu_local, exit_rsp) == CPU_LOCAL_EXIT_RSP);
+
+// set of CPUs by dense id. bits are flipped with atomic RMWs so CPUs can
+// add and remove themselves concurrently; reads are a snapshot
+struct cpu_mask {
+    inline static constexpr std::size_t WORDS = (MAX_CPUS + 63) / 64;
+
+    uint64_t words[WORDS] = { };
+
+    inline void set(std::size_t cpu) {
+        __atomic_fetch_or(&words[cpu / 64], 1ull << (cpu % 64), 
+                          __ATOMIC_SEQ_CST);
+    }
+
+    inline void clear(std::size_t cpu) {
+        __atomic_fetch_and(&words[cpu / 64], ~(1ull << (cpu % 64)), 
+                           __ATOMIC_SEQ_CST);
+    }
+
+    inline bool test(std::size_t cpu) const {
+        return (__atomic_load_n(&words[cpu / 64], __ATOMIC_ACQUIRE) >> 
+                (cpu % 64)) & 1;
+    }
+
+    inline uint64_t word(std::size_t i) const {
+        return __atomic_load_n(&words[i], __ATOMIC_ACQUIRE);
+    }
+};
+
+// points the BSP's GS base at its cpu_local; must run before anything
+// calls id() or current()
+void init_bsp();
+
+// starts the APs Limine parked for us and waits for them to check in
+// returns the number of CPUs online, BSP included
+std::size_t init_smp();
+
+std::size_t count();
+cpu_local& get(std::size_t id);
+const cpu_mask& online_mask();
+
+// background work for CPUs with nothing better to do. returns true if
+// it did something, in which case the idle loop calls round again
+using idle_work = bool (*)();
+
+inline static constexpr std::size_t MAX_IDLE_WORK = 8;
+
+// must happen before the APs are started
+bool register_idle_work(idle_work work);
+
+// wakes idle CPUs to run their idle work; cheap enough for fault paths
+void kick_idle();
+
+// runs idle work until there is none, then sleeps - in mwait where the
+// CPU has it - until kick_idle()
+NO_RETURN void idle_loop();
+
+inline cpu_local& current() {
+    cpu_local* p;
+    __asm__ volatile("movq %%gs:0, %0\n\t" : "=r"(p));
+    return *p;
+}
+
+inline uint32_t id() {
+    uint32_t v;
+    __asm__ volatile("movl %%gs:%c1, %0\n\t" 
+                     : "=r"(v) 
+                     : "i"(offsetof(cpu_local, id)));
+    return v;
+}
+
+} // namespace cpu
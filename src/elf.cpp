@@ -0,0 +1,324 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/sync.hpp"
+
+#include "elf.hpp"
+
+#include "zero_pool.hpp"
+
+namespace elf {
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+
+inline static constexpr uintptr_t page_floor(uintptr_t v) {
+    return v & ~(PAGE_SIZE - 1);
+}
+
+inline static constexpr uintptr_t page_ceil(uintptr_t v) {
+    return (v + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static bool valid_header(const boot::module& m) {
+    if (m.size < sizeof(elf64_ehdr))
+        return false;
+    const elf64_ehdr* eh = (const elf64_ehdr*)m.data;
+    if (eh->e_ident[0] != 0x7F || eh->e_ident[1] != 'E' ||
+        eh->e_ident[2] != 'L' || eh->e_ident[3] != 'F')
+        return false;
+    // 64-bit, little-endian
+    if (eh->e_ident[4] != 2 || eh->e_ident[5] != 1)
+        return false;
+    if ((eh->e_type != ET_EXEC && eh->e_type != ET_DYN) ||
+        eh->e_machine != EM_X86_64)
+        return false;
+    if (eh->e_phentsize != sizeof(elf64_phdr) || eh->e_phoff > m.size ||
+        (uint64_t)eh->e_phnum * sizeof(elf64_phdr) > m.size - eh->e_phoff)
+        return false;
+    return true;
+}
+
+static const elf64_phdr* phdrs(const boot::module& m) {
+    return (const elf64_phdr*)(m.data + ((const elf64_ehdr*)m.data)->e_phoff);
+}
+
+static bool valid_load(const boot::module& m, const elf64_phdr& ph,
+                       uintptr_t bias)
+{
+    if (ph.p_filesz > ph.p_memsz || ph.p_offset > m.size ||
+        ph.p_filesz > m.size - ph.p_offset)
+        return false;
+    // file offsets and addresses have to agree within a page, or no page
+    // of the file could be mapped as it is
+    if ((ph.p_vaddr & (PAGE_SIZE - 1)) != (ph.p_offset & (PAGE_SIZE - 1)))
+        return false;
+    uintptr_t start = ph.p_vaddr + bias;
+    return start >= ph.p_vaddr && ph.p_memsz <= mem::USER_SPACE_END &&
+           start <= mem::USER_SPACE_END - ph.p_memsz && ph.p_memsz != 0;
+}
+
+// where an (unbiased) address in a loaded segment comes from in the file
+static bool file_offset(const boot::module& m, uint64_t vaddr,
+                        uint64_t* offset)
+{
+    const elf64_phdr* ph = phdrs(m);
+    for (uint16_t i = 0; i < ((const elf64_ehdr*)m.data)->e_phnum; i++) {
+        if (ph[i].p_type != PT_LOAD)
+            continue;
+        if (vaddr >= ph[i].p_vaddr && vaddr - ph[i].p_vaddr < ph[i].p_filesz) {
+            *offset = ph[i].p_offset + (vaddr - ph[i].p_vaddr);
+            return true;
+        }
+    }
+    return false;
+}
+
+image* image::create(const boot::module& m) {
+    if (!valid_header(m))
+        return nullptr;
+
+    const elf64_ehdr* eh = (const elf64_ehdr*)m.data;
+    const elf64_phdr* ph = phdrs(m);
+    uintptr_t bias = eh->e_type == ET_DYN ? PIE_BASE : 0;
+
+    // segments come sorted; insisting that they don't share pages keeps
+    // the page list sorted and every page's permissions unambiguous
+    std::size_t num_pages = 0;
+    uintptr_t prev_end = 0;
+    const elf64_phdr* dynamic = nullptr;
+    for (uint16_t i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type == PT_DYNAMIC)
+            dynamic = &ph[i];
+        if (ph[i].p_type != PT_LOAD)
+            continue;
+        if (!valid_load(m, ph[i], bias))
+            return nullptr;
+        uintptr_t start = page_floor(ph[i].p_vaddr + bias);
+        uintptr_t end = page_ceil(ph[i].p_vaddr + bias + ph[i].p_memsz);
+        if (start < prev_end)
+            return nullptr;
+        prev_end = end;
+        num_pages += (end - start) / PAGE_SIZE;
+    }
+    if (num_pages == 0 || eh->e_entry + bias >= mem::USER_SPACE_END)
+        return nullptr;
+
+    image* img = new image();
+    if (img == nullptr)
+        return nullptr;
+    img->m_pages = new image_page[num_pages];
+    if (img->m_pages == nullptr) {
+        delete img;
+        return nullptr;
+    }
+    img->m_entry = eh->e_entry + bias;
+
+    for (uint16_t i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type != PT_LOAD)
+            continue;
+
+        uintptr_t vaddr = ph[i].p_vaddr + bias;
+        uintptr_t file_end = vaddr + ph[i].p_filesz;
+        uint64_t flags = mem::PTE_PINNED;
+        if (ph[i].p_flags & PF_W)
+            flags |= mem::PTE_COW;
+        if ((ph[i].p_flags & PF_X) == 0)
+            flags |= mem::PTE_NX;
+
+        for (uintptr_t p = page_floor(vaddr); p < vaddr + ph[i].p_memsz;
+             p += PAGE_SIZE)
+        {
+            image_page& page = img->m_pages[img->m_num_pages++];
+            page.virt = p;
+            page.flags = flags;
+            page.owned = false;
+
+            uintptr_t frame = m.phys + ph[i].p_offset + (p - vaddr);
+            if (p >= vaddr && p + PAGE_SIZE <= file_end &&
+                (frame & (PAGE_SIZE - 1)) == 0) {
+                page.frame = frame;
+                continue;
+            }
+            if (p >= file_end) {
+                page.frame = pt->zero_page();
+                continue;
+            }
+
+            // the page has file data and something else: bss, or the
+            // neighbouring bytes of the file that aren't ours to show
+            mem::page_table::physical_address copy = mem::alloc_zeroed_frame();
+            if (IS_NULL(copy)) {
+                img->release();
+                return nullptr;
+            }
+            page.frame = copy;
+            page.owned = true;
+            uintptr_t from = p < vaddr ? vaddr : p;
+            uintptr_t to = p + PAGE_SIZE < file_end ? p + PAGE_SIZE : file_end;
+            memcpy((uint8_t*)mem::phys_to_virt(copy) + (from - p),
+                   m.data + ph[i].p_offset + (from - vaddr), to - from);
+        }
+    }
+
+    if (dynamic != nullptr && !img->relocate(m, dynamic, bias)) {
+        img->release();
+        return nullptr;
+    }
+    return img;
+}
+
+void image::release() {
+    for (std::size_t i = 0; i < m_num_pages; i++) {
+        if (m_pages[i].owned)
+            pt->free_frame(m_pages[i].frame);
+    }
+    delete[] m_pages;
+    delete this;
+}
+
+// the page holding virt, given a frame of the image's own so it can be
+// written without touching the module
+image_page* image::private_page(uintptr_t virt) {
+    uintptr_t p = page_floor(virt);
+    std::size_t lo = 0, hi = m_num_pages;
+    while (lo < hi) {
+        std::size_t mid = lo + (hi - lo) / 2;
+        if (m_pages[mid].virt < p)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == m_num_pages || m_pages[lo].virt != p)
+        return nullptr;
+
+    image_page& page = m_pages[lo];
+    if (!page.owned) {
+        mem::page_table::physical_address copy = pt->alloc_frame();
+        if (IS_NULL(copy))
+            return nullptr;
+        memcpy(mem::phys_to_virt(copy), mem::phys_to_virt(page.frame),
+               PAGE_SIZE);
+        page.frame = copy;
+        page.owned = true;
+    }
+    return &page;
+}
+
+bool image::write_user(uintptr_t virt, const void* src, std::size_t n) {
+    const uint8_t* s = (const uint8_t*)src;
+    while (n != 0) {
+        image_page* page = private_page(virt);
+        if (page == nullptr)
+            return false;
+        std::size_t off = virt - page->virt;
+        std::size_t chunk = PAGE_SIZE - off < n ? PAGE_SIZE - off : n;
+        memcpy((uint8_t*)mem::phys_to_virt(page->frame) + off, s, chunk);
+        virt += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+// done once, here, rather than per instance: all instances share the
+// base, so they'd all compute the same values. only what a static PIE
+// needs is supported; anything wanting symbol lookup is refused
+bool image::relocate(const boot::module& m, const elf64_phdr* dynamic,
+                     uintptr_t bias)
+{
+    if (dynamic->p_offset > m.size || dynamic->p_filesz > m.size - dynamic->p_offset)
+        return false;
+
+    const elf64_dyn* dyn = (const elf64_dyn*)(m.data + dynamic->p_offset);
+    std::size_t num_dyn = dynamic->p_filesz / sizeof(elf64_dyn);
+    uint64_t rela = 0, rela_size = 0, rela_ent = sizeof(elf64_rela);
+    for (std::size_t i = 0; i < num_dyn && dyn[i].d_tag != DT_NULL; i++) {
+        switch (dyn[i].d_tag) {
+        case DT_RELA:    rela = dyn[i].d_val;      break;
+        case DT_RELASZ:  rela_size = dyn[i].d_val; break;
+        case DT_RELAENT: rela_ent = dyn[i].d_val;  break;
+        default: break;
+        }
+    }
+    if (rela_size == 0)
+        return true;
+
+    uint64_t offset;
+    if (rela_ent != sizeof(elf64_rela) || !file_offset(m, rela, &offset) ||
+        rela_size > m.size - offset)
+        return false;
+
+    const elf64_rela* r = (const elf64_rela*)(m.data + offset);
+    for (std::size_t i = 0; i < rela_size / sizeof(elf64_rela); i++) {
+        uint32_t type = (uint32_t)r[i].r_info;
+        if (type == R_X86_64_NONE)
+            continue;
+        if (type != R_X86_64_RELATIVE)
+            return false;
+        uint64_t value = bias + r[i].r_addend;
+        if (!write_user(bias + r[i].r_offset, &value, sizeof(value)))
+            return false;
+    }
+    return true;
+}
+
+bool image::map_into(mem::address_space* as) const {
+    for (std::size_t i = 0; i < m_num_pages; i++) {
+        if (!as->map(m_pages[i].virt, m_pages[i].frame, m_pages[i].flags))
+            return false;
+    }
+    return true;
+}
+
+struct cached_image {
+    const boot::module* module;
+    image* img;
+};
+
+// images live as long as the kernel: modules never go away, and instances
+// map their frames without counting them
+static cached_image s_images[boot::MAX_MODULES + 1];
+static std::size_t s_num_images = 0;
+static kstd::ticket_lock s_images_lock;
+
+const image* image_for(const boot::module& m) {
+    kstd::lock_guard guard(s_images_lock);
+    for (std::size_t i = 0; i < s_num_images; i++) {
+        if (s_images[i].module == &m)
+            return s_images[i].img;
+    }
+    if (s_num_images == boot::MAX_MODULES + 1)
+        return nullptr;
+
+    image* img = image::create(m);
+    if (img != nullptr)
+        s_images[s_num_images++] = { &m, img };
+    return img;
+}
+
+mem::address_space* spawn(const boot::module& m, uintptr_t* entry,
+                          uintptr_t* stack_top)
+{
+    const image* img = image_for(m);
+    if (img == nullptr)
+        return nullptr;
+
+    mem::address_space* as = mem::address_space::create();
+    if (as == nullptr)
+        return nullptr;
+    if (!img->map_into(as)) {
+        as->destroy();
+        return nullptr;
+    }
+    for (std::size_t i = 1; i <= USER_STACK_PAGES; i++) {
+        if (!as->map(USER_STACK_TOP - i * PAGE_SIZE, pt->zero_page(),
+                     mem::PTE_COW | mem::PTE_NX)) {
+            as->destroy();
+            return nullptr;
+        }
+    }
+
+    *entry = img->entry();
+    *stack_top = USER_STACK_TOP;
+    return as;
+}
+
+} // namespace elf
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "address_space.hpp"
+#include "boot_modules.hpp"
+
+namespace elf {
+
+inline static constexpr uint16_t ET_EXEC = 2;
+inline static constexpr uint16_t ET_DYN  = 3;
+inline static constexpr uint16_t EM_X86_64 = 62;
+
+inline static constexpr uint32_t PT_LOAD    = 1;
+inline static constexpr uint32_t PT_DYNAMIC = 2;
+
+inline static constexpr uint32_t PF_X = 1;
+inline static constexpr uint32_t PF_W = 2;
+
+inline static constexpr int64_t DT_NULL    = 0;
+inline static constexpr int64_t DT_RELA    = 7;
+inline static constexpr int64_t DT_RELASZ  = 8;
+inline static constexpr int64_t DT_RELAENT = 9;
+
+inline static constexpr uint32_t R_X86_64_NONE     = 0;
+inline static constexpr uint32_t R_X86_64_RELATIVE = 8;
+
+struct elf64_ehdr {
+    uint8_t  e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+};
+
+struct elf64_phdr {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+};
+
+struct elf64_dyn {
+    int64_t  d_tag;
+    uint64_t d_val;
+};
+
+struct elf64_rela {
+    uint64_t r_offset;
+    uint64_t r_info;
+    int64_t  r_addend;
+};
+
+// where position-independent executables go. every instance of one is
+// loaded at the same base, which is what lets their relocated pages be
+// shared
+inline static constexpr uintptr_t PIE_BASE = 0x400000;
+
+inline static constexpr uintptr_t USER_STACK_TOP = 0x00007FFFFFFE0000;
+#ifdef K_USER_STACK_PAGES
+    inline static constexpr std::size_t USER_STACK_PAGES = K_USER_STACK_PAGES;
+#else
+    inline static constexpr std::size_t USER_STACK_PAGES = 16;
+#endif
+
+// a user page as every instance of the image starts out with it
+struct image_page {
+    uintptr_t virt;
+    uintptr_t frame;
+    uint64_t flags;
+    bool owned;     // frame allocated for the image rather than the module's
+};
+
+// a module's executable, prepared once and then mapped into any number of
+// address spaces without copying. pages that read straight from the file
+// map the module's own frames; only pages that relocations write to or
+// that straddle the end of the file data get a frame of their own, and
+// that frame is shared by every instance too. writable pages go in copy
+// on write, so an instance only pays for what it writes
+class image {
+public:
+    // parses and relocates; null if the module isn't a loadable static
+    // x86_64 executable or memory runs out
+    static image* create(const boot::module& m);
+
+    // maps every page at its address; fails if any of them is taken
+    bool map_into(mem::address_space* as) const;
+
+    inline uintptr_t entry() const {
+        return m_entry;
+    }
+
+private:
+    image() = default;
+
+    // frees a half-built image
+    void release();
+
+    image_page* private_page(uintptr_t virt);
+    bool write_user(uintptr_t virt, const void* src, std::size_t n);
+    bool relocate(const boot::module& m, const elf64_phdr* dynamic, uintptr_t bias);
+
+    image_page* m_pages = nullptr;
+    std::size_t m_num_pages = 0;
+    uintptr_t m_entry = 0;
+};
+
+// the image for a module, built the first time it's asked for
+const image* image_for(const boot::module& m);
+
+// a fresh address space running the module: its image plus a stack of
+// USER_STACK_PAGES, all zero-page until touched. null on failure
+mem::address_space* spawn(const boot::module& m, uintptr_t* entry,
+                          uintptr_t* stack_top);
+
+} // namespace elf
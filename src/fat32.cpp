@@ -0,0 +1,486 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/new.hpp"
+
+#include "fat32.hpp"
+
+namespace fat {
+
+// C12A7328-F81F-11D2-BA4B-00A0C93EC93B as it's laid out on disk
+static const uint8_t ESP_TYPE_GUID[16] = {
+    0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+    0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B
+};
+
+inline static constexpr uint8_t MBR_TYPE_FAT32     = 0x0B;
+inline static constexpr uint8_t MBR_TYPE_FAT32_LBA = 0x0C;
+inline static constexpr uint8_t MBR_TYPE_ESP       = 0xEF;
+
+// where the 13 UCS-2 characters of a long name entry sit
+static const uint8_t LFN_OFFSETS[13] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+
+static volume* s_boot_volume = nullptr;
+
+static inline uint16_t rd16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t rd32(const uint8_t* p) {
+    return (uint32_t)rd16(p) | ((uint32_t)rd16(p + 2) << 16);
+}
+
+static inline uint64_t rd64(const uint8_t* p) {
+    return (uint64_t)rd32(p) | ((uint64_t)rd32(p + 4) << 32);
+}
+
+static inline char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+static bool name_equal(kstd::string_view a, const char* b) {
+    std::size_t i = 0;
+    for (; i < a.size(); i++) {
+        if (b[i] == '\0' || lower(a[i]) != lower(b[i]))
+            return false;
+    }
+    return b[i] == '\0';
+}
+
+static uint64_t map_file(void* owner, uint64_t sector, bool) {
+    return ((const file*)owner)->map(sector);
+}
+
+static const cache::object_ops s_file_ops = { &map_file };
+
+file::file(volume* v, uint32_t first_cluster, bool directory, uint64_t size)
+    : m_volume(v), m_first_cluster(first_cluster), m_directory(directory),
+      m_cache(v->m_disk, &s_file_ops, this, size)
+{
+}
+
+file::~file() {
+    delete[] m_extents;
+}
+
+bool file::build_extents() {
+    if (m_first_cluster == 0) {
+        m_cache.set_size(0);
+        return true;
+    }
+
+    uint32_t cluster_size = m_volume->cluster_size();
+    std::size_t capacity = 0;
+    uint32_t cluster = m_first_cluster;
+    uint32_t logical = 0;
+    for (;;) {
+        // a chain longer than the volume loops
+        if (cluster < 2 || cluster >= m_volume->m_cluster_count + 2 ||
+            logical > m_volume->m_cluster_count)
+            return false;
+
+        extent* last = m_num_extents != 0 ? &m_extents[m_num_extents - 1]
+                                          : nullptr;
+        if (last != nullptr && last->disk_cluster + last->count == cluster) {
+            last->count++;
+        } else {
+            if (m_num_extents == capacity) {
+                std::size_t grown = capacity != 0 ? capacity * 2 : 4;
+                extent* e = new extent[grown];
+                if (e == nullptr)
+                    return false;
+                if (m_num_extents != 0)
+                    memcpy(e, m_extents, m_num_extents * sizeof(extent));
+                delete[] m_extents;
+                m_extents = e;
+                capacity = grown;
+            }
+            m_extents[m_num_extents++] = { logical, cluster, 1 };
+        }
+        logical++;
+
+        // a file's chain only matters as far as its size
+        if (!m_directory && (uint64_t)logical * cluster_size >= size())
+            break;
+        uint32_t next = m_volume->next_cluster(cluster);
+        if (next >= CLUSTER_END)
+            break;
+        cluster = next;
+    }
+
+    uint64_t chain = (uint64_t)logical * cluster_size;
+    if (m_directory || chain < size())
+        m_cache.set_size(chain);
+    return true;
+}
+
+uint64_t file::map(uint64_t sector) const {
+    uint32_t spc = m_volume->m_sectors_per_cluster;
+    uint64_t cluster = sector / spc;
+
+    std::size_t lo = 0, hi = m_num_extents;
+    while (lo < hi) {
+        std::size_t mid = (lo + hi) / 2;
+        if ((uint64_t)m_extents[mid].file_cluster + m_extents[mid].count <= cluster)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == m_num_extents || m_extents[lo].file_cluster > cluster)
+        return cache::NO_BLOCK;
+    const extent& e = m_extents[lo];
+    return m_volume->cluster_sector(e.disk_cluster +
+                                    (uint32_t)(cluster - e.file_cluster)) +
+           sector % spc;
+}
+
+static uint8_t short_name_checksum(const uint8_t* name) {
+    uint8_t sum = 0;
+    for (unsigned i = 0; i < 11; i++)
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+    return sum;
+}
+
+// "NAME.EXT" from the padded 8.3 form, in lower case where the entry's
+// NT flags ask for it
+static void short_name(const uint8_t* e, char* out) {
+    bool lower_base = (e[12] & 0x08) != 0;
+    bool lower_ext = (e[12] & 0x10) != 0;
+    std::size_t n = 0;
+    for (unsigned i = 0; i < 8 && e[i] != ' '; i++) {
+        char c = (i == 0 && e[i] == 0x05) ? (char)0xE5 : (char)e[i];
+        out[n++] = lower_base ? lower(c) : c;
+    }
+    if (e[8] != ' ') {
+        out[n++] = '.';
+        for (unsigned i = 8; i < 11 && e[i] != ' '; i++)
+            out[n++] = lower_ext ? lower((char)e[i]) : (char)e[i];
+    }
+    out[n] = '\0';
+}
+
+bool file::read_dir(std::size_t* cookie, dir_entry* out) {
+    if (!m_directory)
+        return false;
+
+    // long names come as entries ahead of their short one, last part
+    // first; non-ASCII characters come out as '?'
+    char lfn[20 * 13 + 1];
+    bool have_lfn = false;
+    uint8_t lfn_sum = 0;
+    for (;; (*cookie)++) {
+        uint8_t e[32];
+        if (read((uint64_t)*cookie * 32, e, 32) != 32 || e[0] == 0x00)
+            return false;
+        if (e[0] == 0xE5) {
+            have_lfn = false;
+            continue;
+        }
+
+        if ((e[11] & 0x3F) == ATTR_LFN) {
+            unsigned seq = e[0] & 0x1F;
+            if (e[0] & 0x40) {
+                memset(lfn, 0, sizeof(lfn));
+                have_lfn = true;
+                lfn_sum = e[13];
+            }
+            if (!have_lfn || seq == 0 || seq > 20 || e[13] != lfn_sum) {
+                have_lfn = false;
+                continue;
+            }
+            for (unsigned i = 0; i < 13; i++) {
+                uint16_t c = rd16(e + LFN_OFFSETS[i]);
+                if (c == 0x0000 || c == 0xFFFF)
+                    break;
+                lfn[(seq - 1) * 13 + i] = c < 0x80 ? (char)c : '?';
+            }
+            continue;
+        }
+        if (e[11] & ATTR_VOLUME_ID) {
+            have_lfn = false;
+            continue;
+        }
+
+        if (have_lfn && short_name_checksum(e) == lfn_sum && lfn[0] != '\0') {
+            std::size_t n = 0;
+            while (n < MAX_NAME && lfn[n] != '\0')
+                n++;
+            memcpy(out->name, lfn, n);
+            out->name[n] = '\0';
+        } else {
+            short_name(e, out->name);
+        }
+        out->attributes = e[11];
+        out->first_cluster = (((uint32_t)rd16(e + 20) << 16) | rd16(e + 26)) &
+                             CLUSTER_MASK;
+        out->size = rd32(e + 28);
+        out->index = *cookie;
+        (*cookie)++;
+        return true;
+    }
+}
+
+bool file::find(kstd::string_view name, dir_entry* out) {
+    std::size_t cookie = 0;
+    while (read_dir(&cookie, out)) {
+        if (name_equal(name, out->name))
+            return true;
+    }
+    return false;
+}
+
+uint64_t volume::cluster_sector(uint32_t cluster) const {
+    return m_data_sector + (uint64_t)(cluster - 2) * m_sectors_per_cluster;
+}
+
+uint32_t volume::next_cluster(uint32_t cluster) {
+    if (cluster < 2 || cluster >= m_cluster_count + 2)
+        return CLUSTER_BAD;
+    uint8_t entry[4];
+    uint64_t pos = m_fat_sector * blk::SECTOR_SIZE + (uint64_t)cluster * 4;
+    if (m_raw->read(pos, entry, 4) != 4)
+        return CLUSTER_BAD;
+    return rd32(entry) & CLUSTER_MASK;
+}
+
+volume* volume::mount(blk::disk* d, uint64_t first_sector) {
+    cache::object* raw = cache::disk_object(d);
+    if (raw == nullptr)
+        return nullptr;
+    uint8_t bs[blk::SECTOR_SIZE];
+    if (raw->read(first_sector * blk::SECTOR_SIZE, bs, sizeof(bs)) != sizeof(bs))
+        return nullptr;
+
+    uint16_t bytes_per_sector = rd16(bs + 11);
+    uint8_t spc = bs[13];
+    uint16_t reserved = rd16(bs + 14);
+    uint8_t num_fats = bs[16];
+    uint16_t root_entries = rd16(bs + 17);
+    uint32_t total = rd16(bs + 19) != 0 ? rd16(bs + 19) : rd32(bs + 32);
+    uint32_t fat_size = rd32(bs + 36);
+    uint32_t root_cluster = rd32(bs + 44);
+
+    // FAT32 in particular: no fixed root directory and no 16-bit FAT size
+    if (rd16(bs + 510) != 0xAA55 || bytes_per_sector != blk::SECTOR_SIZE ||
+        spc == 0 || (spc & (spc - 1)) != 0 || reserved == 0 ||
+        num_fats == 0 || root_entries != 0 || rd16(bs + 22) != 0 ||
+        fat_size == 0)
+        return nullptr;
+    uint64_t data = reserved + (uint64_t)num_fats * fat_size;
+    if (total <= data)
+        return nullptr;
+
+    volume* v = new volume();
+    if (v == nullptr)
+        return nullptr;
+    v->m_disk = d;
+    v->m_raw = raw;
+    v->m_first_sector = first_sector;
+    v->m_sectors_per_cluster = spc;
+    v->m_fat_sector = first_sector + reserved;
+    v->m_data_sector = first_sector + data;
+    v->m_cluster_count = (uint32_t)((total - data) / spc);
+    // and no more than the FAT has entries for
+    uint64_t fat_entries = (uint64_t)fat_size * blk::SECTOR_SIZE / 4;
+    if (v->m_cluster_count > fat_entries - 2)
+        v->m_cluster_count = (uint32_t)(fat_entries - 2);
+    v->m_root_cluster = root_cluster;
+
+    file* root = new file(v, root_cluster, true, 0);
+    if (root == nullptr || !root->build_extents() ||
+        !v->m_files.insert(root_cluster, root))
+    {
+        delete root;
+        delete v;
+        return nullptr;
+    }
+    root->m_key = root_cluster;
+    v->m_root = root;
+    return v;
+}
+
+file* volume::open(const dir_entry& e, uint32_t dir_cluster) {
+    // ".." of a top-level directory
+    if (e.directory() && e.first_cluster == 0)
+        return m_root;
+
+    // files share by cluster; empty ones have none and go by where
+    // their entry is
+    uint64_t key = e.first_cluster != 0
+                 ? e.first_cluster
+                 : (1ull << 63) | ((uint64_t)dir_cluster << 24) |
+                   (e.index & 0xFFFFFF);
+    {
+        kstd::lock_guard guard(m_lock);
+        file* f = m_files.lookup(key);
+        if (f != nullptr)
+            return f;
+    }
+
+    // the chain walk reads the FAT, so it happens unlocked; whoever
+    // loses a race to open the same file throws theirs away
+    file* f = new file(this, e.first_cluster, e.directory(),
+                       e.directory() ? 0 : e.size);
+    if (f == nullptr)
+        return nullptr;
+    f->m_key = key;
+    if (!f->build_extents()) {
+        delete f;
+        return nullptr;
+    }
+
+    kstd::lock_guard guard(m_lock);
+    file* other = m_files.lookup(key);
+    if (other != nullptr || !m_files.insert(key, f)) {
+        delete f;
+        return other;
+    }
+    return f;
+}
+
+file* volume::open(kstd::string_view path) {
+    file* f = m_root;
+    std::size_t pos = 0;
+    while (pos < path.size()) {
+        std::size_t end = pos;
+        while (end < path.size() && path[end] != '/')
+            end++;
+        if (end != pos) {
+            if (!f->directory())
+                return nullptr;
+            dir_entry e;
+            if (!f->find(path.substr(pos, end - pos), &e))
+                return nullptr;
+            f = open(e, f->first_cluster());
+            if (f == nullptr)
+                return nullptr;
+        }
+        pos = end + 1;
+    }
+    return f;
+}
+
+// the ESP's first sector: from the GPT if there is one, then the MBR,
+// and otherwise sector 0 in case the disk is one bare filesystem
+static bool find_esp(blk::disk* d, uint64_t* first) {
+    cache::object* raw = cache::disk_object(d);
+    if (raw == nullptr)
+        return false;
+
+    uint8_t sector[blk::SECTOR_SIZE];
+    if (raw->read(blk::SECTOR_SIZE, sector, sizeof(sector)) == sizeof(sector) &&
+        memcmp(sector, "EFI PART", 8) == 0)
+    {
+        uint64_t entries = rd64(sector + 72);
+        uint32_t count = rd32(sector + 80);
+        uint32_t entry_size = rd32(sector + 84);
+        if (entry_size < 128 || count > 256)
+            return false;
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t entry[128];
+            uint64_t pos = entries * blk::SECTOR_SIZE + (uint64_t)i * entry_size;
+            if (raw->read(pos, entry, sizeof(entry)) != sizeof(entry))
+                return false;
+            if (memcmp(entry, ESP_TYPE_GUID, 16) == 0) {
+                *first = rd64(entry + 32);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (raw->read(0, sector, sizeof(sector)) != sizeof(sector))
+        return false;
+    if (rd16(sector + 510) == 0xAA55) {
+        for (unsigned i = 0; i < 4; i++) {
+            const uint8_t* p = sector + 446 + i * 16;
+            if (p[4] == MBR_TYPE_ESP || p[4] == MBR_TYPE_FAT32 ||
+                p[4] == MBR_TYPE_FAT32_LBA)
+            {
+                *first = rd32(p + 8);
+                return true;
+            }
+        }
+    }
+    *first = 0;
+    return true;
+}
+
+bool init() {
+    for (std::size_t i = 0; i < blk::disk_count(); i++) {
+        blk::disk* d = blk::get_disk(i);
+        uint64_t first;
+        if (!find_esp(d, &first))
+            continue;
+        volume* v = volume::mount(d, first);
+        if (v != nullptr) {
+            s_boot_volume = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+volume* boot_volume() {
+    return s_boot_volume;
+}
+
+extern const vfs::inode_ops s_vfs_ops;
+
+// the inode for f, which is shared and never freed, so a race to make
+// it needs no cleaning up after
+static vfs::inode* vfs_node(vfs::superblock* sb, file* f) {
+    vfs::inode* node = vfs::get_inode(sb, f->key());
+    if (node != nullptr)
+        return node;
+    return vfs::new_inode(sb, f->key(), &s_vfs_ops, f, f->directory());
+}
+
+static vfs::inode* vfs_lookup(vfs::inode* dir, kstd::string_view name) {
+    file* d = (file*)dir->priv;
+    dir_entry e;
+    if (!d->find(name, &e))
+        return nullptr;
+    file* f = ((volume*)dir->sb->priv)->open(e, d->first_cluster());
+    return f != nullptr ? vfs_node(dir->sb, f) : nullptr;
+}
+
+static std::size_t vfs_read(vfs::inode* node, uint64_t pos, void* buf,
+                            std::size_t len)
+{
+    return ((file*)node->priv)->read(pos, buf, len);
+}
+
+static bool vfs_read_dir(vfs::inode* dir, std::size_t* cookie,
+                         vfs::dir_entry* out)
+{
+    dir_entry e;
+    if (!((file*)dir->priv)->read_dir(cookie, &e))
+        return false;
+    memcpy(out->name, e.name, sizeof(out->name));
+    out->directory = e.directory();
+    return true;
+}
+
+static uint64_t vfs_size(vfs::inode* node) {
+    return ((file*)node->priv)->size();
+}
+
+const vfs::inode_ops s_vfs_ops = {
+    &vfs_lookup, nullptr, nullptr, &vfs_read, nullptr, &vfs_read_dir,
+    &vfs_size, nullptr
+};
+
+vfs::superblock* make_superblock(volume* v) {
+    vfs::superblock* sb = new vfs::superblock{ "fat32", nullptr, v };
+    if (sb == nullptr)
+        return nullptr;
+    sb->root = vfs_node(sb, v->root());
+    if (sb->root == nullptr) {
+        delete sb;
+        return nullptr;
+    }
+    return sb;
+}
+
+} // namespace fat
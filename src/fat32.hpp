@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/radix_tree.hpp"
+#include "stdlib/string_view.hpp"
+#include "stdlib/sync.hpp"
+
+#include "block.hpp"
+#include "page_cache.hpp"
+#include "vfs.hpp"
+
+namespace fat {
+
+inline static constexpr std::size_t MAX_NAME = 255;
+
+inline static constexpr uint8_t ATTR_READ_ONLY = 0x01;
+inline static constexpr uint8_t ATTR_HIDDEN    = 0x02;
+inline static constexpr uint8_t ATTR_SYSTEM    = 0x04;
+inline static constexpr uint8_t ATTR_VOLUME_ID = 0x08;
+inline static constexpr uint8_t ATTR_DIRECTORY = 0x10;
+inline static constexpr uint8_t ATTR_LFN       = 0x0F;
+
+inline static constexpr uint32_t CLUSTER_MASK = 0x0FFFFFFF;
+inline static constexpr uint32_t CLUSTER_BAD  = 0x0FFFFFF7;
+inline static constexpr uint32_t CLUSTER_END  = 0x0FFFFFF8;   // and up
+
+// a run of clusters that are consecutive both in the file and on disk
+struct extent {
+    uint32_t file_cluster;
+    uint32_t disk_cluster;
+    uint32_t count;
+};
+
+// a directory entry, long name and all
+struct dir_entry {
+    char name[MAX_NAME + 1];
+    uint8_t attributes;
+    uint32_t first_cluster;
+    uint32_t size;
+    std::size_t index;      // of its short entry in the directory
+
+    inline bool directory() const {
+        return (attributes & ATTR_DIRECTORY) != 0;
+    }
+};
+
+class volume;
+
+// a file or directory. its cluster chain is walked once, when it's first
+// opened, into a sorted extent map, so finding the cluster under any
+// offset is a binary search instead of a chain walk. data is read
+// through the page cache, which maps through the extents. files belong
+// to their volume and are shared by everything that opens them
+class file {
+public:
+    inline uint64_t size() const {
+        return m_cache.size();
+    }
+
+    inline bool directory() const {
+        return m_directory;
+    }
+
+    inline uint32_t first_cluster() const {
+        return m_first_cluster;
+    }
+
+    inline std::size_t extent_count() const {
+        return m_num_extents;
+    }
+
+    // unique within the volume: the first cluster, or for an empty file
+    // (which has none) where its entry is
+    inline uint64_t key() const {
+        return m_key;
+    }
+
+    // bytes copied; short at the end of the file or on an I/O error
+    inline std::size_t read(uint64_t pos, void* buf, std::size_t len) {
+        return m_cache.read(pos, buf, len);
+    }
+
+    // the disk sector under a sector of the file, cache::NO_BLOCK past
+    // the end of the chain
+    uint64_t map(uint64_t sector) const;
+
+    // the next entry at or after *cookie (0 to start), skipping deleted
+    // ones and volume labels; false at the end of the directory
+    bool read_dir(std::size_t* cookie, dir_entry* out);
+
+    // an entry of this directory by name, case-insensitively
+    bool find(kstd::string_view name, dir_entry* out);
+
+private:
+    friend class volume;
+
+    file(volume* v, uint32_t first_cluster, bool directory, uint64_t size);
+    ~file();
+
+    bool build_extents();
+
+    volume* m_volume;
+    uint32_t m_first_cluster;
+    uint64_t m_key = 0;
+    bool m_directory;
+    extent* m_extents = nullptr;
+    std::size_t m_num_extents = 0;
+    cache::object m_cache;
+};
+
+// a mounted FAT32 filesystem. read-only: nothing here writes to the disk
+class volume {
+public:
+    // mounts the filesystem that starts at first_sector of d; null if
+    // there isn't a FAT32 one there or memory runs out
+    static volume* mount(blk::disk* d, uint64_t first_sector);
+
+    inline file* root() const {
+        return m_root;
+    }
+
+    // walks an absolute path from the root; null if any component is
+    // missing or isn't a directory where one is needed
+    file* open(kstd::string_view path);
+
+    // the file an entry describes, opened once and then shared
+    file* open(const dir_entry& e, uint32_t dir_cluster);
+
+    // FAT entry for a cluster, masked to 28 bits; CLUSTER_BAD if the
+    // cluster is out of range or the read fails. FAT sectors stay in the
+    // disk's page cache, so walking a chain doesn't go back to the disk
+    uint32_t next_cluster(uint32_t cluster);
+
+    inline uint32_t cluster_count() const {
+        return m_cluster_count;
+    }
+
+    inline uint32_t cluster_size() const {
+        return m_sectors_per_cluster * blk::SECTOR_SIZE;
+    }
+
+private:
+    friend class file;
+
+    volume() = default;
+
+    uint64_t cluster_sector(uint32_t cluster) const;
+
+    blk::disk* m_disk = nullptr;
+    cache::object* m_raw = nullptr;     // the whole disk
+    uint64_t m_first_sector = 0;
+    uint32_t m_sectors_per_cluster = 0;
+    uint64_t m_fat_sector = 0;          // first FAT, absolute
+    uint64_t m_data_sector = 0;         // cluster 2, absolute
+    uint32_t m_cluster_count = 0;
+    uint32_t m_root_cluster = 0;
+    file* m_root = nullptr;
+
+    kstd::ticket_lock m_lock;
+    kstd::radix_tree<file> m_files;     // by first cluster
+};
+
+// finds the EFI system partition (from the GPT, or the MBR, or failing
+// those the whole disk) on every registered disk and mounts the first
+// FAT32 one; after the disk drivers
+bool init();
+
+// the volume init() mounted, null if none
+volume* boot_volume();
+
+// v as a filesystem to mount in the VFS, its files as the inodes; null
+// if memory runs out
+vfs::superblock* make_superblock(volume* v);
+
+} // namespace fat
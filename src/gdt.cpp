@@ -0,0 +1,98 @@
+#include "gdt.hpp"
+
+#include "cpu.hpp"
+
+namespace gdt {
+
+struct tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iopb_offset;
+} __attribute__((packed));
+
+struct descriptor {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+// null, kernel code/data, unused 32-bit user code, user data/code, and a
+// TSS descriptor taking two slots
+inline static constexpr std::size_t NUM_ENTRIES = 8;
+
+struct alignas(cpu::CACHE_LINE_SIZE) cpu_tables {
+    uint64_t gdt[NUM_ENTRIES];
+    tss      task;
+};
+
+static cpu_tables s_tables[cpu::MAX_CPUS];
+
+// in .bss, so always mapped: entry paths can't take a fault on their
+// own stack
+alignas(16) static uint8_t s_stacks[cpu::MAX_CPUS][KERNEL_STACK_SIZE];
+
+// access byte: present, DPL, code/data, executable, read/write
+inline static constexpr uint64_t SEG_KERNEL_CODE = 0x9A;
+inline static constexpr uint64_t SEG_KERNEL_DATA = 0x92;
+inline static constexpr uint64_t SEG_USER_CODE   = 0xFA;
+inline static constexpr uint64_t SEG_USER_DATA   = 0xF2;
+inline static constexpr uint64_t SEG_LONG_MODE   = 1ull << 53;
+
+static constexpr uint64_t segment(uint64_t access) {
+    // base and limit are ignored in long mode
+    return (access << 40) | ((access & 0x08) ? SEG_LONG_MODE : 0);
+}
+
+uintptr_t kernel_stack_top(std::size_t cpu) {
+    return (uintptr_t)&s_stacks[cpu][KERNEL_STACK_SIZE];
+}
+
+void init_cpu() {
+    std::size_t id = cpu::id();
+    cpu_tables& t = s_tables[id];
+
+    t.gdt[0] = 0;
+    t.gdt[KERNEL_CS / 8] = segment(SEG_KERNEL_CODE);
+    t.gdt[KERNEL_DS / 8] = segment(SEG_KERNEL_DATA);
+    t.gdt[SYSRET_BASE / 8] = 0;
+    t.gdt[USER_DS / 8] = segment(SEG_USER_DATA);
+    t.gdt[USER_CS / 8] = segment(SEG_USER_CODE);
+
+    t.task = { };
+    t.task.rsp[0] = kernel_stack_top(id);
+    t.task.iopb_offset = sizeof(tss); // no I/O permission bitmap
+
+    uint64_t base = (uint64_t)&t.task;
+    uint64_t limit = sizeof(tss) - 1;
+    t.gdt[TSS_SEL / 8] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) |
+                         (0x89ull << 40) | (((limit >> 16) & 0xF) << 48) |
+                         (((base >> 24) & 0xFF) << 56);
+    t.gdt[TSS_SEL / 8 + 1] = base >> 32;
+
+    descriptor d = { sizeof(t.gdt) - 1, (uint64_t)&t.gdt };
+    // CS can only be reloaded through a far return. GS is left alone:
+    // loading it would wipe the base pointing at cpu_local
+    __asm__ volatile(
+            "lgdt %0\n\t"
+            "pushq %1\n\t"
+            "leaq 1f(%%rip), %%rax\n\t"
+            "pushq %%rax\n\t"
+            "lretq\n\t"
+            "1:\n\t"
+            "movw %2, %%ax\n\t"
+            "movw %%ax, %%ds\n\t"
+            "movw %%ax, %%es\n\t"
+            "movw %%ax, %%ss\n\t"
+            "ltr %3\n\t"
+            :
+            :"m"(d), "i"((uint64_t)KERNEL_CS), "i"(KERNEL_DS), "r"(TSS_SEL)
+            :"rax", "memory"
+           );
+
+    cpu::current().kernel_rsp = kernel_stack_top(id);
+}
+
+} // namespace gdt
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace gdt {
+
+// selector layout is dictated by SYSCALL/SYSRET: the kernel's SS follows
+// its CS, and SYSRET takes user SS and CS at +8 and +16 from STAR's base
+inline static constexpr uint16_t KERNEL_CS = 0x08;
+inline static constexpr uint16_t KERNEL_DS = 0x10;
+inline static constexpr uint16_t SYSRET_BASE = 0x18; // no 32-bit user code
+inline static constexpr uint16_t USER_DS = 0x20 | 3;
+inline static constexpr uint16_t USER_CS = 0x28 | 3;
+inline static constexpr uint16_t TSS_SEL = 0x30;
+
+#ifdef K_KERNEL_STACK_SIZE
+    inline static constexpr std::size_t KERNEL_STACK_SIZE = K_KERNEL_STACK_SIZE;
+#else
+    inline static constexpr std::size_t KERNEL_STACK_SIZE = 16384;
+#endif
+
+// loads this CPU's GDT and TSS and reloads the segment registers. must
+// come before idt::init() on the BSP, which picks up the code selector
+void init_cpu();
+
+// top of this CPU's kernel stack, used on entry from user mode
+uintptr_t kernel_stack_top(std::size_t cpu);
+
+} // namespace gdt
@@ -0,0 +1,174 @@
+#include <cstdint>
+
+#include "stdlib/charconv.hpp"
+
+#include "idt.hpp"
+
+#include "cpu.hpp"
+#include "panic.hpp"
+#include "rcu.hpp"
+#include "softirq.hpp"
+#include "syscall.hpp"
+
+// one 16-byte stub per vector. vectors where the CPU doesn't push an
+// error code push a zero so every frame has the same layout
+__asm__(
+    ".text\n"
+    ".balign 16\n"
+    ".global isr_stubs\n"
+    "isr_stubs:\n"
+    ".set vec, 0\n"
+    ".rept 256\n"
+    "    .balign 16\n"
+    "    .if (vec == 8) || (vec >= 10 && vec <= 14) || (vec == 17) || "
+            "(vec == 21) || (vec == 29) || (vec == 30)\n"
+    "    .else\n"
+    "        pushq $0\n"
+    "    .endif\n"
+    "    pushq $vec\n"
+    "    jmp isr_common\n"
+    "    .set vec, vec + 1\n"
+    ".endr\n"
+    "\n"
+    "isr_common:\n"
+    // from ring 3 GS still holds the user base; cs sits past vec, the
+    // error code and rip
+    "    testb $3, 24(%rsp)\n"
+    "    jz 1f\n"
+    "    swapgs\n"
+    "1:\n"
+    "    pushq %rax\n"
+    "    pushq %rbx\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
+    "    pushq %rdi\n"
+    "    pushq %rbp\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    pushq %r11\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    cld\n"
+    "    movq %rsp, %rdi\n"
+    "    call interrupt_dispatch\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %r11\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
+    "    popq %rbp\n"
+    "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    popq %rbx\n"
+    "    popq %rax\n"
+    "    addq $16, %rsp\n"
+    "    testb $3, 8(%rsp)\n"
+    "    jz 2f\n"
+    "    swapgs\n"
+    "2:\n"
+    "    iretq\n"
+);
+
+extern "C" char isr_stubs[];
+
+namespace idt {
+
+struct gate {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t  ist;
+    uint8_t  type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct descriptor {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+static gate s_idt[256] __attribute__((aligned(16)));
+static handler s_handlers[256];
+
+void init() {
+    uint16_t cs;
+    __asm__ volatile("mov %%cs, %0\n\t" : "=r"(cs));
+
+    for(int i = 0; i < 256; i++) {
+        uint64_t stub = (uint64_t)&isr_stubs[i * 16];
+        s_idt[i].offset_low  = stub & 0xFFFF;
+        s_idt[i].selector    = cs;
+        s_idt[i].ist         = 0;
+        s_idt[i].type_attr   = 0x8E; // present, DPL 0, interrupt gate
+        s_idt[i].offset_mid  = (stub >> 16) & 0xFFFF;
+        s_idt[i].offset_high = stub >> 32;
+        s_idt[i].reserved    = 0;
+    }
+}
+
+void load() {
+    descriptor d = { sizeof(s_idt) - 1, (uint64_t)&s_idt };
+    __asm__ volatile("lidt %0\n\t" : : "m"(d));
+}
+
+bool set_handler(uint8_t vector, handler h) {
+    // drivers may claim vectors concurrently through alloc_vector()
+    handler expected = nullptr;
+    return __atomic_compare_exchange_n(&s_handlers[vector], &expected, h,
+                                       false, __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED);
+}
+
+uint8_t alloc_vector(handler h) {
+    for(unsigned v = FIRST_IRQ_VECTOR; v < FIRST_FIXED_VECTOR; v++) {
+        if(set_handler((uint8_t)v, h))
+            return (uint8_t)v;
+    }
+    return 0;
+}
+
+} // namespace idt
+
+extern "C" void interrupt_dispatch(idt::interrupt_frame* frame) {
+    idt::handler h = idt::s_handlers[frame->vector & 0xFF];
+    bool from_user = (frame->cs & 3) != 0;
+    if(h != nullptr) {
+        // an idle CPU stops counting as quiescent while it's in here
+        bool was_idle = rcu::irq_enter();
+
+        // an exception in ring 3 is taken on the program's behalf rather
+        // than in interrupt context, and its handler may end the program
+        // without coming back here
+        bool nested = frame->vector >= idt::FIRST_IRQ_VECTOR || !from_user;
+        cpu::cpu_local& c = cpu::current();
+        if(nested)
+            c.irq_depth++;
+        h(*frame);
+        if(nested)
+            c.irq_depth--;
+
+        // bottom halves only after device interrupts, never exceptions
+        if(frame->vector >= idt::FIRST_IRQ_VECTOR)
+            softirq::irq_exit((frame->rflags & idt::RFLAGS_IF) != 0);
+        rcu::irq_exit(was_idle);
+        return;
+    }
+
+    // whatever the program did wrong, it doesn't take the kernel down
+    if(from_user && frame->vector < idt::FIRST_IRQ_VECTOR)
+        sys::exit_user(sys::EXIT_FAULT_BASE - (int64_t)frame->vector);
+
+    char buf[32] = "unhandled interrupt ";
+    auto r = kstd::to_chars(buf + 20, buf + sizeof(buf), frame->vector);
+    panic(kstd::string_view(buf, r.ptr - buf));
+}
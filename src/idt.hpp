@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+namespace idt {
+
+inline static constexpr uint8_t VECTOR_PAGE_FAULT = 14;
+
+// vectors below this are CPU exceptions
+inline static constexpr uint8_t FIRST_IRQ_VECTOR = 32;
+
+inline static constexpr uint64_t RFLAGS_IF = 1 << 9;
+
+// everything the stubs and the CPU push, lowest address first
+struct interrupt_frame {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t error_code;
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+};
+
+using handler = void (*)(interrupt_frame& frame);
+
+// builds the table on the BSP; load() must then run on every CPU
+void init();
+void load();
+
+// returns false if the vector already has a handler
+bool set_handler(uint8_t vector, handler h);
+
+// vectors from here up are fixed (IPIs, spurious); device interrupts get
+// theirs from alloc_vector()
+inline static constexpr uint8_t FIRST_FIXED_VECTOR = 0xF0;
+
+// installs h on an unused device vector and returns it, or 0 if they're
+// all taken
+uint8_t alloc_vector(handler h);
+
+} // namespace idt
@@ -7,7 +7,35 @@
 
 #include "efi.hpp"
 
+#include "acpi.hpp"
+#include "address_space.hpp"
+#include "ahci.hpp"
+#include "asm_wrappers.hpp"
+#include "block.hpp"
+#include "boot_modules.hpp"
+#include "boot_profile.hpp"
+#include "console.hpp"
+#include "cpu.hpp"
+#include "elf.hpp"
+#include "fat32.hpp"
+#include "gdt.hpp"
+#include "idt.hpp"
+#include "initramfs.hpp"
+#include "io_ring.hpp"
+#include "ipi.hpp"
+#include "memory.hpp"
 #include "page_table.hpp"
+#include "pci.hpp"
+#include "rcu.hpp"
+#include "softirq.hpp"
+#include "syscall.hpp"
+#include "tmpfs.hpp"
+#include "vdso.hpp"
+#include "vfs.hpp"
+#include "virtio_blk.hpp"
+#include "vm.hpp"
+#include "workqueue.hpp"
+#include "zero_pool.hpp"
 
 #ifndef NO_RETURN
 #   define NO_RETURN [[noreturn]]
@@ -49,6 +77,26 @@ volatile limine_kernel_address_request kernel_address_request = {
     .revision = 0
 };
 
+volatile limine_hhdm_request hhdm_request = {
+    .id = LIMINE_HHDM_REQUEST,
+    .revision = 0
+};
+
+volatile limine_memmap_request memmap_request = {
+    .id = LIMINE_MEMMAP_REQUEST,
+    .revision = 0
+};
+
+volatile limine_module_request module_request = {
+    .id = LIMINE_MODULE_REQUEST,
+    .revision = 0
+};
+
+volatile limine_kernel_file_request kernel_file_request = {
+    .id = LIMINE_KERNEL_FILE_REQUEST,
+    .revision = 0
+};
+
 NO_RETURN static void done(void) {
     for (;;) {
         __asm__("cli\n\thlt\n\t");
@@ -62,8 +110,31 @@ static void init_print(limine_terminal* terminal,
     write(terminal, s.data(), s.length());
 }
 
+// runs a boot module in its own address space until it exits
+static void run_user_module(const boot::module& m) {
+    uintptr_t entry, stack_top;
+    mem::address_space* as = elf::spawn(m, &entry, &stack_top);
+    if(as == nullptr) {
+        console::print("- Unable to load init module.\n");
+        return;
+    }
+
+    as->activate();
+    int64_t code = sys::enter_user(entry, stack_top, 0);
+    mem::address_space::activate_kernel();
+    as->destroy();
+    sti();
+
+    console::print("+ init exited with ");
+    console::print_dec(code);
+    console::print(".\n");
+}
+
 // The following will be our kernel's entry point.
 extern "C" void _start(void) {
+    prof::boot_profile_start(rdtsc());
+    cpu::init_bsp();
+
     // Ensure we got a terminal
     if (terminal_request.response == nullptr || 
         terminal_request.response->terminal_count < 1) 
@@ -73,6 +144,9 @@ extern "C" void _start(void) {
 
     auto* terminal = terminal_request.response->terminals[0];
     auto write = terminal_request.response->write;
+    console::init(terminal, write);
+
+    std::size_t boot_requests_phase = prof::phase_begin("limine responses");
 
     void* efi_system_table = nullptr;
     if(efi_system_table_request.response) {
@@ -118,6 +192,7 @@ extern "C" void _start(void) {
         else
             init_print(terminal, write, "- Unable to retrieve boot time.\n");
     } else init_print(terminal, write, "- Unable to retrieve boot time.\n");
+    prof::set_boot_time(boot_time);
 
     void* kernel_physical_base = nullptr;
     void* kernel_virtual_base = nullptr;
@@ -132,10 +207,123 @@ extern "C" void _start(void) {
 
     std::size_t kernel_size_in_pages = 
         kernel_size % 4096 == 0 ? kernel_size / 4096 : kernel_size / 4096 + 1;
-    
-    pt->init();
-    pt->alloc_page(kernel_virtual_base);
-    //pt->alloc_pages(kernel_virtual_base, kernel_size_in_pages);
-    // We're done, just hang...
-    done();
+    prof::phase_end(boot_requests_phase);
+
+    if(hhdm_request.response)
+        mem::hhdm_offset = hhdm_request.response->offset;
+    else
+        init_print(terminal, write, "- Unable to find HHDM.\n");
+
+    boot::init_modules(module_request.response, kernel_file_request.response);
+    if(boot::module_count() != 0)
+        init_print(terminal, write, "+ Found boot modules.\n");
+    if(boot::kernel_file() == nullptr)
+        init_print(terminal, write, "- Unable to find kernel file.\n");
+
+    {
+        prof::scoped_boot_phase phase("page table init");
+        pt->init(kernel_physical_base, kernel_virtual_base);
+        mem::address_space::init_cpu();
+
+        if(memmap_request.response) {
+            auto* memmap = memmap_request.response;
+            for(uint64_t i = 0; i < memmap->entry_count; i++) {
+                if(memmap->entries[i]->type == LIMINE_MEMMAP_USABLE) {
+                    pt->release_phys_range(memmap->entries[i]->base,
+                                           memmap->entries[i]->length);
+                }
+            }
+        } else init_print(terminal, write, "- Unable to retrieve memory map.\n");
+    }
+
+    {
+        prof::scoped_boot_phase phase("interrupts");
+        gdt::init_cpu();
+        idt::init();
+        idt::load();
+        sys::init_cpu();
+        mem::vm_init();
+    }
+
+    {
+        prof::scoped_boot_phase phase("heap init");
+        if(!kheap_init())
+            init_print(terminal, write, "- Unable to reserve kernel heap.\n");
+        mem::zero_pool_init();
+        vdso::init();
+    }
+
+    {
+        prof::scoped_boot_phase phase("kernel mapping");
+        pt->alloc_page(kernel_virtual_base);
+        //pt->alloc_pages(kernel_virtual_base, kernel_size_in_pages);
+    }
+
+    {
+        prof::scoped_boot_phase phase("smp bring-up");
+        rcu::init();
+        softirq::init();
+        work::init();
+        blk::init();
+        ring::init();
+        ipi::init();
+        cpu::init_smp();
+    }
+
+    {
+        prof::scoped_boot_phase phase("pci");
+        if(acpi::init(rsdp))
+            init_print(terminal, write, "+ Parsed ACPI tables.\n");
+        else
+            init_print(terminal, write, "- Unable to parse ACPI tables.\n");
+        if(pci::enumerate() != 0)
+            init_print(terminal, write, "+ Enumerated PCI devices.\n");
+        else
+            init_print(terminal, write, "- No PCI devices.\n");
+    }
+
+    {
+        prof::scoped_boot_phase phase("rootfs");
+        if(vfs::mount("/", tmpfs::create()) && vfs::make_dir("/boot") &&
+           vfs::make_dir("/tmp"))
+            init_print(terminal, write, "+ Mounted tmpfs at /.\n");
+        else
+            init_print(terminal, write, "- Unable to mount tmpfs at /.\n");
+        if(const boot::module* m = boot::find_module(initramfs::MODULE_NAME)) {
+            if(vfs::make_dir(initramfs::MOUNT_POINT) &&
+               vfs::mount(initramfs::MOUNT_POINT, initramfs::create(*m)))
+                init_print(terminal, write, "+ Mounted the initramfs.\n");
+            else
+                init_print(terminal, write, "- Unable to mount the initramfs.\n");
+        }
+    }
+
+    {
+        prof::scoped_boot_phase phase("storage");
+        if(ahci::init())
+            init_print(terminal, write, "+ Found AHCI disks.\n");
+        else
+            init_print(terminal, write, "- No AHCI disks.\n");
+        if(virtio::init())
+            init_print(terminal, write, "+ Found virtio disks.\n");
+        else
+            init_print(terminal, write, "- No virtio disks.\n");
+        if(fat::init() && vfs::mount("/boot", fat::make_superblock(fat::boot_volume())))
+            init_print(terminal, write, "+ Mounted the ESP at /boot.\n");
+        else
+            init_print(terminal, write, "- Unable to mount the ESP.\n");
+    }
+
+    prof::boot_profile_finish();
+    prof::report_boot_profile();
+
+#ifdef K_SYSCALL_BENCH
+    sys::run_null_benchmark();
+#endif
+
+    if(const boot::module* init = boot::find_module("init"))
+        run_user_module(*init);
+
+    // nothing left but background work
+    cpu::idle_loop();
 }
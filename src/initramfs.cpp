@@ -0,0 +1,415 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/new.hpp"
+
+#include "initramfs.hpp"
+
+#include "memory.hpp"
+
+namespace initramfs {
+
+inline static constexpr uint32_t NONE = ~0u;
+inline static constexpr std::size_t END_COOKIE = ~(std::size_t)0;
+
+inline static constexpr std::size_t CPIO_HEADER_SIZE = 110;
+inline static constexpr std::size_t TAR_BLOCK_SIZE = 512;
+inline static constexpr uint32_t CPIO_TYPE_MASK = 0170000;
+inline static constexpr uint32_t CPIO_TYPE_DIR  = 0040000;
+inline static constexpr uint32_t CPIO_TYPE_FILE = 0100000;
+
+// a file or directory in the archive. the name is its last component,
+// pointing into the module; directories the archive doesn't list itself
+// are made up from the paths under them. entry 0 is the root
+struct entry {
+    const char* name;
+    uint32_t len;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    const uint8_t* data;
+    uint64_t size;
+    bool directory;
+};
+
+// tar paths split over the prefix and name fields are the only names
+// that don't exist whole in the module; they're joined into these
+struct name_block {
+    name_block* next;
+};
+
+// the index: entries by (parent, name) in an open-addressed table that
+// stays at most half full
+struct archive {
+    entry* entries = nullptr;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    uint32_t* table = nullptr;
+    uint32_t table_size = 0;
+    name_block* names = nullptr;
+};
+
+static uint32_t hash(uint32_t parent, kstd::string_view name) {
+    uint64_t h = 0xCBF29CE484222325ull ^ parent * 0x9E3779B97F4A7C15ull;
+    for (std::size_t i = 0; i < name.size(); i++)
+        h = (h ^ (uint8_t)name[i]) * 0x100000001B3ull;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static inline kstd::string_view name_of(const entry& e) {
+    return kstd::string_view(e.name, e.len);
+}
+
+static uint32_t find(const archive* a, uint32_t parent, kstd::string_view name) {
+    uint32_t mask = a->table_size - 1;
+    for (uint32_t i = hash(parent, name) & mask; ; i = (i + 1) & mask) {
+        uint32_t e = a->table[i];
+        if (e == NONE)
+            return NONE;
+        if (a->entries[e].parent == parent && name_of(a->entries[e]) == name)
+            return e;
+    }
+}
+
+static void table_insert(archive* a, uint32_t e) {
+    uint32_t mask = a->table_size - 1;
+    uint32_t i = hash(a->entries[e].parent, name_of(a->entries[e])) & mask;
+    while (a->table[i] != NONE)
+        i = (i + 1) & mask;
+    a->table[i] = e;
+}
+
+static bool grow(archive* a) {
+    if (a->count == a->capacity) {
+        uint32_t capacity = a->capacity * 2;
+        entry* entries = new entry[capacity];
+        if (entries == nullptr)
+            return false;
+        memcpy(entries, a->entries, a->count * sizeof(entry));
+        delete[] a->entries;
+        a->entries = entries;
+        a->capacity = capacity;
+    }
+    if ((a->count + 1) * 2 > a->table_size) {
+        uint32_t size = a->table_size * 2;
+        uint32_t* table = new uint32_t[size];
+        if (table == nullptr)
+            return false;
+        delete[] a->table;
+        a->table = table;
+        a->table_size = size;
+        memset(table, 0xFF, size * sizeof(uint32_t));
+        // the root isn't anyone's child
+        for (uint32_t e = 1; e < a->count; e++)
+            table_insert(a, e);
+    }
+    return true;
+}
+
+static uint32_t add(archive* a, uint32_t parent, kstd::string_view name,
+                    bool directory)
+{
+    if (!grow(a))
+        return NONE;
+    uint32_t e = a->count++;
+    a->entries[e] = { name.data(), (uint32_t)name.size(), parent, NONE,
+                      a->entries[parent].first_child, nullptr, 0, directory };
+    a->entries[parent].first_child = e;
+    table_insert(a, e);
+    return e;
+}
+
+// records a file or directory at path, along with the directories above
+// it. leading "/" and "./" go; anything with "..", an overlong name or a
+// file where a directory should be is skipped
+static bool record(archive* a, kstd::string_view path, const uint8_t* data,
+                   uint64_t size, bool directory)
+{
+    uint32_t at = 0;
+    std::size_t pos = 0;
+    while (pos < path.size()) {
+        std::size_t end = pos;
+        while (end < path.size() && path[end] != '/')
+            end++;
+        kstd::string_view name = path.substr(pos, end - pos);
+        pos = end + 1;
+        if (name.size() == 0 || name == kstd::string_view("."))
+            continue;
+        if (name == kstd::string_view("..") || name.size() > vfs::MAX_NAME ||
+            !a->entries[at].directory)
+            return true;
+
+        // the rest is only separators for the last component
+        std::size_t rest = pos;
+        while (rest < path.size() && path[rest] == '/')
+            rest++;
+        bool last = rest >= path.size();
+
+        uint32_t next = find(a, at, name);
+        if (next == NONE) {
+            next = add(a, at, name, last ? directory : true);
+            if (next == NONE)
+                return false;
+        }
+        at = next;
+    }
+
+    // a later copy of a path replaces the earlier one, unless that's a
+    // directory with something in it
+    entry& e = a->entries[at];
+    if (at == 0 || (e.directory && e.first_child != NONE && !directory))
+        return true;
+    e.directory = directory;
+    e.data = directory ? nullptr : data;
+    e.size = directory ? 0 : size;
+    return true;
+}
+
+static bool parse_hex(const uint8_t* p, uint32_t* out) {
+    uint32_t v = 0;
+    for (unsigned i = 0; i < 8; i++) {
+        uint8_t c = p[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return false;
+        v = v << 4 | digit;
+    }
+    *out = v;
+    return true;
+}
+
+// octal, ended by a space or NUL
+static bool parse_octal(const uint8_t* p, std::size_t len, uint64_t* out) {
+    uint64_t v = 0;
+    std::size_t i = 0;
+    while (i < len && p[i] == ' ')
+        i++;
+    for (; i < len && p[i] != ' ' && p[i] != '\0'; i++) {
+        if (p[i] < '0' || p[i] > '7')
+            return false;
+        v = v << 3 | (uint64_t)(p[i] - '0');
+    }
+    *out = v;
+    return true;
+}
+
+static kstd::string_view field(const uint8_t* p, std::size_t max) {
+    std::size_t len = 0;
+    while (len < max && p[len] != '\0')
+        len++;
+    return kstd::string_view((const char*)p, len);
+}
+
+static inline std::size_t align_up(std::size_t v, std::size_t to) {
+    return (v + to - 1) & ~(to - 1);
+}
+
+// "newc" (070701) and "crc" (070702) cpio. everything but directories
+// and regular files is skipped
+static bool parse_cpio(archive* a, const uint8_t* base, std::size_t size) {
+    std::size_t off = 0;
+    while (off + CPIO_HEADER_SIZE <= size) {
+        const uint8_t* h = base + off;
+        if (memcmp(h, "07070", 5) != 0 || (h[5] != '1' && h[5] != '2'))
+            return false;
+        uint32_t mode, file_size, name_size;
+        if (!parse_hex(h + 14, &mode) || !parse_hex(h + 54, &file_size) ||
+            !parse_hex(h + 94, &name_size))
+            return false;
+
+        std::size_t name_off = off + CPIO_HEADER_SIZE;
+        if (name_size == 0 || name_size > size - name_off)
+            return false;
+        kstd::string_view name((const char*)base + name_off, name_size - 1);
+        std::size_t data_off = align_up(name_off + name_size, 4);
+        if (data_off > size || file_size > size - data_off)
+            return false;
+        if (name == kstd::string_view("TRAILER!!!"))
+            return true;
+
+        uint32_t type = mode & CPIO_TYPE_MASK;
+        if ((type == CPIO_TYPE_DIR || type == CPIO_TYPE_FILE) &&
+            !record(a, name, base + data_off, file_size, type == CPIO_TYPE_DIR))
+            return false;
+        off = align_up(data_off + file_size, 4);
+    }
+    return true;
+}
+
+static bool join(archive* a, kstd::string_view prefix, kstd::string_view name,
+                 kstd::string_view* out)
+{
+    std::size_t len = prefix.size() + 1 + name.size();
+    name_block* b = (name_block*)kmalloc(sizeof(name_block) + len);
+    if (b == nullptr)
+        return false;
+    b->next = a->names;
+    a->names = b;
+    char* s = (char*)(b + 1);
+    memcpy(s, prefix.data(), prefix.size());
+    s[prefix.size()] = '/';
+    memcpy(s + prefix.size() + 1, name.data(), name.size());
+    *out = kstd::string_view(s, len);
+    return true;
+}
+
+// ustar, with GNU long names. regular files and directories only
+static bool parse_tar(archive* a, const uint8_t* base, std::size_t size) {
+    kstd::string_view long_name;
+    bool have_long_name = false;
+    std::size_t off = 0;
+    while (off + TAR_BLOCK_SIZE <= size) {
+        const uint8_t* h = base + off;
+        // the end is marked by zeroed blocks
+        if (h[0] == '\0')
+            return true;
+        if (memcmp(h + 257, "ustar", 5) != 0)
+            return false;
+        uint64_t file_size;
+        if (!parse_octal(h + 124, 12, &file_size))
+            return false;
+        std::size_t data_off = off + TAR_BLOCK_SIZE;
+        if (file_size > size - data_off)
+            return false;
+        const uint8_t* data = base + data_off;
+
+        char type = (char)h[156];
+        if (type == 'L') {
+            long_name = field(data, file_size);
+            have_long_name = true;
+        } else {
+            kstd::string_view name = field(h, 100);
+            kstd::string_view prefix = field(h + 345, 155);
+            if (have_long_name)
+                name = long_name;
+            else if (prefix.size() != 0 && !join(a, prefix, name, &name))
+                return false;
+            have_long_name = false;
+
+            bool directory = type == '5';
+            if ((directory || type == '0' || type == '\0') &&
+                !record(a, name, data, file_size, directory))
+                return false;
+        }
+        off = data_off + align_up(file_size, TAR_BLOCK_SIZE);
+    }
+    return true;
+}
+
+static void free_archive(archive* a) {
+    while (a->names != nullptr) {
+        name_block* b = a->names;
+        a->names = b->next;
+        kfree(b);
+    }
+    delete[] a->entries;
+    delete[] a->table;
+    delete a;
+}
+
+extern const vfs::inode_ops s_ops;
+
+static vfs::inode* inode_for(vfs::superblock* sb, uint32_t e) {
+    vfs::inode* node = vfs::get_inode(sb, e);
+    if (node != nullptr)
+        return node;
+    archive* a = (archive*)sb->priv;
+    return vfs::new_inode(sb, e, &s_ops, a, a->entries[e].directory);
+}
+
+static vfs::inode* initramfs_lookup(vfs::inode* dir, kstd::string_view name) {
+    uint32_t e = find((archive*)dir->priv, (uint32_t)dir->ino, name);
+    return e != NONE ? inode_for(dir->sb, e) : nullptr;
+}
+
+static std::size_t initramfs_read(vfs::inode* node, uint64_t pos, void* buf,
+                                  std::size_t len)
+{
+    const entry& e = ((archive*)node->priv)->entries[node->ino];
+    if (pos >= e.size)
+        return 0;
+    if (len > e.size - pos)
+        len = e.size - pos;
+    memcpy(buf, e.data + pos, len);
+    return len;
+}
+
+// *cookie is one past the next child's index, END_COOKIE once they're
+// all done
+static bool initramfs_read_dir(vfs::inode* dir, std::size_t* cookie,
+                               vfs::dir_entry* out)
+{
+    const archive* a = (archive*)dir->priv;
+    if (*cookie == END_COOKIE)
+        return false;
+    uint32_t i = *cookie == 0 ? a->entries[dir->ino].first_child
+                              : (uint32_t)(*cookie - 1);
+    if (i == NONE)
+        return false;
+
+    const entry& e = a->entries[i];
+    memcpy(out->name, e.name, e.len);
+    out->name[e.len] = '\0';
+    out->directory = e.directory;
+    *cookie = e.next_sibling != NONE ? (std::size_t)e.next_sibling + 1
+                                     : END_COOKIE;
+    return true;
+}
+
+static uint64_t initramfs_size(vfs::inode* node) {
+    return ((archive*)node->priv)->entries[node->ino].size;
+}
+
+const vfs::inode_ops s_ops = {
+    &initramfs_lookup, nullptr, nullptr, &initramfs_read, nullptr,
+    &initramfs_read_dir, &initramfs_size, nullptr
+};
+
+vfs::superblock* create(const boot::module& m) {
+    bool tar = m.size >= TAR_BLOCK_SIZE && memcmp(m.data + 257, "ustar", 5) == 0;
+    bool cpio = m.size >= CPIO_HEADER_SIZE && memcmp(m.data, "07070", 5) == 0;
+    if (!tar && !cpio)
+        return nullptr;
+
+    archive* a = new archive();
+    if (a == nullptr)
+        return nullptr;
+    a->capacity = 64;
+    a->entries = new entry[a->capacity];
+    a->table_size = 128;
+    a->table = new uint32_t[a->table_size];
+    if (a->entries == nullptr || a->table == nullptr) {
+        free_archive(a);
+        return nullptr;
+    }
+    memset(a->table, 0xFF, a->table_size * sizeof(uint32_t));
+    a->entries[0] = { "", 0, 0, NONE, NONE, nullptr, 0, true };
+    a->count = 1;
+
+    bool ok = tar ? parse_tar(a, m.data, m.size) : parse_cpio(a, m.data, m.size);
+    vfs::superblock* sb = ok ? new vfs::superblock{ "initramfs", nullptr, a }
+                             : nullptr;
+    if (sb != nullptr)
+        sb->root = vfs::new_inode(sb, 0, &s_ops, a, true);
+    if (sb == nullptr || sb->root == nullptr) {
+        delete sb;
+        free_archive(a);
+        return nullptr;
+    }
+    return sb;
+}
+
+bool file_data(vfs::inode* node, const uint8_t** data, std::size_t* size) {
+    if (node->ops != &s_ops || node->directory)
+        return false;
+    const entry& e = ((archive*)node->priv)->entries[node->ino];
+    *data = e.data;
+    *size = e.size;
+    return true;
+}
+
+} // namespace initramfs
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "boot_modules.hpp"
+#include "vfs.hpp"
+
+namespace initramfs {
+
+// where the archive gets mounted, and the module cmdline that marks it
+inline static constexpr const char* MOUNT_POINT = "/initrd";
+inline static constexpr const char* MODULE_NAME = "initramfs";
+
+// the archive in a module (cpio "newc" or ustar tar) as a read-only
+// filesystem. nothing is unpacked: file data and most names are read in
+// place from the module, which stays where Limine put it. mounting only
+// walks the headers, skipping over file data, to build a hash index of
+// (directory, name); so it costs per file, not per byte. null if the
+// module isn't an archive this understands or memory runs out
+vfs::superblock* create(const boot::module& m);
+
+// where a file's data sits in the module, for callers that can use it
+// in place (loading an ELF, say); false if node isn't an initramfs file
+bool file_data(vfs::inode* node, const uint8_t** data, std::size_t* size);
+
+} // namespace initramfs
@@ -0,0 +1,675 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/new.hpp"
+#include "stdlib/sync.hpp"
+
+#include "io_ring.hpp"
+
+#include "address_space.hpp"
+#include "asm_wrappers.hpp"
+#include "block.hpp"
+#include "cpu.hpp"
+#include "memory.hpp"
+#include "rcu.hpp"
+#include "syscall.hpp"
+#include "util.hpp"
+#include "zero_pool.hpp"
+
+namespace ring {
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+
+// pages one unregistered request can pin; a transfer that spans more
+// has to use a registered buffer
+inline static constexpr std::size_t MAX_PINS = blk::MAX_SEGMENTS;
+
+struct io_ring;
+
+// one submission on its way through the block layer. the pool holds as
+// many as the submission ring, which bounds what a ring has in flight
+struct io_request {
+    io_ring* owner;
+    io_request* next;
+    uint64_t user_data;
+    uint32_t len;
+    blk::bio bio;
+    blk::bio_vec vecs[blk::MAX_SEGMENTS];
+    // frames pinned for this request alone; none for fixed buffers
+    uintptr_t pins[MAX_PINS];
+    std::size_t num_pins;
+};
+
+struct registered_buffer {
+    uint64_t addr;
+    uint64_t len;
+    uintptr_t* frames;      // one per page, from addr's page on
+};
+
+// recorded in the address space it's mapped in, so the ring goes down
+// with it and isn't copied into clones
+struct io_ring {
+    mem::mapping map;
+    mem::address_space* as;
+    uint32_t id;
+    uintptr_t base;
+    std::size_t num_pages;
+    uintptr_t* frames;      // the shared area, page by page
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    bool sqpoll;
+    uint32_t sq_cpu;
+    // the layout and the kernel's own indices, copied out to the header
+    // but never read back from it: user code can write anything there
+    uint32_t sq_mask;
+    uint32_t cq_mask;
+    uint32_t sq_offset;
+    uint32_t cq_offset;
+
+    // taken to consume submissions, by enter() or the polling CPU, and
+    // for changing the registered buffers under them
+    kstd::ticket_lock sq_lock;
+    uint32_t sq_head;
+    io_request* free_list;
+    registered_buffer* buffers;
+    std::size_t num_buffers;
+    // rounds the polling CPU has found the ring empty in
+    uint64_t idle_rounds;
+
+    // completions post from softirq context
+    kstd::ticket_lock cq_lock;
+    uint32_t cq_tail;
+    // finished requests still holding their pins; pushed by end_io
+    io_request* done;
+    uint32_t in_flight;
+
+    // enter() and the polling CPU hold one across their work
+    uint32_t refs;
+    io_request* pool;
+};
+
+static kstd::ticket_lock s_lock;
+static io_ring* s_rings[MAX_RINGS];
+
+static void ring_release(mem::mapping* m, mem::address_space* as);
+
+// a clone() child gets neither the ring nor its frames
+static const mem::mapping_ops s_mapping_ops = {
+    false, nullptr, &ring_release
+};
+
+static std::size_t pages_for(std::size_t bytes) {
+    return (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// the shared area through the HHDM, so the polling CPU can use it from
+// whatever address space it's in. entries never straddle a page; null
+// past the end of the area
+template<typename T> static T* shared_at(io_ring* r, std::size_t offset) {
+    if (offset + sizeof(T) > r->num_pages * PAGE_SIZE)
+        return nullptr;
+    uintptr_t frame = r->frames[offset / PAGE_SIZE];
+    return (T*)((uint8_t*)mem::phys_to_virt(frame) + offset % PAGE_SIZE);
+}
+
+static ring_header* header(io_ring* r) {
+    return shared_at<ring_header>(r, 0);
+}
+
+static io_ring* get_ring(uint64_t id) {
+    if (id >= MAX_RINGS)
+        return nullptr;
+    rcu::read_lock();
+    io_ring* r = rcu::dereference(s_rings[id]);
+    if (r != nullptr)
+        __atomic_add_fetch(&r->refs, 1, __ATOMIC_ACQUIRE);
+    rcu::read_unlock();
+    return r;
+}
+
+static void put_ring(io_ring* r) {
+    __atomic_sub_fetch(&r->refs, 1, __ATOMIC_RELEASE);
+}
+
+// submissions user code has queued past the kernel's head. sq_tail is
+// the one index it writes there; one claiming more than the ring holds
+// counts as none. seq_cst for poll_rings()'s recheck after it sets
+// RING_NEED_WAKEUP
+static uint32_t sq_pending(io_ring* r) {
+    uint32_t tail = __atomic_load_n(&header(r)->sq_tail, __ATOMIC_SEQ_CST);
+    uint32_t n = tail - __atomic_load_n(&r->sq_head, __ATOMIC_ACQUIRE);
+    return n <= r->sq_entries ? n : 0;
+}
+
+// a full ring drops the completion and counts it in cq_overflow
+static void post(io_ring* r, uint64_t user_data, int32_t res) {
+    ring_header* h = header(r);
+    kstd::irq_lock_guard guard(r->cq_lock);
+    uint32_t tail = r->cq_tail;
+    cqe* c = shared_at<cqe>(r, r->cq_offset + (tail & r->cq_mask) * sizeof(cqe));
+    // cq_head is user code's to write, so a bad one only loses it its
+    // own completions
+    if (c == nullptr ||
+        tail - __atomic_load_n(&h->cq_head, __ATOMIC_ACQUIRE) >= r->cq_entries) {
+        __atomic_store_n(&h->cq_overflow, h->cq_overflow + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    c->user_data = user_data;
+    c->res = res;
+    c->flags = 0;
+    __atomic_store_n(&r->cq_tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->cq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// the pins go back later, in reap(): freeing a frame isn't for softirq
+// context
+static void request_done(blk::bio* b) {
+    io_request* rq = (io_request*)b->ctx;
+    io_ring* r = rq->owner;
+    post(r, rq->user_data, b->ok ? (int32_t)rq->len : -(int32_t)sys::EIO);
+
+    io_request* head = __atomic_load_n(&r->done, __ATOMIC_RELAXED);
+    do {
+        rq->next = head;
+    } while (!__atomic_compare_exchange_n(&r->done, &head, rq, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_sub_fetch(&r->in_flight, 1, __ATOMIC_RELEASE);
+}
+
+static void unpin_all(io_request* rq) {
+    for (std::size_t i = 0; i < rq->num_pins; i++)
+        mem::address_space::unpin(rq->pins[i]);
+    rq->num_pins = 0;
+}
+
+// with sq_lock held
+static void reap(io_ring* r) {
+    io_request* rq = __atomic_exchange_n(&r->done, nullptr, __ATOMIC_ACQUIRE);
+    while (rq != nullptr) {
+        io_request* next = rq->next;
+        unpin_all(rq);
+        rq->next = r->free_list;
+        r->free_list = rq;
+        rq = next;
+    }
+}
+
+// appends [phys, phys + len) to rq's vectors, merging with the last one
+// where it carries on from it
+static bool add_vec(io_request* rq, uintptr_t phys, uint32_t len) {
+    blk::bio_vec* last = rq->bio.num_vecs != 0 ? &rq->vecs[rq->bio.num_vecs - 1]
+                                               : nullptr;
+    if (last != nullptr && last->phys + last->len == phys) {
+        last->len += len;
+        return true;
+    }
+    if (rq->bio.num_vecs == blk::MAX_SEGMENTS)
+        return false;
+    rq->vecs[rq->bio.num_vecs++] = { phys, len };
+    return true;
+}
+
+// walks [addr, addr + len) a page at a time, with frame giving the
+// frame behind each page; a negative errno if it can't
+template<typename Frame>
+static int64_t build_vecs(io_request* rq, uint64_t addr, uint32_t len,
+                          Frame frame)
+{
+    uint64_t pos = addr;
+    uint64_t end = addr + len;
+    while (pos < end) {
+        uint64_t page_end = (pos & ~(uint64_t)(PAGE_SIZE - 1)) + PAGE_SIZE;
+        uint32_t chunk = (uint32_t)((page_end < end ? page_end : end) - pos);
+        uintptr_t f;
+        if (!frame(pos & ~(uint64_t)(PAGE_SIZE - 1), &f))
+            return -sys::EFAULT;
+        if (!add_vec(rq, f + pos % PAGE_SIZE, chunk))
+            return -sys::EINVAL;
+        pos += chunk;
+    }
+    return 0;
+}
+
+// starts one submission; a negative errno for the completion if it
+// never gets as far as the disk. with sq_lock held
+static int64_t start(io_ring* r, const sqe& e, io_request* rq) {
+    bool fixed = e.opcode == OP_READ_FIXED || e.opcode == OP_WRITE_FIXED;
+    bool write = e.opcode == OP_WRITE || e.opcode == OP_WRITE_FIXED;
+    if (e.opcode > OP_WRITE_FIXED || e.len == 0 ||
+        e.addr % blk::SECTOR_SIZE != 0 || e.len % blk::SECTOR_SIZE != 0)
+        return -sys::EINVAL;
+    if (!sys::user_range_ok(e.addr, e.len))
+        return -sys::EFAULT;
+    if (e.target >= blk::disk_count())
+        return -sys::ENODEV;
+    blk::disk* d = blk::get_disk(e.target);
+
+    rq->bio.num_vecs = 0;
+    rq->num_pins = 0;
+    int64_t err;
+    if (fixed) {
+        if (e.buf_index >= r->num_buffers)
+            return -sys::EINVAL;
+        const registered_buffer& b = r->buffers[e.buf_index];
+        if (e.addr < b.addr || e.addr + e.len > b.addr + b.len)
+            return -sys::EFAULT;
+        uint64_t first = b.addr & ~(uint64_t)(PAGE_SIZE - 1);
+        err = build_vecs(rq, e.addr, e.len, [&](uint64_t page, uintptr_t* f) {
+            *f = b.frames[(page - first) / PAGE_SIZE];
+            return true;
+        });
+    } else {
+        err = build_vecs(rq, e.addr, e.len, [&](uint64_t page, uintptr_t* f) {
+            if (rq->num_pins == MAX_PINS)
+                return false;
+            mem::page_table::physical_address frame;
+            // a read is the device writing to memory
+            if (!r->as->pin(page, !write, &frame))
+                return false;
+            rq->pins[rq->num_pins++] = frame;
+            *f = frame;
+            return true;
+        });
+    }
+    if (err != 0) {
+        unpin_all(rq);
+        return err;
+    }
+
+    rq->user_data = e.user_data;
+    rq->len = e.len;
+    rq->bio.lba = e.lba;
+    rq->bio.write = write;
+    rq->bio.vecs = rq->vecs;
+    rq->bio.end_io = &request_done;
+    rq->bio.ctx = rq;
+    __atomic_add_fetch(&r->in_flight, 1, __ATOMIC_RELAXED);
+    d->submit(&rq->bio);
+    return 0;
+}
+
+// consumes up to max submissions, each copied out of the shared ring
+// before it's looked at. stops early when every request is in flight;
+// the number consumed. with sq_lock held
+static uint32_t submit(io_ring* r, uint32_t max) {
+    reap(r);
+
+    uint32_t head = r->sq_head;
+    uint32_t pending = sq_pending(r);
+    if (max > pending)
+        max = pending;
+    uint32_t n = 0;
+    blk::plug batch;
+    while (n < max) {
+        const sqe* s = shared_at<sqe>(r, r->sq_offset + (head & r->sq_mask) * sizeof(sqe));
+        if (s == nullptr)
+            break;
+        sqe e;
+        memcpy(&e, s, sizeof(sqe));
+        if (e.opcode == OP_NOP) {
+            post(r, e.user_data, 0);
+        } else {
+            io_request* rq = r->free_list;
+            if (rq == nullptr)
+                break;
+            r->free_list = rq->next;
+            int64_t err = start(r, e, rq);
+            if (err != 0) {
+                rq->next = r->free_list;
+                r->free_list = rq;
+                post(r, e.user_data, (int32_t)err);
+            }
+        }
+        head++;
+        n++;
+    }
+    __atomic_store_n(&r->sq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&header(r)->sq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static void poll_disks() {
+    for (std::size_t i = 0; i < blk::disk_count(); i++)
+        blk::get_disk(i)->poll();
+}
+
+// idle work: feeds the SQPOLL rings bound to this CPU. idle work runs
+// with interrupts off, so it reaps the completions of what it submitted
+// as well
+static bool poll_rings() {
+    bool busy = false;
+    uint32_t self = cpu::id();
+    for (std::size_t i = 0; i < MAX_RINGS; i++) {
+        io_ring* r = get_ring(i);
+        if (r == nullptr)
+            continue;
+        if (!r->sqpoll || r->sq_cpu != self || !r->sq_lock.try_lock()) {
+            put_ring(r);
+            continue;
+        }
+
+        ring_header* h = header(r);
+        if ((__atomic_load_n(&h->sq_flags, __ATOMIC_ACQUIRE) & RING_NEED_WAKEUP) == 0) {
+            if (submit(r, r->sq_entries) != 0) {
+                r->idle_rounds = 0;
+            } else if (++r->idle_rounds >= SQPOLL_IDLE_ROUNDS) {
+                __atomic_or_fetch(&h->sq_flags, RING_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+                // a submission that raced the flag would wait for a
+                // wakeup nobody sends
+                if (sq_pending(r) != 0) {
+                    __atomic_and_fetch(&h->sq_flags, ~RING_NEED_WAKEUP,
+                                       __ATOMIC_RELAXED);
+                    r->idle_rounds = 0;
+                }
+            }
+            // still polling, so the idle loop comes straight back
+            busy = true;
+        }
+        if (__atomic_load_n(&r->in_flight, __ATOMIC_ACQUIRE) != 0) {
+            poll_disks();
+            busy = true;
+        }
+        r->sq_lock.unlock();
+        put_ring(r);
+    }
+    return busy;
+}
+
+void init() {
+    cpu::register_idle_work(&poll_rings);
+}
+
+static void free_buffers(io_ring* r) {
+    for (std::size_t i = 0; i < r->num_buffers; i++) {
+        registered_buffer& b = r->buffers[i];
+        uint64_t first = b.addr & ~(uint64_t)(PAGE_SIZE - 1);
+        std::size_t pages = pages_for(b.addr + b.len - first);
+        for (std::size_t p = 0; p < pages; p++)
+            mem::address_space::unpin(b.frames[p]);
+        kfree(b.frames);
+    }
+    kfree(r->buffers);
+    r->buffers = nullptr;
+    r->num_buffers = 0;
+}
+
+// takes the shared area out of the address space and frees it
+static void free_area(io_ring* r, std::size_t mapped) {
+    for (std::size_t i = 0; i < mapped; i++) {
+        r->as->unmap(r->base + i * PAGE_SIZE);
+        pt->free_frame(r->frames[i]);
+    }
+    kfree(r->frames);
+}
+
+int64_t sys_setup(uint64_t entries, uint64_t base, uint64_t flags,
+                  uint64_t sq_cpu, uint64_t, uint64_t)
+{
+    if (entries == 0 || entries > MAX_ENTRIES || (entries & (entries - 1)) != 0)
+        return -sys::EINVAL;
+    if ((flags & ~(uint64_t)RING_SQPOLL) != 0 ||
+        ((flags & RING_SQPOLL) && sq_cpu >= cpu::count()))
+        return -sys::EINVAL;
+    if (base % PAGE_SIZE != 0)
+        return -sys::EINVAL;
+
+    uint32_t cq_entries = (uint32_t)entries * 2;
+    std::size_t sq_pages = pages_for(entries * sizeof(sqe));
+    std::size_t num_pages = 1 + sq_pages + pages_for(cq_entries * sizeof(cqe));
+    if (!sys::user_range_ok(base, num_pages * PAGE_SIZE))
+        return -sys::EFAULT;
+
+    io_ring* r = new io_ring{};
+    if (r == nullptr)
+        return -sys::ENOMEM;
+    r->map = { &s_mapping_ops, base, 0, nullptr };
+    r->as = mem::address_space::current();
+    r->base = base;
+    r->num_pages = num_pages;
+    r->sq_entries = (uint32_t)entries;
+    r->cq_entries = cq_entries;
+    r->sqpoll = (flags & RING_SQPOLL) != 0;
+    r->sq_cpu = (uint32_t)sq_cpu;
+    r->frames = (uintptr_t*)kmalloc(num_pages * sizeof(uintptr_t));
+    r->pool = (io_request*)kmalloc(entries * sizeof(io_request));
+    if (r->frames == nullptr || r->pool == nullptr) {
+        kfree(r->frames);
+        kfree(r->pool);
+        delete r;
+        return -sys::ENOMEM;
+    }
+    for (std::size_t i = 0; i < entries; i++) {
+        r->pool[i].owner = r;
+        r->pool[i].num_pins = 0;
+        r->pool[i].next = r->free_list;
+        r->free_list = &r->pool[i];
+    }
+
+    // pinned: the ring owns these frames, not the address space
+    std::size_t mapped = 0;
+    for (; mapped < num_pages; mapped++) {
+        mem::page_table::physical_address frame = mem::alloc_zeroed_frame();
+        if (IS_NULL(frame))
+            break;
+        if (!r->as->map(base + mapped * PAGE_SIZE, frame,
+                        mem::PTE_WRITABLE | mem::PTE_NX | mem::PTE_PINNED)) {
+            pt->free_frame(frame);
+            break;
+        }
+        r->frames[mapped] = frame;
+    }
+    r->map.length = mapped * PAGE_SIZE;
+    if (mapped != num_pages) {
+        free_area(r, mapped);
+        kfree(r->pool);
+        delete r;
+        return -sys::ENOMEM;
+    }
+
+    r->sq_mask = (uint32_t)entries - 1;
+    r->sq_offset = PAGE_SIZE;
+    r->cq_mask = cq_entries - 1;
+    r->cq_offset = (uint32_t)((1 + sq_pages) * PAGE_SIZE);
+    ring_header* h = header(r);
+    h->sq_mask = r->sq_mask;
+    h->sq_entries = r->sq_entries;
+    h->sq_offset = r->sq_offset;
+    h->cq_mask = r->cq_mask;
+    h->cq_entries = r->cq_entries;
+    h->cq_offset = r->cq_offset;
+
+    kstd::lock_guard guard(s_lock);
+    for (std::size_t i = 0; i < MAX_RINGS; i++) {
+        if (s_rings[i] == nullptr) {
+            r->id = (uint32_t)i;
+            r->as->add_mapping(&r->map);
+            rcu::assign_pointer(s_rings[i], r);
+            if (r->sqpoll)
+                cpu::kick_idle();
+            return (int64_t)i;
+        }
+    }
+    free_area(r, num_pages);
+    kfree(r->pool);
+    delete r;
+    return -sys::EBUSY;
+}
+
+// a ring only answers to the address space it's mapped in
+static io_ring* get_own_ring(uint64_t id) {
+    io_ring* r = get_ring(id);
+    if (r != nullptr && r->as != mem::address_space::current()) {
+        put_ring(r);
+        return nullptr;
+    }
+    return r;
+}
+
+int64_t sys_enter(uint64_t id, uint64_t to_submit, uint64_t min_complete,
+                  uint64_t flags, uint64_t, uint64_t)
+{
+    if ((flags & ~(uint64_t)(ENTER_GETEVENTS | ENTER_SQ_WAKEUP)) != 0)
+        return -sys::EINVAL;
+    io_ring* r = get_own_ring(id);
+    if (r == nullptr)
+        return -sys::EBADF;
+    ring_header* h = header(r);
+
+    int64_t submitted = 0;
+    if (r->sqpoll) {
+        // the polling CPU does the submitting; this only wakes it
+        if ((flags & ENTER_SQ_WAKEUP) != 0 &&
+            (__atomic_load_n(&h->sq_flags, __ATOMIC_ACQUIRE) & RING_NEED_WAKEUP) != 0) {
+            kstd::lock_guard guard(r->sq_lock);
+            r->idle_rounds = 0;
+            __atomic_and_fetch(&h->sq_flags, ~RING_NEED_WAKEUP, __ATOMIC_RELEASE);
+            cpu::kick_idle();
+        }
+    } else if (to_submit != 0) {
+        kstd::lock_guard guard(r->sq_lock);
+        submitted = submit(r, to_submit > r->sq_entries ? r->sq_entries
+                                                        : (uint32_t)to_submit);
+        if (submitted == 0 && sq_pending(r) != 0)
+            submitted = -sys::EBUSY;
+    }
+
+    if ((flags & ENTER_GETEVENTS) != 0) {
+        if (min_complete > r->cq_entries)
+            min_complete = r->cq_entries;
+        // polled rather than slept on: there's nothing to sleep on. gives
+        // up once nothing's left in flight that could make up the count
+        for (;;) {
+            uint32_t ready = __atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE) -
+                             __atomic_load_n(&h->cq_head, __ATOMIC_ACQUIRE);
+            if (ready >= min_complete)
+                break;
+            if (__atomic_load_n(&r->in_flight, __ATOMIC_ACQUIRE) == 0 &&
+                (!r->sqpoll || sq_pending(r) == 0))
+                break;
+            poll_disks();
+            cpu_relax();
+        }
+    }
+
+    put_ring(r);
+    return submitted;
+}
+
+static int64_t register_buffers(io_ring* r, uint64_t arg, uint64_t nr) {
+    if (nr == 0 || nr > MAX_BUFFERS)
+        return -sys::EINVAL;
+    if (!sys::user_range_ok(arg, nr * sizeof(buffer)))
+        return -sys::EFAULT;
+    if (r->num_buffers != 0)
+        return -sys::EBUSY;
+
+    r->buffers = (registered_buffer*)kmalloc(nr * sizeof(registered_buffer));
+    if (r->buffers == nullptr)
+        return -sys::ENOMEM;
+    for (std::size_t i = 0; i < nr; i++) {
+        buffer b;
+        if (sys::copy_from_user(&b, arg + i * sizeof(buffer), sizeof(b)) != 0 ||
+            b.len == 0 || !sys::user_range_ok(b.addr, b.len)) {
+            free_buffers(r);
+            return -sys::EFAULT;
+        }
+        uint64_t first = b.addr & ~(uint64_t)(PAGE_SIZE - 1);
+        std::size_t pages = pages_for(b.addr + b.len - first);
+        uintptr_t* frames = (uintptr_t*)kmalloc(pages * sizeof(uintptr_t));
+        if (frames == nullptr) {
+            free_buffers(r);
+            return -sys::ENOMEM;
+        }
+        // for writing, so it can be read into as well as written from
+        std::size_t p = 0;
+        for (; p < pages; p++) {
+            mem::page_table::physical_address frame;
+            if (!r->as->pin(first + p * PAGE_SIZE, true, &frame))
+                break;
+            frames[p] = frame;
+        }
+        if (p != pages) {
+            while (p-- > 0)
+                mem::address_space::unpin(frames[p]);
+            kfree(frames);
+            free_buffers(r);
+            return -sys::EFAULT;
+        }
+        r->buffers[i] = { b.addr, b.len, frames };
+        r->num_buffers = i + 1;
+    }
+    return 0;
+}
+
+int64_t sys_register(uint64_t id, uint64_t op, uint64_t arg, uint64_t nr,
+                     uint64_t, uint64_t)
+{
+    io_ring* r = get_own_ring(id);
+    if (r == nullptr)
+        return -sys::EBADF;
+
+    int64_t result;
+    {
+        kstd::lock_guard guard(r->sq_lock);
+        // fixed requests in flight are using the frames
+        if (__atomic_load_n(&r->in_flight, __ATOMIC_ACQUIRE) != 0)
+            result = -sys::EBUSY;
+        else if (op == REGISTER_BUFFERS)
+            result = register_buffers(r, arg, nr);
+        else if (op == UNREGISTER_BUFFERS) {
+            free_buffers(r);
+            result = 0;
+        } else
+            result = -sys::EINVAL;
+    }
+    put_ring(r);
+    return result;
+}
+
+// waits for r's I/O and frees it, with r already out of s_rings and
+// its address space's mappings
+static void teardown(io_ring* r) {
+    // nobody finds it now; wait out whoever already had
+    rcu::synchronize();
+    while (__atomic_load_n(&r->refs, __ATOMIC_ACQUIRE) != 0)
+        cpu_relax();
+    while (__atomic_load_n(&r->in_flight, __ATOMIC_ACQUIRE) != 0) {
+        poll_disks();
+        cpu_relax();
+    }
+
+    reap(r);
+    free_buffers(r);
+    free_area(r, r->num_pages);
+    kfree(r->pool);
+    delete r;
+}
+
+// the address space is going away with the ring still set up
+static void ring_release(mem::mapping* m, mem::address_space*) {
+    io_ring* r = (io_ring*)m;
+    {
+        kstd::lock_guard guard(s_lock);
+        if (s_rings[r->id] == r)
+            rcu::assign_pointer(s_rings[r->id], (io_ring*)nullptr);
+    }
+    teardown(r);
+}
+
+int64_t sys_destroy(uint64_t id, uint64_t, uint64_t, uint64_t, uint64_t,
+                    uint64_t)
+{
+    io_ring* r;
+    {
+        kstd::lock_guard guard(s_lock);
+        r = id < MAX_RINGS ? s_rings[id] : nullptr;
+        if (r == nullptr || r->as != mem::address_space::current())
+            return -sys::EBADF;
+        // lost to address_space::destroy(), which tears it down itself
+        if (!r->as->remove_mapping(&r->map))
+            return -sys::EBADF;
+        rcu::assign_pointer(s_rings[id], (io_ring*)nullptr);
+    }
+    teardown(r);
+    return 0;
+}
+
+} // namespace ring
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace ring {
+
+// a pair of rings in memory shared with user mode: user code fills
+// submission entries and bumps sq_tail, the kernel consumes them and
+// posts completions at cq_tail. one syscall can submit a whole batch,
+// and with RING_SQPOLL an idle CPU picks submissions up by itself, so a
+// busy program submits without any syscall at all
+
+#ifdef K_MAX_RINGS
+    inline static constexpr std::size_t MAX_RINGS = K_MAX_RINGS;
+#else
+    inline static constexpr std::size_t MAX_RINGS = 16;
+#endif
+
+// submission entries per ring at most; the completion ring is twice
+// the size of the submission ring
+inline static constexpr uint32_t MAX_ENTRIES = 4096;
+
+#ifdef K_RING_MAX_BUFFERS
+    inline static constexpr std::size_t MAX_BUFFERS = K_RING_MAX_BUFFERS;
+#else
+    inline static constexpr std::size_t MAX_BUFFERS = 64;
+#endif
+
+// rounds of idle work an SQPOLL CPU finds nothing to do in before it
+// sets RING_NEED_WAKEUP and stops looking
+#ifdef K_SQPOLL_IDLE_ROUNDS
+    inline static constexpr uint64_t SQPOLL_IDLE_ROUNDS = K_SQPOLL_IDLE_ROUNDS;
+#else
+    inline static constexpr uint64_t SQPOLL_IDLE_ROUNDS = 100000;
+#endif
+
+// setup flags
+inline static constexpr uint32_t RING_SQPOLL = 1 << 0;
+
+// header sq_flags, set by the kernel
+inline static constexpr uint32_t RING_NEED_WAKEUP = 1 << 0;
+
+// enter flags
+inline static constexpr uint32_t ENTER_GETEVENTS  = 1 << 0;
+inline static constexpr uint32_t ENTER_SQ_WAKEUP  = 1 << 1;
+
+// register ops
+inline static constexpr uint32_t REGISTER_BUFFERS   = 0;
+inline static constexpr uint32_t UNREGISTER_BUFFERS = 1;
+
+enum opcode : uint8_t {
+    OP_NOP = 0,
+    OP_READ,            // from disk target at lba into addr
+    OP_WRITE,
+    OP_READ_FIXED,      // the same, with addr inside registered buffer
+    OP_WRITE_FIXED,     // buf_index
+};
+
+// the first page of the shared area. the kernel writes sq_head, cq_tail
+// and the flags; user code writes sq_tail and cq_head. the rest is
+// there for user code to read: the kernel keeps its own copy. the entry
+// arrays follow at their offsets, page aligned
+struct ring_header {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_flags;
+    uint32_t sq_offset;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    uint32_t cq_overflow;   // completions lost to a full ring
+    uint32_t cq_offset;
+};
+
+// data addresses and lengths must be sector aligned; the disk is by
+// its index in the block layer
+struct sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t buf_index;
+    uint32_t target;
+    uint64_t lba;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t reserved;
+    uint64_t user_data;
+    uint64_t pad[3];
+};
+static_assert(sizeof(sqe) == 64);
+
+// res is the bytes transferred, or a negative errno
+struct cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+static_assert(sizeof(cqe) == 16);
+
+// an iovec for REGISTER_BUFFERS
+struct buffer {
+    uint64_t addr;
+    uint64_t len;
+};
+
+// registers the SQPOLL idle work; before SMP
+void init();
+
+// the syscalls, for the syscall table:
+//   setup(entries, base, flags, sq_cpu): maps a new ring pair at base
+//       (page aligned) in the caller's address space; its id
+//   enter(id, to_submit, min_complete, flags): submits, and with
+//       ENTER_GETEVENTS waits for min_complete completions; the number
+//       submitted
+//   register(id, op, arg, nr): REGISTER_BUFFERS pins the nr buffers at
+//       arg once, so fixed I/O on them skips pinning per request. a
+//       clone of the address space gets its own copy of pinned pages,
+//       as they were at the clone, never the frames the ring uses
+//   destroy(id): waits for its I/O and takes the rings down; so does
+//       destroying the address space they're in. a clone of it gets
+//       neither
+int64_t sys_setup(uint64_t entries, uint64_t base, uint64_t flags,
+                  uint64_t sq_cpu, uint64_t, uint64_t);
+int64_t sys_enter(uint64_t id, uint64_t to_submit, uint64_t min_complete,
+                  uint64_t flags, uint64_t, uint64_t);
+int64_t sys_register(uint64_t id, uint64_t op, uint64_t arg, uint64_t nr,
+                     uint64_t, uint64_t);
+int64_t sys_destroy(uint64_t id, uint64_t, uint64_t, uint64_t, uint64_t,
+                    uint64_t);
+
+} // namespace ring
@@ -0,0 +1,166 @@
+#include "ipi.hpp"
+
+#include "apic.hpp"
+#include "asm_wrappers.hpp"
+#include "idt.hpp"
+
+namespace ipi {
+
+struct alignas(cpu::CACHE_LINE_SIZE) call_queue {
+    kstd::mpsc_queue<call_request> requests;
+    // set while an IPI is on its way; coalesces senders
+    kstd::atomic<bool> kicked = false;
+};
+
+static call_queue s_queues[cpu::MAX_CPUS];
+
+static void call_handler(idt::interrupt_frame&) {
+    apic::eoi();
+    poll();
+}
+
+// the APIC gives up on an interrupt it already signalled; nothing was
+// delivered, so there's nothing to acknowledge either
+static void spurious_handler(idt::interrupt_frame&) {
+}
+
+// without an x2APIC, idle CPUs still notice calls through kick_idle();
+// busy ones only once they next poll
+static bool idle_work() {
+    return poll();
+}
+
+void init() {
+    apic::init_local();
+    idt::set_handler(VECTOR_CALL, &call_handler);
+    idt::set_handler(apic::SPURIOUS_VECTOR, &spurious_handler);
+    cpu::register_idle_work(&idle_work);
+}
+
+static void notify(std::size_t target) {
+    if (s_queues[target].kicked.exchange(true, kstd::memory_order_acq_rel))
+        return;
+    if (apic::x2apic())
+        apic::send_ipi(cpu::get(target).lapic_id, VECTOR_CALL);
+    else
+        cpu::kick_idle();
+}
+
+bool poll() {
+    call_queue& q = s_queues[cpu::id()];
+    // clear first: a sender that finds it clear again after this point
+    // sends a fresh IPI for anything we miss below
+    q.kicked.store(false, kstd::memory_order_seq_cst);
+
+    bool ran = false;
+    while (call_request* req = q.requests.pop()) {
+        // req may be gone the moment remaining drops
+        call_func func = req->func;
+        void* arg = req->arg;
+        kstd::atomic<uint32_t>* remaining = req->remaining;
+
+        func(arg);
+        if (remaining != nullptr)
+            remaining->fetch_sub(1, kstd::memory_order_release);
+        ran = true;
+    }
+    return ran;
+}
+
+void call_async(std::size_t cpu, call_request* req) {
+    s_queues[cpu].requests.push(req);
+    notify(cpu);
+}
+
+static void wait_for(kstd::atomic<uint32_t>& remaining) {
+    while (remaining.load(kstd::memory_order_acquire) != 0) {
+        if (!poll())
+            cpu_relax();
+    }
+}
+
+void call_on(std::size_t cpu, call_func func, void* arg) {
+    if (cpu == cpu::id()) {
+        func(arg);
+        return;
+    }
+
+    kstd::atomic<uint32_t> remaining = 1;
+    call_request req;
+    req.func = func;
+    req.arg = arg;
+    req.remaining = &remaining;
+    call_async(cpu, &req);
+    wait_for(remaining);
+}
+
+void call_many(const cpu::cpu_mask& mask, call_func func, void* arg) {
+    call_request reqs[cpu::MAX_CPUS];
+    kstd::atomic<uint32_t> remaining = 0;
+    std::size_t self = cpu::id();
+    bool run_here = false;
+
+    // queue everything before sending anything, so targets see the full
+    // count and the IPIs go out back to back
+    for (std::size_t w = 0; w < cpu::cpu_mask::WORDS; w++) {
+        uint64_t bits = mask.word(w);
+        while (bits != 0) {
+            std::size_t c = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (c >= cpu::count() || !cpu::get(c).online)
+                continue;
+            if (c == self) {
+                run_here = true;
+                continue;
+            }
+            reqs[c].func = func;
+            reqs[c].arg = arg;
+            reqs[c].remaining = &remaining;
+            remaining.fetch_add(1, kstd::memory_order_relaxed);
+        }
+    }
+
+    for (std::size_t c = 0; c < cpu::count(); c++) {
+        if (reqs[c].remaining != nullptr) {
+            s_queues[c].requests.push(&reqs[c]);
+            notify(c);
+        }
+    }
+
+    if (run_here)
+        func(arg);
+    wait_for(remaining);
+}
+
+struct shootdown_args {
+    uintptr_t virt;
+    std::size_t pages;
+};
+
+static void do_shootdown(void* p) {
+    const shootdown_args& a = *(const shootdown_args*)p;
+    if (a.pages > SHOOTDOWN_FULL_FLUSH) {
+        flush_tlb_all();
+        return;
+    }
+    for (std::size_t i = 0; i < a.pages; i++)
+        invlpg((const void*)(a.virt + i * 4096));
+}
+
+void tlb_shootdown(const cpu::cpu_mask& mask, uintptr_t virt, 
+                   std::size_t pages)
+{
+    cpu::cpu_mask others = mask;
+    others.clear(cpu::id());
+
+    bool any = false;
+    for (std::size_t w = 0; w < cpu::cpu_mask::WORDS; w++)
+        any |= others.word(w) != 0;
+    if (!any)
+        return;
+
+    shootdown_args args = { virt, pages };
+    call_many(others, &do_shootdown, &args);
+}
+
+} // namespace ipi
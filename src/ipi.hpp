@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/atomic.hpp"
+#include "stdlib/mpsc_queue.hpp"
+
+#include "cpu.hpp"
+
+namespace ipi {
+
+inline static constexpr uint8_t VECTOR_CALL = 0xF0;
+
+// above this many pages a shootdown flushes the whole TLB instead
+inline static constexpr std::size_t SHOOTDOWN_FULL_FLUSH = 32;
+
+using call_func = void (*)(void* arg);
+
+// one queued cross-CPU call. requests are intrusive, so a call costs no
+// allocation; they have to stay put until they've run, which the
+// waiting calls below guarantee by keeping them on the caller's stack
+struct call_request : kstd::mpsc_node {
+    call_func func = nullptr;
+    void* arg = nullptr;
+    // decremented once func returns, if set
+    kstd::atomic<uint32_t>* remaining = nullptr;
+};
+
+// hooks up the call vector and the BSP's APIC; before SMP
+void init();
+
+// queues req on cpu's call queue. requests that pile up while an IPI is
+// already on its way are picked up by that same interrupt
+void call_async(std::size_t cpu, call_request* req);
+
+// runs func(arg) on cpu and waits for it
+void call_on(std::size_t cpu, call_func func, void* arg);
+
+// runs func(arg) on every CPU in mask, this one included if it's set,
+// and waits for all of them. one IPI per target at most
+void call_many(const cpu::cpu_mask& mask, call_func func, void* arg);
+
+// flushes [virt, virt + pages * 4K) from the TLBs of the CPUs in mask
+// other than this one, and waits until they have
+void tlb_shootdown(const cpu::cpu_mask& mask, uintptr_t virt, 
+                   std::size_t pages);
+
+// runs the calls queued for this CPU; returns true if there were any.
+// waiting callers spin in here, so two CPUs calling each other can't
+// deadlock with interrupts off
+bool poll();
+
+} // namespace ipi
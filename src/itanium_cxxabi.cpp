@@ -1,5 +1,9 @@
 #include "itanium_cxxabi.hpp"
 
+#include "asm_wrappers.hpp"
+#include "cpu.hpp"
+#include "panic.hpp"
+
 atexit_func_entry_t __atexit_funcs[ATEXIT_MAX_FUNCS];
 uint32_t __atexit_func_count = 0;
  
@@ -30,18 +34,75 @@ void __cxa_finalize(void *f) {
 	}
 }
  
-int __cxa_guard_acquire (__guard *);
-void __cxa_guard_release (__guard *);
-void __cxa_guard_abort (__guard *);
- 
+// guard layout: byte 0 is the "initialized" flag the compiler tests
+// inline before calling in here, so it must only ever be set once the
+// object is fully built. the upper word holds the id+1 of the CPU running
+// the initializer, 0 when nobody is
+static inline uint8_t* guard_done(__guard *g) {
+	return (uint8_t*)g;
+}
+
+static inline uint32_t* guard_owner(__guard *g) {
+	return (uint32_t*)g + 1;
+}
+
+// pause this many times before backing off harder
+static constexpr uint32_t GUARD_SPIN_LIMIT = 64;
+static constexpr uint32_t GUARD_BACKOFF_MAX = 1024;
+
+// there is no scheduler to hand the CPU to yet, so "yielding" means
+// getting off the guard's cache line for progressively longer
+static void guard_yield(uint32_t& backoff) {
+	for (uint32_t i = 0; i < backoff; i++)
+		cpu_relax();
+	if (backoff < GUARD_BACKOFF_MAX)
+		backoff *= 2;
+}
+
 int __cxa_guard_acquire (__guard *g) {
-	return !*(char *)(g);
+	// fast path: one acquire load, same as the inline check
+	if (__atomic_load_n(guard_done(g), __ATOMIC_ACQUIRE))
+		return 0;
+
+	uint32_t self = cpu::id() + 1;
+	uint32_t spins = 0;
+	uint32_t backoff = GUARD_SPIN_LIMIT;
+	for (;;) {
+		uint32_t owner = 0;
+		if (__atomic_compare_exchange_n(guard_owner(g), &owner, self, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			// the previous owner may have finished between our checks
+			if (__atomic_load_n(guard_done(g), __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(guard_owner(g), 0, __ATOMIC_RELEASE);
+				return 0;
+			}
+			return 1;
+		}
+
+		// an interrupt handler touching a static its CPU is still
+		// building would wait forever
+		if (owner == self)
+			panic("recursive static initialization");
+
+		if (__atomic_load_n(guard_done(g), __ATOMIC_ACQUIRE))
+			return 0;
+
+		if (spins < GUARD_SPIN_LIMIT) {
+			cpu_relax();
+			spins++;
+		} else {
+			guard_yield(backoff);
+		}
+	}
 }
  
 void __cxa_guard_release (__guard *g) {
-	*(char *)g = 1;
+	__atomic_store_n(guard_done(g), 1, __ATOMIC_RELEASE);
+	__atomic_store_n(guard_owner(g), 0, __ATOMIC_RELEASE);
 }
 
-void __cxa_guard_abort (__guard *) {
- 
+// the initializer threw; leave the object unbuilt and let the next
+// caller try again
+void __cxa_guard_abort (__guard *g) {
+	__atomic_store_n(guard_owner(g), 0, __ATOMIC_RELEASE);
 }
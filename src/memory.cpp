@@ -3,36 +3,137 @@
 
 #include "stdlib/list.hpp"
 #include "stdlib/expected.hpp"
+#include "stdlib/sync.hpp"
 
 #include "memory.hpp"
 #include "page_table.hpp"
+#include "vm.hpp"
 
 #ifndef NO_DISCARD
 #	define NO_DISCARD [[nodiscard]]
 #endif
 
+inline static constexpr std::size_t HEAP_PAGE_SIZE = 4096;
+
+// small requests come from power-of-two size classes (16B - 2KiB) carved
+// off the heap with a bump pointer and recycled through per-class free
+// lists; anything larger is rounded up to whole pages. every block
+// carries a 16-byte header so payloads stay 16-byte aligned
+inline static constexpr std::size_t HEAP_HEADER_SIZE = 16;
+inline static constexpr std::size_t HEAP_MIN_CLASS = 16;
+inline static constexpr std::size_t HEAP_NUM_CLASSES = 8;
+
+struct heap_header {
+    std::size_t size; // total block size, header included
+    std::size_t reserved;
+};
+
+struct heap_free_block {
+    heap_free_block* next;
+    std::size_t size;
+};
+
+static char* s_heap_top = nullptr;
+static char* s_heap_limit = nullptr;
+static heap_free_block* s_free_lists[HEAP_NUM_CLASSES];
+static heap_free_block* s_free_large = nullptr;
+
+// one lock over the whole heap for now; interrupts are kept off while
+// it's held so that handlers may allocate
+static kstd::mcs_lock s_heap_lock;
+
 bool kheap_init() {
-    std::size_t num_pages = KHEAP_SIZE / 4096;
-    if(KHEAP_SIZE % 4096 != 0) num_pages++;
+    uintptr_t begin = ((uintptr_t)KHEAP_BEGIN + HEAP_PAGE_SIZE - 1) & 
+                      ~(HEAP_PAGE_SIZE - 1);
+    uintptr_t end = (uintptr_t)KHEAP_END & ~(HEAP_PAGE_SIZE - 1);
 
-    char* p = (char*)KHEAP_BEGIN;
-    while(p != KHEAP_END) {
-        if(pt->alloc_page(p) == nullptr)
-            return false;
-    }
+    if(!mem::reserve_lazy((void*)begin, end - begin, 
+                          mem::VM_READ | mem::VM_WRITE))
+        return false;
+
+    s_heap_top = (char*)begin;
+    s_heap_limit = (char*)end;
     return true;
 }
 
+static std::size_t size_class(std::size_t total) {
+    std::size_t c = 0;
+    while((HEAP_MIN_CLASS << c) < total)
+        c++;
+    return c;
+}
+
+static void* bump(std::size_t size) {
+    if(s_heap_top == nullptr || (std::size_t)(s_heap_limit - s_heap_top) < size)
+        return nullptr;
+    void* p = s_heap_top;
+    s_heap_top += size;
+    return p;
+}
+
 #ifdef __cplusplus
 	extern "C" {
 #endif
 
 NO_DISCARD void* kmalloc(std::size_t size) {
-    return nullptr;
+    if(size == 0)
+        return nullptr;
+
+    std::size_t total = size + HEAP_HEADER_SIZE;
+    void* block = nullptr;
+
+    kstd::irq_mcs_guard guard(s_heap_lock);
+
+    std::size_t c = size_class(total);
+    if(c < HEAP_NUM_CLASSES) {
+        total = HEAP_MIN_CLASS << c;
+        if(s_free_lists[c] != nullptr) {
+            block = s_free_lists[c];
+            s_free_lists[c] = s_free_lists[c]->next;
+        } else {
+            block = bump(total);
+        }
+    } else {
+        total = (total + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+        // first fit; large blocks are rare enough not to bother splitting
+        for(heap_free_block** pp = &s_free_large; *pp != nullptr; pp = &(*pp)->next) {
+            if((*pp)->size >= total) {
+                block = *pp;
+                total = (*pp)->size;
+                *pp = (*pp)->next;
+                break;
+            }
+        }
+        if(block == nullptr)
+            block = bump(total);
+    }
+
+    if(block == nullptr)
+        return nullptr;
+
+    heap_header* h = (heap_header*)block;
+    h->size = total;
+    return (char*)block + HEAP_HEADER_SIZE;
 }
 
 void kfree(void* ptr) {
+    if(ptr == nullptr)
+        return;
 
+    heap_header* h = (heap_header*)((char*)ptr - HEAP_HEADER_SIZE);
+    std::size_t total = h->size;
+    heap_free_block* b = (heap_free_block*)h;
+    b->size = total;
+
+    kstd::irq_mcs_guard guard(s_heap_lock);
+    if(total <= (HEAP_MIN_CLASS << (HEAP_NUM_CLASSES - 1))) {
+        std::size_t c = size_class(total);
+        b->next = s_free_lists[c];
+        s_free_lists[c] = b;
+    } else {
+        b->next = s_free_large;
+        s_free_large = b;
+    }
 }
 
 #ifdef __cplusplus
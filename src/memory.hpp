@@ -8,7 +8,8 @@
 #	define NO_DISCARD [[nodiscard]]
 #endif
 
-extern const void* const KHEAP_BEGIN;
+// linker symbol - its address, not its contents, is where the heap starts
+extern "C" const char KHEAP_BEGIN[];
 
 #ifdef K_HEAP_INIT_SIZE
     inline static constexpr std::size_t KHEAP_SIZE = K_HEAP_INIT_SIZE;
@@ -16,8 +17,10 @@ extern const void* const KHEAP_BEGIN;
     inline static constexpr std::size_t KHEAP_SIZE = 0x2000000;
 #endif
 
-inline const void* KHEAP_END = (void*)((char*)KHEAP_BEGIN + KHEAP_SIZE);
+inline const void* KHEAP_END = (const void*)(KHEAP_BEGIN + KHEAP_SIZE);
 
+// reserves the heap for demand paging; nothing is mapped until kmalloc
+// hands memory out and it's first touched
 bool kheap_init();
 
 extern "C" NO_DISCARD void* kmalloc(std::size_t size);
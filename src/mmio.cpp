@@ -0,0 +1,35 @@
+#include "stdlib/sync.hpp"
+
+#include "mmio.hpp"
+
+#include "page_table.hpp"
+
+namespace mem {
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+
+static uintptr_t s_next = MMIO_BASE;
+static kstd::ticket_lock s_lock;
+
+volatile void* map_mmio(uintptr_t phys, std::size_t len) {
+    uintptr_t first = phys & ~(PAGE_SIZE - 1);
+    std::size_t pages = (phys + len - first + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uintptr_t virt;
+    {
+        kstd::lock_guard guard(s_lock);
+        if (pages > (MMIO_BASE + MMIO_SIZE - s_next) / PAGE_SIZE)
+            return nullptr;
+        virt = s_next;
+        s_next += pages * PAGE_SIZE;
+    }
+
+    for (std::size_t i = 0; i < pages; i++) {
+        if (!pt->map_page(virt + i * PAGE_SIZE, first + i * PAGE_SIZE,
+                          PTE_WRITABLE | PTE_PCD | PTE_PWT | PTE_NX))
+            return nullptr;
+    }
+    return (volatile void*)(virt + (phys - first));
+}
+
+} // namespace mem
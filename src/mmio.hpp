@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace mem {
+
+// device registers get mapped uncached in a window inside the kernel's
+// top PML4 slot, which every address space already shares. the HHDM
+// maps them too, but write-back, which devices don't tolerate
+inline static constexpr uintptr_t MMIO_BASE = 0xFFFFFFFF00000000;
+inline static constexpr std::size_t MMIO_SIZE = 0x40000000;
+
+// maps [phys, phys + len) uncached and returns its address; null once the
+// window is full. mappings are never taken down
+volatile void* map_mmio(uintptr_t phys, std::size_t len);
+
+} // namespace mem
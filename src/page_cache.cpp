@@ -0,0 +1,559 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/new.hpp"
+
+#include "page_cache.hpp"
+
+#include "asm_wrappers.hpp"
+#include "page_table.hpp"
+#include "zero_pool.hpp"
+
+namespace cache {
+
+static void io_done(blk::bio* b) {
+    page* p = (page*)b->ctx;
+    uint32_t set = b->ok ? (b->write ? 0 : PAGE_UPTODATE) : PAGE_ERROR;
+    __atomic_fetch_or(&p->flags, set, __ATOMIC_RELAXED);
+    // the result before the end of I/O, for whoever's waiting on it
+    __atomic_fetch_and(&p->flags, ~PAGE_IO, __ATOMIC_RELEASE);
+}
+
+static inline uint8_t* page_data(const page* p) {
+    return (uint8_t*)mem::phys_to_virt(p->frame);
+}
+
+object::object(blk::disk* d, const object_ops* ops, void* owner,
+               uint64_t size)
+    : m_disk(d), m_ops(ops), m_owner(owner), m_size(size)
+{
+}
+
+object::~object() {
+    writeback(true);
+
+    page* batch[WRITEBACK_BATCH];
+    for (;;) {
+        std::size_t n = m_pages.gang_lookup(0, batch, WRITEBACK_BATCH);
+        if (n == 0)
+            break;
+        for (std::size_t i = 0; i < n; i++) {
+            // readahead may still be landing
+            wait_io(batch[i]);
+            m_pages.remove(batch[i]->index);
+            free_page(batch[i]);
+        }
+    }
+}
+
+uint64_t object::page_count() const {
+    return (size() + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// caches every page of the huge block around index except index's own,
+// which is returned for the caller to insert. all of them are zeroed.
+// with the lock held
+page* object::new_huge_block(uint64_t index) {
+    uint64_t first = index & ~(HUGE_PAGES - 1);
+    page* cached;
+    if (m_pages.gang_lookup(first, &cached, 1) != 0 &&
+        cached->index < first + HUGE_PAGES)
+        return nullptr;
+
+    mem::page_table::physical_address frame = pt->alloc_huge_frame();
+    if (IS_NULL(frame))
+        return nullptr;
+    memset(mem::phys_to_virt(frame), 0, HUGE_PAGES * PAGE_SIZE);
+
+    page* result = nullptr;
+    for (uint64_t i = 0; i < HUGE_PAGES; i++) {
+        page* p = new page();
+        if (p != nullptr) {
+            p->frame = frame + i * PAGE_SIZE;
+            p->index = first + i;
+            p->owner = this;
+            p->flags = PAGE_HUGE | PAGE_UPTODATE;
+            if (first + i == index)
+                result = p;
+            else if (!m_pages.insert(first + i, p)) {
+                delete p;
+                p = nullptr;
+            }
+        }
+        if (p == nullptr) {
+            // out of memory: back to the start, and single frames
+            for (uint64_t j = 0; j < i; j++) {
+                if (first + j != index) {
+                    cached = m_pages.lookup(first + j);
+                    m_pages.remove(first + j);
+                    delete cached;
+                }
+            }
+            delete result;
+            for (uint64_t j = 0; j < HUGE_PAGES; j++)
+                pt->free_frame(frame + j * PAGE_SIZE);
+            return nullptr;
+        }
+    }
+    return result;
+}
+
+page* object::new_page(uint64_t index, bool zeroed) {
+    if (m_huge) {
+        page* p = new_huge_block(index);
+        if (p != nullptr)
+            return p;
+    }
+
+    mem::page_table::physical_address frame =
+        zeroed ? mem::alloc_zeroed_frame() : pt->alloc_frame();
+    if (IS_NULL(frame))
+        return nullptr;
+    page* p = new page();
+    if (p == nullptr) {
+        pt->free_frame(frame);
+        return nullptr;
+    }
+    p->frame = frame;
+    p->index = index;
+    p->owner = this;
+    p->flags = 0;
+    return p;
+}
+
+void object::free_page(page* p) {
+    pt->free_frame(p->frame);
+    delete p;
+}
+
+void object::wait_io(page* p) {
+    while (p->state() & PAGE_IO) {
+        if (m_disk != nullptr)
+            m_disk->poll();
+        cpu_relax();
+    }
+}
+
+// with the lock held
+void object::mark_dirty(page* p) {
+    if (m_disk == nullptr || (p->state() & PAGE_DIRTY))
+        return;
+    __atomic_fetch_or(&p->flags, PAGE_DIRTY, __ATOMIC_RELAXED);
+    m_pages.set_tag(p->index, TAG_DIRTY);
+    __atomic_store_n(&m_num_dirty, m_num_dirty + 1, __ATOMIC_RELAXED);
+}
+
+// with the lock held. a reader that picks up where the last one stopped
+// is sequential: the first time, READAHEAD_MIN pages past it go out, and
+// each time it gets within half a window of the end of what's been read
+// the next window goes out at twice the size, so the disk stays ahead.
+// anything else reads only what it asked for and starts over
+void object::readahead(uint64_t index, uint64_t last, uint64_t* from,
+                       uint64_t* to)
+{
+    bool sequential = index == m_last_index + 1 || index == m_last_index;
+    m_last_index = index;
+    *from = 0;
+    *to = 0;
+
+    if (!sequential) {
+        m_ra_window = 0;
+        m_ra_next = last + 1;
+        *from = index;
+        *to = last + 1;
+    } else {
+        if (m_ra_window == 0)
+            m_ra_window = READAHEAD_MIN;
+        if (m_ra_next < index)
+            m_ra_next = index;
+        if (m_ra_next <= last || m_ra_next - index <= m_ra_window / 2) {
+            *from = m_ra_next;
+            *to = m_ra_next + m_ra_window;
+            if (*to <= last)
+                *to = last + 1;
+            m_ra_next = *to;
+            m_ra_window = m_ra_window * 2 < READAHEAD_MAX
+                        ? m_ra_window * 2 : READAHEAD_MAX;
+        }
+    }
+
+    uint64_t pages = page_count();
+    if (*to > pages)
+        *to = pages;
+    if (*from > *to)
+        *from = *to;
+}
+
+// reads a run of sectors at a time, waiting for each; for pages with
+// holes, or that the object's layout scatters over the disk
+bool object::sync_io(page* p, bool write, const uint64_t* lbas,
+                     unsigned sectors)
+{
+    if (!write)
+        memset(page_data(p), 0, PAGE_SIZE);
+    for (unsigned i = 0; i < sectors; ) {
+        if (lbas[i] == NO_BLOCK) {
+            if (write)
+                return false;
+            i++;
+            continue;
+        }
+        unsigned n = 1;
+        while (i + n < sectors && lbas[i + n] == lbas[i] + n)
+            n++;
+        blk::bio_vec v = { p->frame + i * blk::SECTOR_SIZE,
+                           (uint32_t)(n * blk::SECTOR_SIZE) };
+        blk::bio b = { };
+        b.lba = lbas[i];
+        b.write = write;
+        b.vecs = &v;
+        b.num_vecs = 1;
+        if (!m_disk->submit_wait(&b))
+            return false;
+        i += n;
+    }
+    return true;
+}
+
+// p is marked PAGE_IO; this clears it once the transfer is done, which
+// for a page laid out contiguously on disk is later, from its bio
+void object::start_io(page* p, bool write) {
+    uint64_t first = p->index * SECTORS_PER_PAGE;
+    uint64_t end = (size() + blk::SECTOR_SIZE - 1) / blk::SECTOR_SIZE;
+    unsigned sectors = 0;
+    if (first < end)
+        sectors = end - first < SECTORS_PER_PAGE ? (unsigned)(end - first)
+                                                 : SECTORS_PER_PAGE;
+
+    uint64_t lbas[SECTORS_PER_PAGE];
+    bool contiguous = m_disk != nullptr && sectors != 0;
+    for (unsigned i = 0; i < sectors; i++) {
+        lbas[i] = m_disk != nullptr ? m_ops->map(m_owner, first + i, write)
+                                    : NO_BLOCK;
+        if (lbas[i] == NO_BLOCK || (i != 0 && lbas[i] != lbas[i - 1] + 1))
+            contiguous = false;
+    }
+
+    if (contiguous) {
+        std::size_t len = sectors * blk::SECTOR_SIZE;
+        if (!write && len < PAGE_SIZE)
+            memset(page_data(p) + len, 0, PAGE_SIZE - len);
+        p->vec = { p->frame, (uint32_t)len };
+        p->bio = { };
+        p->bio.lba = lbas[0];
+        p->bio.write = write;
+        p->bio.vecs = &p->vec;
+        p->bio.num_vecs = 1;
+        p->bio.end_io = &io_done;
+        p->bio.ctx = p;
+        m_disk->submit(&p->bio);
+        return;
+    }
+
+    bool ok = sync_io(p, write, lbas, sectors);
+    uint32_t set = ok ? (write ? 0 : PAGE_UPTODATE) : PAGE_ERROR;
+    __atomic_fetch_or(&p->flags, set, __ATOMIC_RELAXED);
+    __atomic_fetch_and(&p->flags, ~PAGE_IO, __ATOMIC_RELEASE);
+}
+
+// queues reads for every page in [from, to) that isn't cached, under one
+// plug so neighbours merge
+void object::start_reads(uint64_t from, uint64_t to) {
+    blk::plug plug;
+    for (uint64_t i = from; i < to; i++) {
+        page* p;
+        {
+            kstd::lock_guard guard(m_lock);
+            if (m_pages.lookup(i) != nullptr)
+                continue;
+            p = new_page(i, false);
+            if (p == nullptr)
+                return;
+            if (!m_pages.insert(i, p)) {
+                free_page(p);
+                return;
+            }
+            __atomic_fetch_or(&p->flags, PAGE_IO, __ATOMIC_RELAXED);
+        }
+        start_io(p, false);
+    }
+}
+
+page* object::find(uint64_t index, uint64_t last) {
+    if (index >= page_count())
+        return nullptr;
+
+    page* p;
+    uint64_t from, to;
+    {
+        kstd::lock_guard guard(m_lock);
+        p = m_pages.lookup(index);
+        readahead(index, last, &from, &to);
+    }
+    if (from < to)
+        start_reads(from, to);
+
+    bool retry = false;
+    {
+        kstd::lock_guard guard(m_lock);
+        if (p == nullptr)
+            p = m_pages.lookup(index);
+        // a read that failed before gets another go
+        if (p != nullptr && (p->state() & (PAGE_UPTODATE | PAGE_IO)) == 0) {
+            __atomic_fetch_and(&p->flags, ~PAGE_ERROR, __ATOMIC_RELAXED);
+            __atomic_fetch_or(&p->flags, PAGE_IO, __ATOMIC_RELAXED);
+            retry = true;
+        }
+    }
+    if (p == nullptr) {
+        // out of memory, or outside the readahead window
+        start_reads(index, index + 1);
+        kstd::lock_guard guard(m_lock);
+        p = m_pages.lookup(index);
+        if (p == nullptr)
+            return nullptr;
+    }
+    if (retry)
+        start_io(p, false);
+
+    wait_io(p);
+    return (p->state() & PAGE_UPTODATE) ? p : nullptr;
+}
+
+page* object::get_page(uint64_t index) {
+    {
+        // before the page exists, so set_size() can't free it between
+        // find() and the caller
+        kstd::lock_guard guard(m_lock);
+        if (index + 1 > m_handed_out)
+            m_handed_out = index + 1;
+    }
+    return find(index, index);
+}
+
+std::size_t object::read(uint64_t pos, void* buf, std::size_t len) {
+    uint64_t size = this->size();
+    if (pos >= size || len == 0)
+        return 0;
+    if (len > size - pos)
+        len = size - pos;
+    uint64_t last = (pos + len - 1) / PAGE_SIZE;
+
+    std::size_t done = 0;
+    while (done < len) {
+        uint64_t at = pos + done;
+        std::size_t offset = at % PAGE_SIZE;
+        std::size_t n = PAGE_SIZE - offset < len - done ? PAGE_SIZE - offset
+                                                        : len - done;
+        page* p = find(at / PAGE_SIZE, last);
+        if (p == nullptr)
+            break;
+        memcpy((uint8_t*)buf + done, page_data(p) + offset, n);
+        done += n;
+    }
+    return done;
+}
+
+std::size_t object::write(uint64_t pos, const void* buf, std::size_t len) {
+    std::size_t done = 0;
+    while (done < len) {
+        uint64_t at = pos + done;
+        uint64_t index = at / PAGE_SIZE;
+        std::size_t offset = at % PAGE_SIZE;
+        std::size_t n = PAGE_SIZE - offset < len - done ? PAGE_SIZE - offset
+                                                        : len - done;
+
+        // the old contents only matter where the write leaves some of
+        // them inside the object
+        uint64_t size = this->size();
+        bool whole = index * PAGE_SIZE >= size ||
+                     (offset == 0 && (n == PAGE_SIZE || at + n >= size));
+        page* p;
+        if (whole) {
+            kstd::lock_guard guard(m_lock);
+            p = m_pages.lookup(index);
+            if (p == nullptr) {
+                p = new_page(index, true);
+                if (p == nullptr)
+                    break;
+                if (!m_pages.insert(index, p)) {
+                    free_page(p);
+                    break;
+                }
+                __atomic_fetch_or(&p->flags, PAGE_UPTODATE, __ATOMIC_RELAXED);
+            }
+        } else {
+            p = find(index, index);
+            if (p == nullptr)
+                break;
+        }
+
+        // copy with the lock held and no I/O in flight, so writeback
+        // can't take the page halfway through
+        for (;;) {
+            {
+                kstd::lock_guard guard(m_lock);
+                if ((p->state() & PAGE_IO) == 0) {
+                    memcpy(page_data(p) + offset, (const uint8_t*)buf + done, n);
+                    __atomic_fetch_and(&p->flags, ~PAGE_ERROR, __ATOMIC_RELAXED);
+                    __atomic_fetch_or(&p->flags, PAGE_UPTODATE, __ATOMIC_RELAXED);
+                    mark_dirty(p);
+                    break;
+                }
+            }
+            wait_io(p);
+        }
+        done += n;
+    }
+
+    if (done != 0) {
+        kstd::lock_guard guard(m_lock);
+        if (pos + done > m_size)
+            __atomic_store_n(&m_size, pos + done, __ATOMIC_RELAXED);
+    }
+    if (dirty_pages() >= WRITEBACK_BATCH)
+        writeback(false);
+    return done;
+}
+
+bool object::set_size(uint64_t size) {
+    kstd::lock_guard guard(m_lock);
+    uint64_t old = m_size;
+    uint64_t keep = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (size < old && keep < m_handed_out)
+        return false;
+    __atomic_store_n(&m_size, size, __ATOMIC_RELAXED);
+    if (size >= old)
+        return true;
+
+    // the tail of the last page reads as zeros if the object grows again
+    if (size % PAGE_SIZE != 0) {
+        page* p = m_pages.lookup(size / PAGE_SIZE);
+        if (p != nullptr && (p->state() & PAGE_UPTODATE))
+            memset(page_data(p) + size % PAGE_SIZE, 0,
+                   PAGE_SIZE - size % PAGE_SIZE);
+    }
+
+    page* batch[WRITEBACK_BATCH];
+    for (;;) {
+        std::size_t n = m_pages.gang_lookup(keep, batch, WRITEBACK_BATCH);
+        if (n == 0)
+            break;
+        for (std::size_t i = 0; i < n; i++) {
+            page* p = batch[i];
+            // pages under I/O are left for now; a read of them fails
+            // once they're past the end
+            if (p->state() & PAGE_IO) {
+                keep = p->index + 1;
+                continue;
+            }
+            if (p->state() & PAGE_DIRTY)
+                __atomic_store_n(&m_num_dirty, m_num_dirty - 1,
+                                 __ATOMIC_RELAXED);
+            m_pages.remove(p->index);
+            free_page(p);
+        }
+        if (n < WRITEBACK_BATCH)
+            break;
+    }
+    return true;
+}
+
+void object::set_huge(bool huge) {
+    kstd::lock_guard guard(m_lock);
+    m_huge = huge && m_disk == nullptr;
+}
+
+bool object::huge_frame(uint64_t first, uintptr_t* frame) {
+    if (first % HUGE_PAGES != 0)
+        return false;
+
+    kstd::lock_guard guard(m_lock);
+    page* p = m_pages.lookup(first);
+    if (p == nullptr || (p->state() & PAGE_HUGE) == 0 ||
+        p->frame % (HUGE_PAGES * PAGE_SIZE) != 0)
+        return false;
+    uintptr_t base = p->frame;
+    for (uint64_t i = 1; i < HUGE_PAGES; i++) {
+        p = m_pages.lookup(first + i);
+        if (p == nullptr || (p->state() & PAGE_HUGE) == 0 ||
+            p->frame != base + i * PAGE_SIZE)
+            return false;
+    }
+    if (first + HUGE_PAGES > m_handed_out)
+        m_handed_out = first + HUGE_PAGES;
+    *frame = base;
+    return true;
+}
+
+bool object::writeback(bool wait) {
+    if (m_disk == nullptr)
+        return true;
+
+    bool ok = true;
+    page* batch[WRITEBACK_BATCH];
+    uint64_t next = 0;
+    for (;;) {
+        std::size_t n;
+        {
+            kstd::lock_guard guard(m_lock);
+            n = m_pages.gang_lookup_tag(next, batch, WRITEBACK_BATCH,
+                                        TAG_DIRTY);
+            for (std::size_t i = 0; i < n; i++) {
+                page* p = batch[i];
+                m_pages.clear_tag(p->index, TAG_DIRTY);
+                __atomic_fetch_and(&p->flags, ~(PAGE_DIRTY | PAGE_ERROR),
+                                   __ATOMIC_RELAXED);
+                __atomic_fetch_or(&p->flags, PAGE_IO, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&m_num_dirty, m_num_dirty - n, __ATOMIC_RELAXED);
+        }
+        if (n == 0)
+            break;
+
+        {
+            // in index order, so runs that are contiguous on disk merge
+            blk::plug plug;
+            for (std::size_t i = 0; i < n; i++)
+                start_io(batch[i], true);
+        }
+        next = batch[n - 1]->index + 1;
+
+        if (wait) {
+            for (std::size_t i = 0; i < n; i++) {
+                wait_io(batch[i]);
+                if (batch[i]->state() & PAGE_ERROR)
+                    ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+static uint64_t map_identity(void*, uint64_t sector, bool) {
+    return sector;
+}
+
+static const object_ops s_disk_ops = { &map_identity };
+
+static blk::disk* s_disk_keys[blk::MAX_DISKS];
+static object* s_disk_objects[blk::MAX_DISKS];
+static kstd::ticket_lock s_disk_lock;
+
+object* disk_object(blk::disk* d) {
+    kstd::lock_guard guard(s_disk_lock);
+    for (std::size_t i = 0; i < blk::MAX_DISKS; i++) {
+        if (s_disk_keys[i] == d)
+            return s_disk_objects[i];
+        if (s_disk_keys[i] != nullptr)
+            continue;
+        object* o = new object(d, &s_disk_ops, nullptr,
+                               d->sectors() * blk::SECTOR_SIZE);
+        if (o == nullptr)
+            return nullptr;
+        s_disk_keys[i] = d;
+        s_disk_objects[i] = o;
+        return o;
+    }
+    return nullptr;
+}
+
+} // namespace cache
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/radix_tree.hpp"
+#include "stdlib/sync.hpp"
+
+#include "block.hpp"
+
+namespace cache {
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+inline static constexpr std::size_t SECTORS_PER_PAGE = PAGE_SIZE / blk::SECTOR_SIZE;
+
+// what object_ops::map returns for a sector with no backing store
+inline static constexpr uint64_t NO_BLOCK = ~0ull;
+
+// pages read ahead when a sequential run starts, and the most the window
+// doubles up to
+#ifdef K_READAHEAD_MIN
+    inline static constexpr uint64_t READAHEAD_MIN = K_READAHEAD_MIN;
+#else
+    inline static constexpr uint64_t READAHEAD_MIN = 4;
+#endif
+
+#ifdef K_READAHEAD_MAX
+    inline static constexpr uint64_t READAHEAD_MAX = K_READAHEAD_MAX;
+#else
+    inline static constexpr uint64_t READAHEAD_MAX = 64;
+#endif
+
+// dirty pages an object collects before writes start pushing them out,
+// and how many go down under one plug
+#ifdef K_WRITEBACK_BATCH
+    inline static constexpr std::size_t WRITEBACK_BATCH = K_WRITEBACK_BATCH;
+#else
+    inline static constexpr std::size_t WRITEBACK_BATCH = 64;
+#endif
+
+// pages in a huge block: one 2MB frame
+inline static constexpr uint64_t HUGE_PAGES = 512;
+
+// page flags, only changed with atomic RMWs
+inline static constexpr uint32_t PAGE_UPTODATE = 1 << 0;
+inline static constexpr uint32_t PAGE_DIRTY    = 1 << 1;
+inline static constexpr uint32_t PAGE_IO       = 1 << 2;   // read or write in flight
+inline static constexpr uint32_t PAGE_ERROR    = 1 << 3;
+inline static constexpr uint32_t PAGE_HUGE     = 1 << 4;   // part of a huge block
+
+class object;
+
+// one cached page. once get_page() or huge_frame() has handed it out it
+// stays put for as long as its object does - set_size() won't drop it -
+// so a pointer to it (or its frame) can be held without a reference
+struct page {
+    uintptr_t frame;
+    uint64_t index;
+    object* owner;
+    uint32_t flags;
+
+    // for the I/O that fills or cleans it when it's contiguous on disk
+    blk::bio bio;
+    blk::bio_vec vec;
+
+    inline uint32_t state() const {
+        return __atomic_load_n(&flags, __ATOMIC_ACQUIRE);
+    }
+};
+
+// where an object's data lives
+struct object_ops {
+    // the disk sector backing the object's sector, NO_BLOCK for a hole,
+    // which reads as zeros. with allocate, a hole is given a sector
+    // first, and NO_BLOCK means that failed
+    uint64_t (*map)(void* owner, uint64_t sector, bool allocate);
+};
+
+// a cached file, device or anything else addressed by byte offset: its
+// pages indexed by page number in a radix tree. sequential reads grow a
+// readahead window that keeps ahead of the reader; writes dirty pages,
+// which go back to disk in index order, batched under a plug so the
+// block layer can merge them. without a disk there's nothing to read or
+// write back and the cache is the only copy
+class object {
+public:
+    object(blk::disk* d, const object_ops* ops, void* owner, uint64_t size);
+
+    // writes back, then frees every page
+    ~object();
+
+    object(const object&) = delete;
+    object& operator=(const object&) = delete;
+
+    inline uint64_t size() const {
+        return __atomic_load_n(&m_size, __ATOMIC_RELAXED);
+    }
+
+    // shrinking drops the pages past the new end, dirty or not. false,
+    // changing nothing, if that would drop a page get_page() or
+    // huge_frame() has handed out
+    bool set_size(uint64_t size);
+
+    // bytes copied, short at the end of the object or on an I/O error
+    std::size_t read(uint64_t pos, void* buf, std::size_t len);
+
+    // grows the object if it writes past the end; short only when memory
+    // runs out
+    std::size_t write(uint64_t pos, const void* buf, std::size_t len);
+
+    // the page at index, read in if need be; null past the end of the
+    // object, on an I/O error or out of memory
+    page* get_page(uint64_t index);
+
+    // starts writing every dirty page, and with wait, waits for them.
+    // false if any of them failed
+    bool writeback(bool wait);
+
+    inline std::size_t dirty_pages() const {
+        return __atomic_load_n(&m_num_dirty, __ATOMIC_RELAXED);
+    }
+
+    inline std::size_t cached_pages() const {
+        return m_pages.size();
+    }
+
+    // for objects without a disk: from now on, pages come in whole,
+    // naturally aligned blocks of HUGE_PAGES cut from one huge frame, so
+    // a block can be mapped as a single 2MB page. a block that already
+    // has pages, or that finds no free huge frame, gets single frames
+    void set_huge(bool huge);
+
+    // the huge frame behind the block of HUGE_PAGES starting at first,
+    // if every page of it is cached and still the one allocation
+    bool huge_frame(uint64_t first, uintptr_t* frame);
+
+private:
+    inline static constexpr unsigned TAG_DIRTY = 0;
+
+    uint64_t page_count() const;
+    page* find(uint64_t index, uint64_t last);
+    page* new_page(uint64_t index, bool zeroed);
+    page* new_huge_block(uint64_t index);
+    void free_page(page* p);
+    void readahead(uint64_t index, uint64_t last, uint64_t* from, uint64_t* to);
+    void start_reads(uint64_t from, uint64_t to);
+    void start_io(page* p, bool write);
+    bool sync_io(page* p, bool write, const uint64_t* lbas, unsigned sectors);
+    void wait_io(page* p);
+    void mark_dirty(page* p);
+
+    blk::disk* m_disk;
+    const object_ops* m_ops;
+    void* m_owner;
+    uint64_t m_size;
+    bool m_huge = false;
+
+    kstd::ticket_lock m_lock;
+    kstd::radix_tree<page, 1> m_pages;
+    std::size_t m_num_dirty = 0;
+    // one past the last page index get_page() or huge_frame() covered
+    uint64_t m_handed_out = 0;
+
+    // readahead state: the last page asked for, the first not yet read
+    // ahead and the current window, 0 while access looks random
+    uint64_t m_last_index = ~0ull;
+    uint64_t m_ra_next = 0;
+    uint64_t m_ra_window = 0;
+};
+
+// the whole of a disk as an object, shared by everything that reads it
+// raw (filesystem metadata, say); null if memory runs out
+object* disk_object(blk::disk* d);
+
+} // namespace cache
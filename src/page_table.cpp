@@ -3,6 +3,8 @@
 #include "stdlib/cstdlib.hpp"
 
 #include "page_table.hpp"
+#include "ipi.hpp"
+#include "zero_pool.hpp"
 
 #include "util.hpp"
 
@@ -16,26 +18,37 @@ namespace mem {
 
 inline static constexpr std::size_t PT_SIZE = 512 * PAGE_SIZE;
 
+// lives in .bss, so it is zero from the moment the kernel is loaded
+alignas(4096) static const uint8_t s_zero_page[4096] = { };
+
 NO_RETURN inline static void halt() {
     for(;;)
         __asm__("cli\n\thlt\n\t");
 }
 
-void page_table::init() {
+void page_table::init(physical_address kernel_phys_base, 
+                      virtual_address kernel_virt_base) 
+{
+	m_kernel_phys_base = kernel_phys_base;
+	m_kernel_virt_base = kernel_virt_base;
+
 	// zero all tables
 	memset_safe(&m_ptes, 0);
 	memset_safe(&m_pdtes, 0);
 	memset_safe(&m_pdptes, 0);
 	memset_safe(&m_pml4tes, 0);
 	//memset_safe(&m_pml5tes, 0);
-	// ...and zero phys_addr_map
-	memset_safe(m_phys_addr_map, 0);
+	// ...and reserve every frame until the memory map says otherwise
+	for (std::size_t i = 0; i < m_phys_addr_map.size(); i++)
+		m_phys_addr_map[i] = ~0ull;
+	m_phys_search_hint = 0;
+	m_zero_page = kernel_virt_to_phys(s_zero_page);
 
 	// identity map first 16MB, leave the rest to be allocated on demand
-	m_pml4tes[0]    = ((uint64_t)(&m_pdptes[0][0]) & ~0xFFF) | 0x03;
-	m_pdptes[0][0]  = ((uint64_t)(&m_pdtes[0][0][0]) & ~0xFFF) | 0x03;
+	m_pml4tes[0]    = kernel_virt_to_phys(&m_pdptes[0][0]) | 0x03;
+	m_pdptes[0][0]  = kernel_virt_to_phys(&m_pdtes[0][0][0]) | 0x03;
 	for (int i = 0; i < 8; i++)
-		m_pdtes[0][0][i] = ((uint64_t)(&m_ptes[0][0][i][0]) & ~0xFFF) | 0x03;
+		m_pdtes[0][0][i] = kernel_virt_to_phys(&m_ptes[0][0][i][0]) | 0x03;
 
 	for (int i = 0; i < 8; i++) {
 		for (int j = 0; j < 512; j++) {
@@ -43,6 +56,226 @@ void page_table::init() {
                 (((i * PT_SIZE) + (j * PAGE_SIZE)) & ~0xFFF) | 0x03;
         }
 	}
+
+	// share the bootloader's higher half (kernel image, HHDM) so that
+	// tables built under it are visible whichever CR3 is loaded
+	if (hhdm_offset != 0) {
+		const uint64_t* live_pml4t = 
+			(const uint64_t*)phys_to_virt((uintptr_t)rcr3() & PTE_ADDR_MASK);
+		for (std::size_t i = 256; i < 512; i++)
+			m_pml4tes[i] = live_pml4t[i];
+	}
+
+	xlat_flush();
+}
+
+void page_table::xlat_flush() {
+	for (auto& cache : m_xlat_cache) {
+		for (auto& e : cache.entries)
+			e.vpn.store(XLAT_INVALID_VPN, kstd::memory_order_relaxed);
+	}
+}
+
+bool page_table::xlat_lookup(uintptr_t vpn, uintptr_t& pfn) const {
+	const xlat_entry& e = 
+		m_xlat_cache[cpu::id()].entries[vpn & (XLAT_CACHE_ENTRIES - 1)];
+	if (e.vpn.load(kstd::memory_order_acquire) != vpn)
+		return false;
+
+	pfn = e.pfn.load(kstd::memory_order_relaxed);
+	// a concurrent invalidate() may have slipped in between the two loads
+	kstd::atomic_thread_fence(kstd::memory_order_acquire);
+	return e.vpn.load(kstd::memory_order_relaxed) == vpn;
+}
+
+void page_table::xlat_fill(uintptr_t vpn, uintptr_t pfn) const {
+	xlat_entry& e = 
+		m_xlat_cache[cpu::id()].entries[vpn & (XLAT_CACHE_ENTRIES - 1)];
+	e.vpn.store(XLAT_INVALID_VPN, kstd::memory_order_relaxed);
+	kstd::atomic_thread_fence(kstd::memory_order_release);
+	e.pfn.store(pfn, kstd::memory_order_relaxed);
+	e.vpn.store(vpn, kstd::memory_order_release);
+}
+
+void page_table::xlat_invalidate(uintptr_t vpn, std::size_t first_cpu,
+                                 std::size_t end_cpu) const
+{
+	std::size_t slot = vpn & (XLAT_CACHE_ENTRIES - 1);
+
+	// the cache is direct mapped, so each CPU has at most one copy
+	for (std::size_t i = first_cpu; i < end_cpu; i++) {
+		uintptr_t expected = vpn;
+		m_xlat_cache[i].entries[slot].vpn.compare_exchange_strong(
+			expected, XLAT_INVALID_VPN, kstd::memory_order_seq_cst,
+			kstd::memory_order_relaxed);
+	}
+}
+
+void page_table::invalidate(virtual_address virt_addr) {
+	xlat_invalidate(virt_addr >> 12, 0, cpu::count());
+
+	// the higher half is shared with whatever CR3 is live, so flush
+	// even when this table isn't the one loaded
+	invlpg(virt_addr.const_ptr());
+}
+
+void page_table::shootdown(virtual_address virt_addr, std::size_t num_pages) {
+	// every CPU caches the shared higher half whichever table it runs on.
+	// the lower half hardly changes after boot, so it goes everywhere too
+	// rather than tracking which CPUs ever loaded this table
+	ipi::tlb_shootdown(cpu::online_mask(), virt_addr, num_pages);
+
+	// the xlat caches are plain memory, so rather than each CPU clearing
+	// its own from the IPI they're all cleared from here, once the TLBs
+	// are: anything filled from the old entries since is gone as well
+	if (num_pages > ipi::SHOOTDOWN_FULL_FLUSH) {
+		xlat_flush();
+		return;
+	}
+	uintptr_t vpn = virt_addr >> 12;
+	for (std::size_t i = 0; i < num_pages; i++)
+		xlat_invalidate(vpn + i, 0, cpu::count());
+}
+
+uint64_t* page_table::static_table(virtual_address virt_addr, pt_level l) const {
+	std::size_t pml4t_index = pt_index(virt_addr, pt_level::pml4t);
+	std::size_t pdpt_index  = pt_index(virt_addr, pt_level::pdpt);
+	std::size_t pdt_index   = pt_index(virt_addr, pt_level::pdt);
+
+	// the static tables have a fixed layout, so the table covering an
+	// address is a single array index away as long as it's inside it
+	if (l == pt_level::pml4t)
+		return const_cast<uint64_t*>(m_pml4tes);
+	if (pml4t_index >= NUM_PML4TES)
+		return nullptr;
+
+	if (l == pt_level::pdpt)
+		return const_cast<uint64_t*>(m_pdptes[pml4t_index]);
+	if (pdpt_index >= NUM_PDPTES)
+		return nullptr;
+
+	if (l == pt_level::pdt)
+		return const_cast<uint64_t*>(m_pdtes[pml4t_index][pdpt_index]);
+	if (pdt_index >= NUM_PDTES)
+		return nullptr;
+
+	return const_cast<uint64_t*>(m_ptes[pml4t_index][pdpt_index][pdt_index]);
+}
+
+uint64_t* page_table::entry_ptr(virtual_address virt_addr, pt_level l,
+                                const uint64_t* parent) const 
+{
+	uint64_t* table = static_table(virt_addr, l);
+	if (table == nullptr) {
+		// outside the static layout tables are ordinary frames, reached
+		// through the HHDM from the parent entry
+		if (parent == nullptr)
+			parent = entry_ptr(virt_addr, (pt_level)((unsigned)l + 1));
+		if (parent == nullptr || (*parent & PTE_PRESENT) == 0 || 
+		    (*parent & PTE_HUGE) != 0 || hhdm_offset == 0)
+			return nullptr;
+		table = (uint64_t*)phys_to_virt(*parent & PTE_ADDR_MASK);
+	}
+	return &table[pt_index(virt_addr, l)];
+}
+
+page_table::physical_address page_table::new_table(virtual_address virt_addr, 
+                                                   pt_level l) 
+{
+	uint64_t* table = static_table(virt_addr, l);
+	if (table != nullptr)
+		return kernel_virt_to_phys(table);
+
+	if (hhdm_offset == 0)
+		return nullptr;
+
+	return alloc_zeroed_frame();
+}
+
+uint64_t* page_table::ensure_pte(virtual_address virt_addr) {
+	uint64_t* parent = nullptr;
+	for (unsigned l = (unsigned)pt_level::pml4t; l > (unsigned)pt_level::pt; l--) {
+		uint64_t* e = entry_ptr(virt_addr, (pt_level)l, parent);
+		if (e == nullptr)
+			return nullptr;
+
+		if ((*e & PTE_PRESENT) == 0) {
+			physical_address table = new_table(virt_addr, (pt_level)(l - 1));
+			if (IS_NULL(table))
+				return nullptr;
+			// leave permission checks to the leaf entries
+			*e = table | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+		} else if (*e & PTE_HUGE)
+			return nullptr;
+
+		parent = e;
+	}
+	return entry_ptr(virt_addr, pt_level::pt, parent);
+}
+
+void page_table::mark_phys_addr(physical_address phys_addr, bool allocated) {
+	uintptr_t pfn = phys_addr / PAGE_SIZE;
+	std::size_t word = pfn / SIZE_IN_BITS<uint64_t>();
+	uint64_t bit = 1ull << (pfn % SIZE_IN_BITS<uint64_t>());
+	if (word >= m_phys_addr_map.size())
+		return;
+
+	if (allocated)
+		m_phys_addr_map[word] |= bit;
+	else
+		m_phys_addr_map[word] &= ~bit;
+}
+
+void page_table::release_phys_range(physical_address base, std::size_t length) {
+	uintptr_t begin = (base + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+	uintptr_t end = (base + length) & ~(PAGE_SIZE - 1);
+
+	// frames under 16MB back the identity map and are never handed out
+	if (begin < 16_mb)
+		begin = 16_mb;
+	kstd::irq_mcs_guard guard(m_frame_lock);
+	for (; begin < end; begin += PAGE_SIZE)
+		mark_phys_addr(begin, false);
+}
+
+page_table::physical_address page_table::alloc_frame() {
+	kstd::irq_mcs_guard guard(m_frame_lock);
+	physical_address phys_addr = find_free_phys_addr();
+	if (!IS_NULL(phys_addr))
+		mark_phys_addr(phys_addr, true);
+	return phys_addr;
+}
+
+page_table::physical_address page_table::alloc_huge_frame() {
+	// a huge frame is 8 whole words of the bitmap, aligned when the first
+	// one is. rare enough for a plain scan from the start
+	constexpr std::size_t words = 512 / SIZE_IN_BITS<uint64_t>();
+	kstd::irq_mcs_guard guard(m_frame_lock);
+	std::size_t num_words = m_phys_addr_map.size() & ~(words - 1);
+	for (std::size_t word = 0; word < num_words; word += words) {
+		std::size_t i = 0;
+		while (i < words && m_phys_addr_map[word + i] == 0)
+			i++;
+		if (i != words)
+			continue;
+
+		for (i = 0; i < words; i++)
+			m_phys_addr_map[word + i] = ~0ull;
+		return word * SIZE_IN_BITS<uint64_t>() * PAGE_SIZE;
+	}
+	return nullptr;
+}
+
+void page_table::free_frame(physical_address phys_addr) {
+	if (phys_addr == m_zero_page)
+		return;
+	unmap_phys_addr(phys_addr);
+}
+
+bool page_table::map_page(virtual_address virt_addr, physical_address phys_addr,
+                          uint64_t flags)
+{
+	return map_phys_addr(phys_addr, virt_addr, flags);
 }
 
 bool page_table::is_physically_allocated(physical_address phys_addr) const {
@@ -55,11 +288,12 @@ bool page_table::is_physically_allocated(physical_address phys_addr) const {
 	if (phys_addr == m_last_mapped_phys_addr)
 		return true;
 
-	phys_addr &= ~0xFFF; // 4KB-align address
-	phys_addr /= PAGE_SIZE;
-	uintptr_t page_index = reinterpret_cast<uintptr_t>(phys_addr / m_phys_addr_map.size());
-	uintptr_t page_pos   = reinterpret_cast<uintptr_t>(phys_addr % SIZE_IN_BITS(*m_phys_addr_map.data()));
-	return (m_phys_addr_map[page_index] & (1 << page_pos)) != 0x00000000;
+	uintptr_t pfn = phys_addr / PAGE_SIZE;
+	std::size_t page_index = pfn / SIZE_IN_BITS<uint64_t>();
+	uint64_t    page_bit   = 1ull << (pfn % SIZE_IN_BITS<uint64_t>());
+	if (page_index >= m_phys_addr_map.size())
+		return true; // beyond the bitmap, never handed out
+	return (m_phys_addr_map[page_index] & page_bit) != 0;
 }
 
 bool page_table::is_virtually_allocated(virtual_address virt_addr) const {
@@ -69,70 +303,31 @@ bool page_table::is_virtually_allocated(virtual_address virt_addr) const {
 	if (virt_addr < 0x1000000)
         return 1; // memory under 16MB guaranteed to be identity mapped
 
-	uint16_t pml4t_index = (virt_addr >> 39) & 0x01FF;
-	uint16_t pdpt_index  = (virt_addr >> 30) & 0x01FF;
-	uint16_t pdt_index   = (virt_addr >> 21) & 0x01FF;
-	uint16_t pt_index    = (virt_addr >> 12) & 0x01FF;
-
 	// if entries aren't present, page can't be allocated
-	if ((m_pml4tes[pml4t_index] & 0x01) == 0x00)
-		return false;
-
-	if ((m_pdptes[pml4t_index][pdpt_index] & 0x01) == 0x00)
-		return false;
-
-	if ((m_pdtes[pml4t_index][pdpt_index][pdt_index] & 0x01) == 0x00)
-		return false;
-
-	if ((m_ptes[pml4t_index][pdpt_index][pdt_index][pt_index] & 0x01) == 0x00)
-		return false;
-
-	return true;
+	return walk(virt_addr).is_leaf();
 }
 
-bool page_table::map_phys_addr(physical_address phys_addr, virtual_address virt_addr) {
-	uint16_t pml4t_index   = (virt_addr >> 39) & 0x01FF;
-	uint16_t pdpt_index    = (virt_addr >> 30) & 0x01FF;
-	uint16_t pdt_index     = (virt_addr >> 21) & 0x01FF;
-	uint16_t pt_index      = (virt_addr >> 12) & 0x01FF;
-
+bool page_table::map_phys_addr(physical_address phys_addr, virtual_address virt_addr,
+                               uint64_t flags) 
+{
 	if (virt_addr & 0xFFF)
 		return false;
 
 	if (phys_addr & 0xFFF)
 		return false;
 
-	// bail if page is already allocated
-	if (is_virtually_allocated(virt_addr))
-		return false;
-
-    if ((m_pml4tes[pml4t_index] & 0x03) != 0x03) {
-		m_pml4tes[pml4t_index] = 
-            (uint64_t)(&m_pdptes[pml4t_index][pdpt_index]) | 0x03;
-    }
-
-    if ((m_pdptes[pml4t_index][pdpt_index] & 0x03) != 0x03) { 
-        m_pdptes[pml4t_index][pdpt_index] = 
-            (uint64_t)(&m_pdtes[pml4t_index][pdpt_index][pdt_index]) | 0x03;
-    }
-    halt();
-
-    if ((m_pdtes[pml4t_index][pdpt_index][pdt_index] & 0x03) != 0x03) { 
-		m_pdtes[pml4t_index][pdpt_index][pdt_index] = 
-            (uint64_t)(&m_ptes[pml4t_index][pdpt_index][pdt_index][pt_index]) |
-                       0x03;
-    }
+	{
+		kstd::irq_mcs_guard guard(m_table_lock);
+		// bail if page is already allocated
+		uint64_t* pte = ensure_pte(virt_addr);
+		if (pte == nullptr || (*pte & PTE_PRESENT) != 0)
+			return false;
 
-    if ((m_ptes[pml4t_index][pdpt_index][pdt_index][pt_index] & 0x03) != 0x03)
-    {
-		m_ptes[pml4t_index][pdpt_index][pdt_index][pt_index] = 
-            phys_addr | 0x03;
-    }
+		*pte = phys_addr | PTE_PRESENT | flags;
+	}
 
-	phys_addr /= PAGE_SIZE;
-	uint16_t page_index = phys_addr / NUM_PHYS_ADDR_MAP_ENTRIES;
-	uint8_t  page_pos   = phys_addr % SIZE_IN_BITS(*m_phys_addr_map.data());
-	m_phys_addr_map[page_index] |= (1 << page_pos);
+	kstd::irq_mcs_guard guard(m_frame_lock);
+	mark_phys_addr(phys_addr, true);
 	return true;
 }
 
@@ -150,13 +345,15 @@ void* page_table::alloc_page(virtual_address virt_addr) {
 	if (is_virtually_allocated(virt_addr))
 		return const_cast<void*>(virt_addr.const_ptr());
 
-	physical_address phys_addr = find_free_phys_addr();
+	physical_address phys_addr = alloc_frame();
 	if (IS_NULL(phys_addr))
 		return nullptr;
 	
 	// ...and map them
-	if (ERROR(map_phys_addr(phys_addr, virt_addr)))
+	if (ERROR(map_phys_addr(phys_addr, virt_addr))) {
+		free_frame(phys_addr);
 		return nullptr;
+	}
 	m_last_mapped_virt_addr = virt_addr.const_ptr();
 	m_last_mapped_phys_addr = phys_addr.const_ptr();
     for(auto& r : m_allocated_pages) {
@@ -203,18 +400,9 @@ bool page_table::unmap_virt_addr(virtual_address virt_addr) {
 	if (virt_addr & 0xFFF)
 		return false;
 
-	// bail if page is already allocated
-	if (is_virtually_allocated(virt_addr))
+	if (clear_leaf(virt_addr) == CLEAR_FAILED)
 		return false;
-
-	uint16_t pml4t_index = (virt_addr >> 39) & 0x01FF;
-	uint16_t pdpt_index  = (virt_addr >> 30) & 0x01FF;
-	uint16_t pdt_index   = (virt_addr >> 21) & 0x01FF;
-	uint16_t pt_index    = (virt_addr >> 12) & 0x01FF;
-
-	// clear PT entry
-	m_ptes[pml4t_index][pdpt_index][pdt_index][pt_index] = 0x00000000;
-
+	shootdown(virt_addr, 1);
 	return true;
 }
 
@@ -225,59 +413,76 @@ bool page_table::unmap_phys_addr(physical_address phys_addr) {
 	if (!is_physically_allocated(phys_addr))
 		return false;
 
-	phys_addr /= PAGE_SIZE;
-
 	// and clear bit in phys_addr_map
-	uint16_t page_index = phys_addr / NUM_PHYS_ADDR_MAP_ENTRIES;
-	uint8_t  page_pos = phys_addr % SIZE_IN_BITS(*m_phys_addr_map.data());
-	m_phys_addr_map[page_index] &= ~(1 << page_pos);
+	kstd::irq_mcs_guard guard(m_frame_lock);
+	mark_phys_addr(phys_addr, false);
 	return true;
 }
 
 bool page_table::dealloc_page(virtual_address virt_addr) {
-	if (virt_addr & ~0xFFF)
-		return false;
-
-	if (!is_virtually_allocated(virt_addr))
+	if (virt_addr & 0xFFF)
 		return false;
 
-	uint16_t pml4t_index = (virt_addr >> 39) & 0x01FF;
-	uint16_t pdpt_index  = (virt_addr >> 30) & 0x01FF;
-	uint16_t pdt_index   = (virt_addr >> 21) & 0x01FF;
-	uint16_t pt_index    = (virt_addr >> 12) & 0x01FF;
-
-	// bail if entries are not present
-	if ((m_pml4tes[pml4t_index] & 0x01) == 0x00000000)
+	// the identity mapped low 16MB is never handed out, so never taken back
+	if (virt_addr < 16_mb)
 		return false;
 
-	if ((m_pdptes[pml4t_index][pdpt_index] & 0x01) == 0x00000000)
+	uintptr_t phys_addr = clear_leaf(virt_addr);
+	if (phys_addr == CLEAR_FAILED)
 		return false;
 
-	if ((m_pdtes[pml4t_index][pdpt_index][pdt_index] & 0x01) == 0x00000000)
-		return false;
+	// nobody may still reach the frame through a stale TLB entry by the
+	// time it's handed out again
+	shootdown(virt_addr, 1);
 
-	if ((m_ptes[pml4t_index][pdpt_index][pt_index][pt_index] & 0x01) == 
-            0x00000000)
-		return false;
-
-	// zero PT entry
-    m_ptes[pml4t_index][pdpt_index][pt_index][pt_index] = 0x00000000;
-	// unmap virtual address
-	if (unmap_virt_addr(virt_addr))
-		return false;
-	// and unmap physical address
-	return unmap_phys_addr(to_phys_addr(virt_addr));
+	// and unmap physical address, unless it's the shared zero page
+	if (phys_addr == m_zero_page)
+		return true;
+	return unmap_phys_addr(phys_addr);
 }
 
 bool page_table::dealloc_pages(virtual_address virt_addr, std::size_t num_pages) {
 	bool b = true;
-	for (std::size_t i = 0; i < num_pages; i++) {
-		if (ERROR(dealloc_page(virt_addr)))
-			b = false;
+	// clear a batch of entries, then shoot them all down with one IPI
+	// per CPU before freeing their frames
+	uintptr_t frames[ipi::SHOOTDOWN_FULL_FLUSH];
+	while (num_pages != 0) {
+		std::size_t n = num_pages < ipi::SHOOTDOWN_FULL_FLUSH ? 
+		                num_pages : ipi::SHOOTDOWN_FULL_FLUSH;
+		virtual_address batch = virt_addr;
+		for (std::size_t i = 0; i < n; i++) {
+			frames[i] = virt_addr < 16_mb ? CLEAR_FAILED : clear_leaf(virt_addr);
+			if (frames[i] == CLEAR_FAILED)
+				b = false;
+			virt_addr += PAGE_SIZE;
+		}
+
+		shootdown(batch, n);
+		for (std::size_t i = 0; i < n; i++) {
+			if (frames[i] != CLEAR_FAILED && frames[i] != m_zero_page)
+				unmap_phys_addr(frames[i]);
+		}
+		num_pages -= n;
 	}
 	return b;
 }
 
+uintptr_t page_table::clear_leaf(virtual_address virt_addr) {
+	kstd::irq_mcs_guard guard(m_table_lock);
+
+	// bail if page isn't mapped by a PT entry
+	pte_ref r = walk(virt_addr);
+	if (!r.is_leaf() || r.level != pt_level::pt)
+		return CLEAR_FAILED;
+
+	uintptr_t phys_addr = *r.entry & PTE_ADDR_MASK;
+
+	// zero PT entry
+	*r.entry = 0x00000000;
+	invalidate(virt_addr);
+	return phys_addr;
+}
+
 page_table::virtual_address page_table::find_free_virt_addr() const {
 	virtual_address test_vaddr;
 	if (m_last_mapped_virt_addr == nullptr)
@@ -299,47 +504,94 @@ page_table::virtual_address page_table::find_free_virt_addr() const {
 }
 
 page_table::physical_address page_table::find_free_phys_addr() const {
-	physical_address test_paddr;
-	if (m_last_mapped_phys_addr == nullptr)
-		test_paddr = 16_mb;
-	else
-		test_paddr = m_last_mapped_virt_addr + 4096;
-
-	bool b = false;
-	for (; test_paddr < MAX_VIRTUAL_MEMORY; test_paddr += 4096) {
-		if (!is_physically_allocated(test_paddr)) {
-			b = true;
-			break;
-		}
+	// scan a word (64 frames) at a time from where the last search ended,
+	// wrapping around once
+	std::size_t num_words = m_phys_addr_map.size();
+	for (std::size_t n = 0; n < num_words; n++) {
+		std::size_t word = (m_phys_search_hint + n) % num_words;
+		uint64_t bits = m_phys_addr_map[word];
+		if (bits == ~0ull)
+			continue;
+
+		m_phys_search_hint = word;
+		uintptr_t pfn = word * SIZE_IN_BITS<uint64_t>() + __builtin_ctzll(~bits);
+		return pfn * PAGE_SIZE;
 	}
-	if (b == false)
-		return nullptr;
-
-	return test_paddr;
+	return nullptr;
 }
 
 page_table::physical_address page_table::to_phys_addr(virtual_address virt_addr) const {
-	uint16_t offset = virt_addr & 0xFFF;
-
-	uint16_t pml4t_index = (virt_addr >> 39) & 0x01FF;
-	uint16_t pdpt_index  = (virt_addr >> 30) & 0x01FF;
-	uint16_t pdt_index   = (virt_addr >> 21) & 0x01FF;
-	uint16_t pt_index    = (virt_addr >> 12) & 0x01FF;
+	uintptr_t vpn = virt_addr >> 12;
+	uintptr_t pfn;
+	if (xlat_lookup(vpn, pfn))
+		return (pfn << 12) | (virt_addr & 0xFFF);
 
 	// bail if entries are not present
-	if ((m_pml4tes[pml4t_index] & 0x01) == 0x00000000)
-		return nullptr;
-
-	if ((m_pdptes[pml4t_index][pdpt_index] & 0x01) == 0x00000000)
-		return nullptr;
-
-	if ((m_pdtes[pml4t_index][pdpt_index][pdt_index] & 0x01) == 0x00000000)
+	pte_ref r = walk(virt_addr);
+	if (!r.is_leaf())
 		return nullptr;
 
+	// large pages keep more of the virtual address as the offset
+	uint64_t seen = __atomic_load_n(r.entry, __ATOMIC_RELAXED);
+	uintptr_t offset_mask = r.page_size() - 1;
 	physical_address phys_addr =
-		(m_ptes[pml4t_index][pdpt_index][pt_index][pt_index] & ~0xFFF) + offset;
-
+		(seen & PTE_ADDR_MASK & ~offset_mask) + (virt_addr & offset_mask);
+
+	xlat_fill(vpn, phys_addr >> 12);
+	// an invalidate() between the walk and the fill found nothing to
+	// clear; the entry it changed is how to tell. the fence pairs with
+	// its locked compare-exchange
+	kstd::atomic_thread_fence(kstd::memory_order_seq_cst);
+	if (__atomic_load_n(r.entry, __ATOMIC_RELAXED) != seen)
+		xlat_invalidate(vpn, cpu::id(), cpu::id() + 1);
 	return phys_addr;
 }
 
+std::size_t page_table::to_phys_ranges(virtual_address virt_addr, 
+                                       std::size_t len,
+                                       phys_range* ranges, 
+                                       std::size_t max_ranges) const 
+{
+	std::size_t num_ranges = 0;
+	uintptr_t v = (uintptr_t)virt_addr.const_ptr();
+	uintptr_t end = v + len;
+
+	while (v < end) {
+		// one walk per table, then step through its entries in place
+		pte_ref r = walk(v);
+		if (!r.is_leaf())
+			return num_ranges;
+
+		std::size_t page_size = r.page_size();
+		std::size_t entries_left = 512 - pt_index(v, r.level);
+		const uint64_t* e = r.entry;
+
+		for (; entries_left > 0 && v < end; entries_left--, e++) {
+			if ((*e & PTE_PRESENT) == 0)
+				return num_ranges;
+			if (r.level != pt_level::pt && (*e & PTE_HUGE) == 0)
+				break; // next entry points to a smaller table, re-walk
+
+			uintptr_t offset = v & (page_size - 1);
+			uintptr_t phys = (*e & PTE_ADDR_MASK & ~(page_size - 1)) + offset;
+			std::size_t chunk = page_size - offset;
+			if (chunk > end - v)
+				chunk = end - v;
+
+			phys_range* last = num_ranges ? &ranges[num_ranges - 1] : nullptr;
+			if (last != nullptr && last->base + last->length == phys) {
+				last->length += chunk;
+			} else {
+				if (num_ranges == max_ranges)
+					return num_ranges;
+				ranges[num_ranges].base = phys;
+				ranges[num_ranges].length = chunk;
+				num_ranges++;
+			}
+			v += chunk;
+		}
+	}
+	return num_ranges;
+}
+
 } // namespace mem
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "stdlib/atomic.hpp"
+#include "stdlib/sync.hpp"
+
 #include "stdlib/array.hpp"
 
 #include "asm_wrappers.hpp"
+#include "cpu.hpp"
 #include "util.hpp"
 
 namespace mem {
@@ -14,6 +18,15 @@ namespace mem {
 #endif
 inline static constexpr std::size_t MAX_PAGES = MAX_VIRTUAL_MEMORY / 4096;
 
+// entries in each CPU's direct-mapped translation cache; power of two
+#ifdef K_XLAT_CACHE_ENTRIES
+    inline static constexpr std::size_t XLAT_CACHE_ENTRIES = K_XLAT_CACHE_ENTRIES;
+#else
+	inline static constexpr std::size_t XLAT_CACHE_ENTRIES = 64;
+#endif
+static_assert((XLAT_CACHE_ENTRIES & (XLAT_CACHE_ENTRIES - 1)) == 0,
+              "XLAT_CACHE_ENTRIES must be a power of two");
+
 inline constexpr std::size_t operator""_gb(unsigned long long s) {
 	return s * 1024 * 1024 * 1024;
 }
@@ -30,12 +43,79 @@ inline constexpr std::size_t operator""_b(unsigned long long s) {
 	return s;
 }
 
+// page table entry bits shared by every level
+inline static constexpr uint64_t PTE_PRESENT   = 1ull << 0;
+inline static constexpr uint64_t PTE_WRITABLE  = 1ull << 1;
+inline static constexpr uint64_t PTE_USER      = 1ull << 2;
+inline static constexpr uint64_t PTE_PWT       = 1ull << 3;
+inline static constexpr uint64_t PTE_PCD       = 1ull << 4;
+inline static constexpr uint64_t PTE_HUGE      = 1ull << 7; // PDPTE/PDTE only
+inline static constexpr uint64_t PTE_COW       = 1ull << 9; // software: copy on write
+inline static constexpr uint64_t PTE_PINNED    = 1ull << 10; // software: frame owned elsewhere
+inline static constexpr uint64_t PTE_NX        = 1ull << 63;
+inline static constexpr uint64_t PTE_ADDR_MASK = 0x000FFFFFFFFFF000;
+
+enum class pt_level : uint8_t {
+	pt    = 1,
+	pdt   = 2,
+	pdpt  = 3,
+	pml4t = 4
+};
+
+inline constexpr unsigned pt_level_shift(pt_level l) {
+	return 12 + 9 * ((unsigned)l - 1);
+}
+
+inline constexpr std::size_t pt_index(uintptr_t virt_addr, pt_level l) {
+	return (virt_addr >> pt_level_shift(l)) & 0x01FF;
+}
+
+// result of a page table walk: the deepest entry reached and its level.
+// entry is null if the address lies outside what the table can describe
+struct pte_ref {
+	uint64_t* entry = nullptr;
+	pt_level  level = pt_level::pml4t;
+
+	inline bool valid() const {
+		return entry != nullptr;
+	}
+
+	inline bool present() const {
+		return entry != nullptr && (*entry & PTE_PRESENT) != 0;
+	}
+
+	// true if the entry maps memory rather than pointing at another table
+	inline bool is_leaf() const {
+		return present() && 
+		       (level == pt_level::pt || (*entry & PTE_HUGE) != 0);
+	}
+
+	inline std::size_t page_size() const {
+		return 1ull << pt_level_shift(level);
+	}
+};
+
+// offset of Limine's higher half direct map; every physical page is
+// reachable at phys + hhdm_offset once this is set
+inline uintptr_t hhdm_offset = 0;
+
+inline void* phys_to_virt(memory_address<void*> phys_addr) {
+	return (void*)(phys_addr + hhdm_offset);
+}
+
+// one physically contiguous extent, e.g. a scatter-gather element
+struct phys_range {
+	memory_address<void*> base;
+	std::size_t length;
+};
+
 class page_table {
 public:
 	using virtual_address = memory_address<void*>;
 	using physical_address = memory_address<void*>;
 
-    void  init();
+	void  init(physical_address kernel_phys_base, 
+	           virtual_address kernel_virt_base);
 	void* alloc_page(virtual_address virt_addr = nullptr);
 	void* alloc_pages(virtual_address virt_addr, std::size_t num_pages);
 	bool  dealloc_page(virtual_address virt_addr);
@@ -44,6 +124,67 @@ public:
 	bool  is_virtually_allocated(virtual_address virt_addr) const;
 	bool  is_physically_allocated(physical_address phys_addr) const;
 
+	// frame allocator over the physical bitmap. init() starts with every
+	// frame reserved; the memory map hands usable ranges back through
+	// release_phys_range()
+	physical_address alloc_frame();
+	void  free_frame(physical_address phys_addr);
+
+	// 512 contiguous frames, 2MB aligned, for mapping as one huge page;
+	// null if no such run is free. they go back one at a time through
+	// free_frame()
+	physical_address alloc_huge_frame();
+	void  release_phys_range(physical_address base, std::size_t length);
+
+	// maps phys_addr at virt_addr with the given PTE_* flags (PTE_PRESENT
+	// is implied); fails if virt_addr is already mapped
+	bool  map_page(virtual_address virt_addr, physical_address phys_addr,
+	               uint64_t flags = PTE_WRITABLE);
+
+	// returns the PT entry for virt_addr, building missing intermediate
+	// tables; null if it can't be reached (huge page, out of frames).
+	// callers hold table_lock() across this and their update of the entry
+	uint64_t* ensure_pte(virtual_address virt_addr);
+
+	// serializes changes to the table structure and leaf entries. lookups
+	// (walk, to_phys_addr) stay lock-free: entries are only ever written
+	// whole, and tables are never freed while mapped. taken with
+	// interrupts off (irq_mcs_guard): interrupt handlers kmalloc, and the
+	// heap is backed through page faults that take it
+	inline kstd::mcs_lock& table_lock() {
+		return m_table_lock;
+	}
+
+	// drops virt_addr from this CPU's TLB and every CPU's xlat cache;
+	// must follow any change to a present leaf entry. enough on its own
+	// when the change only adds permissions, since a stale entry elsewhere
+	// just takes a spurious fault that flushes it
+	void  invalidate(virtual_address virt_addr);
+
+	// flushes [virt_addr, virt_addr + num_pages pages) from every other
+	// CPU. waits for them, so call it without table_lock() held
+	void  shootdown(virtual_address virt_addr, std::size_t num_pages);
+
+	// one shared, permanently zero frame; read faults on lazily backed
+	// memory map it instead of allocating
+	inline physical_address zero_page() const {
+		return m_zero_page;
+	}
+
+	// coalesces the physical memory behind [virt_addr, virt_addr + len)
+	// into extents, walking once per page table rather than once per page.
+	// returns the number of extents written; stops early at an unmapped
+	// page or when ranges is full, so callers compare the summed lengths
+	// against len
+	std::size_t to_phys_ranges(virtual_address virt_addr, std::size_t len,
+	                           phys_range* ranges, 
+	                           std::size_t max_ranges) const;
+
+	// walks towards the level-Target entry for virt_addr, stopping early at
+	// a non-present entry or a huge page
+	template<pt_level Target = pt_level::pt>
+	pte_ref walk(virtual_address virt_addr) const;
+
 	inline page_table() { }
 
 	inline physical_address last_mapped_phys_addr() const {
@@ -70,8 +211,15 @@ public:
 		return m_pml4tes;
 	}
 
-    inline void activate() const {
-		lcr3(to_phys_addr((void*)&m_pml4tes).const_ptr());
+	inline void activate() {
+		lcr3(kernel_virt_to_phys(&m_pml4tes).const_ptr());
+	}
+
+	// the static tables live in the kernel image, so their physical
+	// address is a fixed offset from their virtual one
+	inline physical_address kernel_virt_to_phys(const void* p) const {
+		return (uintptr_t)p - (uintptr_t)m_kernel_virt_base.const_ptr() + 
+		       (uintptr_t)m_kernel_phys_base.const_ptr();
 	}
 
 private:
@@ -99,18 +247,76 @@ private:
 	uint64_t m_pdptes[NUM_PML4TES][512] __attribute__((aligned(4096)));
 	uint64_t m_pml4tes[512] __attribute__((aligned(4096)));
 	//uint64_t m_pml5tes[NUM_PML5TES] __attribute__((aligned(4096)));
+	physical_address m_kernel_phys_base;
+	virtual_address m_kernel_virt_base;
+	physical_address m_zero_page;
+	mutable std::size_t m_phys_search_hint = 0;
 	physical_address m_last_mapped_phys_addr;
 	virtual_address m_last_mapped_virt_addr;
 	kstd::array<void*, MAX_PAGES> m_allocated_pages;
     kstd::array<uint64_t, NUM_PHYS_ADDR_MAP_ENTRIES> m_phys_addr_map;
 
+	// software TLB in front of to_phys_addr, one per CPU so lookups never
+	// share cache lines. an entry is valid while vpn matches before and
+	// after reading pfn, which lets remote CPUs invalidate without locks
+	struct xlat_entry {
+		kstd::atomic<uintptr_t> vpn;
+		kstd::atomic<uintptr_t> pfn;
+	};
+
+	struct alignas(cpu::CACHE_LINE_SIZE) xlat_cache {
+		xlat_entry entries[XLAT_CACHE_ENTRIES];
+	};
+
+	inline static constexpr uintptr_t XLAT_INVALID_VPN = ~(uintptr_t)0;
+
+	mutable xlat_cache m_xlat_cache[cpu::MAX_CPUS];
+
+	bool  xlat_lookup(uintptr_t vpn, uintptr_t& pfn) const;
+	void  xlat_fill(uintptr_t vpn, uintptr_t pfn) const;
+	// drops vpn from the caches of CPUs [first_cpu, end_cpu)
+	void  xlat_invalidate(uintptr_t vpn, std::size_t first_cpu,
+	                      std::size_t end_cpu) const;
+	void  xlat_flush();
+
+	// guards m_phys_addr_map and the search hint; held only across a
+	// bitmap update. ordered after m_table_lock, since building tables
+	// allocates frames. interrupts are off while it's held, for the same
+	// reason as m_table_lock
+	kstd::mcs_lock m_frame_lock;
+	kstd::mcs_lock m_table_lock;
+
+	inline static constexpr uintptr_t CLEAR_FAILED = ~(uintptr_t)0;
+
+	// unmaps one 4K leaf and flushes it locally; returns the frame it
+	// pointed at, or CLEAR_FAILED
+	uintptr_t clear_leaf(virtual_address virt_addr);
+
 	bool  unmap_virt_addr(virtual_address virt_addr);
 	bool  unmap_phys_addr(physical_address phys_addr);
-	bool  map_phys_addr(physical_address phys_addr, virtual_address virt_addr);
+	bool  map_phys_addr(physical_address phys_addr, virtual_address virt_addr,
+	                    uint64_t flags = PTE_WRITABLE);
+	void  mark_phys_addr(physical_address phys_addr, bool allocated);
+	uint64_t* static_table(virtual_address virt_addr, pt_level l) const;
+	uint64_t* entry_ptr(virtual_address virt_addr, pt_level l,
+	                    const uint64_t* parent = nullptr) const;
+	physical_address new_table(virtual_address virt_addr, pt_level l);
 	virtual_address find_free_virt_addr() const;
 	physical_address find_free_phys_addr() const;
 };
 
+template<pt_level Target>
+pte_ref page_table::walk(virtual_address virt_addr) const {
+	pte_ref r;
+	for (unsigned l = (unsigned)pt_level::pml4t; l >= (unsigned)Target; l--) {
+		r.level = (pt_level)l;
+		r.entry = entry_ptr(virt_addr, r.level, r.entry);
+		if (!r.present() || r.is_leaf() || l == (unsigned)Target)
+			break;
+	}
+	return r;
+}
+
 } // namespace mem
 
 inline mem::page_table kernel_pt;
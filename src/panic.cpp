@@ -0,0 +1,17 @@
+#include "panic.hpp"
+
+#include "asm_wrappers.hpp"
+#include "console.hpp"
+#include "serial.hpp"
+
+NO_RETURN void panic(kstd::string_view msg) {
+    cli();
+    console::print("\n- PANIC: ");
+    console::print(msg);
+    console::print("\n");
+    serial::write("PANIC: ");
+    serial::write(msg);
+    serial::write("\n");
+    for(;;)
+        __asm__("cli\n\thlt\n\t");
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "stdlib/string_view.hpp"
+
+#ifndef NO_RETURN
+#   define NO_RETURN [[noreturn]]
+#endif
+
+// prints msg on the console and serial port and stops this CPU
+NO_RETURN void panic(kstd::string_view msg);
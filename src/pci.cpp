@@ -0,0 +1,356 @@
+#include "stdlib/sync.hpp"
+
+#include "pci.hpp"
+
+#include "acpi.hpp"
+#include "apic.hpp"
+#include "asm_wrappers.hpp"
+#include "cpu.hpp"
+#include "idt.hpp"
+#include "mmio.hpp"
+
+namespace pci {
+
+inline static constexpr uint16_t MSI_CONTROL  = 2;
+inline static constexpr uint16_t MSI_ADDRESS  = 4;
+inline static constexpr uint16_t MSI_64BIT    = 1 << 7;
+inline static constexpr uint16_t MSI_MULTIPLE = 7 << 4;
+inline static constexpr uint16_t MSI_ENABLE   = 1 << 0;
+
+inline static constexpr uint16_t MSIX_CONTROL = 2;
+inline static constexpr uint16_t MSIX_TABLE   = 4;
+inline static constexpr uint16_t MSIX_ENABLE  = 1 << 15;
+inline static constexpr uint16_t MSIX_MASK    = 1 << 14;
+inline static constexpr uint32_t MSIX_ENTRY_MASKED = 1;
+
+static uint32_t config_address(address a, uint16_t offset) {
+    return (1u << 31) | ((uint32_t)a.bus << 16) | 
+           ((uint32_t)a.device << 11) | ((uint32_t)a.function << 8) | 
+           (offset & 0xFC);
+}
+
+// the address/data pair is shared by every CPU
+static kstd::ticket_lock s_config_lock;
+
+// per MCFG region, the mapping of each bus's 1M of config space
+static volatile uint8_t* s_ecam_buses[acpi::MAX_ECAM][256];
+static kstd::ticket_lock s_ecam_lock;
+
+static device s_devices[MAX_DEVICES];
+static std::size_t s_num_devices = 0;
+
+// a function's config space through ECAM, null if no region covers it
+static volatile uint8_t* ecam(address a) {
+    for (std::size_t i = 0; i < acpi::ecam_count(); i++) {
+        const acpi::ecam_region& r = acpi::get_ecam(i);
+        if (r.segment != a.segment || a.bus < r.start_bus || a.bus > r.end_bus)
+            continue;
+        volatile uint8_t* bus = __atomic_load_n(&s_ecam_buses[i][a.bus], 
+                                                __ATOMIC_ACQUIRE);
+        if (bus == nullptr) {
+            kstd::lock_guard guard(s_ecam_lock);
+            bus = s_ecam_buses[i][a.bus];
+            if (bus == nullptr) {
+                uintptr_t phys = r.base + ((uintptr_t)(a.bus - r.start_bus) << 20);
+                bus = (volatile uint8_t*)mem::map_mmio(phys, 1 << 20);
+                if (bus == nullptr)
+                    return nullptr;
+                __atomic_store_n(&s_ecam_buses[i][a.bus], bus, 
+                                 __ATOMIC_RELEASE);
+            }
+        }
+        return bus + ((uint32_t)a.device << 15) + ((uint32_t)a.function << 12);
+    }
+    return nullptr;
+}
+
+uint32_t read32(address a, uint16_t offset) {
+    if (volatile uint8_t* cfg = ecam(a))
+        return offset < CONFIG_SIZE ? *(volatile uint32_t*)(cfg + (offset & ~3)) 
+                                    : 0xFFFFFFFF;
+    if (a.segment != 0 || offset >= LEGACY_CONFIG_SIZE)
+        return 0xFFFFFFFF;
+    kstd::irq_lock_guard guard(s_config_lock);
+    outd(CONFIG_ADDRESS, config_address(a, offset));
+    return ind(CONFIG_DATA);
+}
+
+uint16_t read16(address a, uint16_t offset) {
+    return (uint16_t)(read32(a, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t read8(address a, uint16_t offset) {
+    return (uint8_t)(read32(a, offset) >> ((offset & 3) * 8));
+}
+
+void write32(address a, uint16_t offset, uint32_t value) {
+    if (volatile uint8_t* cfg = ecam(a)) {
+        if (offset < CONFIG_SIZE)
+            *(volatile uint32_t*)(cfg + (offset & ~3)) = value;
+        return;
+    }
+    if (a.segment != 0 || offset >= LEGACY_CONFIG_SIZE)
+        return;
+    kstd::irq_lock_guard guard(s_config_lock);
+    outd(CONFIG_ADDRESS, config_address(a, offset));
+    outd(CONFIG_DATA, value);
+}
+
+void write16(address a, uint16_t offset, uint16_t value) {
+    if (volatile uint8_t* cfg = ecam(a)) {
+        if (offset < CONFIG_SIZE)
+            *(volatile uint16_t*)(cfg + (offset & ~1)) = value;
+        return;
+    }
+    if (a.segment != 0 || offset >= LEGACY_CONFIG_SIZE)
+        return;
+    kstd::irq_lock_guard guard(s_config_lock);
+    outd(CONFIG_ADDRESS, config_address(a, offset));
+    outw(CONFIG_DATA + (offset & 2), value);
+}
+
+static void scan_bus(uint16_t segment, uint8_t bus, unsigned depth);
+
+static void add_function(address a, unsigned depth) {
+    if (s_num_devices == MAX_DEVICES)
+        return;
+    device& d = s_devices[s_num_devices++];
+    d.addr = a;
+    d.vendor_id = read16(a, REG_VENDOR_ID);
+    d.device_id = read16(a, REG_DEVICE_ID);
+    d.class_code = read8(a, REG_CLASS);
+    d.subclass = read8(a, REG_SUBCLASS);
+    d.prog_if = read8(a, REG_PROG_IF);
+    d.header_type = read8(a, REG_HEADER_TYPE);
+
+    // PCI-to-PCI bridge: its secondary bus hangs below it. firmware
+    // numbered them already, so a bus that doesn't sit after its parent
+    // is a loop
+    if ((d.header_type & 0x7F) == 1) {
+        uint8_t secondary = read8(a, REG_SECONDARY_BUS);
+        if (secondary > a.bus)
+            scan_bus(a.segment, secondary, depth + 1);
+    }
+}
+
+static void scan_bus(uint16_t segment, uint8_t bus, unsigned depth) {
+    // deeper than any real topology
+    if (depth > 32)
+        return;
+    for (uint8_t dev = 0; dev < 32; dev++) {
+        address a = { segment, bus, dev, 0 };
+        if (read16(a, REG_VENDOR_ID) == 0xFFFF)
+            continue;
+        uint8_t functions = (read8(a, REG_HEADER_TYPE) & 0x80) ? 8 : 1;
+        for (uint8_t fn = 0; fn < functions; fn++) {
+            a.function = fn;
+            if (fn != 0 && read16(a, REG_VENDOR_ID) == 0xFFFF)
+                continue;
+            add_function(a, depth);
+        }
+    }
+}
+
+// a segment's root buses: if the host bridge at 0:0.0 is multi-function,
+// function n of it is the root of bus n
+static void scan_segment(uint16_t segment, uint8_t start_bus) {
+    address host = { segment, start_bus, 0, 0 };
+    if ((read8(host, REG_HEADER_TYPE) & 0x80) == 0) {
+        scan_bus(segment, start_bus, 0);
+        return;
+    }
+    for (uint8_t fn = 0; fn < 8; fn++) {
+        host.function = fn;
+        if (read16(host, REG_VENDOR_ID) != 0xFFFF)
+            scan_bus(segment, start_bus + fn, 0);
+    }
+}
+
+std::size_t enumerate() {
+    s_num_devices = 0;
+    if (acpi::ecam_count() == 0) {
+        scan_segment(0, 0);
+        return s_num_devices;
+    }
+    for (std::size_t i = 0; i < acpi::ecam_count(); i++) {
+        const acpi::ecam_region& r = acpi::get_ecam(i);
+        scan_segment(r.segment, r.start_bus);
+    }
+    return s_num_devices;
+}
+
+std::size_t device_count() {
+    return s_num_devices;
+}
+
+const device& get_device(std::size_t i) {
+    return s_devices[i];
+}
+
+bool find_class(uint8_t cls, uint8_t subclass, uint8_t prog_if,
+                std::size_t index, address* out)
+{
+    for (std::size_t i = 0; i < s_num_devices; i++) {
+        const device& d = s_devices[i];
+        if (d.class_code != cls || d.subclass != subclass || 
+            d.prog_if != prog_if)
+            continue;
+        if (index-- == 0) {
+            *out = d.addr;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool find_id(uint16_t vendor, uint16_t device_id, std::size_t index,
+             address* out)
+{
+    for (std::size_t i = 0; i < s_num_devices; i++) {
+        const device& d = s_devices[i];
+        if (d.vendor_id != vendor || d.device_id != device_id)
+            continue;
+        if (index-- == 0) {
+            *out = d.addr;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t bar(address a, unsigned index) {
+    uint32_t lo = read32(a, REG_BAR0 + index * 4);
+    if (lo & 1)
+        return 0; // I/O space
+    uint64_t base = lo & ~0xFull;
+    if (((lo >> 1) & 3) == 2 && index < 5)
+        base |= (uint64_t)read32(a, REG_BAR0 + (index + 1) * 4) << 32;
+    return base;
+}
+
+void enable(address a) {
+    uint16_t cmd = read16(a, REG_COMMAND);
+    write16(a, REG_COMMAND, 
+            cmd | COMMAND_MEMORY | COMMAND_BUS_MASTER | COMMAND_INTX_DISABLE);
+}
+
+uint8_t find_capability(address a, uint8_t id, uint8_t from) {
+    if ((read16(a, REG_STATUS) & STATUS_CAP_LIST) == 0)
+        return 0;
+    uint8_t cap = from != 0 ? read8(a, from + 1) : read8(a, REG_CAP_PTR);
+    // the list lives in the 192 bytes after the header; more hops than
+    // that means it loops
+    for (unsigned hops = 0; cap != 0 && hops < 48; hops++) {
+        cap &= 0xFC;
+        if (read8(a, cap) == id)
+            return cap;
+        cap = read8(a, cap + 1);
+    }
+    return 0;
+}
+
+bool enable_msi(address a, uint8_t vector, uint32_t lapic_id) {
+    uint8_t cap = find_capability(a, CAP_MSI);
+    if (cap == 0)
+        return false;
+
+    uint16_t control = read16(a, cap + MSI_CONTROL);
+    uint64_t addr = msi_address(lapic_id);
+    write32(a, cap + MSI_ADDRESS, (uint32_t)addr);
+    if (control & MSI_64BIT) {
+        write32(a, cap + MSI_ADDRESS + 4, (uint32_t)(addr >> 32));
+        write16(a, cap + 12, (uint16_t)msi_data(vector));
+    } else {
+        write16(a, cap + 8, (uint16_t)msi_data(vector));
+    }
+    // a single vector
+    write16(a, cap + MSI_CONTROL, (control & ~MSI_MULTIPLE) | MSI_ENABLE);
+    return true;
+}
+
+struct irq_slot {
+    irq_fn fn;
+    void* ctx;
+};
+
+static irq_slot s_irqs[256];
+static std::size_t s_cpu_irqs[cpu::MAX_CPUS];
+static kstd::ticket_lock s_irq_lock;
+
+static void irq_dispatch(idt::interrupt_frame& frame) {
+    const irq_slot& slot = s_irqs[frame.vector & 0xFF];
+    slot.fn(slot.ctx);
+    apic::eoi();
+}
+
+uint8_t alloc_irq(irq_fn fn, void* ctx, std::size_t* target_cpu) {
+    kstd::lock_guard guard(s_irq_lock);
+    std::size_t target = *target_cpu;
+    if (target == ANY_CPU || target >= cpu::count()) {
+        target = 0;
+        for (std::size_t i = 1; i < cpu::count(); i++) {
+            if (s_cpu_irqs[i] < s_cpu_irqs[target])
+                target = i;
+        }
+    }
+
+    // the slot is filled in before the vector can fire: nothing is aimed
+    // at it until the caller programs the device
+    uint8_t vector = idt::alloc_vector(&irq_dispatch);
+    if (vector == 0)
+        return 0;
+    s_irqs[vector] = { fn, ctx };
+    s_cpu_irqs[target]++;
+    *target_cpu = target;
+    return vector;
+}
+
+bool msix::init(address a) {
+    m_cap = find_capability(a, CAP_MSIX);
+    if (m_cap == 0)
+        return false;
+    m_addr = a;
+    m_size = (read16(a, m_cap + MSIX_CONTROL) & 0x7FF) + 1;
+
+    uint32_t table = read32(a, m_cap + MSIX_TABLE);
+    uint64_t base = bar(a, table & 7);
+    if (base == 0)
+        return false;
+    m_table = (volatile uint32_t*)mem::map_mmio(base + (table & ~7u), 
+                                                 m_size * 16);
+    if (m_table == nullptr)
+        return false;
+    for (unsigned i = 0; i < m_size; i++)
+        m_table[i * 4 + 3] = MSIX_ENTRY_MASKED;
+    return true;
+}
+
+void msix::set(unsigned entry, uint8_t vector, uint32_t lapic_id) {
+    volatile uint32_t* e = &m_table[entry * 4];
+    uint64_t addr = msi_address(lapic_id);
+    e[3] = MSIX_ENTRY_MASKED;
+    e[0] = (uint32_t)addr;
+    e[1] = (uint32_t)(addr >> 32);
+    e[2] = msi_data(vector);
+    e[3] = 0;
+}
+
+bool msix::route(unsigned entry, std::size_t target_cpu, irq_fn fn, 
+                 void* ctx)
+{
+    if (entry >= m_size)
+        return false;
+    uint8_t vector = alloc_irq(fn, ctx, &target_cpu);
+    if (vector == 0)
+        return false;
+    set(entry, vector, cpu::get(target_cpu).lapic_id);
+    return true;
+}
+
+void msix::enable() {
+    uint16_t control = read16(m_addr, m_cap + MSIX_CONTROL);
+    write16(m_addr, m_cap + MSIX_CONTROL, 
+            (control & ~MSIX_MASK) | MSIX_ENABLE);
+}
+
+} // namespace pci
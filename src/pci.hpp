@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace pci {
+
+#ifdef K_PCI_MAX_DEVICES
+    inline static constexpr std::size_t MAX_DEVICES = K_PCI_MAX_DEVICES;
+#else
+    inline static constexpr std::size_t MAX_DEVICES = 256;
+#endif
+
+// configuration mechanism #1: an address written to one port selects the
+// dword that the other port then reads or writes
+inline static constexpr uint16_t CONFIG_ADDRESS = 0xCF8;
+inline static constexpr uint16_t CONFIG_DATA    = 0xCFC;
+
+inline static constexpr uint16_t REG_VENDOR_ID   = 0x00;
+inline static constexpr uint16_t REG_DEVICE_ID   = 0x02;
+inline static constexpr uint16_t REG_COMMAND     = 0x04;
+inline static constexpr uint16_t REG_STATUS      = 0x06;
+inline static constexpr uint16_t REG_PROG_IF     = 0x09;
+inline static constexpr uint16_t REG_SUBCLASS    = 0x0A;
+inline static constexpr uint16_t REG_CLASS       = 0x0B;
+inline static constexpr uint16_t REG_HEADER_TYPE = 0x0E;
+inline static constexpr uint16_t REG_BAR0        = 0x10;
+inline static constexpr uint16_t REG_SECONDARY_BUS = 0x19;
+inline static constexpr uint16_t REG_CAP_PTR     = 0x34;
+
+// bytes of config space per function: 256 through the legacy ports, 4K
+// through ECAM
+inline static constexpr uint16_t LEGACY_CONFIG_SIZE = 256;
+inline static constexpr uint16_t CONFIG_SIZE = 4096;
+
+inline static constexpr uint16_t COMMAND_MEMORY       = 1 << 1;
+inline static constexpr uint16_t COMMAND_BUS_MASTER   = 1 << 2;
+inline static constexpr uint16_t COMMAND_INTX_DISABLE = 1 << 10;
+inline static constexpr uint16_t STATUS_CAP_LIST      = 1 << 4;
+
+inline static constexpr uint8_t CAP_MSI    = 0x05;
+inline static constexpr uint8_t CAP_VENDOR = 0x09;
+inline static constexpr uint8_t CAP_MSIX   = 0x11;
+
+struct address {
+    uint16_t segment;
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+};
+
+// a function found by enumerate()
+struct device {
+    address addr;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t header_type;
+};
+
+// config space goes through the MCFG's ECAM windows for the segments and
+// buses they cover, and through the legacy ports for segment 0 otherwise.
+// reads past what the mechanism reaches return all ones and writes are
+// dropped. ECAM buses get mapped the first time they're touched
+uint32_t read32(address a, uint16_t offset);
+uint16_t read16(address a, uint16_t offset);
+uint8_t  read8(address a, uint16_t offset);
+void write32(address a, uint16_t offset, uint32_t value);
+void write16(address a, uint16_t offset, uint16_t value);
+
+// walks every segment from its root bus down through the bridges and
+// records each function in the device table; after acpi::init(), and
+// before anything looks for a device. returns the number found
+std::size_t enumerate();
+
+std::size_t device_count();
+const device& get_device(std::size_t i);
+
+// the index-th function (counting from 0) in the device table with this
+// class code, or with this vendor and device id; false if there are fewer
+bool find_class(uint8_t cls, uint8_t subclass, uint8_t prog_if,
+                std::size_t index, address* out);
+bool find_id(uint16_t vendor, uint16_t device_id, std::size_t index,
+             address* out);
+
+// physical base of a memory BAR, taking the following BAR as the upper
+// half of a 64-bit one; 0 for I/O or unimplemented BARs
+uint64_t bar(address a, unsigned index);
+
+// turns on memory decoding and bus mastering and masks INTx
+void enable(address a);
+
+// config space offset of the first capability with this id (after `from`
+// if given), 0 if there is none
+uint8_t find_capability(address a, uint8_t id, uint8_t from = 0);
+
+// points the function's MSI at a vector on one CPU; false if it has no
+// MSI capability
+bool enable_msi(address a, uint8_t vector, uint32_t lapic_id);
+
+// the MSI address and data that deliver vector to lapic_id: fixed
+// delivery, edge triggered, physical destination
+inline uint64_t msi_address(uint32_t lapic_id) {
+    return 0xFEE00000 | ((uint64_t)(lapic_id & 0xFF) << 12);
+}
+
+inline uint32_t msi_data(uint8_t vector) {
+    return vector;
+}
+
+using irq_fn = void (*)(void* ctx);
+
+inline static constexpr std::size_t ANY_CPU = ~(std::size_t)0;
+
+// claims a device vector that runs fn(ctx) and then sends the EOI, for
+// an MSI or MSI-X message aimed at *target_cpu. ANY_CPU picks whichever
+// CPU has the fewest vectors so far, and *target_cpu says which it was.
+// 0 once the vectors run out
+uint8_t alloc_irq(irq_fn fn, void* ctx, std::size_t* target_cpu);
+
+// a function's MSI-X table, mapped from whichever BAR holds it
+class msix {
+public:
+    // false if the function has no MSI-X capability
+    bool init(address a);
+
+    // number of table entries
+    inline unsigned size() const {
+        return m_size;
+    }
+
+    // points an entry at a vector on one CPU and unmasks it
+    void set(unsigned entry, uint8_t vector, uint32_t lapic_id);
+
+    // alloc_irq() and set() in one: entry runs fn(ctx) on that CPU (or
+    // the least loaded one for ANY_CPU). false when vectors run out
+    bool route(unsigned entry, std::size_t target_cpu, irq_fn fn, void* ctx);
+
+    // turns MSI-X on for the function; entries not set() stay masked
+    void enable();
+
+private:
+    address m_addr = { };
+    uint8_t m_cap = 0;
+    unsigned m_size = 0;
+    volatile uint32_t* m_table = nullptr;
+};
+
+} // namespace pci
@@ -1,6 +1,15 @@
+# ./qemu.sh --virtio puts the disk on a multi-queue virtio-blk device
+# instead of AHCI; VIRTIO_QUEUES sets the queue count, and as many CPUs
+# come up so each gets a queue of its own
+if [ "$1" = "--virtio" ]; then
+    shift
+    DISK="-device virtio-blk-pci,drive=disk,disable-legacy=on,num-queues=${VIRTIO_QUEUES:-4} -smp ${VIRTIO_QUEUES:-4}"
+else
+    DISK="-device ahci,id=ahci -device ide-hd,drive=disk,bus=ahci.0"
+fi
+
 qemu-system-x86_64 \
     -bios /usr/share/ovmf/x64/OVMF.fd \
     -drive id=disk,file=image.hdd,if=none \
-    -device ahci,id=ahci \
-    -device ide-hd,drive=disk,bus=ahci.0 -m 256M \
+    $DISK -m 256M \
     "$@"
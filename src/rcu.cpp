@@ -0,0 +1,182 @@
+#include "stdlib/atomic.hpp"
+#include "stdlib/sync.hpp"
+
+#include "rcu.hpp"
+
+#include "asm_wrappers.hpp"
+#include "cpu.hpp"
+#include "memory.hpp"
+
+namespace rcu {
+
+// grace periods are numbered; at most one is in progress, and it is in
+// progress while s_gp.started > s_gp.completed
+struct alignas(cpu::CACHE_LINE_SIZE) gp_state {
+    kstd::atomic<uint64_t> started = 0;
+    kstd::atomic<uint64_t> completed = 0;
+};
+
+// one line per CPU, written only by its owner; other CPUs read qs_seq
+// and idle while checking for the end of a grace period
+struct alignas(cpu::CACHE_LINE_SIZE) rcu_data {
+    // latest grace period this CPU has passed a quiescent state in
+    kstd::atomic<uint64_t> qs_seq = 0;
+    kstd::atomic<bool> idle = false;
+
+    // callbacks not yet assigned a grace period
+    rcu_head*  next = nullptr;
+    rcu_head** next_tail = &next;
+    // callbacks waiting for grace period wait_seq to complete
+    rcu_head*  wait = nullptr;
+    uint64_t   wait_seq = 0;
+};
+
+static gp_state s_gp;
+static rcu_data s_data[cpu::MAX_CPUS];
+
+static bool idle_work() {
+    return quiescent_state();
+}
+
+void init() {
+    cpu::register_idle_work(&idle_work);
+}
+
+// ends the grace period in progress if every online CPU has either
+// reported a quiescent state in it or is asleep
+static void try_complete_gp() {
+    uint64_t seq = s_gp.started.load(kstd::memory_order_seq_cst);
+    uint64_t done = s_gp.completed.load(kstd::memory_order_acquire);
+    if (seq == done)
+        return;
+
+    for (std::size_t i = 0; i < cpu::count(); i++) {
+        if (!cpu::get(i).online)
+            continue;
+        if (s_data[i].idle.load(kstd::memory_order_seq_cst))
+            continue;
+        if (s_data[i].qs_seq.load(kstd::memory_order_acquire) < seq)
+            return;
+    }
+
+    if (s_gp.completed.compare_exchange_strong(done, seq,
+                                               kstd::memory_order_release,
+                                               kstd::memory_order_relaxed))
+        cpu::kick_idle(); // other CPUs may have callbacks to run now
+}
+
+// any grace period started after the caller's updates covers them. if
+// one is already running, the next is needed, and it will be started by
+// whoever finds the current one finished
+static uint64_t request_gp() {
+    uint64_t seq = s_gp.started.load(kstd::memory_order_seq_cst);
+    uint64_t done = s_gp.completed.load(kstd::memory_order_acquire);
+    if (seq == done)
+        s_gp.started.compare_exchange_strong(seq, seq + 1,
+                                             kstd::memory_order_seq_cst);
+    return seq + 1;
+}
+
+static void invoke(rcu_head* list) {
+    while (list != nullptr) {
+        rcu_head* next = list->next;
+        uintptr_t f = (uintptr_t)list->func;
+        if (f < KFREE_OFFSET_MAX)
+            kfree((char*)list - f);
+        else
+            list->func(list);
+        list = next;
+    }
+}
+
+bool quiescent_state() {
+    rcu_data& d = s_data[cpu::id()];
+    d.qs_seq.store(s_gp.started.load(kstd::memory_order_seq_cst),
+                   kstd::memory_order_seq_cst);
+
+    try_complete_gp();
+
+    rcu_head* ready = nullptr;
+    bool pending;
+    {
+        kstd::irq_guard irq;
+        uint64_t done = s_gp.completed.load(kstd::memory_order_acquire);
+        if (d.wait != nullptr && done >= d.wait_seq) {
+            ready = d.wait;
+            d.wait = nullptr;
+        }
+        // start the next batch waiting as soon as the last one is out
+        if (d.wait == nullptr && d.next != nullptr) {
+            d.wait = d.next;
+            d.next = nullptr;
+            d.next_tail = &d.next;
+            d.wait_seq = request_gp();
+        }
+        // a grace period nobody started yet needs starting, and will
+        // also need this CPU's own quiescent state for it
+        if (d.wait != nullptr && 
+            s_gp.started.load(kstd::memory_order_relaxed) < d.wait_seq)
+            request_gp();
+        pending = d.wait != nullptr;
+    }
+
+    invoke(ready);
+    return ready != nullptr || 
+           (pending && s_gp.started.load(kstd::memory_order_relaxed) > 
+                       d.qs_seq.load(kstd::memory_order_relaxed));
+}
+
+void call_rcu(rcu_head* head, rcu_callback func) {
+    head->next = nullptr;
+    head->func = func;
+
+    kstd::irq_guard irq;
+    rcu_data& d = s_data[cpu::id()];
+    *d.next_tail = head;
+    d.next_tail = &head->next;
+    // idle CPUs only run quiescent_state() once kicked
+    cpu::kick_idle();
+}
+
+void kfree_rcu_offset(rcu_head* head, std::size_t offset) {
+    call_rcu(head, (rcu_callback)(uintptr_t)offset);
+}
+
+void synchronize() {
+    uint64_t target = request_gp();
+    // the caller is outside any read-side section, which is as good as
+    // a quiescent state
+    rcu_data& d = s_data[cpu::id()];
+    while (s_gp.completed.load(kstd::memory_order_acquire) < target) {
+        d.qs_seq.store(s_gp.started.load(kstd::memory_order_seq_cst),
+                       kstd::memory_order_seq_cst);
+        try_complete_gp();
+        if (s_gp.started.load(kstd::memory_order_relaxed) < target)
+            request_gp();
+        cpu_relax();
+    }
+}
+
+void idle_enter() {
+    s_data[cpu::id()].idle.store(true, kstd::memory_order_seq_cst);
+}
+
+void idle_exit() {
+    s_data[cpu::id()].idle.store(false, kstd::memory_order_seq_cst);
+}
+
+bool irq_enter() {
+    // only the outermost interrupt finds the flag set
+    rcu_data& d = s_data[cpu::id()];
+    if (!d.idle.load(kstd::memory_order_relaxed))
+        return false;
+    d.idle.store(false, kstd::memory_order_seq_cst);
+    return true;
+}
+
+void irq_exit(bool was_idle) {
+    if (was_idle)
+        idle_enter();
+}
+
+} // namespace rcu
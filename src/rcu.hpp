@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "memory.hpp"
+
+namespace rcu {
+
+// quiescent-state based RCU. the kernel never preempts or sleeps inside
+// a read-side section, so a CPU that has gone through the idle loop (or,
+// later, a context switch) can't still be reading anything unpublished
+// before that point. readers therefore do no work at all, and writers
+// pay for it by waiting out a grace period before freeing
+
+struct rcu_head;
+using rcu_callback = void (*)(rcu_head*);
+
+// embedded in objects that are freed through call_rcu/kfree_rcu
+struct rcu_head {
+    rcu_head*    next;
+    rcu_callback func;
+};
+
+// compiler barriers only: they keep loads of protected data inside the
+// section but emit no instructions and touch no memory
+inline void read_lock() {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+inline void read_unlock() {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+// loads an RCU-protected pointer for use inside a read-side section
+template<typename T> inline T* dereference(T* const& p) {
+    return __atomic_load_n(&p, __ATOMIC_CONSUME);
+}
+
+// publishes a fully initialized object to readers
+template<typename T> inline void assign_pointer(T*& p, T* v) {
+    __atomic_store_n(&p, v, __ATOMIC_RELEASE);
+}
+
+// hooks the grace period machinery into the idle loop; before SMP
+void init();
+
+// runs func(head) on this CPU once every CPU has passed a quiescent
+// state. safe from interrupt context
+void call_rcu(rcu_head* head, rcu_callback func);
+
+// waits for a full grace period. must not be called inside a read-side
+// section, nor with interrupts off while another CPU needs this one
+void synchronize();
+
+// reports that this CPU holds no RCU references, then moves any
+// callbacks along. called from the idle loop; returns true if it has
+// callbacks left that another call could make progress on
+bool quiescent_state();
+
+// idle CPUs count as quiescent for as long as they sleep, so a grace
+// period doesn't have to wake them
+void idle_enter();
+void idle_exit();
+
+// an interrupt taken while idle isn't quiescent: its handler and the
+// softirqs after it may read. irq_enter() leaves the idle state for the
+// length of it and says whether it did; irq_exit() puts it back
+bool irq_enter();
+void irq_exit(bool was_idle);
+
+// offsets below this in place of a callback mean "kfree the object
+// that many bytes before the rcu_head"
+inline static constexpr uintptr_t KFREE_OFFSET_MAX = 4096;
+
+void kfree_rcu_offset(rcu_head* head, std::size_t offset);
+
+// kfree()s obj after a grace period; head is obj's embedded rcu_head
+template<typename T> inline void kfree_rcu(T* obj, rcu_head T::*head) {
+    rcu_head* h = &(obj->*head);
+    kfree_rcu_offset(h, (std::size_t)((char*)h - (char*)obj));
+}
+
+} // namespace rcu
@@ -0,0 +1,49 @@
+#include "serial.hpp"
+
+#include "asm_wrappers.hpp"
+
+namespace serial {
+
+static uint16_t s_port = 0;
+
+bool init(uint16_t port) {
+    outb(port + 1, 0x00); // disable interrupts
+    outb(port + 3, 0x80); // enable DLAB
+    outb(port + 0, 0x01); // divisor low byte (115200 baud)
+    outb(port + 1, 0x00); // divisor high byte
+    outb(port + 3, 0x03); // 8 bits, no parity, one stop bit
+    outb(port + 2, 0xC7); // enable and clear FIFOs, 14-byte threshold
+    outb(port + 4, 0x1E); // loopback mode for the self-test
+
+    outb(port + 0, 0xAE);
+    if(inb(port + 0) != 0xAE)
+        return false;
+
+    outb(port + 4, 0x0F); // normal operation, OUT1/OUT2 set
+    s_port = port;
+    return true;
+}
+
+bool is_initialized() {
+    return s_port != 0;
+}
+
+void write_char(char c) {
+    if(s_port == 0)
+        return;
+
+    // wait for the transmit holding register to empty
+    while((inb(s_port + 5) & 0x20) == 0)
+        cpu_relax();
+    outb(s_port, (uint8_t)c);
+}
+
+void write(kstd::string_view s) {
+    for(std::size_t i = 0; i < s.length(); i++) {
+        if(s.data()[i] == '\n')
+            write_char('\r');
+        write_char(s.data()[i]);
+    }
+}
+
+} // namespace serial
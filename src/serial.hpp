@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+#include "stdlib/string_view.hpp"
+
+namespace serial {
+
+inline static constexpr uint16_t COM1 = 0x3F8;
+
+// programs the UART for 115200 8N1 and runs the loopback self-test
+// returns false if no working UART answers at the port
+bool init(uint16_t port = COM1);
+bool is_initialized();
+
+void write(kstd::string_view s);
+void write_char(char c);
+
+} // namespace serial
@@ -0,0 +1,84 @@
+#include "softirq.hpp"
+
+#include "asm_wrappers.hpp"
+#include "cpu.hpp"
+
+namespace softirq {
+
+static handler s_handlers[NUM_SOFTIRQS];
+
+static bool idle_work() {
+    return run_pending();
+}
+
+void init() {
+    cpu::register_idle_work(&idle_work);
+}
+
+bool register_handler(vector v, handler h) {
+    if (v >= NUM_SOFTIRQS || s_handlers[v] != nullptr)
+        return false;
+    s_handlers[v] = h;
+    return true;
+}
+
+void raise(vector v) {
+    __atomic_fetch_or(&cpu::current().softirq_pending, 1u << v,
+                      __ATOMIC_RELEASE);
+}
+
+void raise_on(std::size_t cpu, vector v) {
+    uint32_t old = __atomic_fetch_or(&cpu::get(cpu).softirq_pending, 1u << v,
+                                     __ATOMIC_RELEASE);
+    if (old == 0 && cpu != cpu::id())
+        cpu::kick_idle();
+}
+
+// runs the pending vectors, restarting while more get raised. with
+// enable_irqs, interrupts are on while handlers run and off again after
+static bool do_softirq(bool enable_irqs) {
+    cpu::cpu_local& c = cpu::current();
+    if (c.in_softirq)
+        return false;
+    c.in_softirq = true;
+
+    bool ran = false;
+    for (std::size_t n = 0; n < MAX_RESTARTS; n++) {
+        uint32_t pending = __atomic_exchange_n(&c.softirq_pending, 0,
+                                               __ATOMIC_ACQUIRE);
+        if (pending == 0)
+            break;
+
+        if (enable_irqs)
+            sti();
+        while (pending != 0) {
+            unsigned v = __builtin_ctz(pending);
+            pending &= pending - 1;
+            if (s_handlers[v] != nullptr)
+                s_handlers[v]();
+        }
+        if (enable_irqs)
+            cli();
+        ran = true;
+    }
+
+    c.in_softirq = false;
+    return ran;
+}
+
+void irq_exit(bool irqs_were_enabled) {
+    cpu::cpu_local& c = cpu::current();
+    if (c.irq_depth != 0 || !irqs_were_enabled)
+        return;
+    if (__atomic_load_n(&c.softirq_pending, __ATOMIC_RELAXED) == 0)
+        return;
+    do_softirq(true);
+}
+
+bool run_pending() {
+    if (__atomic_load_n(&cpu::current().softirq_pending, __ATOMIC_RELAXED) == 0)
+        return false;
+    return do_softirq(false);
+}
+
+} // namespace softirq
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace softirq {
+
+// bottom halves: work raised from interrupt handlers and run once the
+// outermost handler returns, with interrupts back on. each vector runs
+// on the CPU that raised it, and never nested within itself
+enum vector : uint8_t {
+    SOFTIRQ_WORK = 0, // per-CPU workqueues
+    SOFTIRQ_BLOCK,    // block I/O completions
+    NUM_SOFTIRQS
+};
+
+using handler = void (*)();
+
+// times a single exit re-runs vectors raised while it was running before
+// leaving the rest to the idle loop, so a busy source can't starve the
+// interrupted context
+inline static constexpr std::size_t MAX_RESTARTS = 8;
+
+// registers the idle fallback; before SMP
+void init();
+
+bool register_handler(vector v, handler h);
+
+// marks v pending on this CPU; safe from any context
+void raise(vector v);
+
+// marks v pending on another CPU and wakes it if it's idle
+void raise_on(std::size_t cpu, vector v);
+
+// called on interrupt exit once the handler is done. runs pending
+// vectors if this was the outermost interrupt and the interrupted code
+// had interrupts enabled (so held no irq-safe locks)
+void irq_exit(bool irqs_were_enabled);
+
+// runs whatever is pending without touching the interrupt flag;
+// returns true if anything ran
+bool run_pending();
+
+} // namespace softirq
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+
+#include <type_traits>
+
+namespace kstd {
+
+// libstdc++'s <atomic> drags in hosted headers (gthreads, wait/notify),
+// so this is the subset we need built directly on the compiler builtins
+
+enum class memory_order : int {
+	relaxed = __ATOMIC_RELAXED,
+	consume = __ATOMIC_CONSUME,
+	acquire = __ATOMIC_ACQUIRE,
+	release = __ATOMIC_RELEASE,
+	acq_rel = __ATOMIC_ACQ_REL,
+	seq_cst = __ATOMIC_SEQ_CST
+};
+
+inline constexpr memory_order memory_order_relaxed = memory_order::relaxed;
+inline constexpr memory_order memory_order_consume = memory_order::consume;
+inline constexpr memory_order memory_order_acquire = memory_order::acquire;
+inline constexpr memory_order memory_order_release = memory_order::release;
+inline constexpr memory_order memory_order_acq_rel = memory_order::acq_rel;
+inline constexpr memory_order memory_order_seq_cst = memory_order::seq_cst;
+
+inline void atomic_thread_fence(memory_order order) noexcept {
+	__atomic_thread_fence((int)order);
+}
+
+inline void atomic_signal_fence(memory_order order) noexcept {
+	__atomic_signal_fence((int)order);
+}
+
+template<typename T> class atomic {
+public:
+	static_assert(std::is_trivially_copyable_v<T>,
+	              "atomic<T> requires a trivially copyable T");
+
+	using value_type = T;
+
+	constexpr atomic() noexcept : m_value() { }
+	constexpr atomic(value_type desired) noexcept : m_value(desired) { }
+
+	atomic(const atomic&) = delete;
+	atomic& operator=(const atomic&) = delete;
+
+	inline value_type load(memory_order order = memory_order_seq_cst) const noexcept {
+		return __atomic_load_n(&m_value, (int)order);
+	}
+
+	inline void store(value_type desired,
+	                  memory_order order = memory_order_seq_cst) noexcept
+	{
+		__atomic_store_n(&m_value, desired, (int)order);
+	}
+
+	inline value_type exchange(value_type desired,
+	                           memory_order order = memory_order_seq_cst) noexcept
+	{
+		return __atomic_exchange_n(&m_value, desired, (int)order);
+	}
+
+	inline bool compare_exchange_weak(value_type& expected, value_type desired,
+	                                  memory_order success,
+	                                  memory_order failure) noexcept
+	{
+		return __atomic_compare_exchange_n(&m_value, &expected, desired, true,
+		                                   (int)success, (int)failure);
+	}
+
+	inline bool compare_exchange_strong(value_type& expected, value_type desired,
+	                                    memory_order success,
+	                                    memory_order failure) noexcept
+	{
+		return __atomic_compare_exchange_n(&m_value, &expected, desired, false,
+		                                   (int)success, (int)failure);
+	}
+
+	inline bool compare_exchange_strong(value_type& expected, value_type desired,
+	                                    memory_order order = memory_order_seq_cst) noexcept
+	{
+		return compare_exchange_strong(expected, desired, order,
+		                               failure_order(order));
+	}
+
+	inline bool compare_exchange_weak(value_type& expected, value_type desired,
+	                                  memory_order order = memory_order_seq_cst) noexcept
+	{
+		return compare_exchange_weak(expected, desired, order,
+		                             failure_order(order));
+	}
+
+	inline value_type fetch_add(value_type arg,
+	                            memory_order order = memory_order_seq_cst) noexcept
+		requires std::is_integral_v<T>
+	{
+		return __atomic_fetch_add(&m_value, arg, (int)order);
+	}
+
+	inline value_type fetch_sub(value_type arg,
+	                            memory_order order = memory_order_seq_cst) noexcept
+		requires std::is_integral_v<T>
+	{
+		return __atomic_fetch_sub(&m_value, arg, (int)order);
+	}
+
+	inline value_type fetch_and(value_type arg,
+	                            memory_order order = memory_order_seq_cst) noexcept
+		requires std::is_integral_v<T>
+	{
+		return __atomic_fetch_and(&m_value, arg, (int)order);
+	}
+
+	inline value_type fetch_or(value_type arg,
+	                           memory_order order = memory_order_seq_cst) noexcept
+		requires std::is_integral_v<T>
+	{
+		return __atomic_fetch_or(&m_value, arg, (int)order);
+	}
+
+	inline operator value_type() const noexcept {
+		return load();
+	}
+
+	inline value_type operator=(value_type desired) noexcept {
+		store(desired);
+		return desired;
+	}
+
+private:
+	static constexpr memory_order failure_order(memory_order order) {
+		if (order == memory_order_acq_rel)
+			return memory_order_acquire;
+		if (order == memory_order_release)
+			return memory_order_relaxed;
+		return order;
+	}
+
+	// naturally align power-of-two sizes so the builtins stay lock-free
+	static constexpr std::size_t required_alignment() {
+		if (sizeof(T) <= 16 && (sizeof(T) & (sizeof(T) - 1)) == 0 &&
+		    sizeof(T) > alignof(T))
+			return sizeof(T);
+		return alignof(T);
+	}
+
+	alignas(required_alignment()) value_type m_value;
+};
+
+} // namespace kstd
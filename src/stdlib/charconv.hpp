@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+#include <type_traits>
+
+namespace kstd {
+
+enum class errc {
+    ok = 0,
+    value_too_large
+};
+
+struct to_chars_result {
+    char* ptr;
+    errc ec;
+};
+
+template<typename T>
+    requires std::is_integral_v<T>
+constexpr to_chars_result to_chars(char* first, char* last, T value,
+                                   int base = 10)
+{
+    using unsigned_type = std::make_unsigned_t<T>;
+    constexpr const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+    if(base < 2 || base > 36)
+        base = 10;
+
+    unsigned_type u = static_cast<unsigned_type>(value);
+    if constexpr (std::is_signed_v<T>) {
+        if(value < 0) {
+            if(first == last)
+                return { last, errc::value_too_large };
+            *first++ = '-';
+            u = static_cast<unsigned_type>(0) - u;
+        }
+    }
+
+    // count digits first so we can write front-to-back without a buffer
+    std::size_t len = 1;
+    for(unsigned_type v = u / base; v != 0; v /= base)
+        len++;
+
+    if(static_cast<std::size_t>(last - first) < len)
+        return { last, errc::value_too_large };
+
+    char* p = first + len;
+    do {
+        *--p = digits[u % base];
+        u /= base;
+    } while(u != 0);
+
+    return { first + len, errc::ok };
+}
+
+} // namespace kstd
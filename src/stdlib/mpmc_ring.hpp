@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <new>
+
+#include "atomic.hpp"
+#include "new.hpp"
+#include "utility.hpp"
+
+namespace kstd {
+
+// bounded multi-producer multi-consumer ring (Vyukov). every cell carries
+// a sequence number saying whose turn it is, so producers and consumers
+// only contend on their own index and then work on separate cells.
+// N must be a power of two
+template<typename T, std::size_t N> class mpmc_ring {
+public:
+	static_assert(N >= 2 && (N & (N - 1)) == 0,
+	              "mpmc_ring size must be a power of two");
+
+	using value_type = T;
+
+	inline mpmc_ring() noexcept {
+		for (std::size_t i = 0; i < N; i++)
+			m_cells[i].seq.store(i, memory_order_relaxed);
+	}
+
+	mpmc_ring(const mpmc_ring&) = delete;
+	mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+	inline ~mpmc_ring() {
+		T v;
+		while (try_pop(v)) { }
+	}
+
+	template<typename U> inline bool try_push(U&& value) {
+		std::size_t pos = m_enqueue.load(memory_order_relaxed);
+		cell* c;
+		for (;;) {
+			c = &m_cells[pos & (N - 1)];
+			std::size_t seq = c->seq.load(memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				// cell is free for this lap; claim the slot
+				if (m_enqueue.compare_exchange_weak(pos, pos + 1, 
+				                                    memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false; // full
+			} else {
+				pos = m_enqueue.load(memory_order_relaxed);
+			}
+		}
+
+		::new ((void*)c->storage) T(forward<U>(value));
+		c->seq.store(pos + 1, memory_order_release);
+		return true;
+	}
+
+	inline bool try_pop(T& out) {
+		std::size_t pos = m_dequeue.load(memory_order_relaxed);
+		cell* c;
+		for (;;) {
+			c = &m_cells[pos & (N - 1)];
+			std::size_t seq = c->seq.load(memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (m_dequeue.compare_exchange_weak(pos, pos + 1, 
+				                                    memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false; // empty
+			} else {
+				pos = m_dequeue.load(memory_order_relaxed);
+			}
+		}
+
+		T* p = reinterpret_cast<T*>(c->storage);
+		out = move(*p);
+		p->~T();
+		// hand the cell to the producer one lap ahead
+		c->seq.store(pos + N, memory_order_release);
+		return true;
+	}
+
+	inline std::size_t size_approx() const {
+		std::size_t e = m_enqueue.load(memory_order_relaxed);
+		std::size_t d = m_dequeue.load(memory_order_relaxed);
+		return e > d ? e - d : 0;
+	}
+
+	inline static constexpr std::size_t capacity() {
+		return N;
+	}
+
+private:
+	struct cell {
+		atomic<std::size_t> seq;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	alignas(hardware_destructive_interference_size) atomic<std::size_t> m_enqueue = 0;
+	alignas(hardware_destructive_interference_size) atomic<std::size_t> m_dequeue = 0;
+	alignas(hardware_destructive_interference_size) cell m_cells[N];
+};
+
+} // namespace kstd
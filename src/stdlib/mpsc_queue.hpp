@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <type_traits>
+
+#include "atomic.hpp"
+#include "new.hpp"
+
+namespace kstd {
+
+// link for mpsc_queue; embed it in (or derive from it for) anything
+// that gets queued. a node may be on one queue at a time
+struct mpsc_node {
+	atomic<mpsc_node*> next = nullptr;
+};
+
+// unbounded intrusive multi-producer single-consumer queue (Vyukov).
+// push is one exchange plus one store and never waits, which makes it
+// usable from interrupt handlers; pop is consumer-only and never blocks.
+// T must derive from mpsc_node
+template<typename T> class mpsc_queue {
+public:
+	static_assert(std::is_base_of_v<mpsc_node, T>,
+	              "mpsc_queue elements must derive from mpsc_node");
+
+	inline mpsc_queue() noexcept : m_head(&m_stub), m_tail(&m_stub) { }
+
+	mpsc_queue(const mpsc_queue&) = delete;
+	mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+	// any CPU; returns true if the queue was empty beforehand, which is
+	// when the consumer needs waking
+	inline bool push(T* item) noexcept {
+		return push_node(static_cast<mpsc_node*>(item)) == &m_stub;
+	}
+
+	// consumer only. may return null while a push is half done even
+	// though the queue isn't empty; the pusher's wakeup covers that
+	inline T* pop() noexcept {
+		mpsc_node* tail = m_tail;
+		mpsc_node* next = tail->next.load(memory_order_acquire);
+
+		if (tail == &m_stub) {
+			if (next == nullptr)
+				return nullptr;
+			// step over the stub
+			m_tail = next;
+			tail = next;
+			next = next->next.load(memory_order_acquire);
+		}
+
+		if (next != nullptr) {
+			m_tail = next;
+			return static_cast<T*>(tail);
+		}
+
+		// tail is the last node we can see. if it isn't the head a push
+		// is mid-flight; otherwise requeue the stub behind it so tail
+		// can be handed out
+		if (tail != m_head.load(memory_order_acquire))
+			return nullptr;
+		push_node(&m_stub);
+
+		next = tail->next.load(memory_order_acquire);
+		if (next == nullptr)
+			return nullptr;
+		m_tail = next;
+		return static_cast<T*>(tail);
+	}
+
+	inline bool empty() const noexcept {
+		return m_tail == &m_stub && 
+		       m_stub.next.load(memory_order_acquire) == nullptr;
+	}
+
+private:
+	inline mpsc_node* push_node(mpsc_node* n) noexcept {
+		n->next.store(nullptr, memory_order_relaxed);
+		mpsc_node* prev = m_head.exchange(n, memory_order_acq_rel);
+		// the queue is briefly split here; pop() treats it as empty
+		prev->next.store(n, memory_order_release);
+		return prev;
+	}
+
+	alignas(hardware_destructive_interference_size) atomic<mpsc_node*> m_head;
+	alignas(hardware_destructive_interference_size) mpsc_node* m_tail;
+	mpsc_node m_stub;
+};
+
+} // namespace kstd
@@ -1,5 +1,16 @@
 #pragma once
 
+#include <cstddef>
+
+namespace kstd {
+
+// x86 lines are 64 bytes; anything written by different CPUs should sit
+// at least this far apart
+inline constexpr std::size_t hardware_destructive_interference_size = 64;
+inline constexpr std::size_t hardware_constructive_interference_size = 64;
+
+} // namespace kstd
+
 enum class align_val_t : std::size_t { };
 struct nothrow_t { explicit nothrow_t() = default; };
 extern const nothrow_t nothrow;
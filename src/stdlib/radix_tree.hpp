@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "new.hpp"
+
+namespace kstd {
+
+// sparse map from 64-bit indices to T*, 64 ways per level and only as
+// tall as the largest index needs. each node keeps Tags bitmaps of which
+// slots hold (or lead to) an entry carrying that tag, so walking the
+// tagged entries in order skips everything else a whole subtree at a
+// time. not synchronized; nodes come from the heap
+template<typename T, unsigned Tags = 1> class radix_tree {
+public:
+	inline static constexpr unsigned SHIFT = 6;
+	inline static constexpr std::size_t FANOUT = std::size_t(1) << SHIFT;
+	inline static constexpr uint64_t MASK = FANOUT - 1;
+	inline static constexpr unsigned MAX_DEPTH = (64 + SHIFT - 1) / SHIFT;
+
+	constexpr radix_tree() noexcept = default;
+
+	radix_tree(const radix_tree&) = delete;
+	radix_tree& operator=(const radix_tree&) = delete;
+
+	// the entries themselves are the caller's
+	inline ~radix_tree() {
+		clear();
+	}
+
+	inline std::size_t size() const noexcept {
+		return m_size;
+	}
+
+	T* lookup(uint64_t index) const noexcept {
+		if (m_root == nullptr || !fits(index))
+			return nullptr;
+		node* n = m_root;
+		for (unsigned shift = m_shift; shift != 0; shift -= SHIFT) {
+			n = (node*)n->slots[(index >> shift) & MASK];
+			if (n == nullptr)
+				return nullptr;
+		}
+		return (T*)n->slots[index & MASK];
+	}
+
+	// false if index is taken or a node can't be allocated
+	bool insert(uint64_t index, T* item) {
+		if (item == nullptr)
+			return false;
+		if (m_root == nullptr) {
+			m_root = new node();
+			if (m_root == nullptr)
+				return false;
+			m_shift = 0;
+		}
+		while (!fits(index)) {
+			if (!grow())
+				return false;
+		}
+
+		node* n = m_root;
+		for (unsigned shift = m_shift; shift != 0; shift -= SHIFT) {
+			void*& slot = n->slots[(index >> shift) & MASK];
+			if (slot == nullptr) {
+				slot = new node();
+				if (slot == nullptr)
+					return false;
+				n->count++;
+			}
+			n = (node*)slot;
+		}
+		void*& slot = n->slots[index & MASK];
+		if (slot != nullptr)
+			return false;
+		slot = item;
+		n->count++;
+		m_size++;
+		return true;
+	}
+
+	// takes the entry out along with its tags and returns it; nodes left
+	// empty are freed
+	T* remove(uint64_t index) {
+		if (m_root == nullptr || !fits(index))
+			return nullptr;
+		node* path[MAX_DEPTH];
+		unsigned depth = 0;
+		node* n = m_root;
+		for (unsigned shift = m_shift; shift != 0; shift -= SHIFT) {
+			path[depth++] = n;
+			n = (node*)n->slots[(index >> shift) & MASK];
+			if (n == nullptr)
+				return nullptr;
+		}
+		T* item = (T*)n->slots[index & MASK];
+		if (item == nullptr)
+			return nullptr;
+		for (unsigned t = 0; t < Tags; t++)
+			clear_tag(index, t);
+
+		n->slots[index & MASK] = nullptr;
+		n->count--;
+		m_size--;
+		unsigned shift = 0;
+		while (n->count == 0 && depth != 0) {
+			node* parent = path[--depth];
+			shift += SHIFT;
+			parent->slots[(index >> shift) & MASK] = nullptr;
+			parent->count--;
+			delete n;
+			n = parent;
+		}
+		if (m_root->count == 0) {
+			delete m_root;
+			m_root = nullptr;
+			m_shift = 0;
+		}
+		return item;
+	}
+
+	// no-ops if there's no entry at index
+	void set_tag(uint64_t index, unsigned tag) noexcept {
+		if (lookup(index) == nullptr)
+			return;
+		node* n = m_root;
+		for (unsigned shift = m_shift; ; shift -= SHIFT) {
+			unsigned i = (index >> shift) & MASK;
+			n->tags[tag] |= uint64_t(1) << i;
+			if (shift == 0)
+				return;
+			n = (node*)n->slots[i];
+		}
+	}
+
+	void clear_tag(uint64_t index, unsigned tag) noexcept {
+		if (lookup(index) == nullptr)
+			return;
+		node* path[MAX_DEPTH];
+		unsigned depth = 0;
+		node* n = m_root;
+		for (unsigned shift = m_shift; shift != 0; shift -= SHIFT) {
+			path[depth++] = n;
+			n = (node*)n->slots[(index >> shift) & MASK];
+		}
+		n->tags[tag] &= ~(uint64_t(1) << (index & MASK));
+		// a parent's bit goes once nothing below it carries the tag
+		unsigned shift = 0;
+		while (n->tags[tag] == 0 && depth != 0) {
+			n = path[--depth];
+			shift += SHIFT;
+			n->tags[tag] &= ~(uint64_t(1) << ((index >> shift) & MASK));
+		}
+	}
+
+	bool tagged(uint64_t index, unsigned tag) const noexcept {
+		if (lookup(index) == nullptr)
+			return false;
+		node* n = m_root;
+		for (unsigned shift = m_shift; shift != 0; shift -= SHIFT)
+			n = (node*)n->slots[(index >> shift) & MASK];
+		return (n->tags[tag] >> (index & MASK)) & 1;
+	}
+
+	inline bool any_tagged(unsigned tag) const noexcept {
+		return m_root != nullptr && m_root->tags[tag] != 0;
+	}
+
+	// up to max entries at first or after, in index order; returns the
+	// count
+	inline std::size_t gang_lookup(uint64_t first, T** out,
+	                               std::size_t max) const noexcept
+	{
+		return collect(first, out, max, -1);
+	}
+
+	// the same, counting only entries that carry tag
+	inline std::size_t gang_lookup_tag(uint64_t first, T** out,
+	                                   std::size_t max,
+	                                   unsigned tag) const noexcept
+	{
+		return collect(first, out, max, (int)tag);
+	}
+
+	// frees every node; the entries are left to the caller
+	void clear() noexcept {
+		if (m_root != nullptr)
+			free_node(m_root, m_shift);
+		m_root = nullptr;
+		m_shift = 0;
+		m_size = 0;
+	}
+
+private:
+	struct node {
+		void* slots[FANOUT] = { };
+		uint64_t tags[Tags] = { };
+		uint32_t count = 0;
+	};
+
+	inline bool fits(uint64_t index) const noexcept {
+		return m_shift + SHIFT >= 64 || (index >> (m_shift + SHIFT)) == 0;
+	}
+
+	// a new root above the old one, which becomes its slot 0
+	bool grow() {
+		node* root = new node();
+		if (root == nullptr)
+			return false;
+		root->slots[0] = m_root;
+		root->count = 1;
+		for (unsigned t = 0; t < Tags; t++) {
+			if (m_root->tags[t] != 0)
+				root->tags[t] = 1;
+		}
+		m_root = root;
+		m_shift += SHIFT;
+		return true;
+	}
+
+	std::size_t collect(uint64_t first, T** out, std::size_t max,
+	                    int tag) const noexcept
+	{
+		std::size_t n = 0;
+		if (m_root != nullptr && max != 0 && fits(first))
+			collect_node(m_root, m_shift, 0, first, out, max, tag, n);
+		return n;
+	}
+
+	static void collect_node(node* nd, unsigned shift, uint64_t base,
+	                         uint64_t first, T** out, std::size_t max,
+	                         int tag, std::size_t& n) noexcept
+	{
+		uint64_t start = first > base ? (first - base) >> shift : 0;
+		uint64_t bits = start >= FANOUT ? 0 : ~uint64_t(0) << start;
+		bits &= tag >= 0 ? nd->tags[tag] : ~uint64_t(0);
+		while (bits != 0 && n < max) {
+			unsigned i = __builtin_ctzll(bits);
+			bits &= bits - 1;
+			void* slot = nd->slots[i];
+			if (slot == nullptr)
+				continue;
+			uint64_t index = base + ((uint64_t)i << shift);
+			if (shift == 0)
+				out[n++] = (T*)slot;
+			else
+				collect_node((node*)slot, shift - SHIFT, index, first, out,
+				             max, tag, n);
+		}
+	}
+
+	static void free_node(node* nd, unsigned shift) noexcept {
+		if (shift != 0) {
+			for (std::size_t i = 0; i < FANOUT; i++) {
+				if (nd->slots[i] != nullptr)
+					free_node((node*)nd->slots[i], shift - SHIFT);
+			}
+		}
+		delete nd;
+	}
+
+	node* m_root = nullptr;
+	unsigned m_shift = 0;
+	std::size_t m_size = 0;
+};
+
+} // namespace kstd
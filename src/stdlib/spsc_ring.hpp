@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <new>
+#include <type_traits>
+
+#include "atomic.hpp"
+#include "new.hpp"
+#include "utility.hpp"
+
+namespace kstd {
+
+// bounded single-producer single-consumer ring. each side owns one index
+// on its own cache line and keeps a private copy of the other's, so the
+// shared lines only move when the cached view says full or empty.
+// N must be a power of two
+template<typename T, std::size_t N> class spsc_ring {
+public:
+	static_assert(N >= 2 && (N & (N - 1)) == 0,
+	              "spsc_ring size must be a power of two");
+
+	using value_type = T;
+
+	constexpr spsc_ring() noexcept = default;
+
+	spsc_ring(const spsc_ring&) = delete;
+	spsc_ring& operator=(const spsc_ring&) = delete;
+
+	inline ~spsc_ring() {
+		T v;
+		while (try_pop(v)) { }
+	}
+
+	// producer side
+	template<typename U> inline bool try_push(U&& value) {
+		std::size_t tail = m_prod.tail.load(memory_order_relaxed);
+		if (tail - m_prod.head_cache == N) {
+			m_prod.head_cache = m_cons.head.load(memory_order_acquire);
+			if (tail - m_prod.head_cache == N)
+				return false;
+		}
+
+		::new ((void*)slot(tail)) T(forward<U>(value));
+		m_prod.tail.store(tail + 1, memory_order_release);
+		return true;
+	}
+
+	// consumer side
+	inline bool try_pop(T& out) {
+		std::size_t head = m_cons.head.load(memory_order_relaxed);
+		if (head == m_cons.tail_cache) {
+			m_cons.tail_cache = m_prod.tail.load(memory_order_acquire);
+			if (head == m_cons.tail_cache)
+				return false;
+		}
+
+		T* p = slot(head);
+		out = move(*p);
+		p->~T();
+		m_cons.head.store(head + 1, memory_order_release);
+		return true;
+	}
+
+	// exact only when called from one of the two sides while the other
+	// is quiet
+	inline std::size_t size_approx() const {
+		return m_prod.tail.load(memory_order_acquire) - 
+		       m_cons.head.load(memory_order_acquire);
+	}
+
+	inline bool empty() const {
+		return size_approx() == 0;
+	}
+
+	inline static constexpr std::size_t capacity() {
+		return N;
+	}
+
+private:
+	// indices run freely and are masked on use, so full and empty
+	// differ without sacrificing a slot
+	struct alignas(hardware_destructive_interference_size) producer {
+		atomic<std::size_t> tail = 0;
+		std::size_t head_cache = 0;
+	};
+
+	struct alignas(hardware_destructive_interference_size) consumer {
+		atomic<std::size_t> head = 0;
+		std::size_t tail_cache = 0;
+	};
+
+	inline T* slot(std::size_t i) {
+		return reinterpret_cast<T*>(m_storage[i & (N - 1)]);
+	}
+
+	producer m_prod;
+	consumer m_cons;
+	alignas(T) unsigned char m_storage[N][sizeof(T)];
+};
+
+} // namespace kstd
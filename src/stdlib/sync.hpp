@@ -0,0 +1,405 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "atomic.hpp"
+#include "new.hpp"
+
+#include "asm_wrappers.hpp"
+
+namespace kstd {
+
+// spinning primitives for kernel code; none of them sleep. the plain
+// locks leave interrupts alone, so anything an interrupt handler can also
+// take must be held through an irq_* guard
+
+inline static constexpr uint64_t RFLAGS_IF = 1 << 9;
+
+// hold time and contention per lock, collected only with K_LOCK_STATS so
+// the default build pays nothing for them. counters are updated while
+// the lock is held and read racily
+#ifdef K_LOCK_STATS
+struct lock_stats {
+	uint64_t acquisitions = 0;
+	uint64_t contentions = 0;
+	uint64_t hold_cycles = 0;
+	uint64_t max_hold_cycles = 0;
+	uint64_t acquired_at = 0;
+
+	inline void on_acquire(bool contended) {
+		acquisitions++;
+		if (contended)
+			contentions++;
+		acquired_at = rdtsc();
+	}
+
+	inline void on_release() {
+		uint64_t held = rdtsc() - acquired_at;
+		hold_cycles += held;
+		if (held > max_hold_cycles)
+			max_hold_cycles = held;
+	}
+};
+#else
+struct lock_stats {
+	inline void on_acquire(bool) { }
+	inline void on_release() { }
+};
+#endif
+
+// FIFO spinlock: waiters take a ticket and spin until it's served. every
+// waiter polls the same line, so keep it for locks with little contention
+class ticket_lock {
+public:
+	constexpr ticket_lock() noexcept = default;
+
+	ticket_lock(const ticket_lock&) = delete;
+	ticket_lock& operator=(const ticket_lock&) = delete;
+
+	inline void lock() noexcept {
+		uint32_t ticket = m_next.fetch_add(1, memory_order_relaxed);
+		bool contended = false;
+		while (m_serving.load(memory_order_acquire) != ticket) {
+			contended = true;
+			cpu_relax();
+		}
+		m_stats.on_acquire(contended);
+	}
+
+	inline bool try_lock() noexcept {
+		uint32_t serving = m_serving.load(memory_order_relaxed);
+		uint32_t expected = serving;
+		if (!m_next.compare_exchange_strong(expected, serving + 1,
+		                                    memory_order_acquire,
+		                                    memory_order_relaxed))
+			return false;
+		m_stats.on_acquire(false);
+		return true;
+	}
+
+	inline void unlock() noexcept {
+		m_stats.on_release();
+		m_serving.store(m_serving.load(memory_order_relaxed) + 1,
+		                memory_order_release);
+	}
+
+	inline bool is_locked() const noexcept {
+		return m_next.load(memory_order_relaxed) != 
+		       m_serving.load(memory_order_relaxed);
+	}
+
+	inline const lock_stats& stats() const noexcept {
+		return m_stats;
+	}
+
+private:
+	atomic<uint32_t> m_next = 0;
+	atomic<uint32_t> m_serving = 0;
+	[[no_unique_address]] lock_stats m_stats;
+};
+
+// queue node for mcs_lock. each waiter spins on the flag in its own node,
+// so a contended lock costs one cache line transfer per hand-off instead
+// of one per waiter. nodes normally live on the stack through mcs_guard
+struct alignas(hardware_destructive_interference_size) mcs_node {
+	atomic<mcs_node*> next = nullptr;
+	atomic<bool> locked = false;
+};
+
+class mcs_lock {
+public:
+	constexpr mcs_lock() noexcept = default;
+
+	mcs_lock(const mcs_lock&) = delete;
+	mcs_lock& operator=(const mcs_lock&) = delete;
+
+	inline void lock(mcs_node& node) noexcept {
+		node.next.store(nullptr, memory_order_relaxed);
+		node.locked.store(true, memory_order_relaxed);
+
+		mcs_node* prev = m_tail.exchange(&node, memory_order_acq_rel);
+		bool contended = prev != nullptr;
+		if (contended) {
+			prev->next.store(&node, memory_order_release);
+			while (node.locked.load(memory_order_acquire))
+				cpu_relax();
+		}
+		m_stats.on_acquire(contended);
+	}
+
+	inline bool try_lock(mcs_node& node) noexcept {
+		node.next.store(nullptr, memory_order_relaxed);
+		node.locked.store(false, memory_order_relaxed);
+
+		mcs_node* expected = nullptr;
+		if (!m_tail.compare_exchange_strong(expected, &node,
+		                                    memory_order_acquire,
+		                                    memory_order_relaxed))
+			return false;
+		m_stats.on_acquire(false);
+		return true;
+	}
+
+	inline void unlock(mcs_node& node) noexcept {
+		m_stats.on_release();
+
+		mcs_node* next = node.next.load(memory_order_acquire);
+		if (next == nullptr) {
+			// nobody queued behind us: swing the tail back to empty
+			mcs_node* expected = &node;
+			if (m_tail.compare_exchange_strong(expected, nullptr,
+			                                   memory_order_release,
+			                                   memory_order_relaxed))
+				return;
+			// someone swapped in after us but hasn't linked yet
+			while ((next = node.next.load(memory_order_acquire)) == nullptr)
+				cpu_relax();
+		}
+		next->locked.store(false, memory_order_release);
+	}
+
+	inline bool is_locked() const noexcept {
+		return m_tail.load(memory_order_relaxed) != nullptr;
+	}
+
+	inline const lock_stats& stats() const noexcept {
+		return m_stats;
+	}
+
+private:
+	atomic<mcs_node*> m_tail = nullptr;
+	[[no_unique_address]] lock_stats m_stats;
+};
+
+// reader-writer spinlock. a waiting writer blocks new readers, so a
+// steady stream of readers can't starve it
+class rw_lock {
+public:
+	constexpr rw_lock() noexcept = default;
+
+	rw_lock(const rw_lock&) = delete;
+	rw_lock& operator=(const rw_lock&) = delete;
+
+	inline void read_lock() noexcept {
+		for (;;) {
+			uint32_t s = m_state.load(memory_order_relaxed);
+			if ((s & (WRITER | WRITER_WAITING)) == 0 &&
+			    m_state.compare_exchange_weak(s, s + 1,
+			                                  memory_order_acquire,
+			                                  memory_order_relaxed))
+				return;
+			cpu_relax();
+		}
+	}
+
+	inline void read_unlock() noexcept {
+		m_state.fetch_sub(1, memory_order_release);
+	}
+
+	inline void write_lock() noexcept {
+		bool contended = false;
+		for (;;) {
+			uint32_t s = m_state.load(memory_order_relaxed);
+			if ((s & ~WRITER_WAITING) == 0 &&
+			    m_state.compare_exchange_weak(s, WRITER,
+			                                  memory_order_acquire,
+			                                  memory_order_relaxed))
+				break;
+			if ((s & WRITER_WAITING) == 0)
+				m_state.fetch_or(WRITER_WAITING, memory_order_relaxed);
+			contended = true;
+			cpu_relax();
+		}
+		m_stats.on_acquire(contended);
+	}
+
+	inline void write_unlock() noexcept {
+		m_stats.on_release();
+		m_state.fetch_and(~WRITER, memory_order_release);
+	}
+
+	inline const lock_stats& stats() const noexcept {
+		return m_stats;
+	}
+
+private:
+	inline static constexpr uint32_t WRITER = 1u << 31;
+	inline static constexpr uint32_t WRITER_WAITING = 1u << 30;
+
+	// reader count in the low bits
+	atomic<uint32_t> m_state = 0;
+	[[no_unique_address]] lock_stats m_stats;
+};
+
+// sequence lock for small, read-mostly data. readers never write shared
+// memory; they retry if a writer ran while they were copying:
+//
+//	uint32_t seq;
+//	do {
+//		seq = lock.read_begin();
+//		copy = data;
+//	} while (lock.read_retry(seq));
+//
+// the data itself must be read with plain loads that tolerate tearing
+class seqlock {
+public:
+	constexpr seqlock() noexcept = default;
+
+	seqlock(const seqlock&) = delete;
+	seqlock& operator=(const seqlock&) = delete;
+
+	inline uint32_t read_begin() const noexcept {
+		uint32_t seq;
+		while ((seq = m_seq.load(memory_order_acquire)) & 1)
+			cpu_relax();
+		return seq;
+	}
+
+	inline bool read_retry(uint32_t seq) const noexcept {
+		atomic_thread_fence(memory_order_acquire);
+		return m_seq.load(memory_order_relaxed) != seq;
+	}
+
+	inline void write_lock() noexcept {
+		m_writer.lock();
+		m_seq.store(m_seq.load(memory_order_relaxed) + 1, 
+		            memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+	}
+
+	inline void write_unlock() noexcept {
+		m_seq.store(m_seq.load(memory_order_relaxed) + 1, 
+		            memory_order_release);
+		m_writer.unlock();
+	}
+
+	inline const lock_stats& stats() const noexcept {
+		return m_writer.stats();
+	}
+
+private:
+	atomic<uint32_t> m_seq = 0;
+	ticket_lock m_writer;
+};
+
+// saves the interrupt flag and disables interrupts for its lifetime;
+// nests, since only the outermost guard saw them enabled
+class irq_guard {
+public:
+	inline irq_guard() noexcept : m_flags(read_rflags()) {
+		cli();
+	}
+
+	inline ~irq_guard() {
+		if (m_flags & RFLAGS_IF)
+			sti();
+	}
+
+	irq_guard(const irq_guard&) = delete;
+	irq_guard& operator=(const irq_guard&) = delete;
+
+private:
+	uint64_t m_flags;
+};
+
+template<typename Lock> class lock_guard {
+public:
+	inline explicit lock_guard(Lock& lock) noexcept : m_lock(lock) {
+		m_lock.lock();
+	}
+
+	inline ~lock_guard() {
+		m_lock.unlock();
+	}
+
+	lock_guard(const lock_guard&) = delete;
+	lock_guard& operator=(const lock_guard&) = delete;
+
+private:
+	Lock& m_lock;
+};
+
+class mcs_guard {
+public:
+	inline explicit mcs_guard(mcs_lock& lock) noexcept : m_lock(lock) {
+		m_lock.lock(m_node);
+	}
+
+	inline ~mcs_guard() {
+		m_lock.unlock(m_node);
+	}
+
+	mcs_guard(const mcs_guard&) = delete;
+	mcs_guard& operator=(const mcs_guard&) = delete;
+
+private:
+	mcs_lock& m_lock;
+	mcs_node m_node;
+};
+
+template<typename Lock> class read_guard {
+public:
+	inline explicit read_guard(Lock& lock) noexcept : m_lock(lock) {
+		m_lock.read_lock();
+	}
+
+	inline ~read_guard() {
+		m_lock.read_unlock();
+	}
+
+	read_guard(const read_guard&) = delete;
+	read_guard& operator=(const read_guard&) = delete;
+
+private:
+	Lock& m_lock;
+};
+
+template<typename Lock> class write_guard {
+public:
+	inline explicit write_guard(Lock& lock) noexcept : m_lock(lock) {
+		m_lock.write_lock();
+	}
+
+	inline ~write_guard() {
+		m_lock.write_unlock();
+	}
+
+	write_guard(const write_guard&) = delete;
+	write_guard& operator=(const write_guard&) = delete;
+
+private:
+	Lock& m_lock;
+};
+
+// interrupt-disabling variants: interrupts go off before the lock is
+// taken and come back on after it's dropped (members are destroyed in
+// reverse order)
+template<typename Lock> class irq_lock_guard {
+public:
+	inline explicit irq_lock_guard(Lock& lock) noexcept : m_guard(lock) { }
+
+private:
+	irq_guard m_irq;
+	lock_guard<Lock> m_guard;
+};
+
+class irq_mcs_guard {
+public:
+	inline explicit irq_mcs_guard(mcs_lock& lock) noexcept : m_guard(lock) { }
+
+private:
+	irq_guard m_irq;
+	mcs_guard m_guard;
+};
+
+template<typename Lock> class irq_write_guard {
+public:
+	inline explicit irq_write_guard(Lock& lock) noexcept : m_guard(lock) { }
+
+private:
+	irq_guard m_irq;
+	write_guard<Lock> m_guard;
+};
+
+} // namespace kstd
@@ -0,0 +1,333 @@
+#include "stdlib/string_view.hpp"
+
+#include "syscall.hpp"
+
+#include "stdlib/cstdlib.hpp"
+
+#include "address_space.hpp"
+#include "asm_wrappers.hpp"
+#include "boot_profile.hpp"
+#include "console.hpp"
+#include "cpu.hpp"
+#include "gdt.hpp"
+#include "io_ring.hpp"
+#include "serial.hpp"
+#include "util.hpp"
+#include "zero_pool.hpp"
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+// the entry stub bounds-checks against this
+#define SYSCALL_COUNT 8
+static_assert(SYSCALL_COUNT == sys::NUM_SYSCALLS);
+
+// what the program exits with when it can't be returned to: as if it
+// had taken a #GP
+#define EXIT_GP -269
+static_assert(EXIT_GP == sys::EXIT_FAULT_BASE - 13);
+
+// SYSCALL leaves rip in rcx, rflags in r11 and interrupts masked through
+// FMASK. everything here is kept to what SYSRET needs back: switch
+// stacks, save three registers, call through the table, clear the
+// argument registers so no kernel values leak out, return
+__asm__(
+    ".text\n"
+    ".global syscall_entry\n"
+    "syscall_entry:\n"
+    "    swapgs\n"
+    "    movq %rsp, %gs:" STR(CPU_LOCAL_USER_RSP) "\n"
+    "    movq %gs:" STR(CPU_LOCAL_KERNEL_RSP) ", %rsp\n"
+    "    pushq %gs:" STR(CPU_LOCAL_USER_RSP) "\n"
+    "    pushq %r11\n"
+    "    pushq %rcx\n"
+    "    subq $8, %rsp\n" // 16-byte align for the call
+    "    sti\n"
+    "    cmpq $" STR(SYSCALL_COUNT) ", %rax\n"
+    "    jae 1f\n"
+    "    movq %r10, %rcx\n"
+    "    movabsq $syscall_table, %r11\n"
+    "    callq *(%r11, %rax, 8)\n"
+    "    jmp 2f\n"
+    "1:\n"
+    "    movq $-38, %rax\n" // -ENOSYS
+    "2:\n"
+    "    cli\n"
+    // SYSRET to a non-canonical rip faults in ring 0 on Intel, on the
+    // user's stack. only a syscall in the last two bytes below
+    // USER_SPACE_END returns there, and the program would fault on its
+    // next fetch anyway, so it ends here instead
+    "    movq 8(%rsp), %rcx\n"
+    "    shrq $47, %rcx\n"
+    "    jnz 3f\n"
+    "    xorl %edi, %edi\n"
+    "    xorl %esi, %esi\n"
+    "    xorl %edx, %edx\n"
+    "    xorl %r8d, %r8d\n"
+    "    xorl %r9d, %r9d\n"
+    "    xorl %r10d, %r10d\n"
+    "    addq $8, %rsp\n"
+    "    popq %rcx\n"
+    "    popq %r11\n"
+    "    popq %rsp\n"
+    "    swapgs\n"
+    "    sysretq\n"
+    "3:\n"
+    "    movq $" STR(EXIT_GP) ", %rdi\n"
+    "    jmp exit_to_kernel\n"
+    "\n"
+    // enter_user(entry, stack, arg): saves the callee-saved registers
+    // for SYS_EXIT to come back to, then SYSRETs with IF set
+    ".global enter_user_asm\n"
+    "enter_user_asm:\n"
+    "    pushq %rbx\n"
+    "    pushq %rbp\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, %gs:" STR(CPU_LOCAL_EXIT_RSP) "\n"
+    "    movq %rdi, %rcx\n"
+    "    movq %rsi, %rsp\n"
+    "    movq %rdx, %rdi\n"
+    "    movl $0x202, %r11d\n"
+    "    xorl %eax, %eax\n"
+    "    xorl %ebx, %ebx\n"
+    "    xorl %ebp, %ebp\n"
+    "    xorl %esi, %esi\n"
+    "    xorl %edx, %edx\n"
+    "    xorl %r12d, %r12d\n"
+    "    xorl %r13d, %r13d\n"
+    "    xorl %r14d, %r14d\n"
+    "    xorl %r15d, %r15d\n"
+    "    cli\n"
+    "    swapgs\n"
+    "    sysretq\n"
+    "\n"
+    // exit_to_kernel(code): unwinds to enter_user_asm's caller
+    ".global exit_to_kernel\n"
+    "exit_to_kernel:\n"
+    "    cli\n"
+    "    movq %gs:" STR(CPU_LOCAL_EXIT_RSP) ", %rsp\n"
+    "    movq %rdi, %rax\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbp\n"
+    "    popq %rbx\n"
+    "    ret\n"
+    "\n"
+    // copy_user(dst, src, len): the rep movsb is where a bad user pointer
+    // faults, and the exception table sends that to the -EFAULT return
+    ".global copy_user\n"
+    "copy_user:\n"
+    "    movq %rdx, %rcx\n"
+    "4:\n"
+    "    rep movsb\n"
+    "    xorl %eax, %eax\n"
+    "    ret\n"
+    "5:\n"
+    "    movq $-14, %rax\n" // -EFAULT
+    "    ret\n"
+    ".pushsection .ex_table, \"a\"\n"
+    "    .balign 8\n"
+    "    .quad 4b, 5b\n"
+    ".popsection\n"
+#ifdef K_SYSCALL_BENCH
+    "\n"
+    // copied into a user page: rdi null syscalls, then SYS_EXIT(0)
+    ".global user_null_bench\n"
+    ".global user_null_bench_end\n"
+    "user_null_bench:\n"
+    "    movq %rdi, %rbx\n"
+    "1:\n"
+    "    xorl %eax, %eax\n"
+    "    syscall\n"
+    "    decq %rbx\n"
+    "    jnz 1b\n"
+    "    movl $1, %eax\n"
+    "    xorl %edi, %edi\n"
+    "    syscall\n"
+    "user_null_bench_end:\n"
+#endif
+);
+
+extern "C" void syscall_entry();
+extern "C" int64_t enter_user_asm(uintptr_t entry, uintptr_t stack, 
+                                  uint64_t arg);
+extern "C" [[noreturn]] void exit_to_kernel(int64_t code);
+extern "C" int64_t copy_user(void* dst, const void* src, std::size_t len);
+
+// faulting instructions that may touch user memory, and where each one
+// goes instead of panicking. the linker script collects them
+struct ex_table_entry {
+    uint64_t fault;
+    uint64_t fixup;
+};
+extern "C" const ex_table_entry EX_TABLE_BEGIN[];
+extern "C" const ex_table_entry EX_TABLE_END[];
+#ifdef K_SYSCALL_BENCH
+extern "C" const uint8_t user_null_bench[];
+extern "C" const uint8_t user_null_bench_end[];
+#endif
+
+namespace sys {
+
+static int64_t sys_null(uint64_t, uint64_t, uint64_t, 
+                        uint64_t, uint64_t, uint64_t)
+{
+    return 0;
+}
+
+static int64_t sys_exit(uint64_t code, uint64_t, uint64_t, 
+                        uint64_t, uint64_t, uint64_t)
+{
+    exit_to_kernel((int64_t)code);
+}
+
+static int64_t sys_write(uint64_t buf, uint64_t len, uint64_t, 
+                         uint64_t, uint64_t, uint64_t)
+{
+    if (!user_range_ok(buf, len))
+        return -EFAULT;
+
+    char chunk[256];
+    for (uint64_t done = 0; done < len; ) {
+        std::size_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+        if (copy_from_user(chunk, buf + done, n) != 0)
+            return -EFAULT;
+        // not the console: the Limine terminal needs the bootloader's
+        // tables
+        serial::write(kstd::string_view(chunk, n));
+        done += n;
+    }
+    return (int64_t)len;
+}
+
+static int64_t sys_getcpu(uint64_t, uint64_t, uint64_t, 
+                          uint64_t, uint64_t, uint64_t)
+{
+    return cpu::id();
+}
+
+} // namespace sys
+
+// indexed straight from the entry stub
+extern "C" const sys::syscall_fn syscall_table[sys::NUM_SYSCALLS] = {
+    &sys::sys_null,
+    &sys::sys_exit,
+    &sys::sys_write,
+    &sys::sys_getcpu,
+    &ring::sys_setup,
+    &ring::sys_enter,
+    &ring::sys_register,
+    &ring::sys_destroy,
+};
+
+namespace sys {
+
+void init_cpu() {
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+    wrmsr(MSR_STAR, ((uint64_t)gdt::SYSRET_BASE << 48) | 
+                    ((uint64_t)gdt::KERNEL_CS << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)&syscall_entry);
+    // IF, DF, TF, NT and AC off on entry
+    wrmsr(MSR_FMASK, 0x44700);
+    // user GS until the first swapgs
+    wrmsr(cpu::MSR_KERNEL_GS_BASE, 0);
+}
+
+int64_t enter_user(uintptr_t entry, uintptr_t stack, uint64_t arg) {
+    return enter_user_asm(entry, stack, arg);
+}
+
+void exit_user(int64_t code) {
+    exit_to_kernel(code);
+}
+
+int64_t copy_from_user(void* dst, uint64_t src, std::size_t len) {
+    if (!user_range_ok(src, len))
+        return -EFAULT;
+    return copy_user(dst, (const void*)src, len);
+}
+
+int64_t copy_to_user(uint64_t dst, const void* src, std::size_t len) {
+    if (!user_range_ok(dst, len))
+        return -EFAULT;
+    return copy_user((void*)dst, src, len);
+}
+
+bool fixup_user_access(idt::interrupt_frame& frame) {
+    for (const ex_table_entry* e = EX_TABLE_BEGIN; e != EX_TABLE_END; e++) {
+        if (e->fault == frame.rip) {
+            frame.rip = e->fixup;
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef K_SYSCALL_BENCH
+
+#ifdef K_SYSCALL_BENCH_ITERATIONS
+    inline static constexpr uint64_t BENCH_ITERATIONS = K_SYSCALL_BENCH_ITERATIONS;
+#else
+    inline static constexpr uint64_t BENCH_ITERATIONS = 1000000;
+#endif
+
+inline static constexpr uintptr_t BENCH_CODE  = 0x400000;
+inline static constexpr uintptr_t BENCH_STACK = 0x7FFFFFFFE000;
+
+// maps a fresh zeroed frame; once mapped, destroy() owns it
+static void* map_bench_page(mem::address_space* as, uintptr_t virt, 
+                            uint64_t flags)
+{
+    mem::page_table::physical_address frame = mem::alloc_zeroed_frame();
+    if (IS_NULL(frame))
+        return nullptr;
+    if (!as->map(virt, frame, flags)) {
+        pt->free_frame(frame);
+        return nullptr;
+    }
+    return mem::phys_to_virt(frame);
+}
+
+void run_null_benchmark() {
+    mem::address_space* as = mem::address_space::create();
+    if (as == nullptr)
+        return;
+
+    void* code = map_bench_page(as, BENCH_CODE, 0);
+    if (code == nullptr || 
+        map_bench_page(as, BENCH_STACK, mem::PTE_WRITABLE | mem::PTE_NX) == nullptr) 
+    {
+        as->destroy();
+        return;
+    }
+    memcpy(code, user_null_bench, user_null_bench_end - user_null_bench);
+
+    as->activate();
+    // warm the TLB, caches and branch predictors first
+    enter_user(BENCH_CODE, BENCH_STACK + 4096, 1000);
+    uint64_t start = rdtsc();
+    enter_user(BENCH_CODE, BENCH_STACK + 4096, BENCH_ITERATIONS);
+    uint64_t cycles = rdtsc() - start;
+    mem::address_space::activate_kernel();
+    as->destroy();
+
+    console::print("- null syscall: ");
+    console::print_udec(cycles / BENCH_ITERATIONS);
+    console::print(" cycles");
+    uint64_t hz = prof::tsc_frequency();
+    if (hz != 0) {
+        console::print(", ");
+        console::print_udec(cycles * 1000 / (hz / 1000000) / BENCH_ITERATIONS);
+        console::print(" ns");
+    }
+    console::print(" per round trip\n");
+}
+
+#endif
+
+} // namespace sys
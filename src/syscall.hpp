@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "address_space.hpp"
+#include "idt.hpp"
+
+namespace sys {
+
+inline static constexpr uint32_t MSR_EFER  = 0xC0000080;
+inline static constexpr uint32_t MSR_STAR  = 0xC0000081;
+inline static constexpr uint32_t MSR_LSTAR = 0xC0000082;
+inline static constexpr uint32_t MSR_FMASK = 0xC0000084;
+
+inline static constexpr uint64_t EFER_SCE = 1 << 0;
+
+// syscall ABI: number in rax, arguments in rdi, rsi, rdx, r10, r8, r9,
+// result in rax. rcx and r11 are clobbered by the instruction itself
+enum syscall_number : uint64_t {
+    SYS_NULL = 0,       // does nothing; for measuring entry cost
+    SYS_EXIT,           // (code) - back to whoever called enter_user()
+    SYS_WRITE,          // (buf, len) - to the serial port
+    SYS_GETCPU,         // () - id of the CPU running the caller
+    SYS_RING_SETUP,     // (entries, base, flags, sq_cpu) - see io_ring.hpp
+    SYS_RING_ENTER,     // (id, to_submit, min_complete, flags)
+    SYS_RING_REGISTER,  // (id, op, arg, nr)
+    SYS_RING_DESTROY,   // (id)
+    NUM_SYSCALLS
+};
+
+inline static constexpr int64_t EIO    = 5;
+inline static constexpr int64_t EBADF  = 9;
+inline static constexpr int64_t ENOMEM = 12;
+inline static constexpr int64_t EFAULT = 14;
+inline static constexpr int64_t EBUSY  = 16;
+inline static constexpr int64_t ENODEV = 19;
+inline static constexpr int64_t EINVAL = 22;
+inline static constexpr int64_t ENOSYS = 38;
+
+// what enter_user() returns when a CPU exception ends the program
+// instead of SYS_EXIT: this minus the vector
+inline static constexpr int64_t EXIT_FAULT_BASE = -0x100;
+
+using syscall_fn = int64_t (*)(uint64_t, uint64_t, uint64_t, 
+                               uint64_t, uint64_t, uint64_t);
+
+// whether [p, p + len) lies in the user half; what a syscall checks
+// before it touches user memory
+inline bool user_range_ok(uint64_t p, uint64_t len) {
+    return p < mem::USER_SPACE_END && len <= mem::USER_SPACE_END - p;
+}
+
+// enables SYSCALL on this CPU and points it at the entry stub; after
+// gdt::init_cpu()
+void init_cpu();
+
+// drops to ring 3 at entry with rsp = stack and rdi = arg, on whatever
+// address space is loaded. returns SYS_EXIT's code, with interrupts off
+int64_t enter_user(uintptr_t entry, uintptr_t stack, uint64_t arg);
+
+// ends the program this CPU is running as SYS_EXIT(code) would; for
+// exception handlers that catch it misbehaving in ring 3
+[[noreturn]] void exit_user(int64_t code);
+
+// copies between kernel memory and the user half of whatever address
+// space is loaded. a range outside the user half, or a fault partway
+// through, gives -EFAULT instead of a panic; 0 once it's all copied.
+// every syscall that takes a user pointer goes through these
+int64_t copy_from_user(void* dst, uint64_t src, std::size_t len);
+int64_t copy_to_user(uint64_t dst, const void* src, std::size_t len);
+
+// for the page fault handler: if frame faulted in one of the copies
+// above, sends it to its -EFAULT path and returns true
+bool fixup_user_access(idt::interrupt_frame& frame);
+
+#ifdef K_SYSCALL_BENCH
+// times SYS_NULL round trips from a throwaway user address space and
+// prints the cost on the console
+void run_null_benchmark();
+#endif
+
+} // namespace sys
@@ -0,0 +1,319 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/new.hpp"
+#include "stdlib/sync.hpp"
+
+#include "tmpfs.hpp"
+
+#include "memory.hpp"
+#include "page_cache.hpp"
+
+namespace tmpfs {
+
+inline static constexpr std::size_t PAGE_SIZE = cache::PAGE_SIZE;
+inline static constexpr std::size_t HUGE_PAGE_SIZE = cache::HUGE_PAGES * PAGE_SIZE;
+
+struct node;
+
+// a name in a directory; the name follows the struct
+struct entry {
+    entry* next;
+    node* target;
+    uint32_t len;
+
+    inline kstd::string_view name() const {
+        return kstd::string_view((const char*)(this + 1), len);
+    }
+};
+
+static uint64_t no_block(void*, uint64_t, bool) {
+    return cache::NO_BLOCK;
+}
+
+static const cache::object_ops s_data_ops = { &no_block };
+
+// a file or directory. it outlives its inode for as long as a directory
+// names it, and goes with the inode's release once nothing does
+struct node {
+    node(bool dir, uint64_t number)
+        : data(nullptr, &s_data_ops, this, 0), directory(dir), ino(number)
+    {
+    }
+
+    ~node() {
+        while (entries != nullptr) {
+            entry* e = entries;
+            entries = e->next;
+            kfree(e);
+        }
+    }
+
+    cache::object data;
+    bool directory;
+    uint64_t ino;
+    // entries naming it. changed under the VFS's lock on the directory
+    // doing the naming; read once the last reference is gone
+    uint32_t links = 0;
+
+    // creates and removes are serialized by the VFS already; this keeps
+    // read_dir() off the list while they change it
+    kstd::ticket_lock lock;
+    entry* entries = nullptr;
+};
+
+static uint64_t s_next_ino = 1;
+
+extern const vfs::inode_ops s_ops;
+
+static vfs::inode* inode_for(vfs::superblock* sb, node* n) {
+    vfs::inode* i = vfs::get_inode(sb, n->ino);
+    if (i != nullptr)
+        return i;
+    return vfs::new_inode(sb, n->ino, &s_ops, n, n->directory);
+}
+
+// with the VFS's lock on dir held
+static entry* find(node* dir, kstd::string_view name) {
+    for (entry* e = dir->entries; e != nullptr; e = e->next) {
+        if (e->name() == name)
+            return e;
+    }
+    return nullptr;
+}
+
+static vfs::inode* tmpfs_lookup(vfs::inode* dir, kstd::string_view name) {
+    entry* e = find((node*)dir->priv, name);
+    return e != nullptr ? inode_for(dir->sb, e->target) : nullptr;
+}
+
+static vfs::inode* tmpfs_create(vfs::inode* dir, kstd::string_view name,
+                                bool directory)
+{
+    node* d = (node*)dir->priv;
+    if (find(d, name) != nullptr)
+        return nullptr;
+
+    node* n = new node(directory,
+                       __atomic_fetch_add(&s_next_ino, 1, __ATOMIC_RELAXED));
+    if (n == nullptr)
+        return nullptr;
+    entry* e = (entry*)kmalloc(sizeof(entry) + name.size());
+    vfs::inode* result = e != nullptr ? inode_for(dir->sb, n) : nullptr;
+    if (result == nullptr) {
+        kfree(e);
+        delete n;
+        return nullptr;
+    }
+
+    e->target = n;
+    e->len = (uint32_t)name.size();
+    memcpy(e + 1, name.data(), name.size());
+    n->links = 1;
+
+    kstd::lock_guard guard(d->lock);
+    e->next = d->entries;
+    d->entries = e;
+    return result;
+}
+
+static bool tmpfs_remove(vfs::inode* dir, kstd::string_view name,
+                         vfs::inode* child)
+{
+    node* d = (node*)dir->priv;
+    node* c = (node*)child->priv;
+    if (c->directory && c->entries != nullptr)
+        return false;
+
+    kstd::lock_guard guard(d->lock);
+    for (entry** at = &d->entries; *at != nullptr; at = &(*at)->next) {
+        entry* e = *at;
+        if (e->target == c && e->name() == name) {
+            *at = e->next;
+            kfree(e);
+            __atomic_sub_fetch(&c->links, 1, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::size_t tmpfs_read(vfs::inode* i, uint64_t pos, void* buf,
+                              std::size_t len)
+{
+    return i->directory ? 0 : ((node*)i->priv)->data.read(pos, buf, len);
+}
+
+static std::size_t tmpfs_write(vfs::inode* i, uint64_t pos, const void* buf,
+                               std::size_t len)
+{
+    if (i->directory)
+        return 0;
+    node* n = (node*)i->priv;
+    if (pos + len >= HUGE_THRESHOLD)
+        n->data.set_huge(true);
+    return n->data.write(pos, buf, len);
+}
+
+// entries in the order they were made, newest first. *cookie counts
+// entries, so a create or remove between calls shifts the rest
+static bool tmpfs_read_dir(vfs::inode* dir, std::size_t* cookie,
+                           vfs::dir_entry* out)
+{
+    node* d = (node*)dir->priv;
+    kstd::lock_guard guard(d->lock);
+    entry* e = d->entries;
+    for (std::size_t i = 0; e != nullptr && i < *cookie; i++)
+        e = e->next;
+    if (e == nullptr)
+        return false;
+
+    memcpy(out->name, e + 1, e->len);
+    out->name[e->len] = '\0';
+    out->directory = e->target->directory;
+    (*cookie)++;
+    return true;
+}
+
+static uint64_t tmpfs_size(vfs::inode* i) {
+    return ((node*)i->priv)->data.size();
+}
+
+static void tmpfs_release(vfs::inode* i) {
+    node* n = (node*)i->priv;
+    if (__atomic_load_n(&n->links, __ATOMIC_ACQUIRE) == 0)
+        delete n;
+}
+
+const vfs::inode_ops s_ops = {
+    &tmpfs_lookup, &tmpfs_create, &tmpfs_remove, &tmpfs_read, &tmpfs_write,
+    &tmpfs_read_dir, &tmpfs_size, &tmpfs_release
+};
+
+vfs::superblock* create() {
+    node* root = new node(true,
+                          __atomic_fetch_add(&s_next_ino, 1, __ATOMIC_RELAXED));
+    if (root == nullptr)
+        return nullptr;
+    // named by the mount, so never released
+    root->links = 1;
+
+    vfs::superblock* sb = new vfs::superblock{ "tmpfs", nullptr, nullptr };
+    if (sb != nullptr)
+        sb->root = vfs::new_inode(sb, root->ino, &s_ops, root, true);
+    if (sb == nullptr || sb->root == nullptr) {
+        delete sb;
+        delete root;
+        return nullptr;
+    }
+    return sb;
+}
+
+static void unmap_range(mem::address_space* as, uintptr_t virt,
+                        std::size_t length)
+{
+    std::size_t done = 0;
+    while (done < length) {
+        uintptr_t at = virt + done;
+        if (at % HUGE_PAGE_SIZE == 0 && length - done >= HUGE_PAGE_SIZE &&
+            as->unmap_huge(at)) {
+            done += HUGE_PAGE_SIZE;
+            continue;
+        }
+        as->unmap(at);
+        done += PAGE_SIZE;
+    }
+}
+
+// a map() as its address space has it: the pages are the file's, so
+// whoever has them mapped holds a reference on the inode
+struct file_mapping {
+    mem::mapping base;
+    vfs::inode* node;
+};
+
+static mem::mapping* clone_mapping(mem::mapping* m, mem::address_space*);
+static void release_mapping(mem::mapping* m, mem::address_space* as);
+
+static const mem::mapping_ops s_mapping_ops = {
+    true, &clone_mapping, &release_mapping
+};
+
+static mem::mapping* clone_mapping(mem::mapping* m, mem::address_space*) {
+    file_mapping* f = (file_mapping*)m;
+    file_mapping* copy = new file_mapping{ { &s_mapping_ops, m->start,
+                                             m->length, nullptr }, f->node };
+    if (copy == nullptr)
+        return nullptr;
+    vfs::get(f->node);
+    return &copy->base;
+}
+
+static void release_mapping(mem::mapping* m, mem::address_space* as) {
+    file_mapping* f = (file_mapping*)m;
+    unmap_range(as, m->start, m->length);
+    vfs::put(f->node);
+    delete f;
+}
+
+bool map(vfs::inode* i, mem::address_space* as, uintptr_t virt,
+         uint64_t offset, std::size_t length, bool writable)
+{
+    if (i->ops != &s_ops || i->directory)
+        return false;
+    if (virt % PAGE_SIZE != 0 || offset % PAGE_SIZE != 0 ||
+        length % PAGE_SIZE != 0)
+        return false;
+    node* n = (node*)i->priv;
+    uint64_t end = (n->data.size() + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (offset > end || length > end - offset)
+        return false;
+    file_mapping* record = new file_mapping{ { &s_mapping_ops, virt, length,
+                                               nullptr }, i };
+    if (record == nullptr)
+        return false;
+
+    // the page cache owns the frames, not the address space
+    uint64_t flags = mem::PTE_NX | (writable ? mem::PTE_WRITABLE : 0);
+    std::size_t done = 0;
+    while (done < length) {
+        uintptr_t at = virt + done;
+        uint64_t pos = offset + done;
+        // brings in the whole block if the file has gone huge
+        cache::page* p = n->data.get_page(pos / PAGE_SIZE);
+        if (p == nullptr) {
+            unmap_range(as, virt, done);
+            delete record;
+            return false;
+        }
+
+        uintptr_t frame;
+        if (at % HUGE_PAGE_SIZE == 0 && pos % HUGE_PAGE_SIZE == 0 &&
+            length - done >= HUGE_PAGE_SIZE &&
+            n->data.huge_frame(pos / PAGE_SIZE, &frame) &&
+            as->map_huge(at, frame, flags)) {
+            done += HUGE_PAGE_SIZE;
+            continue;
+        }
+        if (!as->map(at, p->frame, flags | mem::PTE_PINNED)) {
+            unmap_range(as, virt, done);
+            delete record;
+            return false;
+        }
+        done += PAGE_SIZE;
+    }
+    vfs::get(i);
+    as->add_mapping(&record->base);
+    return true;
+}
+
+bool unmap(vfs::inode* i, mem::address_space* as, uintptr_t virt) {
+    mem::mapping* m = as->find_mapping(virt, &s_mapping_ops);
+    if (m == nullptr || ((file_mapping*)m)->node != i ||
+        !as->remove_mapping(m))
+        return false;
+    unmap_range(as, m->start, m->length);
+    vfs::put(i);
+    delete (file_mapping*)m;
+    return true;
+}
+
+} // namespace tmpfs
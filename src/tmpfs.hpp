@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "address_space.hpp"
+#include "vfs.hpp"
+
+namespace tmpfs {
+
+// files that reach this size switch to huge blocks for the rest of
+// their pages
+#ifdef K_TMPFS_HUGE_THRESHOLD
+    inline static constexpr uint64_t HUGE_THRESHOLD = K_TMPFS_HUGE_THRESHOLD;
+#else
+    inline static constexpr uint64_t HUGE_THRESHOLD = 2 * 1024 * 1024;
+#endif
+
+// a new, empty filesystem that lives in memory. a file's data is its
+// page cache object and nothing else: there's no disk behind it and no
+// copy anywhere, so the pages themselves are what mmap hands out. null
+// if memory runs out
+vfs::superblock* create();
+
+// maps length bytes of a tmpfs file from offset, both page aligned and
+// inside the file, at virt in as. the mapping is the file's own pages,
+// so writes through it are writes to the file; where virt and offset
+// line up on a huge block it goes in as one 2MB page. holds a
+// reference on node until unmap() or as is destroyed, and a clone of
+// as gets the same pages and a reference of its own
+bool map(vfs::inode* node, mem::address_space* as, uintptr_t virt,
+         uint64_t offset, std::size_t length, bool writable);
+
+// undoes the map() of node at virt; false if there wasn't one
+bool unmap(vfs::inode* node, mem::address_space* as, uintptr_t virt);
+
+} // namespace tmpfs
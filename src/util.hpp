@@ -317,27 +317,28 @@ inline constexpr bool ERROR(const kstd::optional<T>& t) {
 	return !t.has_value();
 }
 
+// sizes are in bytes - N alone is only the outermost extent
 template<typename T, std::size_t N> 
 inline void* memset_safe(T (*p)[N], int c) {
-	return memset((void*)p, c, N);
+	return memset((void*)p, c, sizeof(*p));
 }
 
 template<typename T, std::size_t N>
 inline void* memset_safe(kstd::array<T, N>& a, int c) {
-	return memset((void*)a.data(), c, N);
+	return memset((void*)a.data(), c, N * sizeof(T));
 }
 
 template<typename T, std::size_t N> 
 inline void* memcpy_safe(T (*dest)[N], T (*src)[N]) {
-	return memcpy((void*)dest, (void*)src, N);
+	return memcpy((void*)dest, (void*)src, sizeof(*dest));
 }
 
 template<typename T, std::size_t N> 
 inline void* memmove_safe(T (*dest)[N], T (*src)[N]) {
-	return memmove((void*)dest, (void*)src, N);
+	return memmove((void*)dest, (void*)src, sizeof(*dest));
 }
 
 template<typename T, std::size_t N> 
 inline int memcmp_safe(T (*dest)[N], T (*src)[N]) {
-	return memcmp((void*)dest, (void*)src, N);
+	return memcmp((void*)dest, (void*)src, sizeof(*dest));
 }
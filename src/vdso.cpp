@@ -0,0 +1,84 @@
+#include "vdso.hpp"
+
+#include "boot_profile.hpp"
+#include "cpu.hpp"
+#include "zero_pool.hpp"
+
+namespace vdso {
+
+inline static constexpr uint32_t CLOCK_SHIFT = 32;
+inline static constexpr uint64_t NS_PER_SEC = 1000000000;
+
+static mem::page_table::physical_address s_frame = nullptr;
+static vdso_data* s_data = nullptr;
+static uint32_t s_features = 0;
+
+static uint32_t probe_features() {
+    uint32_t features = 0;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        if (edx & (1u << 27))
+            features |= FEATURE_RDTSCP;
+    }
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        if (ecx & (1u << 22))
+            features |= FEATURE_RDPID;
+    }
+    return features;
+}
+
+void init() {
+    s_features = probe_features();
+    init_cpu();
+
+    s_frame = mem::alloc_zeroed_frame();
+    if (IS_NULL(s_frame))
+        return;
+    // an all-zero page is already a valid, unlocked vdso_data
+    s_data = (vdso_data*)mem::phys_to_virt(s_frame);
+
+    uint64_t hz = prof::tsc_frequency();
+    kstd::irq_guard irqs;
+    s_data->lock.write_lock();
+    s_data->features = s_features;
+    // everything counts from kernel entry, which is also about when
+    // Limine sampled the boot time
+    s_data->tsc_base = prof::entry_tsc();
+    s_data->mono_base_ns = 0;
+    s_data->real_base_ns = prof::boot_time() * (int64_t)NS_PER_SEC;
+    s_data->shift = CLOCK_SHIFT;
+    s_data->mult = hz != 0 ? (NS_PER_SEC << CLOCK_SHIFT) / hz : 0;
+    s_data->lock.write_unlock();
+}
+
+void init_cpu() {
+    if (s_features & (FEATURE_RDTSCP | FEATURE_RDPID))
+        wrmsr(MSR_TSC_AUX, cpu::id());
+}
+
+void set_realtime_ns(int64_t unix_ns) {
+    if (s_data == nullptr)
+        return;
+    kstd::irq_guard irqs;
+    s_data->lock.write_lock();
+    // rebase both clocks on now so the monotonic one doesn't jump
+    uint64_t tsc = rdtsc();
+    s_data->mono_base_ns += scale(*s_data, tsc);
+    s_data->tsc_base = tsc;
+    s_data->real_base_ns = unix_ns;
+    s_data->lock.write_unlock();
+}
+
+mem::page_table::physical_address data_frame() {
+    return s_frame;
+}
+
+const vdso_data& kernel_data() {
+    return *s_data;
+}
+
+} // namespace vdso
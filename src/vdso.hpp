@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/sync.hpp"
+
+#include "asm_wrappers.hpp"
+#include "page_table.hpp"
+
+namespace vdso {
+
+// where every address space sees the page, read-only. kept clear of the
+// very top of the user half
+inline static constexpr uintptr_t VDSO_BASE = 0x00007FFFFFFF0000;
+
+inline static constexpr uint32_t MSR_TSC_AUX = 0xC0000103;
+
+// vdso_data::features
+inline static constexpr uint32_t FEATURE_RDTSCP = 1u << 0;
+inline static constexpr uint32_t FEATURE_RDPID  = 1u << 1;
+
+// the clock is published as a linear function of the TSC:
+//     ns = base_ns + ((tsc - tsc_base) * mult >> shift)
+// the kernel republishes it under the seqlock; readers retry if they
+// raced a rewrite. the layout is shared with user code, so only ever
+// append to it
+struct vdso_data {
+    kstd::seqlock lock;
+    uint64_t tsc_base;
+    uint64_t mono_base_ns;  // since the kernel was entered
+    int64_t  real_base_ns;  // unix time; 0 if the bootloader had none
+    uint64_t mult;          // 0 if the TSC frequency is unknown
+    uint32_t shift;
+    uint32_t features;
+};
+
+static_assert(sizeof(vdso_data) <= 4096);
+
+// allocates and fills the page and sets up this (the bootstrap) CPU;
+// after zero_pool_init()
+void init();
+
+// loads the CPU id into IA32_TSC_AUX for rdtscp/rdpid; every AP
+void init_cpu();
+
+// republishes the realtime base, e.g. after a clock is set
+void set_realtime_ns(int64_t unix_ns);
+
+// the frame address_space::create() maps at VDSO_BASE; null before init()
+mem::page_table::physical_address data_frame();
+
+// the kernel's own view of the page
+const vdso_data& kernel_data();
+
+// readers: valid in the kernel on kernel_data() and in user mode on
+// user_data(), neither needs a system call
+
+inline const vdso_data& user_data() {
+    return *(const vdso_data*)VDSO_BASE;
+}
+
+inline uint64_t scale(const vdso_data& d, uint64_t tsc) {
+    return (uint64_t)(((__uint128_t)(tsc - d.tsc_base) * d.mult) >> d.shift);
+}
+
+// false if the TSC can't be used as a clock on this machine
+inline bool monotonic_ns(const vdso_data& d, uint64_t* ns) {
+    uint32_t seq;
+    uint64_t value;
+    do {
+        seq = d.lock.read_begin();
+        if (d.mult == 0)
+            return false;
+        value = d.mono_base_ns + scale(d, rdtsc());
+    } while (d.lock.read_retry(seq));
+    *ns = value;
+    return true;
+}
+
+inline bool realtime_ns(const vdso_data& d, int64_t* ns) {
+    uint32_t seq;
+    int64_t value;
+    do {
+        seq = d.lock.read_begin();
+        if (d.mult == 0 || d.real_base_ns == 0)
+            return false;
+        value = d.real_base_ns + (int64_t)scale(d, rdtsc());
+    } while (d.lock.read_retry(seq));
+    *ns = value;
+    return true;
+}
+
+// the CPU the caller is running on (which may have changed by the time
+// it looks); false if the CPU has neither rdpid nor rdtscp
+inline bool getcpu(const vdso_data& d, uint32_t* cpu) {
+    if (d.features & FEATURE_RDPID) {
+        *cpu = (uint32_t)rdpid();
+        return true;
+    }
+    if (d.features & FEATURE_RDTSCP) {
+        rdtscp(cpu);
+        return true;
+    }
+    return false;
+}
+
+} // namespace vdso
@@ -0,0 +1,436 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/new.hpp"
+
+#include "vfs.hpp"
+
+#include "memory.hpp"
+
+namespace vfs {
+
+// a cached name: positive if it names an inode, negative if the
+// filesystem said there's nothing there. everything but mounted and dead
+// is fixed once it's hashed; a create or remove replaces the dentry
+// instead of changing it, so a walk never sees one half-updated. the
+// name follows the struct
+struct dentry {
+    dentry* hash_next;
+    dentry* parent;             // itself for the root
+    uint64_t id;                // never reused; children hash by it
+    uint64_t hash;
+    inode* node;                // null if negative
+    dentry* mounted;            // root of what's mounted here
+    bool dead;                  // removed; under its inode's lock
+    uint32_t len;
+    rcu::rcu_head rcu;
+
+    inline kstd::string_view name() const {
+        return kstd::string_view((const char*)(this + 1), len);
+    }
+};
+
+// both tables are read under RCU and changed under their locks. nothing
+// evicts yet, so the dentry cache only shrinks through remove()
+static dentry* s_dentries[DCACHE_BUCKETS];
+static kstd::ticket_lock s_dentry_lock;
+static uint64_t s_next_id = 1;
+
+static inode* s_inodes[ICACHE_BUCKETS];
+static kstd::ticket_lock s_inode_lock;
+
+static dentry* s_root = nullptr;
+static kstd::ticket_lock s_mount_lock;
+
+static inline std::size_t inode_bucket(const superblock* sb, uint64_t ino) {
+    uint64_t h = ((uintptr_t)sb >> 6) ^ ino * 0x9E3779B97F4A7C15ull;
+    return (std::size_t)(h ^ (h >> 32)) & (ICACHE_BUCKETS - 1);
+}
+
+// a reference, unless the count has already hit zero and the inode is
+// on its way out
+static bool get_unless_zero(inode* node) {
+    uint32_t refs = __atomic_load_n(&node->refs, __ATOMIC_RELAXED);
+    while (refs != 0) {
+        if (__atomic_compare_exchange_n(&node->refs, &refs, refs + 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+inode* get_inode(superblock* sb, uint64_t ino) {
+    rcu::read_lock();
+    inode* n = rcu::dereference(s_inodes[inode_bucket(sb, ino)]);
+    for (; n != nullptr; n = rcu::dereference(n->hash_next)) {
+        if (n->sb == sb && n->ino == ino && get_unless_zero(n))
+            break;
+    }
+    rcu::read_unlock();
+    return n;
+}
+
+inode* new_inode(superblock* sb, uint64_t ino, const inode_ops* ops,
+                 void* priv, bool directory)
+{
+    inode* fresh = new inode();
+    if (fresh == nullptr)
+        return nullptr;
+    fresh->sb = sb;
+    fresh->ino = ino;
+    fresh->ops = ops;
+    fresh->priv = priv;
+    fresh->directory = directory;
+    fresh->refs = 1;
+
+    inode*& bucket = s_inodes[inode_bucket(sb, ino)];
+    kstd::lock_guard guard(s_inode_lock);
+    for (inode* n = bucket; n != nullptr; n = n->hash_next) {
+        if (n->sb == sb && n->ino == ino && get_unless_zero(n)) {
+            delete fresh;
+            return n;
+        }
+    }
+    fresh->hash_next = bucket;
+    rcu::assign_pointer(bucket, fresh);
+    return fresh;
+}
+
+void get(inode* node) {
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+void put(inode* node) {
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    {
+        kstd::lock_guard guard(s_inode_lock);
+        inode** at = &s_inodes[inode_bucket(node->sb, node->ino)];
+        while (*at != node)
+            at = &(*at)->hash_next;
+        // node keeps its link, so readers already on it carry on
+        __atomic_store_n(at, node->hash_next, __ATOMIC_RELEASE);
+    }
+    if (node->ops->release != nullptr)
+        node->ops->release(node);
+    rcu::kfree_rcu(node, &inode::rcu);
+}
+
+static uint64_t name_hash(uint64_t parent_id, kstd::string_view name) {
+    uint64_t h = 0xCBF29CE484222325ull ^ parent_id * 0x9E3779B97F4A7C15ull;
+    for (std::size_t i = 0; i < name.size(); i++)
+        h = (h ^ (uint8_t)name[i]) * 0x100000001B3ull;
+    return h;
+}
+
+static dentry* new_dentry(dentry* parent, kstd::string_view name,
+                          uint64_t hash, inode* node)
+{
+    dentry* d = (dentry*)kmalloc(sizeof(dentry) + name.size());
+    if (d == nullptr)
+        return nullptr;
+    d->hash_next = nullptr;
+    d->parent = parent;
+    d->id = __atomic_fetch_add(&s_next_id, 1, __ATOMIC_RELAXED);
+    d->hash = hash;
+    d->node = node;
+    d->mounted = nullptr;
+    d->dead = false;
+    d->len = (uint32_t)name.size();
+    memcpy(d + 1, name.data(), name.size());
+    return d;
+}
+
+static inline dentry*& dentry_bucket(uint64_t hash) {
+    return s_dentries[hash & (DCACHE_BUCKETS - 1)];
+}
+
+static dentry* hash_find(const dentry* parent, kstd::string_view name,
+                         uint64_t hash)
+{
+    dentry* d = rcu::dereference(dentry_bucket(hash));
+    for (; d != nullptr; d = rcu::dereference(d->hash_next)) {
+        if (d->hash == hash && d->parent == parent && d->name() == name)
+            return d;
+    }
+    return nullptr;
+}
+
+// called with s_dentry_lock held
+static void unhash(dentry* d) {
+    dentry** at = &dentry_bucket(d->hash);
+    while (*at != d)
+        at = &(*at)->hash_next;
+    __atomic_store_n(at, d->hash_next, __ATOMIC_RELEASE);
+    rcu::kfree_rcu(d, &dentry::rcu);
+}
+
+// swaps old (if any) for d (if any) in one step under the lock
+static void replace(dentry* old, dentry* d) {
+    kstd::lock_guard guard(s_dentry_lock);
+    if (old != nullptr)
+        unhash(old);
+    if (d != nullptr) {
+        dentry*& bucket = dentry_bucket(d->hash);
+        d->hash_next = bucket;
+        rcu::assign_pointer(bucket, d);
+    }
+}
+
+// drops the dentries under a directory that's been removed. it was
+// empty, so they're all negative; this is rare enough to sweep the
+// whole table for them
+static void purge_children(const dentry* dir) {
+    kstd::lock_guard guard(s_dentry_lock);
+    for (std::size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry* d = s_dentries[i];
+        while (d != nullptr) {
+            dentry* next = d->hash_next;
+            if (d->parent == dir) {
+                if (d->node != nullptr)
+                    put(d->node);
+                unhash(d);
+            }
+            d = next;
+        }
+    }
+}
+
+// asks parent's filesystem about name and caches the answer. with
+// parent's inode locked
+static dentry* lookup_locked(dentry* parent, kstd::string_view name,
+                             uint64_t hash)
+{
+    if (parent->dead)
+        return nullptr;
+    dentry* d = hash_find(parent, name, hash);
+    if (d != nullptr)
+        return d;
+
+    inode* dir = parent->node;
+    inode* child = dir->ops->lookup != nullptr ? dir->ops->lookup(dir, name)
+                                               : nullptr;
+    d = new_dentry(parent, name, hash, child);
+    if (d == nullptr) {
+        if (child != nullptr)
+            put(child);
+        return nullptr;
+    }
+    replace(nullptr, d);
+    return d;
+}
+
+static dentry* lookup_slow(dentry* parent, kstd::string_view name,
+                           uint64_t hash)
+{
+    kstd::lock_guard guard(parent->node->lock);
+    return lookup_locked(parent, name, hash);
+}
+
+static inline dentry* follow_mounts(dentry* d) {
+    for (dentry* m; (m = rcu::dereference(d->mounted)) != nullptr; )
+        d = m;
+    return d;
+}
+
+// the dentry path ends at, positive or negative; null if a component
+// before the last is missing or isn't a directory. inside a read-side
+// section. a miss leaves it for the filesystem, which may go to the
+// disk, but nothing here passes a quiescent state, so every dentry and
+// inode the walk has seen stays valid until the section ends
+static dentry* walk(kstd::string_view path) {
+    dentry* d = rcu::dereference(s_root);
+    if (d == nullptr)
+        return nullptr;
+    d = follow_mounts(d);
+
+    std::size_t pos = 0;
+    while (pos < path.size()) {
+        std::size_t end = pos;
+        while (end < path.size() && path[end] != '/')
+            end++;
+        kstd::string_view name = path.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (name.size() == 0 || name == kstd::string_view("."))
+            continue;
+        if (name == kstd::string_view("..")) {
+            d = follow_mounts(d->parent);
+            continue;
+        }
+        if (d->node == nullptr || !d->node->directory ||
+            name.size() > MAX_NAME)
+            return nullptr;
+
+        uint64_t hash = name_hash(d->id, name);
+        dentry* child = hash_find(d, name, hash);
+        if (child == nullptr) {
+            child = lookup_slow(d, name, hash);
+            if (child == nullptr)
+                return nullptr;
+        }
+        d = follow_mounts(child);
+    }
+    return d;
+}
+
+// path's directory part and final name, which has to be a real one
+static bool split(kstd::string_view path, kstd::string_view* dir,
+                  kstd::string_view* name)
+{
+    std::size_t end = path.size();
+    while (end > 0 && path[end - 1] == '/')
+        end--;
+    std::size_t start = end;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    *dir = path.substr(0, start);
+    *name = path.substr(start, end - start);
+    return name->size() != 0 && name->size() <= MAX_NAME &&
+           *name != kstd::string_view(".") && *name != kstd::string_view("..");
+}
+
+inode* lookup(kstd::string_view path) {
+    rcu::read_lock();
+    dentry* d = walk(path);
+    inode* node = d != nullptr ? d->node : nullptr;
+    if (node != nullptr && !get_unless_zero(node))
+        node = nullptr;
+    rcu::read_unlock();
+    return node;
+}
+
+inode* create(kstd::string_view path, bool directory) {
+    kstd::string_view dir_path, name;
+    if (!split(path, &dir_path, &name))
+        return nullptr;
+
+    rcu::read_lock();
+    inode* result = nullptr;
+    dentry* parent = walk(dir_path);
+    inode* dir = parent != nullptr ? parent->node : nullptr;
+    if (dir != nullptr && dir->directory && dir->ops->create != nullptr) {
+        kstd::lock_guard guard(dir->lock);
+        uint64_t hash = name_hash(parent->id, name);
+        dentry* old = hash_find(parent, name, hash);
+        if (!parent->dead && (old == nullptr || old->node == nullptr))
+            result = dir->ops->create(dir, name, directory);
+
+        if (result != nullptr) {
+            // the dentry keeps create's reference; the caller gets its
+            // own. without one, the negative entry still has to go
+            dentry* d = new_dentry(parent, name, hash, result);
+            if (d != nullptr)
+                get(result);
+            replace(old, d);
+        }
+    }
+    rcu::read_unlock();
+    return result;
+}
+
+bool make_dir(kstd::string_view path) {
+    inode* dir = create(path, true);
+    if (dir == nullptr)
+        dir = lookup(path);
+    if (dir == nullptr)
+        return false;
+    bool ok = dir->directory;
+    put(dir);
+    return ok;
+}
+
+bool remove(kstd::string_view path) {
+    kstd::string_view dir_path, name;
+    if (!split(path, &dir_path, &name))
+        return false;
+
+    rcu::read_lock();
+    bool ok = false;
+    dentry* parent = walk(dir_path);
+    inode* dir = parent != nullptr ? parent->node : nullptr;
+    if (dir != nullptr && dir->directory && dir->ops->remove != nullptr) {
+        kstd::lock_guard guard(dir->lock);
+        dentry* d = lookup_locked(parent, name, name_hash(parent->id, name));
+        inode* child = d != nullptr ? d->node : nullptr;
+        if (child != nullptr && rcu::dereference(d->mounted) == nullptr) {
+            // a directory's lock keeps lookups out of it while it goes
+            if (child->directory)
+                child->lock.lock();
+            ok = dir->ops->remove(dir, name, child);
+            if (ok) {
+                d->dead = true;
+                replace(d, nullptr);
+                if (child->directory)
+                    purge_children(d);
+            }
+            if (child->directory)
+                child->lock.unlock();
+            if (ok)
+                put(child);
+        }
+    }
+    rcu::read_unlock();
+    return ok;
+}
+
+bool mount(kstd::string_view path, superblock* sb) {
+    if (sb == nullptr || sb->root == nullptr || !sb->root->directory)
+        return false;
+
+    kstd::lock_guard guard(s_mount_lock);
+    dentry* root = new_dentry(nullptr, kstd::string_view(""), 0, sb->root);
+    if (root == nullptr)
+        return false;
+
+    if (s_root == nullptr) {
+        if (path != kstd::string_view("/")) {
+            kfree(root);
+            return false;
+        }
+        root->parent = root;
+        get(sb->root);
+        rcu::assign_pointer(s_root, root);
+        return true;
+    }
+
+    rcu::read_lock();
+    dentry* at = walk(path);
+    bool ok = at != nullptr && at->node != nullptr && at->node->directory;
+    if (ok) {
+        // ".." out of the mount goes where it would from the directory
+        // it covers
+        root->parent = at->parent == at ? root : at->parent;
+        get(sb->root);
+        rcu::assign_pointer(at->mounted, root);
+    }
+    rcu::read_unlock();
+    if (!ok)
+        kfree(root);
+    return ok;
+}
+
+std::size_t read(inode* node, uint64_t pos, void* buf, std::size_t len) {
+    if (node->ops->read == nullptr)
+        return 0;
+    return node->ops->read(node, pos, buf, len);
+}
+
+std::size_t write(inode* node, uint64_t pos, const void* buf, std::size_t len) {
+    if (node->ops->write == nullptr)
+        return 0;
+    return node->ops->write(node, pos, buf, len);
+}
+
+bool read_dir(inode* dir, std::size_t* cookie, dir_entry* out) {
+    if (!dir->directory || dir->ops->read_dir == nullptr)
+        return false;
+    return dir->ops->read_dir(dir, cookie, out);
+}
+
+uint64_t size(inode* node) {
+    if (node->ops->size == nullptr)
+        return 0;
+    return node->ops->size(node);
+}
+
+} // namespace vfs
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/string_view.hpp"
+#include "stdlib/sync.hpp"
+
+#include "rcu.hpp"
+
+namespace vfs {
+
+inline static constexpr std::size_t MAX_NAME = 255;
+
+// buckets in the dentry and inode hash tables; powers of two
+#ifdef K_DCACHE_BUCKETS
+    inline static constexpr std::size_t DCACHE_BUCKETS = K_DCACHE_BUCKETS;
+#else
+    inline static constexpr std::size_t DCACHE_BUCKETS = 4096;
+#endif
+
+#ifdef K_ICACHE_BUCKETS
+    inline static constexpr std::size_t ICACHE_BUCKETS = K_ICACHE_BUCKETS;
+#else
+    inline static constexpr std::size_t ICACHE_BUCKETS = 1024;
+#endif
+
+static_assert((DCACHE_BUCKETS & (DCACHE_BUCKETS - 1)) == 0);
+static_assert((ICACHE_BUCKETS & (ICACHE_BUCKETS - 1)) == 0);
+
+struct inode;
+
+struct dir_entry {
+    char name[MAX_NAME + 1];
+    bool directory;
+};
+
+// what a filesystem does for its inodes. anything it can't do is null
+struct inode_ops {
+    // dir's child called name, referenced (through get_inode/new_inode),
+    // or null if there's no such child
+    inode* (*lookup)(inode* dir, kstd::string_view name);
+
+    // makes a child that isn't there yet, referenced; null on failure
+    inode* (*create)(inode* dir, kstd::string_view name, bool directory);
+
+    // unlinks child (called name) from dir; false if it can't, say
+    // because it's a directory that isn't empty
+    bool (*remove)(inode* dir, kstd::string_view name, inode* child);
+
+    std::size_t (*read)(inode* node, uint64_t pos, void* buf, std::size_t len);
+    std::size_t (*write)(inode* node, uint64_t pos, const void* buf,
+                         std::size_t len);
+
+    // the next entry at or after *cookie (0 to start); false at the end
+    bool (*read_dir)(inode* dir, std::size_t* cookie, dir_entry* out);
+
+    uint64_t (*size)(inode* node);
+
+    // the last reference is gone; frees whatever priv holds
+    void (*release)(inode* node);
+};
+
+struct superblock {
+    const char* type;
+    inode* root;        // referenced for as long as it's mounted
+    void* priv;
+};
+
+// a file or directory as the VFS sees it, cached by (superblock, number)
+// for as long as anything references it. every cached dentry that names
+// an inode holds a reference to it
+struct inode {
+    superblock* sb;
+    uint64_t ino;
+    const inode_ops* ops;
+    void* priv;
+    bool directory;
+
+    uint32_t refs;
+    inode* hash_next;
+    // serializes lookups that miss, creates and removes in a directory
+    kstd::ticket_lock lock;
+    rcu::rcu_head rcu;
+};
+
+// the cached inode, referenced; null if it isn't cached
+inode* get_inode(superblock* sb, uint64_t ino);
+
+// caches a new inode with one reference. if another CPU cached the same
+// one first, that's returned (referenced) instead and its priv won't be
+// the one passed in; null if memory runs out
+inode* new_inode(superblock* sb, uint64_t ino, const inode_ops* ops,
+                 void* priv, bool directory);
+
+void get(inode* node);
+
+// drops a reference. the last one releases the inode and frees it after
+// a grace period
+void put(inode* node);
+
+// mounts sb over the directory at path. the first mount has to be at "/"
+// and becomes the root
+bool mount(kstd::string_view path, superblock* sb);
+
+// the inode at an absolute path, referenced; null if something on the
+// way is missing or isn't a directory. components that are already in
+// the dentry cache (positive or negative) are resolved under RCU
+// without taking a lock or writing to shared memory; only misses go to
+// the filesystem
+inode* lookup(kstd::string_view path);
+
+// makes the file or directory at path, referenced; null if it exists,
+// its directory doesn't, or the filesystem can't
+inode* create(kstd::string_view path, bool directory);
+
+// makes the directory at path unless there's one there already
+bool make_dir(kstd::string_view path);
+
+bool remove(kstd::string_view path);
+
+std::size_t read(inode* node, uint64_t pos, void* buf, std::size_t len);
+std::size_t write(inode* node, uint64_t pos, const void* buf, std::size_t len);
+bool read_dir(inode* dir, std::size_t* cookie, dir_entry* out);
+uint64_t size(inode* node);
+
+} // namespace vfs
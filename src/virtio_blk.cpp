@@ -0,0 +1,478 @@
+#include "stdlib/cstdlib.hpp"
+
+#include "virtio_blk.hpp"
+
+#include "apic.hpp"
+#include "asm_wrappers.hpp"
+#include "mmio.hpp"
+#include "zero_pool.hpp"
+
+namespace virtio {
+
+inline static constexpr uint16_t VENDOR_VIRTIO = 0x1AF4;
+inline static constexpr uint16_t DEVICE_BLK_MODERN = 0x1042;
+inline static constexpr uint16_t DEVICE_BLK_TRANSITIONAL = 0x1001;
+
+// vendor capability types
+inline static constexpr uint8_t CAP_COMMON = 1;
+inline static constexpr uint8_t CAP_NOTIFY = 2;
+inline static constexpr uint8_t CAP_DEVICE = 4;
+
+// common configuration layout
+inline static constexpr uint16_t COMMON_DFSELECT     = 0;
+inline static constexpr uint16_t COMMON_DF           = 4;
+inline static constexpr uint16_t COMMON_GFSELECT     = 8;
+inline static constexpr uint16_t COMMON_GF           = 12;
+inline static constexpr uint16_t COMMON_MSIX         = 16;
+inline static constexpr uint16_t COMMON_NUM_QUEUES   = 18;
+inline static constexpr uint16_t COMMON_STATUS       = 20;
+inline static constexpr uint16_t COMMON_Q_SELECT     = 22;
+inline static constexpr uint16_t COMMON_Q_SIZE       = 24;
+inline static constexpr uint16_t COMMON_Q_MSIX       = 26;
+inline static constexpr uint16_t COMMON_Q_ENABLE     = 28;
+inline static constexpr uint16_t COMMON_Q_NOTIFY_OFF = 30;
+inline static constexpr uint16_t COMMON_Q_DESC       = 32;
+inline static constexpr uint16_t COMMON_Q_AVAIL      = 40;
+inline static constexpr uint16_t COMMON_Q_USED       = 48;
+
+inline static constexpr uint8_t STATUS_ACKNOWLEDGE = 1;
+inline static constexpr uint8_t STATUS_DRIVER      = 2;
+inline static constexpr uint8_t STATUS_DRIVER_OK   = 4;
+inline static constexpr uint8_t STATUS_FEATURES_OK = 8;
+inline static constexpr uint8_t STATUS_FAILED      = 128;
+
+inline static constexpr uint64_t F_BLK_SEG_MAX     = 1ull << 2;
+inline static constexpr uint64_t F_BLK_MQ          = 1ull << 12;
+inline static constexpr uint64_t F_INDIRECT_DESC   = 1ull << 28;
+inline static constexpr uint64_t F_EVENT_IDX       = 1ull << 29;
+inline static constexpr uint64_t F_VERSION_1       = 1ull << 32;
+
+// device configuration layout
+inline static constexpr uint16_t BLK_CAPACITY   = 0;
+inline static constexpr uint16_t BLK_SEG_MAX    = 12;
+inline static constexpr uint16_t BLK_NUM_QUEUES = 34;
+
+inline static constexpr uint16_t DESC_NEXT     = 1;
+inline static constexpr uint16_t DESC_WRITE    = 2;
+inline static constexpr uint16_t DESC_INDIRECT = 4;
+
+inline static constexpr uint16_t USED_F_NO_NOTIFY = 1;
+inline static constexpr uint16_t NO_VECTOR = 0xFFFF;
+
+inline static constexpr uint32_t BLK_T_IN  = 0;
+inline static constexpr uint32_t BLK_T_OUT = 1;
+inline static constexpr uint8_t BLK_S_OK = 0;
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+inline static constexpr std::size_t INDIRECT_SIZE = INDIRECT_MAX * sizeof(vring_desc);
+
+static_assert(INDIRECT_SIZE * 4 == PAGE_SIZE);
+static_assert(MAX_QUEUE_SIZE * sizeof(request_header) <= PAGE_SIZE);
+
+static blk_device* s_disks[MAX_DISKS];
+static std::size_t s_num_disks = 0;
+
+// whether moving an index from old to new crossed event: the EVENT_IDX
+// test for both notifications and interrupts
+static bool need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static uintptr_t alloc_frame_or_zero() {
+    mem::page_table::physical_address f = mem::alloc_zeroed_frame();
+    return IS_NULL(f) ? 0 : (uintptr_t)f;
+}
+
+bool virtqueue::setup(uint16_t index, uint16_t size, bool event_idx,
+                      std::size_t max_segments)
+{
+    m_index = index;
+    m_size = size;
+    m_event_idx = event_idx;
+    m_max_segments = max_segments;
+
+    // descriptors and the avail ring share a frame; the used ring, which
+    // only the device writes, gets its own line of traffic
+    uintptr_t ring = alloc_frame_or_zero();
+    m_used_phys = alloc_frame_or_zero();
+    m_headers_phys = alloc_frame_or_zero();
+    if (ring == 0 || m_used_phys == 0 || m_headers_phys == 0)
+        return false;
+    m_desc_phys = ring;
+    m_avail_phys = ring + 2048;
+    m_desc = (vring_desc*)mem::phys_to_virt(m_desc_phys);
+    m_avail = (vring_avail*)mem::phys_to_virt(m_avail_phys);
+    m_used = (volatile vring_used*)mem::phys_to_virt(m_used_phys);
+    m_headers = (request_header*)mem::phys_to_virt(m_headers_phys);
+
+    for (std::size_t i = 0; i < (std::size_t)(size + 3) / 4; i++) {
+        m_indirect[i] = alloc_frame_or_zero();
+        if (m_indirect[i] == 0)
+            return false;
+    }
+
+    // ring entry i always points at indirect table i
+    for (uint16_t i = 0; i < size; i++) {
+        m_desc[i].addr = m_indirect[i / 4] + (i % 4) * INDIRECT_SIZE;
+        m_desc[i].flags = DESC_INDIRECT;
+        m_desc[i].next = 0;
+        m_free[i] = size - 1 - i;
+    }
+    m_num_free = size;
+    return true;
+}
+
+bool virtqueue::submit(request* req) {
+    std::size_t len = (std::size_t)req->sectors * SECTOR_SIZE;
+    if (req->sectors == 0)
+        return false;
+
+    {
+        kstd::irq_lock_guard guard(m_lock);
+        if (m_num_free == 0)
+            return false;
+
+        std::size_t n = blk::request_ranges(req, m_ranges, m_max_segments);
+        std::size_t covered = 0;
+        for (std::size_t i = 0; i < n; i++)
+            covered += m_ranges[i].length;
+        if (covered != len)
+            return false;
+
+        uint16_t slot = m_free[--m_num_free];
+        request_header& hdr = m_headers[slot];
+        hdr.type = req->write ? BLK_T_OUT : BLK_T_IN;
+        hdr.reserved = 0;
+        hdr.sector = req->lba;
+        hdr.status = 0xFF;
+
+        uintptr_t hdr_phys = m_headers_phys + slot * sizeof(request_header);
+        vring_desc* table = (vring_desc*)mem::phys_to_virt(m_desc[slot].addr);
+        table[0] = { hdr_phys, 16, DESC_NEXT, 1 };
+        for (std::size_t i = 0; i < n; i++) {
+            table[1 + i] = { (uint64_t)(uintptr_t)m_ranges[i].base,
+                             (uint32_t)m_ranges[i].length,
+                             (uint16_t)(DESC_NEXT | (req->write ? 0 : DESC_WRITE)),
+                             (uint16_t)(2 + i) };
+        }
+        table[n + 1] = { hdr_phys + 16, 1, DESC_WRITE, 0 };
+        m_desc[slot].len = (uint32_t)((n + 2) * sizeof(vring_desc));
+        m_requests[slot] = req;
+
+        uint16_t old_idx = m_avail_idx;
+        m_avail->ring[m_avail_idx % m_size] = slot;
+        m_avail_idx++;
+        // the entry before the index, and the index before we look at
+        // whether the device wants to hear about it
+        __atomic_store_n(&m_avail->idx, m_avail_idx, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        bool kick;
+        if (m_event_idx) {
+            uint16_t event = *(volatile uint16_t*)&m_used->ring[m_size];
+            kick = need_event(event, m_avail_idx, old_idx);
+        } else {
+            kick = (m_used->flags & USED_F_NO_NOTIFY) == 0;
+        }
+        if (kick)
+            *m_notify = m_index;
+    }
+    return true;
+}
+
+void virtqueue::poll() {
+    request* done[MAX_QUEUE_SIZE];
+    std::size_t num_done = 0;
+
+    {
+        kstd::irq_lock_guard guard(m_lock);
+        for (;;) {
+            uint16_t used_idx = __atomic_load_n(&m_used->idx, __ATOMIC_ACQUIRE);
+            while (m_last_used != used_idx) {
+                volatile vring_used_elem& e = m_used->ring[m_last_used % m_size];
+                uint16_t slot = (uint16_t)e.id;
+                request* req = m_requests[slot];
+                m_requests[slot] = nullptr;
+                req->ok = m_headers[slot].status == BLK_S_OK;
+                done[num_done++] = req;
+                m_free[m_num_free++] = slot;
+                m_last_used++;
+            }
+            if (!m_event_idx)
+                break;
+            // interrupt on the next completion only, then look again in
+            // case it slipped in before the device saw that
+            __atomic_store_n(&m_avail->ring[m_size], m_last_used,
+                             __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&m_used->idx, __ATOMIC_ACQUIRE) == m_last_used)
+                break;
+        }
+    }
+
+    for (std::size_t i = 0; i < num_done; i++)
+        done[i]->done(done[i]);
+}
+
+volatile uint8_t* blk_device::common(uint16_t offset) const {
+    return m_common + offset;
+}
+
+template<typename T> static inline T rd(volatile uint8_t* p) {
+    return *(volatile T*)p;
+}
+
+template<typename T> static inline void wr(volatile uint8_t* p, T v) {
+    *(volatile T*)p = v;
+}
+
+bool blk_device::map_capabilities() {
+    for (uint8_t cap = pci::find_capability(m_pci, pci::CAP_VENDOR); cap != 0;
+         cap = pci::find_capability(m_pci, pci::CAP_VENDOR, cap))
+    {
+        uint8_t type = pci::read8(m_pci, cap + 3);
+        if (type != CAP_COMMON && type != CAP_NOTIFY && type != CAP_DEVICE)
+            continue;
+        uint64_t base = pci::bar(m_pci, pci::read8(m_pci, cap + 4));
+        uint32_t offset = pci::read32(m_pci, cap + 8);
+        uint32_t length = pci::read32(m_pci, cap + 12);
+        if (base == 0)
+            continue;
+        volatile uint8_t* p = (volatile uint8_t*)mem::map_mmio(base + offset, length);
+        if (p == nullptr)
+            return false;
+
+        if (type == CAP_COMMON && m_common == nullptr) {
+            m_common = p;
+        } else if (type == CAP_NOTIFY && m_notify_base == nullptr) {
+            m_notify_base = p;
+            m_notify_mult = pci::read32(m_pci, cap + 16);
+        } else if (type == CAP_DEVICE && m_device == nullptr) {
+            m_device = p;
+        }
+    }
+    return m_common != nullptr && m_notify_base != nullptr &&
+           m_device != nullptr;
+}
+
+static void queue_irq(void* ctx) {
+    ((virtqueue*)ctx)->poll();
+}
+
+static void device_irq(void* ctx) {
+    ((blk_device*)ctx)->poll();
+}
+
+static bool idle_poll() {
+    bool any = false;
+    for (std::size_t i = 0; i < s_num_disks; i++) {
+        if (s_disks[i]->busy()) {
+            s_disks[i]->poll();
+            any = true;
+        }
+    }
+    return any;
+}
+
+bool blk_device::start(pci::address a) {
+    m_pci = a;
+    pci::enable(a);
+    if (!map_capabilities())
+        return false;
+
+    wr<uint8_t>(common(COMMON_STATUS), 0);
+    while (rd<uint8_t>(common(COMMON_STATUS)) != 0)
+        cpu_relax();
+    wr<uint8_t>(common(COMMON_STATUS), STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+
+    wr<uint32_t>(common(COMMON_DFSELECT), 0);
+    uint64_t offered = rd<uint32_t>(common(COMMON_DF));
+    wr<uint32_t>(common(COMMON_DFSELECT), 1);
+    offered |= (uint64_t)rd<uint32_t>(common(COMMON_DF)) << 32;
+
+    // one ring entry per request needs indirect tables
+    uint64_t required = F_VERSION_1 | F_INDIRECT_DESC;
+    if ((offered & required) != required) {
+        wr<uint8_t>(common(COMMON_STATUS), STATUS_FAILED);
+        return false;
+    }
+    uint64_t features = required |
+                        (offered & (F_EVENT_IDX | F_BLK_MQ | F_BLK_SEG_MAX));
+    wr<uint32_t>(common(COMMON_GFSELECT), 0);
+    wr<uint32_t>(common(COMMON_GF), (uint32_t)features);
+    wr<uint32_t>(common(COMMON_GFSELECT), 1);
+    wr<uint32_t>(common(COMMON_GF), (uint32_t)(features >> 32));
+
+    uint8_t status = STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK;
+    wr<uint8_t>(common(COMMON_STATUS), status);
+    if ((rd<uint8_t>(common(COMMON_STATUS)) & STATUS_FEATURES_OK) == 0)
+        return false;
+
+    m_sectors = rd<uint32_t>(m_device + BLK_CAPACITY) |
+                ((uint64_t)rd<uint32_t>(m_device + BLK_CAPACITY + 4) << 32);
+    std::size_t max_segments = MAX_SEGMENTS;
+    if (features & F_BLK_SEG_MAX) {
+        uint32_t seg_max = rd<uint32_t>(m_device + BLK_SEG_MAX);
+        if (seg_max != 0 && seg_max < max_segments)
+            max_segments = seg_max;
+    }
+    std::size_t queues = 1;
+    if (features & F_BLK_MQ)
+        queues = rd<uint16_t>(m_device + BLK_NUM_QUEUES);
+    if (queues > cpu::count())
+        queues = cpu::count();
+    if (queues > MAX_QUEUES)
+        queues = MAX_QUEUES;
+    if (queues > rd<uint16_t>(common(COMMON_NUM_QUEUES)))
+        queues = rd<uint16_t>(common(COMMON_NUM_QUEUES));
+
+    // queue q takes the submissions of CPUs q, q + queues, ..., so its
+    // completions go to CPU q on a vector of its own. a table too small
+    // for that gets one vector for the whole device
+    bool msix = apic::x2apic() && m_msix.init(a);
+    bool per_queue = msix && m_msix.size() >= queues;
+    if (msix && !per_queue)
+        msix = m_msix.route(0, pci::ANY_CPU, &device_irq, this);
+    wr<uint16_t>(common(COMMON_MSIX), NO_VECTOR);
+
+    for (std::size_t q = 0; q < queues; q++) {
+        wr<uint16_t>(common(COMMON_Q_SELECT), (uint16_t)q);
+        uint16_t size = rd<uint16_t>(common(COMMON_Q_SIZE));
+        if (size == 0)
+            break;
+        if (size > MAX_QUEUE_SIZE)
+            size = MAX_QUEUE_SIZE;
+        // largest power of two that fits
+        size = (uint16_t)(1u << (31 - __builtin_clz(size)));
+
+        virtqueue* vq = new virtqueue();
+        if (vq == nullptr ||
+            !vq->setup((uint16_t)q, size, (features & F_EVENT_IDX) != 0,
+                       max_segments))
+            break;
+
+        wr<uint16_t>(common(COMMON_Q_SIZE), size);
+        wr<uint64_t>(common(COMMON_Q_DESC), vq->m_desc_phys);
+        wr<uint64_t>(common(COMMON_Q_AVAIL), vq->m_avail_phys);
+        wr<uint64_t>(common(COMMON_Q_USED), vq->m_used_phys);
+        if (msix) {
+            uint16_t entry = per_queue ? (uint16_t)q : 0;
+            if (per_queue && !m_msix.route(entry, q, &queue_irq, vq))
+                msix = false;
+            uint16_t want = msix ? entry : NO_VECTOR;
+            wr<uint16_t>(common(COMMON_Q_MSIX), want);
+            // the device answers NO_VECTOR if it couldn't take it
+            if (rd<uint16_t>(common(COMMON_Q_MSIX)) != want)
+                msix = false;
+        }
+        uint16_t notify_off = rd<uint16_t>(common(COMMON_Q_NOTIFY_OFF));
+        vq->m_notify = (volatile uint16_t*)(m_notify_base +
+                                            notify_off * m_notify_mult);
+        wr<uint16_t>(common(COMMON_Q_ENABLE), 1);
+        m_queues[m_num_queues++] = vq;
+    }
+    if (m_num_queues == 0)
+        return false;
+
+    if (msix)
+        m_msix.enable();
+    else
+        cpu::register_idle_work(&idle_poll);
+    wr<uint8_t>(common(COMMON_STATUS), status | STATUS_DRIVER_OK);
+    return true;
+}
+
+bool blk_device::submit(request* req) {
+    return submit_on(cpu::id(), req);
+}
+
+bool blk_device::submit_on(std::size_t queue, request* req) {
+    if (req->lba + req->sectors > m_sectors || req->lba + req->sectors < req->lba)
+        return false;
+    return m_queues[queue % m_num_queues]->submit(req);
+}
+
+void blk_device::poll() {
+    for (std::size_t i = 0; i < m_num_queues; i++)
+        m_queues[i]->poll();
+}
+
+bool blk_device::busy() const {
+    for (std::size_t i = 0; i < m_num_queues; i++) {
+        if (m_queues[i]->busy())
+            return true;
+    }
+    return false;
+}
+
+static bool disk_submit(void* driver, std::size_t hwq, request* req) {
+    return ((blk_device*)driver)->submit_on(hwq, req);
+}
+
+static void disk_poll(void* driver) {
+    ((blk_device*)driver)->poll();
+}
+
+static bool disk_busy(void* driver, std::size_t hwq) {
+    return ((blk_device*)driver)->queue(hwq)->busy();
+}
+
+static const blk::disk_ops s_disk_ops = { &disk_submit, &disk_poll, &disk_busy };
+
+bool init() {
+    for (int pass = 0; pass < 2; pass++) {
+        uint16_t id = pass == 0 ? DEVICE_BLK_MODERN : DEVICE_BLK_TRANSITIONAL;
+        pci::address a;
+        for (std::size_t i = 0; s_num_disks < MAX_DISKS &&
+             pci::find_id(VENDOR_VIRTIO, id, i, &a); i++)
+        {
+            blk_device* d = new blk_device();
+            if (d == nullptr)
+                return s_num_disks != 0;
+            // a failed device keeps whatever it allocated; boot only
+            if (!d->start(a)) {
+                delete d;
+                continue;
+            }
+            char name[] = "vda";
+            name[2] = (char)('a' + s_num_disks);
+            blk::register_disk(name, d, &s_disk_ops, d->sectors(),
+                               d->queue_count(), d->max_segments(), 0);
+            s_disks[s_num_disks++] = d;
+        }
+    }
+    return s_num_disks != 0;
+}
+
+std::size_t disk_count() {
+    return s_num_disks;
+}
+
+blk_device* get_disk(std::size_t i) {
+    return s_disks[i];
+}
+
+static void sync_done(request* req) {
+    __atomic_store_n((bool*)req->ctx, true, __ATOMIC_RELEASE);
+}
+
+bool transfer(blk_device* d, uint64_t lba, uint32_t sectors, void* buffer,
+              bool write)
+{
+    bool finished = false;
+    request req = { lba, sectors, write, buffer, nullptr, 0, &sync_done,
+                    &finished, false };
+    while (!d->submit(&req)) {
+        // refused by an idle device: the request itself is bad
+        if (!d->busy())
+            return false;
+        d->poll();
+    }
+    while (!__atomic_load_n(&finished, __ATOMIC_ACQUIRE)) {
+        d->poll();
+        cpu_relax();
+    }
+    return req.ok;
+}
+
+} // namespace virtio
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/sync.hpp"
+
+#include "block.hpp"
+#include "cpu.hpp"
+#include "page_table.hpp"
+#include "pci.hpp"
+
+namespace virtio {
+
+inline static constexpr std::size_t SECTOR_SIZE = blk::SECTOR_SIZE;
+
+// ring entries per queue; each request takes exactly one, whatever its
+// size, since its descriptors live in an indirect table
+#ifdef K_VIRTIO_QUEUE_SIZE
+    inline static constexpr uint16_t MAX_QUEUE_SIZE = K_VIRTIO_QUEUE_SIZE;
+#else
+    inline static constexpr uint16_t MAX_QUEUE_SIZE = 128;
+#endif
+
+#ifdef K_VIRTIO_MAX_QUEUES
+    inline static constexpr std::size_t MAX_QUEUES = K_VIRTIO_MAX_QUEUES;
+#else
+    inline static constexpr std::size_t MAX_QUEUES = 16;
+#endif
+
+inline static constexpr std::size_t MAX_DISKS = 8;
+
+// descriptors in one indirect table: the request header, the data
+// segments and the status byte
+inline static constexpr std::size_t INDIRECT_MAX = 64;
+inline static constexpr std::size_t MAX_SEGMENTS = INDIRECT_MAX - 2;
+
+static_assert((MAX_QUEUE_SIZE & (MAX_QUEUE_SIZE - 1)) == 0);
+static_assert(MAX_QUEUE_SIZE * 16 <= 2048, "descriptors share a frame with the avail ring");
+
+using request = blk::request;
+using completion_fn = blk::completion_fn;
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+// the avail ring's used_event and the used ring's avail_event sit right
+// after the queue's last entry, wherever that falls for its size; with
+// EVENT_IDX they say when to interrupt or notify
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[MAX_QUEUE_SIZE + 1];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    vring_used_elem ring[MAX_QUEUE_SIZE + 1];
+};
+
+// header and status of one in-flight request; the device reads the first
+// 16 bytes and writes status
+struct request_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+    uint8_t status;
+    uint8_t pad[15];
+};
+
+static_assert(sizeof(request_header) == 32);
+
+// one split virtqueue. it belongs to a CPU, but takes its lock anyway so
+// that a queue can be shared when the device has fewer than there are
+// CPUs
+class virtqueue {
+public:
+    bool submit(request* req);
+    void poll();
+
+    inline bool busy() const {
+        return __atomic_load_n(&m_num_free, __ATOMIC_RELAXED) != m_size;
+    }
+
+private:
+    friend class blk_device;
+
+    bool setup(uint16_t index, uint16_t size, bool event_idx,
+               std::size_t max_segments);
+
+    uint16_t m_index = 0;
+    uint16_t m_size = 0;
+    bool m_event_idx = false;
+    std::size_t m_max_segments = MAX_SEGMENTS;
+
+    vring_desc* m_desc = nullptr;
+    vring_avail* m_avail = nullptr;
+    volatile vring_used* m_used = nullptr;
+    uintptr_t m_desc_phys = 0;
+    uintptr_t m_avail_phys = 0;
+    uintptr_t m_used_phys = 0;
+    volatile uint16_t* m_notify = nullptr;
+
+    // four 1K indirect tables per frame
+    uintptr_t m_indirect[MAX_QUEUE_SIZE / 4] = { };
+    request_header* m_headers = nullptr;
+    uintptr_t m_headers_phys = 0;
+
+    kstd::ticket_lock m_lock;
+    uint16_t m_avail_idx = 0;   // ours; the device's copy is m_avail->idx
+    uint16_t m_last_used = 0;
+    uint16_t m_free[MAX_QUEUE_SIZE];
+    uint16_t m_num_free = 0;
+    request* m_requests[MAX_QUEUE_SIZE] = { };
+    mem::phys_range m_ranges[MAX_SEGMENTS];  // scratch for submit()
+};
+
+// a virtio-blk device on the modern (1.0) PCI transport, with up to one
+// queue per CPU
+class blk_device {
+public:
+    // goes to the submitting CPU's queue; false if that one is full or
+    // the buffer needs too many segments
+    bool submit(request* req);
+
+    // the same, on a given queue (modulo the number there are)
+    bool submit_on(std::size_t queue, request* req);
+
+    void poll();
+    bool busy() const;
+
+    inline uint64_t sectors() const {
+        return m_sectors;
+    }
+
+    inline std::size_t queue_count() const {
+        return m_num_queues;
+    }
+
+    inline const virtqueue* queue(std::size_t i) const {
+        return m_queues[i % m_num_queues];
+    }
+
+    // data extents one request can have
+    inline std::size_t max_segments() const {
+        return m_queues[0]->m_max_segments;
+    }
+
+private:
+    friend bool init();
+
+    bool start(pci::address a);
+    bool map_capabilities();
+    volatile uint8_t* common(uint16_t offset) const;
+
+    pci::address m_pci = { };
+    volatile uint8_t* m_common = nullptr;
+    volatile uint8_t* m_device = nullptr;
+    volatile uint8_t* m_notify_base = nullptr;
+    uint32_t m_notify_mult = 0;
+    pci::msix m_msix;
+
+    uint64_t m_sectors = 0;
+    virtqueue* m_queues[MAX_QUEUES] = { };
+    std::size_t m_num_queues = 0;
+};
+
+// probes every virtio-blk function and registers each as vda, vdb, ...;
+// after SMP bring-up, so there's a CPU count to size the queues by
+bool init();
+
+std::size_t disk_count();
+blk_device* get_disk(std::size_t i);
+
+// submits and waits, polling; interrupts may be on or off
+bool transfer(blk_device* d, uint64_t lba, uint32_t sectors, void* buffer,
+              bool write);
+
+} // namespace virtio
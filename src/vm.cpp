@@ -0,0 +1,175 @@
+#include "stdlib/cstdlib.hpp"
+
+#include "vm.hpp"
+#include "address_space.hpp"
+#include "zero_pool.hpp"
+
+#include "asm_wrappers.hpp"
+#include "console.hpp"
+#include "idt.hpp"
+#include "panic.hpp"
+#include "syscall.hpp"
+
+namespace mem {
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+
+static vm_region s_regions[MAX_VM_REGIONS];
+static std::size_t s_num_regions = 0;
+
+static uint64_t leaf_flags(uint32_t vm_flags) {
+    uint64_t flags = PTE_PRESENT;
+    if(vm_flags & VM_WRITE)
+        flags |= PTE_WRITABLE;
+    if(vm_flags & VM_USER)
+        flags |= PTE_USER;
+    if((vm_flags & VM_EXEC) == 0)
+        flags |= PTE_NX;
+    return flags;
+}
+
+static void page_fault_handler(idt::interrupt_frame& frame) {
+    uintptr_t addr = (uintptr_t)rcr2();
+    if(handle_fault(addr, frame.error_code))
+        return;
+
+    address_space* as = address_space::current();
+    if(as != nullptr && as->handle_cow_fault(addr, frame.error_code))
+        return;
+
+    // a bad access by the program is the program's problem, and one by
+    // copy_from_user() or copy_to_user() is the syscall's
+    if(frame.cs & 3)
+        sys::exit_user(sys::EXIT_FAULT_BASE - (int64_t)frame.vector);
+    if(sys::fixup_user_access(frame))
+        return;
+
+    console::print("- page fault at ");
+    console::print_hex(addr);
+    console::print(" rip ");
+    console::print_hex(frame.rip);
+    console::print(" error ");
+    console::print_hex(frame.error_code);
+    console::print("\n");
+    panic("unhandled page fault");
+}
+
+void vm_init() {
+    idt::set_handler(idt::VECTOR_PAGE_FAULT, &page_fault_handler);
+}
+
+bool reserve_lazy(page_table::virtual_address base, std::size_t length,
+                  uint32_t flags)
+{
+    if((base & (PAGE_SIZE - 1)) || length == 0)
+        return false;
+    if(s_num_regions == MAX_VM_REGIONS)
+        return false;
+
+    s_regions[s_num_regions++] = { 
+        (uintptr_t)base.const_ptr(), 
+        (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1), 
+        flags 
+    };
+    return true;
+}
+
+const vm_region* find_region(uintptr_t addr) {
+    for(std::size_t i = 0; i < s_num_regions; i++) {
+        const vm_region& r = s_regions[i];
+        if(addr >= r.base && addr - r.base < r.length)
+            return &r;
+    }
+    return nullptr;
+}
+
+// a write to a page still backed by the shared zero page: gives it a
+// frame of its own. the frame number changes, so every CPU that may have
+// the zero page cached has to drop it, not just this one; true if done
+static bool upgrade_zero_page(uintptr_t page, bool write, uint64_t flags) {
+    if(!write)
+        return false;
+
+    {
+        kstd::irq_mcs_guard guard(pt->table_lock());
+        uint64_t* pte = pt->ensure_pte(page);
+        if(pte == nullptr || (*pte & PTE_PRESENT) == 0 ||
+           (*pte & PTE_ADDR_MASK) != (uintptr_t)pt->zero_page().const_ptr())
+            return false;
+
+        page_table::physical_address frame = alloc_zeroed_frame();
+        if(IS_NULL(frame))
+            return false;
+        *pte = frame | flags;
+        pt->invalidate(page);
+    }
+    pt->shootdown(page, 1);
+    return true;
+}
+
+bool handle_fault(uintptr_t addr, uint64_t error_code) {
+    const vm_region* region = find_region(addr);
+    if(region == nullptr)
+        return false;
+
+    bool write = (error_code & PF_WRITE) != 0;
+    if(write && (region->flags & VM_WRITE) == 0)
+        return false;
+    if((error_code & PF_FETCH) && (region->flags & VM_EXEC) == 0)
+        return false;
+    if((error_code & PF_USER) && (region->flags & VM_USER) == 0)
+        return false;
+
+    uintptr_t page = addr & ~(PAGE_SIZE - 1);
+    if(upgrade_zero_page(page, write, leaf_flags(region->flags)))
+        return true;
+
+    kstd::irq_mcs_guard guard(pt->table_lock());
+    uint64_t* pte = pt->ensure_pte(page);
+    if(pte == nullptr)
+        return false;
+
+    uint64_t flags = leaf_flags(region->flags);
+
+    if(*pte & PTE_PRESENT) {
+        // another CPU got here first, or this one still has the zero
+        // page mapping cached from before the upgrade
+        if(write && (*pte & PTE_WRITABLE) == 0)
+            return false;
+        invlpg((const void*)page);
+        return true;
+    }
+
+    // fault around: the window is aligned and never larger than a page
+    // table, so its entries are adjacent to pte and need no further walks
+    uintptr_t window = FAULT_AROUND_PAGES * PAGE_SIZE;
+    uintptr_t start = page & ~(window - 1);
+    uintptr_t end = start + window;
+    if(start < region->base)
+        start = region->base;
+    if(end > region->base + region->length)
+        end = region->base + region->length;
+
+    // reads share the zero page across the whole window; writes back the
+    // faulting page and the ones after it, assuming a sequential pattern
+    if(write)
+        start = page;
+
+    uint64_t* e = pte - (page - start) / PAGE_SIZE;
+    for(uintptr_t v = start; v < end; v += PAGE_SIZE, e++) {
+        if(*e & PTE_PRESENT)
+            continue;
+
+        if(write) {
+            page_table::physical_address frame = alloc_zeroed_frame();
+            if(IS_NULL(frame))
+                return v != page; // neighbours are best effort
+            *e = frame | flags;
+        } else {
+            *e = pt->zero_page() | (flags & ~PTE_WRITABLE);
+        }
+    }
+    return true;
+}
+
+} // namespace mem
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "page_table.hpp"
+
+namespace mem {
+
+#ifdef K_MAX_VM_REGIONS
+    inline static constexpr std::size_t MAX_VM_REGIONS = K_MAX_VM_REGIONS;
+#else
+    inline static constexpr std::size_t MAX_VM_REGIONS = 32;
+#endif
+
+// pages mapped per fault: the aligned window around the faulting page.
+// power of two, at most one page table (512)
+#ifdef K_FAULT_AROUND_PAGES
+    inline static constexpr std::size_t FAULT_AROUND_PAGES = K_FAULT_AROUND_PAGES;
+#else
+    inline static constexpr std::size_t FAULT_AROUND_PAGES = 16;
+#endif
+static_assert((FAULT_AROUND_PAGES & (FAULT_AROUND_PAGES - 1)) == 0 &&
+              FAULT_AROUND_PAGES <= 512,
+              "FAULT_AROUND_PAGES must be a power of two no larger than 512");
+
+enum vm_flags : uint32_t {
+    VM_READ  = 1 << 0,
+    VM_WRITE = 1 << 1,
+    VM_EXEC  = 1 << 2,
+    VM_USER  = 1 << 3
+};
+
+struct vm_region {
+    uintptr_t   base;
+    std::size_t length;
+    uint32_t    flags;
+};
+
+// page fault error code bits
+inline static constexpr uint64_t PF_PRESENT = 1 << 0;
+inline static constexpr uint64_t PF_WRITE   = 1 << 1;
+inline static constexpr uint64_t PF_USER    = 1 << 2;
+inline static constexpr uint64_t PF_FETCH   = 1 << 4;
+
+// installs the page fault handler; the IDT must be initialized
+void vm_init();
+
+// reserves [base, base + length) for demand paging. nothing is mapped
+// until it's touched: read faults map the shared zero page, write faults
+// allocate zeroed frames, both across a FAULT_AROUND_PAGES window
+bool reserve_lazy(page_table::virtual_address base, std::size_t length,
+                  uint32_t flags);
+
+const vm_region* find_region(uintptr_t addr);
+
+// resolves a fault on addr, returns false if it's a genuine access error
+bool handle_fault(uintptr_t addr, uint64_t error_code);
+
+} // namespace mem
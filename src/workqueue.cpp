@@ -0,0 +1,65 @@
+#include "stdlib/new.hpp"
+
+#include "workqueue.hpp"
+
+#include "cpu.hpp"
+#include "softirq.hpp"
+
+namespace work {
+
+// producers are any CPU (and interrupt handlers); the consumer is always
+// the owning CPU's softirq
+struct alignas(cpu::CACHE_LINE_SIZE) cpu_queue {
+    kstd::mpsc_queue<work_item> items;
+};
+
+static cpu_queue s_queues[cpu::MAX_CPUS];
+
+static void work_softirq() {
+    run_batch();
+}
+
+void init() {
+    softirq::register_handler(softirq::SOFTIRQ_WORK, &work_softirq);
+}
+
+bool queue_on(std::size_t cpu, work_item* item) {
+    uint32_t old = item->state.fetch_or(work_item::PENDING,
+                                        kstd::memory_order_acq_rel);
+    if (old & work_item::PENDING)
+        return false;
+
+    s_queues[cpu].items.push(item);
+    // always raise: the consumer may have emptied the queue but not yet
+    // returned from its batch, and a spare pass costs one bit test
+    if (cpu == cpu::id())
+        softirq::raise(softirq::SOFTIRQ_WORK);
+    else
+        softirq::raise_on(cpu, softirq::SOFTIRQ_WORK);
+    return true;
+}
+
+bool queue(work_item* item) {
+    return queue_on(cpu::id(), item);
+}
+
+std::size_t run_batch() {
+    cpu_queue& q = s_queues[cpu::id()];
+
+    std::size_t n = 0;
+    for (; n < WORK_BATCH; n++) {
+        work_item* item = q.items.pop();
+        if (item == nullptr)
+            break;
+        // clear before running so the function (or anyone) can re-arm
+        item->state.fetch_and(~work_item::PENDING, kstd::memory_order_acq_rel);
+        item->func(item);
+    }
+
+    // more left (or a push still landing): come back on the next pass
+    if (!q.items.empty())
+        softirq::raise(softirq::SOFTIRQ_WORK);
+    return n;
+}
+
+} // namespace work
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "stdlib/atomic.hpp"
+#include "stdlib/mpsc_queue.hpp"
+
+namespace work {
+
+// items run per softirq pass before the rest is deferred to the next,
+// so one flood of work can't hold interrupts' bottom halves hostage
+#ifdef K_WORK_BATCH
+    inline static constexpr std::size_t WORK_BATCH = K_WORK_BATCH;
+#else
+    inline static constexpr std::size_t WORK_BATCH = 64;
+#endif
+
+struct work_item;
+using work_func = void (*)(work_item*);
+
+// intrusive and allocation-free: embed one (or derive from it) in the
+// object the work is about. an item is queued at most once at a time;
+// it may be queued again from its own function, or from anywhere once
+// it has started running
+struct work_item : kstd::mpsc_node {
+    work_func func = nullptr;
+    kstd::atomic<uint32_t> state = 0;
+
+    inline static constexpr uint32_t PENDING = 1 << 0;
+
+    constexpr work_item() noexcept = default;
+    constexpr explicit work_item(work_func f) noexcept : func(f) { }
+
+    inline bool pending() const {
+        return (state.load(kstd::memory_order_acquire) & PENDING) != 0;
+    }
+};
+
+// registers the workqueue softirq; before SMP
+void init();
+
+// queues item on this CPU. returns false if it was already pending, in
+// which case it will still run (once) after this call
+bool queue(work_item* item);
+
+// queues item on the given CPU
+bool queue_on(std::size_t cpu, work_item* item);
+
+// runs up to WORK_BATCH items queued on this CPU; returns the count.
+// called from softirq context
+std::size_t run_batch();
+
+} // namespace work
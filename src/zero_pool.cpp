@@ -0,0 +1,105 @@
+#include "stdlib/cstdlib.hpp"
+#include "stdlib/sync.hpp"
+
+#include "zero_pool.hpp"
+
+#include "asm_wrappers.hpp"
+#include "cpu.hpp"
+
+namespace mem {
+
+inline static constexpr std::size_t PAGE_SIZE = 4096;
+
+static uintptr_t s_pool[ZERO_POOL_SIZE];
+static std::size_t s_pool_count = 0;
+// only ever held for a push or a pop, with interrupts off: the heap's
+// page faults take frames from here, and interrupt handlers kmalloc
+static kstd::ticket_lock s_pool_lock;
+
+// non-temporal stores: a frame zeroed in the background shouldn't evict
+// the working set of whoever ends up using that cache
+static void zero_frame_nt(void* p) {
+    uint64_t* q = (uint64_t*)p;
+    for (std::size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        __asm__ volatile(
+                "movnti %1, 0(%0)\n\t"
+                "movnti %1, 8(%0)\n\t"
+                "movnti %1, 16(%0)\n\t"
+                "movnti %1, 24(%0)\n\t"
+                :
+                :"r"(q + i), "r"(0ull)
+                :"memory"
+               );
+    }
+}
+
+void zero_pool_init() {
+    if (hhdm_offset == 0)
+        return;
+    cpu::register_idle_work(&zero_pool_refill);
+}
+
+page_table::physical_address alloc_zeroed_frame() {
+    uintptr_t frame = 0;
+    std::size_t left = 0;
+
+    {
+        kstd::irq_lock_guard guard(s_pool_lock);
+        if (s_pool_count != 0) {
+            frame = s_pool[--s_pool_count];
+            left = s_pool_count;
+        }
+    }
+
+    if (frame != 0) {
+        if (left < ZERO_POOL_LOW_WATERMARK)
+            cpu::kick_idle();
+        return frame;
+    }
+
+    cpu::kick_idle();
+    page_table::physical_address f = pt->alloc_frame();
+    if (IS_NULL(f))
+        return nullptr;
+    memset(phys_to_virt(f), 0, PAGE_SIZE);
+    return f;
+}
+
+bool zero_pool_refill() {
+    bool did_work = false;
+    for (std::size_t n = 0; n < ZERO_POOL_BATCH; n++) {
+        if (__atomic_load_n(&s_pool_count, __ATOMIC_RELAXED) >= ZERO_POOL_SIZE)
+            break;
+
+        page_table::physical_address frame = pt->alloc_frame();
+        if (IS_NULL(frame))
+            break;
+        zero_frame_nt(phys_to_virt(frame));
+        // movnti is weakly ordered; the zeroes must be visible before
+        // anyone can pop the frame
+        sfence();
+        did_work = true;
+
+        bool pushed = false;
+        {
+            kstd::irq_lock_guard guard(s_pool_lock);
+            if (s_pool_count < ZERO_POOL_SIZE) {
+                s_pool[s_pool_count++] = frame;
+                pushed = true;
+            }
+        }
+
+        // another idle CPU filled the last slot first
+        if (!pushed) {
+            pt->free_frame(frame);
+            break;
+        }
+    }
+    return did_work;
+}
+
+std::size_t zero_pool_count() {
+    return __atomic_load_n(&s_pool_count, __ATOMIC_RELAXED);
+}
+
+} // namespace mem
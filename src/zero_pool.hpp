@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "page_table.hpp"
+
+namespace mem {
+
+// frames kept zeroed ahead of time by idle CPUs, so that page faults and
+// new page tables don't pay for clearing 4K inline
+#ifdef K_ZERO_POOL_SIZE
+    inline static constexpr std::size_t ZERO_POOL_SIZE = K_ZERO_POOL_SIZE;
+#else
+    inline static constexpr std::size_t ZERO_POOL_SIZE = 256;
+#endif
+
+// idle CPUs are woken to refill once the pool drops below this
+inline static constexpr std::size_t ZERO_POOL_LOW_WATERMARK = ZERO_POOL_SIZE / 4;
+
+// frames zeroed per call of the idle work, so idle CPUs come back to the
+// idle loop regularly instead of filling the whole pool in one go
+inline static constexpr std::size_t ZERO_POOL_BATCH = 16;
+
+// hooks the refill into the idle loop; needs the HHDM
+void zero_pool_init();
+
+// returns a frame whose contents are all zero: from the pool if it has
+// one, otherwise allocated and cleared on the spot. null if out of frames
+page_table::physical_address alloc_zeroed_frame();
+
+// idle work: zeroes up to ZERO_POOL_BATCH frames into the pool; returns
+// true if it did anything
+bool zero_pool_refill();
+
+std::size_t zero_pool_count();
+
+} // namespace mem